@@ -0,0 +1,81 @@
+// Offline lighting: bakes the lightmaps of .MAP files, every brush face lit by the map's light
+// entities with shadows from the world, and writes them next to each one as <name>.MAP.lightmap.
+// Reports the luxels baked per second, in all and per thread
+// Usage: bake_lightmaps [.map file or directory] [threads]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <cctype>
+#include <thread>
+#include <filesystem>
+
+#include "fuake_lightmap.hpp"
+#include "fuake_mapcompiler.hpp"
+
+using namespace fuake;
+namespace fs = std::filesystem;
+
+int main(int argc, char **argv) {
+   string target = argc > 1 ? argv[1] : "assets/quake_maps";
+   size_t threads = argc > 2 ? (size_t)atoi(argv[2]) : std::thread::hardware_concurrency();
+   const bool exchange_axes = true; // As the viewer loads maps by default
+
+   vector<string> paths;
+   if (fs::is_directory(target)) {
+      for (auto &entry : fs::directory_iterator(target)) {
+         string ext = entry.path().extension().string();
+         for (auto &c : ext) c = (char)tolower(c);
+         if (ext == ".map") paths.push_back(entry.path().string());
+      }
+   } else {
+      paths.push_back(target);
+   }
+   std::sort(paths.begin(), paths.end());
+
+   ThreadPool pool(threads);
+   printf("%zu maps, %zu threads\n", paths.size(), pool.size());
+   uint64_t total_luxels = 0;
+   double total_seconds = 0, total_thread_seconds = 0;
+   for (auto &path : paths) {
+      MappedFile source(path);
+      QuakeMap map(path);
+      if (!source.is_open || !map.ok()) continue;
+
+      auto t0 = std::chrono::steady_clock::now();
+      LightmapBakeStats stats;
+      Lightmaps lightmaps = bake_lightmaps(map, exchange_axes, &stats, pool);
+      auto t1 = std::chrono::steady_clock::now();
+
+      LightmapHeader stamp = lightmap_stamp(path, source, exchange_axes);
+      stamp.source_hash = hash_bytes(source.data, source.size);
+      bool written = write_lightmaps(lightmap_path(path), lightmaps, stamp);
+
+      // Per thread: luxels over the time that thread spent baking
+      uint64_t luxels = stats.luxels();
+      double thread_seconds = 0;
+      for (double seconds : stats.thread_seconds) thread_seconds += seconds;
+      total_luxels += luxels;
+      total_seconds += stats.seconds;
+      total_thread_seconds += thread_seconds;
+
+      printf("%-16s lights: %3zu  surfaces: %6zu  luxels: %8llu  rays: %9llu  total: %6.0f ms  "
+             "bake: %6.0f ms  %6.2f M luxels/s, %6.2f M per thread%s\n",
+             fs::path(path).filename().string().c_str(),
+             compile_lights(map, exchange_axes).size(),
+             lightmaps.surfaces.size(),
+             (unsigned long long)luxels,
+             (unsigned long long)stats.rays(),
+             std::chrono::duration<double, std::milli>(t1 - t0).count(),
+             stats.seconds * 1000,
+             stats.seconds > 0 ? luxels / stats.seconds / 1E6 : 0.0,
+             thread_seconds > 0 ? luxels / thread_seconds / 1E6 : 0.0,
+             written ? "" : "  (couldn't write)");
+   }
+   printf("total: %llu luxels in %.0f ms, %.2f M luxels/s, %.2f M per thread\n",
+          (unsigned long long)total_luxels,
+          total_seconds * 1000,
+          total_seconds > 0 ? total_luxels / total_seconds / 1E6 : 0.0,
+          total_thread_seconds > 0 ? total_luxels / total_thread_seconds / 1E6 : 0.0);
+   return 0;
+}
@@ -0,0 +1,103 @@
+// Per-frame face ordering cost: std::sort by view-space center depth vs a BSP tree walk
+// Usage: bench_bsp [directory with Quake level .obj files] [frames]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <filesystem>
+
+#include "fuake_bsp.hpp"
+#include "fuake_camera.hpp"
+#include "fuake_objloader.hpp"
+#include "fuake_transform.hpp"
+
+using namespace fuake;
+namespace fs = std::filesystem;
+
+int main(int argc, char **argv) {
+   string dir = argc > 1 ? argv[1] : "assets/quake_objs";
+   int frames = argc > 2 ? atoi(argv[2]) : 100;
+
+   // Levels only, the b_*.obj item boxes are too small to matter
+   vector<string> paths;
+   for (auto &entry : fs::directory_iterator(dir)) {
+      string name = entry.path().filename().string();
+      if (entry.path().extension() == ".obj" && name.rfind("b_", 0) != 0)
+         paths.push_back(entry.path().string());
+   }
+   std::sort(paths.begin(), paths.end());
+   printf("%zu levels, %d frames each\n", paths.size(), frames);
+
+   double total_sort_ms = 0, total_bsp_ms = 0;
+   for (auto &path : paths) {
+      Mesh mesh = read_obj(path, true);
+      triangulate(mesh);
+      size_t original_faces = mesh.num_vertices.size();
+
+      auto t0 = std::chrono::steady_clock::now();
+      BSPTree bsp = build_bsp(mesh);
+      auto t1 = std::chrono::steady_clock::now();
+      double build_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+      // Face centers for the sort, which the flat renderer computes anyway
+      size_t num_faces = mesh.num_vertices.size();
+      vector<Vec3> centers(num_faces);
+      for (size_t f = 0; f < num_faces; f++) {
+         const u32 *idx = &mesh.indices[mesh.index_offsets[f]];
+         centers[f] = (mesh.vertices[idx[0]] + mesh.vertices[idx[1]] + mesh.vertices[idx[2]]) *
+                      (1.f / 3);
+      }
+
+      // Orbit the camera around the level center
+      Vec3 center = (mesh.bounds_min + mesh.bounds_max) * 0.5f;
+      Vec3 extent = mesh.bounds_max - mesh.bounds_min;
+      vector<float> depth(num_faces);
+      vector<u32> order(num_faces), bsp_order;
+      double sort_s = 0, bsp_s = 0;
+      for (int f = 0; f < frames; f++) {
+         float angle = 2 * PI * f / frames;
+         Camera cam({center.x() + cosf(angle) * extent.x() / 4,
+                     center.y(),
+                     center.z() + sinf(angle) * extent.z() / 4,
+                     1},
+                    Vec4(-cosf(angle), 0, -sinf(angle), 0));
+         Mat4 view = cam.get_view_matrix();
+         MatrixRows rows(view);
+
+         auto s0 = std::chrono::steady_clock::now();
+         for (size_t i = 0; i < num_faces; i++) {
+            const Vec3 &c = centers[i];
+            depth[i] = rows.m[8] * c.x() + rows.m[9] * c.y() + rows.m[10] * c.z() + rows.m[11];
+            order[i] = (u32)i;
+         }
+         std::sort(order.begin(), order.end(), [&depth](u32 left, u32 right) {
+            return depth[left] > depth[right];
+         });
+         auto s1 = std::chrono::steady_clock::now();
+         bsp.order_from(inverse_transform_origin(rows), bsp_order);
+         auto s2 = std::chrono::steady_clock::now();
+
+         sort_s += std::chrono::duration<double>(s1 - s0).count();
+         bsp_s += std::chrono::duration<double>(s2 - s1).count();
+      }
+
+      double sort_ms = sort_s * 1000 / frames, bsp_ms = bsp_s * 1000 / frames;
+      total_sort_ms += sort_ms;
+      total_bsp_ms += bsp_ms;
+      printf("%-28s faces: %6zu -> %6zu  nodes: %5zu  build: %7.1f ms  "
+             "sort: %6.3f ms  bsp: %6.3f ms (%.1fx)\n",
+             fs::path(path).filename().string().c_str(),
+             original_faces,
+             num_faces,
+             bsp.nodes.size(),
+             build_ms,
+             sort_ms,
+             bsp_ms,
+             sort_ms / bsp_ms);
+   }
+   printf("total per frame: sort %.3f ms, bsp %.3f ms (%.1fx)\n",
+          total_sort_ms,
+          total_bsp_ms,
+          total_sort_ms / total_bsp_ms);
+   return 0;
+}
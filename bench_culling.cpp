@@ -0,0 +1,103 @@
+// Per-frame cost of the smooth renderer from inside each Quake level, with and without BVH frustum
+// culling, checking both produce the same image
+// Usage: bench_culling [directory with Quake level .obj files] [frames] [width] [height]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <filesystem>
+
+#include "fuake_accel.hpp"
+#include "fuake_camera.hpp"
+#include "fuake_lighting.hpp"
+#include "fuake_objloader.hpp"
+#include "fuake_raster.hpp"
+
+using namespace fuake;
+namespace fs = std::filesystem;
+
+int main(int argc, char **argv) {
+   string dir = argc > 1 ? argv[1] : "assets/quake_objs";
+   int frames = argc > 2 ? atoi(argv[2]) : 60;
+   Vec2 dims = {argc > 3 ? (float)atof(argv[3]) : 1600, argc > 4 ? (float)atof(argv[4]) : 1200};
+
+   // Levels only, the b_*.obj item boxes are too small to matter
+   vector<string> paths;
+   for (auto &entry : fs::directory_iterator(dir)) {
+      string name = entry.path().filename().string();
+      if (entry.path().extension() == ".obj" && name.rfind("b_", 0) != 0)
+         paths.push_back(entry.path().string());
+   }
+   std::sort(paths.begin(), paths.end());
+   printf("%zu levels, %d frames each, %dx%d\n", paths.size(), frames, (int)dims.x(), (int)dims.y());
+
+   // Depth shading uses the range of the processed vertices, which culling changes
+   RenderContext context(dims);
+   context.mode = kRenderMode_Gouraud;
+   context.color_by_depth = false;
+   Light light(kLightType_Directional, Vec4(1, -1, -1, 0).normalized());
+   Mat4 model = Mat4::transform({0, 0, 5}, {1, 1, 1}, {0, 0, 0});
+
+   ThreadPool &pool = default_thread_pool();
+   RasterTarget target(dims), reference(dims);
+
+   double total_off_ms = 0, total_on_ms = 0;
+   for (auto &path : paths) {
+      Mesh mesh = read_obj(path, true);
+      triangulate(mesh);
+      calculate_vertex_normals(mesh);
+
+      auto t0 = std::chrono::steady_clock::now();
+      MeshAccel accel = build_accel(mesh);
+      auto t1 = std::chrono::steady_clock::now();
+      TriMesh tri_mesh = make_trimesh(mesh);
+      double build_ms = std::chrono::duration<double, std::milli>(t1 - t0).count();
+
+      // Stand at the level center and turn around once
+      Vec3 center = (mesh.bounds_min + mesh.bounds_max) * 0.5f;
+      double off_s = 0, on_s = 0, visible_faces = 0;
+      size_t mismatched_pixels = 0;
+      for (int f = 0; f < frames; f++) {
+         float angle = 2 * PI * f / frames;
+         Camera cam({center.x(), center.y(), center.z() + 5, 1},
+                    Vec4(cosf(angle), 0, sinf(angle), 0));
+         Mat4 view = cam.get_view_matrix();
+
+         context.frustum_culling = false;
+         auto s0 = std::chrono::steady_clock::now();
+         render_mesh_smooth_offscreen(
+             tri_mesh, model, view, light.direction, context, reference, pool, &accel);
+         auto s1 = std::chrono::steady_clock::now();
+         context.frustum_culling = true;
+         render_mesh_smooth_offscreen(
+             tri_mesh, model, view, light.direction, context, target, pool, &accel);
+         auto s2 = std::chrono::steady_clock::now();
+
+         off_s += std::chrono::duration<double>(s1 - s0).count();
+         on_s += std::chrono::duration<double>(s2 - s1).count();
+         visible_faces += target.visible[0].num_faces;
+         for (size_t p = 0; p < target.color.size; p++)
+            if (target.color.data[p] != reference.color.data[p]) mismatched_pixels++;
+      }
+
+      double off_ms = off_s * 1000 / frames, on_ms = on_s * 1000 / frames;
+      total_off_ms += off_ms;
+      total_on_ms += on_ms;
+      printf("%-28s faces: %6zu  visible: %5.1f%%  nodes: %5zu  build: %7.1f ms  "
+             "off: %7.3f ms  on: %7.3f ms (%.1fx)  mismatched pixels: %zu\n",
+             fs::path(path).filename().string().c_str(),
+             mesh.num_vertices.size(),
+             100 * visible_faces / frames / mesh.num_vertices.size(),
+             accel.bvh.nodes.size(),
+             build_ms,
+             off_ms,
+             on_ms,
+             off_ms / on_ms,
+             mismatched_pixels);
+   }
+   printf("total per frame: no culling %.3f ms, culling %.3f ms (%.1fx)\n",
+          total_off_ms,
+          total_on_ms,
+          total_off_ms / total_on_ms);
+   return 0;
+}
@@ -0,0 +1,169 @@
+// Per-frame cost of ordering a Quake level's visible faces back to front along its camera path:
+// std::sort with a comparator vs radix sort vs the coherent DepthOrder, with the BSP walk the flat
+// renderer uses for reference. DepthOrder also sorts every frame a second time, as if the camera
+// had stopped ("still"). Checks every sort gives a back to front order of the same faces
+// Usage: bench_depthsort [directory with Quake level .obj files] [frames]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <filesystem>
+
+#include "fuake_arena.hpp"
+#include "fuake_campath.hpp"
+#include "fuake_camera.hpp"
+#include "fuake_context.hpp"
+#include "fuake_depthsort.hpp"
+#include "fuake_scene.hpp"
+
+using namespace fuake;
+namespace fs = std::filesystem;
+
+// Whether `order` is back to front and has the items of `reference`
+bool check_order(const vector<float> &depth, Span<u32> order, Span<u32> reference,
+                 vector<u8> &seen) {
+   if (order.size() != reference.size()) return false;
+   for (size_t i = 1; i < order.size(); i++)
+      if (depth[order[i - 1]] < depth[order[i]]) return false;
+   for (u32 f : reference) seen[f] = 1;
+   bool same = true;
+   for (u32 f : order) same &= seen[f] == 1;
+   for (u32 f : reference) seen[f] = 0;
+   return same;
+}
+
+int main(int argc, char **argv) {
+   string dir = argc > 1 ? argv[1] : "assets/quake_objs";
+   int frames = argc > 2 ? atoi(argv[2]) : 300;
+
+   // Levels only, the b_*.obj item boxes are too small to matter
+   vector<string> paths;
+   for (auto &entry : fs::directory_iterator(dir)) {
+      string name = entry.path().filename().string();
+      if (has_extension(entry.path(), ".obj") && name.rfind("b_", 0) != 0)
+         paths.push_back(entry.path().string());
+   }
+   std::sort(paths.begin(), paths.end());
+   printf("%zu levels, %d frames each\n", paths.size(), frames);
+
+   RenderContext context({1600, 1200});
+   Mat4 model = Mat4::transform({0, 0, 5}, {1, 1, 1}, {0, 0, 0});
+   FrameArena &arena = frame_arena();
+   double total_ms[5] = {0, 0, 0, 0, 0};
+   int failures = 0;
+   for (auto &path : paths) {
+      Scene scene;
+      if (!load_scene(path, true, scene)) continue;
+      const TriMesh &mesh = scene.meshes[0];
+      const MeshAccel &accel = scene.accels[0];
+
+      CameraPath camera_path;
+      if (!read_camera_path(camera_path_path(path), camera_path)) {
+         Vec3 center = (mesh.bounds_min + mesh.bounds_max) * 0.5f;
+         Vec4 world_center = model * Vec4{center.x(), center.y(), center.z(), 1};
+         float radius = (mesh.bounds_max - center).length();
+         camera_path = default_camera_path(
+             {world_center.x(), world_center.y(), world_center.z()}, radius);
+      }
+
+      // View space depth of every face center, as the flat renderer sorts them
+      size_t num_faces = mesh.num_triangles;
+      vector<Vec3> centers(num_faces);
+      for (size_t f = 0; f < num_faces; f++) {
+         u32 v[3];
+         mesh.triangle(f, v);
+         centers[f] = (mesh.position(v[0]) + mesh.position(v[1]) + mesh.position(v[2])) * (1.f / 3);
+      }
+      vector<float> depth(num_faces);
+      vector<u8> seen(num_faces, 0);
+      VisibleSet visible;
+      DepthOrder coherent;
+      double seconds[5] = {0, 0, 0, 0, 0};
+      size_t sorted_faces = 0;
+      bool ok = true;
+      for (int f = 0; f < frames; f++) {
+         float t = frames > 1 ? camera_path.duration() * f / (frames - 1) : 0;
+         Vec4 position, forward;
+         camera_path.sample(t, position, forward);
+         Mat4 obj2view = Camera(position, forward).get_view_matrix() * model;
+         find_visible(mesh, &accel, context.persp * obj2view, true, visible);
+
+         MatrixRows rows(obj2view);
+         Span<u32> faces = arena.alloc<u32>(visible.num_faces);
+         size_t n = 0;
+         for (auto &range : visible.faces) {
+            for (u32 i = range.begin; i < range.end; i++) {
+               const Vec3 &c = centers[i];
+               depth[i] = rows.m[8] * c.x() + rows.m[9] * c.y() + rows.m[10] * c.z() + rows.m[11];
+               faces[n++] = i;
+            }
+         }
+         sorted_faces += n;
+
+         Span<u32> by_sort = arena.alloc<u32>(n), by_radix = arena.alloc<u32>(n);
+         Span<u32> by_coherent = arena.alloc<u32>(n), by_still = arena.alloc<u32>(n);
+         Span<u32> by_bsp = arena.alloc<u32>(num_faces);
+         for (Span<u32> copy : {by_sort, by_radix, by_coherent, by_still})
+            std::copy(faces.begin(), faces.end(), copy.begin());
+
+         auto s0 = std::chrono::steady_clock::now();
+         std::sort(by_sort.begin(), by_sort.end(), [&depth](u32 left, u32 right) {
+            return depth[left] > depth[right];
+         });
+         auto s1 = std::chrono::steady_clock::now();
+         radix_sort_back_to_front(depth.data(), by_radix, arena);
+         auto s2 = std::chrono::steady_clock::now();
+         coherent.sort(depth.data(), by_coherent, num_faces, arena);
+         auto s3 = std::chrono::steady_clock::now();
+         accel.bsp.order_from(inverse_transform_origin(rows),
+                              by_bsp.data(),
+                              nullptr,
+                              arena.alloc<u32>(accel.bsp.stack_size()).data());
+         auto s4 = std::chrono::steady_clock::now();
+         coherent.sort(depth.data(), by_still, num_faces, arena);
+         auto s5 = std::chrono::steady_clock::now();
+
+         seconds[0] += std::chrono::duration<double>(s1 - s0).count();
+         seconds[1] += std::chrono::duration<double>(s2 - s1).count();
+         seconds[2] += std::chrono::duration<double>(s3 - s2).count();
+         seconds[3] += std::chrono::duration<double>(s4 - s3).count();
+         seconds[4] += std::chrono::duration<double>(s5 - s4).count();
+         for (Span<u32> order : {by_sort, by_radix, by_coherent, by_still})
+            ok &= check_order(depth, order, faces, seen);
+         arena.reset();
+      }
+
+      double ms[5];
+      for (int i = 0; i < 5; i++) {
+         ms[i] = seconds[i] * 1000 / frames;
+         total_ms[i] += ms[i];
+      }
+      if (!ok) failures++;
+      printf("%-14s faces: %6zu  visible: %6zu  sort: %6.3f  radix: %6.3f (%.1fx)  "
+             "coherent: %6.3f (%.1fx)  still: %6.3f (%.1fx)  bsp: %6.3f ms%s\n",
+             fs::path(path).filename().string().c_str(),
+             num_faces,
+             sorted_faces / std::max(frames, 1),
+             ms[0],
+             ms[1],
+             ms[0] / ms[1],
+             ms[2],
+             ms[0] / ms[2],
+             ms[4],
+             ms[0] / ms[4],
+             ms[3],
+             ok ? "" : "  WRONG ORDER");
+   }
+   printf("total per frame: sort %.3f ms, radix %.3f ms (%.1fx), coherent %.3f ms (%.1fx), "
+          "still %.3f ms (%.1fx), bsp %.3f ms\n",
+          total_ms[0],
+          total_ms[1],
+          total_ms[0] / total_ms[1],
+          total_ms[2],
+          total_ms[0] / total_ms[2],
+          total_ms[4],
+          total_ms[0] / total_ms[4],
+          total_ms[3]);
+   if (failures) printf("WARNING: %d levels got a wrong order\n", failures);
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,252 @@
+// Replays a camera path over every model in assets/demo_objects and assets/quake_objs in each
+// render mode, headless, and reports frame time percentiles. Models use <name>.obj.campath when
+// there is one (record it in the viewer with R), else an orbit and a turn around their center.
+// Frames are sampled at fixed path times, so runs render the same frames and can be compared
+// Usage: bench_flythrough [options]
+//   --frames n            frames per model and mode (60)
+//   --size width height   image size (1600 1200)
+//   --out prefix          results go to <prefix>.json and <prefix>.csv (flythrough)
+//   --baseline file.csv   compare with the CSV of an earlier run
+//   --filter text         only models with `text` in their file name
+//   --trace file.json     write a Chrome trace of the profiler scopes of the whole run
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <filesystem>
+
+#include "fuake_arena.hpp"
+#include "fuake_backend.hpp"
+#include "fuake_campath.hpp"
+#include "fuake_camera.hpp"
+#include "fuake_frametimes.hpp"
+#include "fuake_lighting.hpp"
+#include "fuake_profiler.hpp"
+#include "fuake_render.hpp"
+#include "fuake_scene.hpp"
+
+using namespace fuake;
+namespace fs = std::filesystem;
+
+struct RunResult {
+   string model, mode;
+   size_t faces;
+   FrameTimeStats stats;
+};
+
+// p50 and p95 of every model,mode in a CSV written by an earlier run
+std::map<string, std::pair<double, double>> read_baseline(const string &filepath) {
+   std::map<string, std::pair<double, double>> baseline;
+   std::ifstream fs(filepath);
+   string line;
+   std::getline(fs, line); // Header
+   while (std::getline(fs, line)) {
+      vector<string> fields;
+      std::stringstream ss(line);
+      for (string field; std::getline(ss, field, ',');) fields.push_back(field);
+      if (fields.size() < 9) continue;
+      baseline[fields[0] + "," + fields[1]] = {atof(fields[5].c_str()), atof(fields[6].c_str())};
+   }
+   return baseline;
+}
+
+int main(int argc, char **argv) {
+   int frames = 60;
+   Vec2 dims = {1600, 1200};
+   string out_prefix = "flythrough", baseline_path, filter, trace_path;
+   for (int i = 1; i < argc; i++) {
+      string arg = argv[i];
+      if (arg == "--frames" && i + 1 < argc) {
+         frames = std::max(1, atoi(argv[++i]));
+      } else if (arg == "--size" && i + 2 < argc) {
+         dims = {(float)atof(argv[i + 1]), (float)atof(argv[i + 2])};
+         i += 2;
+      } else if (arg == "--out" && i + 1 < argc) {
+         out_prefix = argv[++i];
+      } else if (arg == "--baseline" && i + 1 < argc) {
+         baseline_path = argv[++i];
+      } else if (arg == "--filter" && i + 1 < argc) {
+         filter = argv[++i];
+      } else if (arg == "--trace" && i + 1 < argc) {
+         trace_path = argv[++i];
+      } else {
+         printf("WARNING: Ignoring unknown argument %s\n", arg.c_str());
+      }
+   }
+
+   vector<string> paths;
+   for (const char *dir : {"assets/demo_objects", "assets/quake_objs"}) {
+      vector<string> dir_paths;
+      if (!fs::is_directory(dir)) continue;
+      for (auto &entry : fs::directory_iterator(dir)) {
+         string name = entry.path().filename().string();
+         if (has_extension(entry.path(), ".obj") && name.find(filter) != string::npos)
+            dir_paths.push_back(entry.path().string());
+      }
+      std::sort(dir_paths.begin(), dir_paths.end());
+      paths.insert(paths.end(), dir_paths.begin(), dir_paths.end());
+   }
+   printf("%zu models, %d frames per mode, %dx%d, %u threads\n",
+          paths.size(),
+          frames,
+          (int)dims.x(),
+          (int)dims.y(),
+          (unsigned)default_thread_pool().size());
+
+   HeadlessBackend backend(dims);
+   RenderContext context(dims);
+   context.backend = &backend;
+   SceneFrame frame(dims);
+   Light light(kLightType_Directional, Vec4(1, -1, -1, 0).normalized());
+   Mat4 model = Mat4::transform({0, 0, 5}, {1, 1, 1}, {0, 0, 0});
+
+   vector<RunResult> results;
+   vector<double> frame_ms(frames);
+#if FUAKE_PROFILE
+   if (!trace_path.empty()) profiler().start_capture(trace_path, (size_t)-1);
+#else
+   if (!trace_path.empty()) printf("WARNING: Built with FUAKE_PROFILE=0, no trace is written\n");
+#endif
+   for (auto &path : paths) {
+      Scene scene;
+      if (!load_scene(path, true, scene)) continue;
+      const vector<TriMesh> &meshes = scene.meshes;
+
+      CameraPath camera_path;
+      if (!read_camera_path(camera_path_path(path), camera_path)) {
+         Vec3 center = (meshes[0].bounds_min + meshes[0].bounds_max) * 0.5f;
+         Vec4 world_center = model * Vec4{center.x(), center.y(), center.z(), 1};
+         float radius = (meshes[0].bounds_max - center).length();
+         camera_path = default_camera_path(
+             {world_center.x(), world_center.y(), world_center.z()}, radius);
+      }
+
+      for (int mode = 0; mode < 3; mode++) {
+         context.mode = (RenderMode)mode;
+         for (int f = -1; f < frames; f++) {
+            // Frame -1 warms up the renderers' scratch buffers and isn't timed
+            float t = frames > 1 ? camera_path.duration() * std::max(f, 0) / (frames - 1) : 0;
+            Vec4 position, forward;
+            camera_path.sample(t, position, forward);
+            Mat4 view = Camera(position, forward).get_view_matrix();
+
+            auto start = std::chrono::steady_clock::now();
+            backend.clear(0, 0, 0);
+            render_scene(meshes,
+                         scene.accels,
+                         nullptr,
+                         model,
+                         view,
+                         light.direction,
+                         context,
+                         frame,
+                         &scene.point_lights,
+                         &scene.baked);
+            auto end = std::chrono::steady_clock::now();
+            if (f >= 0)
+               frame_ms[f] = std::chrono::duration<double, std::milli>(end - start).count();
+            FUAKE_PROFILE_FRAME();
+            frame_arena().reset();
+         }
+
+         RunResult result = {fs::path(path).filename().string(),
+                             RENDER_MODES[mode],
+                             meshes[0].num_triangles,
+                             summarize_frame_times(frame_ms)};
+         const FrameTimeStats &s = result.stats;
+         printf("%-20s %-9s faces: %6zu  mean: %8.3f  p50: %8.3f  p95: %8.3f  p99: %8.3f  "
+                "max: %8.3f ms\n",
+                result.model.c_str(),
+                result.mode.c_str(),
+                result.faces,
+                s.mean,
+                s.p50,
+                s.p95,
+                s.p99,
+                s.max);
+         results.push_back(result);
+      }
+   }
+
+#if FUAKE_PROFILE
+   if (!trace_path.empty()) profiler().stop_capture();
+#endif
+
+   // Machine readable results
+   std::ofstream csv(out_prefix + ".csv", std::ios::trunc);
+   csv << "model,mode,faces,frames,mean_ms,p50_ms,p95_ms,p99_ms,max_ms\n";
+   std::ofstream json(out_prefix + ".json", std::ios::trunc);
+   json << "{\n  \"width\": " << (int)dims.x() << ",\n  \"height\": " << (int)dims.y()
+        << ",\n  \"frames\": " << frames << ",\n  \"threads\": " << default_thread_pool().size()
+        << ",\n  \"results\": [\n";
+   for (size_t r = 0; r < results.size(); r++) {
+      const RunResult &result = results[r];
+      const FrameTimeStats &s = result.stats;
+      char line[512];
+      snprintf(line,
+               sizeof(line),
+               "%s,%s,%zu,%zu,%.4f,%.4f,%.4f,%.4f,%.4f\n",
+               result.model.c_str(),
+               result.mode.c_str(),
+               result.faces,
+               s.frames,
+               s.mean,
+               s.p50,
+               s.p95,
+               s.p99,
+               s.max);
+      csv << line;
+      snprintf(line,
+               sizeof(line),
+               "    {\"model\": \"%s\", \"mode\": \"%s\", \"faces\": %zu, \"frames\": %zu, "
+               "\"mean_ms\": %.4f, \"p50_ms\": %.4f, \"p95_ms\": %.4f, \"p99_ms\": %.4f, "
+               "\"max_ms\": %.4f}%s\n",
+               result.model.c_str(),
+               result.mode.c_str(),
+               result.faces,
+               s.frames,
+               s.mean,
+               s.p50,
+               s.p95,
+               s.p99,
+               s.max,
+               r + 1 < results.size() ? "," : "");
+      json << line;
+   }
+   json << "  ]\n}\n";
+   printf("Results written to %s.csv and %s.json\n", out_prefix.c_str(), out_prefix.c_str());
+
+   if (!baseline_path.empty()) {
+      auto baseline = read_baseline(baseline_path);
+      if (baseline.empty()) {
+         printf("WARNING: No results in baseline %s\n", baseline_path.c_str());
+         return 1;
+      }
+
+      // Ratios to the baseline, < 1 is faster. The geometric mean weighs every run the same
+      double log_sum = 0;
+      size_t compared = 0;
+      printf("\nCompared with %s (new / baseline):\n", baseline_path.c_str());
+      for (auto &result : results) {
+         auto it = baseline.find(result.model + "," + result.mode);
+         if (it == baseline.end() || it->second.first <= 0 || it->second.second <= 0) continue;
+         double p50_ratio = result.stats.p50 / it->second.first;
+         double p95_ratio = result.stats.p95 / it->second.second;
+         printf("%-20s %-9s p50: %6.3fx  p95: %6.3fx\n",
+                result.model.c_str(),
+                result.mode.c_str(),
+                p50_ratio,
+                p95_ratio);
+         log_sum += log(p50_ratio);
+         compared++;
+      }
+      if (compared)
+         printf("geometric mean of p50: %.3fx over %zu runs\n",
+                exp(log_sum / compared),
+                compared);
+   }
+   return 0;
+}
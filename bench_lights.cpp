@@ -0,0 +1,148 @@
+// Frame time of Quake maps lit by their light entities against the single sun light, and against
+// their baked lightmaps when bake_lightmaps has built them, in the flat and Gouraud modes, along
+// an orbit of each map. Frames alternate between the lightings so they see the same load. Also
+// reports how many lights reach a cluster, and a vertex, on average: what clustering saves against
+// evaluating every light everywhere
+// Usage: bench_lights [directory with Quake .map files] [frames]
+#include <chrono>
+#include <cctype>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <filesystem>
+
+#include "fuake_arena.hpp"
+#include "fuake_backend.hpp"
+#include "fuake_campath.hpp"
+#include "fuake_camera.hpp"
+#include "fuake_lighting.hpp"
+#include "fuake_profiler.hpp"
+#include "fuake_render.hpp"
+#include "fuake_scene.hpp"
+
+using namespace fuake;
+namespace fs = std::filesystem;
+
+int main(int argc, char **argv) {
+   string dir = argc > 1 ? argv[1] : "assets/quake_maps";
+   int frames = argc > 2 ? atoi(argv[2]) : 30;
+
+   // Levels only, the b_*.map item boxes have no lights worth measuring
+   vector<string> paths;
+   for (auto &entry : fs::directory_iterator(dir)) {
+      string name = entry.path().filename().string();
+      for (auto &c : name) c = (char)tolower(c);
+      if (has_extension(entry.path(), ".map") && name.rfind("b_", 0) != 0)
+         paths.push_back(entry.path().string());
+   }
+   std::sort(paths.begin(), paths.end());
+   printf("%zu maps, %d frames each\n", paths.size(), frames);
+
+   Vec2 dims = {800, 600};
+   HeadlessBackend backend(dims);
+   RenderContext context(dims);
+   context.backend = &backend;
+   SceneFrame frame(dims);
+   Light light(kLightType_Directional, Vec4(1, -1, -1, 0).normalized());
+   Mat4 model = Mat4::transform({0, 0, 5}, {1, 1, 1}, {0, 0, 0});
+
+   const RenderMode modes[2] = {kRenderMode_Flat, kRenderMode_Gouraud};
+   // Sun, map lights, baked
+   double total_ms[2][3] = {{0, 0, 0}, {0, 0, 0}};
+   for (auto &path : paths) {
+      Scene scene;
+      if (!load_scene(path, true, scene) || scene.point_lights.empty()) continue;
+      const vector<TriMesh> &meshes = scene.meshes;
+
+      // Lights per cluster, over every cluster of every mesh
+      size_t vertex_clusters = 0, vertex_cluster_lights = 0;
+      for (auto &clusters : scene.point_lights.clusters) {
+         vertex_clusters += clusters.vertex_first.size() - 1;
+         vertex_cluster_lights += clusters.vertex_lights.size();
+      }
+
+      Vec3 bounds_min = meshes[0].bounds_min, bounds_max = meshes[0].bounds_max;
+      for (auto &mesh : meshes) {
+         for (int axis = 0; axis < 3; axis++) {
+            bounds_min[axis] = std::min(bounds_min[axis], mesh.bounds_min[axis]);
+            bounds_max[axis] = std::max(bounds_max[axis], mesh.bounds_max[axis]);
+         }
+      }
+      Vec3 center = (bounds_min + bounds_max) * 0.5f;
+      Vec4 world_center = model * Vec4{center.x(), center.y(), center.z(), 1};
+      CameraPath camera_path = default_camera_path(
+          {world_center.x(), world_center.y(), world_center.z()}, (bounds_max - center).length());
+
+      int lightings = scene.baked.empty() ? 2 : 3;
+      double ms[2][3] = {{0, 0, 0}, {0, 0, 0}};
+      double evaluated_per_vertex = 0;
+      for (int m = 0; m < 2; m++) {
+         context.mode = modes[m];
+         double seconds[3] = {0, 0, 0};
+         uint64_t evaluated = 0, transformed = 0;
+         for (int f = -1; f < frames; f++) {
+            // Frame -1 warms up the scratch buffers and isn't timed
+            float t = frames > 1 ? camera_path.duration() * std::max(f, 0) / (frames - 1) : 0;
+            Vec4 position, forward;
+            camera_path.sample(t, position, forward);
+            Mat4 view = Camera(position, forward).get_view_matrix();
+
+            for (int lit = 0; lit < lightings; lit++) {
+               context.map_lights = lit == 1;
+               context.baked_lighting = lit == 2;
+               auto start = std::chrono::steady_clock::now();
+               backend.clear(0, 0, 0);
+               render_scene(meshes,
+                            scene.accels,
+                            nullptr,
+                            model,
+                            view,
+                            light.direction,
+                            context,
+                            frame,
+                            &scene.point_lights,
+                            &scene.baked);
+               auto end = std::chrono::steady_clock::now();
+               FUAKE_PROFILE_FRAME();
+               frame_arena().reset();
+               if (f < 0) continue;
+               seconds[lit] += std::chrono::duration<double>(end - start).count();
+#if FUAKE_PROFILE
+               if (lit == 1) {
+                  evaluated += profiler().last_counters[kProfileCounter_PointLightsEvaluated];
+                  transformed += profiler().last_counters[kProfileCounter_VerticesTransformed];
+               }
+#endif
+            }
+         }
+         for (int lit = 0; lit < lightings; lit++) {
+            ms[m][lit] = seconds[lit] * 1000 / std::max(frames, 1);
+            total_ms[m][lit] += ms[m][lit];
+         }
+         if (modes[m] == kRenderMode_Gouraud)
+            evaluated_per_vertex = transformed ? (double)evaluated / transformed : 0;
+      }
+
+      printf("%-12s lights: %3zu  per cluster: %5.1f  per vertex: %5.1f  flat: %6.2f -> %6.2f, "
+             "baked %6.2f ms  gouraud: %6.2f -> %6.2f, baked %6.2f ms\n",
+             fs::path(path).filename().string().c_str(),
+             scene.point_lights.lights.size(),
+             vertex_clusters ? (double)vertex_cluster_lights / vertex_clusters : 0,
+             evaluated_per_vertex,
+             ms[0][0],
+             ms[0][1],
+             ms[0][2],
+             ms[1][0],
+             ms[1][1],
+             ms[1][2]);
+   }
+   printf("total per frame: flat %.2f -> %.2f, baked %.2f ms, gouraud %.2f -> %.2f, baked %.2f ms "
+          "(baked: maps with lightmaps only)\n",
+          total_ms[0][0],
+          total_ms[0][1],
+          total_ms[0][2],
+          total_ms[1][0],
+          total_ms[1][1],
+          total_ms[1][2]);
+   return 0;
+}
@@ -0,0 +1,127 @@
+// Parses every .MAP file in a directory with the line based and the tokenizer parsers, converts
+// every brush to a mesh reporting brushes per second, then compiles the whole maps into batches
+// with 1, 2, 4... threads
+// Usage: bench_maploader [directory with .map files] [repetitions]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <cctype>
+#include <filesystem>
+
+#include "fuake_mapcompiler.hpp"
+
+using namespace fuake;
+namespace fs = std::filesystem;
+
+int main(int argc, char **argv) {
+   string dir = argc > 1 ? argv[1] : "assets/quake_maps";
+   int reps = argc > 2 ? atoi(argv[2]) : 3;
+
+   vector<string> paths;
+   size_t total_bytes = 0;
+   for (auto &entry : fs::directory_iterator(dir)) {
+      string ext = entry.path().extension().string();
+      for (auto &c : ext) c = (char)tolower(c);
+      if (ext != ".map") continue;
+      paths.push_back(entry.path().string());
+      total_bytes += (size_t)entry.file_size();
+   }
+   std::sort(paths.begin(), paths.end());
+
+   vector<QuakeMap> maps(paths.size());
+   double stream_s = 0, tokenizer_s = 0;
+   for (size_t m = 0; m < paths.size(); m++) {
+      QuakeMap reference;
+
+      auto t0 = std::chrono::steady_clock::now();
+      for (int r = 0; r < reps; r++) reference = read_map_stream(paths[m]);
+      auto t1 = std::chrono::steady_clock::now();
+      for (int r = 0; r < reps; r++) maps[m] = QuakeMap(paths[m]);
+      auto t2 = std::chrono::steady_clock::now();
+
+      stream_s += std::chrono::duration<double>(t1 - t0).count();
+      tokenizer_s += std::chrono::duration<double>(t2 - t1).count();
+
+      // Both parsers must find the same planes
+      bool same = reference.entities.size() == maps[m].entities.size();
+      for (size_t e = 0; same && e < reference.entities.size(); e++) {
+         auto &ref_brushes = reference.entities[e].brushes;
+         auto &brushes = maps[m].entities[e].brushes;
+         same = ref_brushes.size() == brushes.size();
+         for (size_t b = 0; same && b < brushes.size(); b++) {
+            same = ref_brushes[b].planes.size() == brushes[b].planes.size();
+            for (size_t p = 0; same && p < brushes[b].planes.size(); p++)
+               for (int i = 0; i < 3; i++)
+                  same = same && vec_equal(ref_brushes[b].planes[p].points[i],
+                                           brushes[b].planes[p].points[i],
+                                           1E-5f);
+         }
+      }
+      if (!same || !maps[m].ok()) printf("MISMATCH: %s\n", paths[m].c_str());
+   }
+
+   size_t num_brushes = 0;
+   for (auto &map : maps)
+      for (auto &entity : map.entities) num_brushes += entity.brushes.size();
+   printf("%zu maps, %.2f MB, %zu brushes, %d repetitions\n",
+          paths.size(),
+          total_bytes / 1e6,
+          num_brushes,
+          reps);
+
+   double mb = total_bytes * (double)reps / 1e6;
+   printf("line parser:      %8.2f MB/s\n", mb / stream_s);
+   printf("tokenizer parser: %8.2f MB/s (%.1fx)\n", mb / tokenizer_s, stream_s / tokenizer_s);
+
+   size_t num_failed = 0, num_vertices = 0, num_faces = 0;
+   auto t0 = std::chrono::steady_clock::now();
+   for (int r = 0; r < reps; r++) {
+      for (auto &map : maps) {
+         for (auto &entity : map.entities) {
+            for (auto &brush : entity.brushes) {
+               Mesh mesh = brush.to_mesh();
+               if (r > 0) continue;
+               if (mesh.num_vertices.empty()) num_failed++;
+               num_vertices += mesh.vertices.size();
+               num_faces += mesh.num_vertices.size();
+            }
+         }
+      }
+   }
+   auto t1 = std::chrono::steady_clock::now();
+
+   double seconds = std::chrono::duration<double>(t1 - t0).count();
+   printf("%zu vertices, %zu faces, %zu brushes failed\n", num_vertices, num_faces, num_failed);
+   printf("to_mesh: %.0f brushes/s\n", num_brushes * (double)reps / seconds);
+
+   // 1, 2, 4... and finally all hardware threads
+   vector<size_t> thread_counts;
+   size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+   for (size_t t = 1; t < max_threads; t *= 2) thread_counts.push_back(t);
+   thread_counts.push_back(max_threads);
+
+   double single_thread_s = 0;
+   for (size_t threads : thread_counts) {
+      ThreadPool pool(threads);
+      size_t num_batches = 0;
+
+      auto start = std::chrono::steady_clock::now();
+      for (int r = 0; r < reps; r++) {
+         for (auto &map : maps) {
+            vector<Mesh> batches = compile_map(map, true, 1024, pool);
+            if (r == 0) num_batches += batches.size();
+         }
+      }
+      auto end = std::chrono::steady_clock::now();
+
+      double s = std::chrono::duration<double>(end - start).count() / reps;
+      if (threads == 1) single_thread_s = s;
+      printf("compile_map threads: %2zu  all maps: %8.2f ms  batches: %zu  speedup: %5.2fx\n",
+             threads,
+             s * 1000,
+             num_batches,
+             single_thread_s / s);
+   }
+   return 0;
+}
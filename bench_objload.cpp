@@ -0,0 +1,57 @@
+// Compares the memory-mapped parallel OBJ loader against the stream based one
+// Usage: bench_objload [directory with .obj files] [repetitions]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <filesystem>
+
+#include "fuake_objloader.hpp"
+
+using namespace fuake;
+namespace fs = std::filesystem;
+
+int main(int argc, char **argv) {
+   string dir = argc > 1 ? argv[1] : "assets/quake_objs";
+   int reps = argc > 2 ? atoi(argv[2]) : 3;
+
+   vector<string> paths;
+   size_t total_bytes = 0;
+   for (auto &entry : fs::directory_iterator(dir)) {
+      if (entry.path().extension() != ".obj") continue;
+      paths.push_back(entry.path().string());
+      total_bytes += (size_t)entry.file_size();
+   }
+   std::sort(paths.begin(), paths.end());
+   printf("%zu files, %.2f MB, %d repetitions, %zu threads\n",
+          paths.size(),
+          total_bytes / 1e6,
+          reps,
+          default_thread_pool().size());
+
+   double stream_s = 0, mapped_s = 0;
+   for (auto &path : paths) {
+      Mesh reference, mesh;
+
+      auto t0 = std::chrono::steady_clock::now();
+      for (int r = 0; r < reps; r++) reference = read_obj_stream(path);
+      auto t1 = std::chrono::steady_clock::now();
+      for (int r = 0; r < reps; r++) mesh = read_obj(path);
+      auto t2 = std::chrono::steady_clock::now();
+
+      stream_s += std::chrono::duration<double>(t1 - t0).count();
+      mapped_s += std::chrono::duration<double>(t2 - t1).count();
+
+      bool same = reference.vertices.size() == mesh.vertices.size() &&
+                  reference.indices == mesh.indices &&
+                  reference.num_vertices == mesh.num_vertices;
+      for (size_t v = 0; same && v < mesh.vertices.size(); v++)
+         same = vec_equal(reference.vertices[v], mesh.vertices[v], 1E-5f);
+      if (!same) printf("MISMATCH: %s\n", path.c_str());
+   }
+
+   double mb = total_bytes * (double)reps / 1e6;
+   printf("stream loader: %8.2f MB/s\n", mb / stream_s);
+   printf("mapped loader: %8.2f MB/s (%.1fx)\n", mb / mapped_s, stream_s / mapped_s);
+   return 0;
+}
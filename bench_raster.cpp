@@ -0,0 +1,70 @@
+// Offscreen benchmark of the tiled rasterizer: renders a model with 1, 2, 4... threads (no window)
+// Usage: bench_raster [obj path] [frames] [width] [height]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "fuake_camera.hpp"
+#include "fuake_lighting.hpp"
+#include "fuake_objloader.hpp"
+#include "fuake_raster.hpp"
+#include "fuake_trimesh.hpp"
+
+using namespace fuake;
+
+int main(int argc, char **argv) {
+   string path = argc > 1 ? argv[1] : "assets/quake_objs/base32b.obj";
+   int frames = argc > 2 ? atoi(argv[2]) : 60;
+   Vec2 dims = {argc > 3 ? (float)atof(argv[3]) : 1600, argc > 4 ? (float)atof(argv[4]) : 1200};
+
+   Mesh mesh = read_obj(path, true);
+   triangulate(mesh);
+   calculate_vertex_normals(mesh);
+   TriMesh tri_mesh = make_trimesh(mesh);
+   printf("%s: %zu triangles, %dx%d, %d frames\n",
+          path.c_str(),
+          mesh.num_vertices.size(),
+          (int)dims.x(),
+          (int)dims.y(),
+          frames);
+
+   RenderContext context(dims);
+   context.mode = kRenderMode_Gouraud;
+   Camera camera({0, 0, 0, 1}, {0, 0, 1, 0});
+   Light light(kLightType_Directional, Vec4(1, -1, -1, 0).normalized());
+   Mat4 model = Mat4::transform({0, 0, 5}, {1, 1, 1}, {0, 0, 0});
+
+   // 1, 2, 4... and finally all hardware threads
+   vector<size_t> thread_counts;
+   size_t max_threads = std::max(1u, std::thread::hardware_concurrency());
+   for (size_t t = 1; t < max_threads; t *= 2) thread_counts.push_back(t);
+   thread_counts.push_back(max_threads);
+
+   double single_thread_ms = 0;
+   for (size_t threads : thread_counts) {
+      ThreadPool pool(threads);
+      RasterTarget target(dims);
+
+      // Warm up scratch buffers, then time a fixed slow yaw around the model
+      render_mesh_smooth_offscreen(
+          tri_mesh, model, camera.get_view_matrix(), light.direction, context, target, pool);
+
+      Camera cam = camera;
+      auto start = std::chrono::steady_clock::now();
+      for (int f = 0; f < frames; f++) {
+         cam.change_yaw(0.01f);
+         render_mesh_smooth_offscreen(
+             tri_mesh, model, cam.get_view_matrix(), light.direction, context, target, pool);
+      }
+      auto end = std::chrono::steady_clock::now();
+
+      double ms = std::chrono::duration<double, std::milli>(end - start).count() / frames;
+      if (threads == 1) single_thread_ms = ms;
+      printf("threads: %2zu  frame: %8.3f ms  speedup: %5.2fx\n",
+             threads,
+             ms,
+             single_thread_ms / ms);
+   }
+   return 0;
+}
@@ -1,5 +1,6 @@
 #include <esat/draw.h>
 #include <esat/input.h>
+#include <esat/time.h>
 #include <esat/window.h>
 
 #include <amath_core.hpp>
@@ -7,13 +8,17 @@
 #include <string>
 #include <vector>
 
+#include "fuake_accel.hpp"
+#include "fuake_arena.hpp"
+#include "fuake_backend_esat.hpp"
 #include "fuake_camera.hpp"
+#include "fuake_campath.hpp"
 #include "fuake_fpsmeter.hpp"
 #include "fuake_gui.hpp"
 #include "fuake_lighting.hpp"
-#include "fuake_mesh.hpp"
-#include "fuake_objloader.hpp"
+#include "fuake_profiler.hpp"
 #include "fuake_render.hpp"
+#include "fuake_scene.hpp"
 #include "fuake_settings.hpp"
 
 using namespace std;
@@ -31,7 +36,9 @@ int esat::main(int argc, char **argv) {
   FuakeSettings settings;
 
   //* Graphics settings
+  EsatBackend backend;
   RenderContext render_ctxt(window_dims);
+  render_ctxt.backend = &backend;
 
   //* Mouse controls
   float mouse_x = (float)esat::MousePositionX();
@@ -51,21 +58,44 @@ int esat::main(int argc, char **argv) {
   int current_group = 0;
   int current_obj = 0;
 
-  Mesh mesh;
+  Scene scene;
+  SceneFrame frame(window_dims);  // Visible parts of the meshes
+
+  // Camera path being recorded for bench_flythrough, toggled with R
+  CameraPath recording;
+  bool is_recording = false;
+  double recording_start = 0;
   while (WindowIsOpened() && !IsSpecialKeyDown(kSpecialKey_Escape)) {
     //* Load mesh if model changed
     if (settings.model_group != current_group ||
         settings.model_object != current_obj) {
       // if (settings.model_group > 0) settings.exchange_axes = true;
-      mesh = read_obj(settings.get_mesh_name(), settings.exchange_axes);
+      load_scene(settings.get_mesh_name(), settings.exchange_axes, scene);
       current_group = settings.model_group;
       current_obj = settings.model_object;
-      triangulate(mesh);
     }
 
     //* Input
     if (esat::IsSpecialKeyDown(kSpecialKey_Tab)) gui ^= true;  // Toggle GUI
 
+    // Record the camera path, saved next to the model when stopped
+    if (esat::IsKeyDown('R')) {
+      is_recording ^= true;
+      if (is_recording) {
+        recording = CameraPath();
+        recording_start = esat::Time();
+        printf("Recording camera path, R again to stop\n");
+      } else {
+        string path = camera_path_path(settings.get_mesh_name());
+        if (write_camera_path(path, recording))
+          printf("Camera path of %.1f s written to %s\n",
+                 recording.duration(),
+                 path.c_str());
+        else
+          printf("WARNING: Couldn't write camera path %s\n", path.c_str());
+      }
+    }
+
     // Cycle rendering mode
     if (esat::IsKeyDown('T'))
       render_ctxt.mode = (RenderMode)((render_ctxt.mode + 1) % 3);
@@ -105,27 +135,31 @@ int esat::main(int argc, char **argv) {
     mouse_x = new_mouse_x;
     mouse_y = new_mouse_y;
 
+    if (is_recording)
+      recording.add((float)((esat::Time() - recording_start) / 1000),
+                    camera.position,
+                    camera.forward);
+
     //* Render
     amath::Mat4 model = amath::Mat4::transform({0, 0, 5}, {1, 1, 1}, {0, 0, 0});
     amath::Mat4 view = camera.get_view_matrix();
 
     DrawBegin();
-    DrawClear(0, 0, 0);
-
-    switch (render_ctxt.mode) {
-      case kRenderMode_Wireframe:
-        render_mesh_wireframe(mesh, model, view, render_ctxt);
-        break;
-      case kRenderMode_Flat:
-        render_mesh_flat(mesh, model, view, light.direction, render_ctxt);
-        break;
-      case kRenderMode_Gouraud:
-        render_mesh_smooth(mesh, model, view, light.direction, render_ctxt);
-        break;
-    }
+    backend.clear(0, 0, 0);
+
+    render_scene(scene.meshes,
+                 scene.accels,
+                 &scene.pvs,
+                 model,
+                 view,
+                 light.direction,
+                 render_ctxt,
+                 frame,
+                 &scene.point_lights,
+                 &scene.baked);
     // draw_mesh_edges(mesh, tr);
 
-    if (gui) DrawGui(render_ctxt, settings, fps_meter, camera);
+    if (gui) DrawGui(render_ctxt, settings, fps_meter, camera, frame.cull_stats);
 
     DrawEnd();
 
@@ -134,6 +168,8 @@ int esat::main(int argc, char **argv) {
 
     // FPS meter
     fps_meter.Update();
+    FUAKE_PROFILE_FRAME();
+    frame_arena().reset();
   }
   WindowDestroy();
   return 0;
@@ -0,0 +1,142 @@
+#pragma once
+
+#include "fuake_mesh.hpp"
+#include "fuake_arena.hpp"
+#include "fuake_bsp.hpp"
+#include "fuake_bvh.hpp"
+#include "fuake_trimesh.hpp"
+
+namespace fuake {
+
+// Acceleration structures built once per mesh at load time. Renderers take them as optional
+struct MeshAccel {
+   BSPTree bsp; // Exact back-to-front face and edge order
+   BVH bvh;     // Frustum culling of whole groups of faces and vertices
+};
+
+// Build every structure for `mesh`, which they may modify (the BSP splits faces, the BVH reorders
+// faces and vertices)
+MeshAccel build_accel(Mesh &mesh) {
+   MeshAccel accel;
+   accel.bsp = build_bsp(mesh);
+   accel.bvh = build_bvh(mesh, &accel.bsp);
+   return accel;
+}
+
+// Faces and vertices of a mesh that may be inside the view frustum, as sorted ranges
+struct VisibleSet {
+   vector<IndexRange> faces, vertices;
+   size_t num_faces = 0, num_vertices = 0;
+
+   void update_counts() {
+      num_faces = num_vertices = 0;
+      for (auto &range : faces) num_faces += range.end - range.begin;
+      for (auto &range : vertices) num_vertices += range.end - range.begin;
+   }
+};
+
+/* Collect the parts of `mesh` that may be visible through `obj2clip` (persp * view * model), and
+   not hidden behind `hiz` if given. With `meshlets`, only the BVH's meshlets it keeps are.
+   Everything is visible without culling or without a BVH */
+void find_visible(const TriMesh &mesh, const MeshAccel *accel, const Mat4 &obj2clip, bool culling,
+                  VisibleSet &out, const HiZBuffer *hiz = nullptr, CullStats *stats = nullptr,
+                  const MeshletCulling *meshlets = nullptr) {
+   if (culling && accel && !accel->bvh.empty()) {
+      accel->bvh.cull(Frustum(obj2clip), out.faces, out.vertices, hiz, stats, meshlets);
+   } else {
+      out.faces.assign(1, {0, (u32)mesh.num_triangles});
+      out.vertices.assign(1, {0, (u32)mesh.num_vertices});
+   }
+   out.update_counts();
+}
+
+/* Rasterize the occluders of a frame into `hiz`: the faces of the BVH leaves inside the frustum,
+   nearest to `eye` (in the meshes' space) first, until `budget` triangles. Faces the renderer
+   won't draw with backface culling are skipped, as they hide nothing */
+void build_hiz(HiZBuffer &hiz, const vector<TriMesh> &meshes, const vector<MeshAccel> &accels,
+               const Mat4 &obj2clip, const Mat4 &viewport, const Vec3 &eye, bool backface_culling,
+               bool ccw_normals, size_t budget, CullStats *stats = nullptr) {
+   hiz.clear(obj2clip, viewport);
+   Frustum frustum(obj2clip);
+
+   struct Leaf {
+      float distance; // Squared, from the eye to the leaf's box
+      u32 mesh, node;
+   };
+
+   // Scratch comes from the frame arena. There are no more leaves than nodes, and as each node is
+   // pushed once, a mesh's stack never holds more than its nodes either
+   size_t total_nodes = 0, max_nodes = 0;
+   for (auto &accel : accels) {
+      total_nodes += accel.bvh.nodes.size();
+      max_nodes = std::max(max_nodes, accel.bvh.nodes.size());
+   }
+   FrameArena &arena = frame_arena();
+   Span<Leaf> leaves = arena.alloc<Leaf>(total_nodes);
+   Span<u32> stack = arena.alloc<u32>(max_nodes);
+   size_t num_leaves = 0;
+   for (u32 m = 0; m < accels.size(); m++) {
+      const vector<BVHNode> &nodes = accels[m].bvh.nodes;
+      if (nodes.empty()) continue;
+
+      size_t stack_size = 0;
+      stack[stack_size++] = 0;
+      while (stack_size > 0) {
+         u32 n = stack[--stack_size];
+         const BVHNode &node = nodes[n];
+         if (frustum.test_box(node.bounds_min, node.bounds_max) == kFrustumTest_Outside) continue;
+         if (node.first_child != 0) {
+            stack[stack_size++] = node.first_child;
+            stack[stack_size++] = node.first_child + 1;
+            continue;
+         }
+
+         float distance = 0;
+         for (int axis = 0; axis < 3; axis++) {
+            float d = std::max(node.bounds_min[axis] - eye[axis],
+                               eye[axis] - node.bounds_max[axis]);
+            if (d > 0) distance += d * d;
+         }
+         leaves[num_leaves++] = {distance, m, n};
+      }
+   }
+   leaves = leaves.first(num_leaves);
+   std::sort(leaves.begin(), leaves.end(), [](const Leaf &a, const Leaf &b) {
+      return a.distance < b.distance;
+   });
+
+   MatrixRows rows(obj2clip);
+   auto to_clip = [&rows](const Vec3 &p) {
+      const float *m = rows.m;
+      ClipVertex v;
+      v.x = m[0] * p.x() + m[1] * p.y() + m[2] * p.z() + m[3];
+      v.y = m[4] * p.x() + m[5] * p.y() + m[6] * p.z() + m[7];
+      v.z = m[8] * p.x() + m[9] * p.y() + m[10] * p.z() + m[11];
+      v.w = m[12] * p.x() + m[13] * p.y() + m[14] * p.z() + m[15];
+      v.attribute = 0;
+      return v;
+   };
+
+   size_t triangles = 0;
+   for (const Leaf &leaf : leaves) {
+      if (triangles >= budget) break;
+      const TriMesh &mesh = meshes[leaf.mesh];
+      IndexRange faces = accels[leaf.mesh].bvh.nodes[leaf.node].faces;
+      for (u32 f = faces.begin; f < faces.end; f++) {
+         u32 idx[3];
+         mesh.triangle(f, idx);
+         Vec3 v0 = mesh.position(idx[0]), v1 = mesh.position(idx[1]), v2 = mesh.position(idx[2]);
+         if (backface_culling) {
+            Vec3 normal = cross_product(v1 - v0, v2 - v0);
+            if (dot_product(v0 - eye, normal) * (ccw_normals ? 1.f : -1.f) > 0) continue;
+         }
+
+         hiz.add_occluder(to_clip(v0), to_clip(v1), to_clip(v2));
+         triangles++;
+      }
+   }
+   hiz.build_pyramid();
+   if (stats) stats->occluder_triangles += triangles;
+}
+
+} // namespace fuake
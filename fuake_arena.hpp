@@ -0,0 +1,126 @@
+#pragma once
+
+#include <memory>
+#include <vector>
+#include <algorithm>
+#include <type_traits>
+
+#include <amath_core.hpp>
+
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+// Contiguous run of `size()` T owned by someone else: a FrameArena, a vector or a plain array
+template <class T> struct Span {
+   T *ptr = nullptr;
+   size_t count = 0;
+
+   Span() {}
+   Span(T *ptr, size_t count) : ptr(ptr), count(count) {}
+   Span(vector<T> &v) : ptr(v.data()), count(v.size()) {}
+
+   T *data() const { return ptr; }
+   size_t size() const { return count; }
+   bool empty() const { return count == 0; }
+   T *begin() const { return ptr; }
+   T *end() const { return ptr + count; }
+   T &operator[](size_t i) const { return ptr[i]; }
+
+   Span first(size_t n) const { return {ptr, std::min(n, count)}; }
+   void fill(const T &value) const { std::fill(begin(), end(), value); }
+};
+
+/* Linear allocator for scratch memory that lives until the end of the frame. Allocating bumps an
+   offset and reset() frees everything at once. When a frame needs more than the current block,
+   extra blocks are chained, and the next reset() replaces them all with one block as large as
+   their sum, so a steady workload stops touching the heap after its first frame.
+   Not thread-safe: allocate on the render thread, worker threads may fill the spans */
+struct FrameArena {
+   // Every allocation starts on its own cache line, so threads filling neighboring spans don't
+   // share lines, and SIMD loads are aligned
+   static const size_t kAlignment = 64;
+
+   struct Block {
+      std::unique_ptr<u8[]> memory;
+      u8 *base;        // memory aligned to kAlignment
+      size_t capacity; // Bytes from base
+   };
+
+   vector<Block> blocks; // The last one is being filled
+   size_t used = 0;      // Bytes taken from the last block
+   size_t frame_bytes = 0, peak_bytes = 0;
+
+   FrameArena(size_t capacity = 1 << 20) {
+      blocks.reserve(16);
+      add_block(capacity);
+   }
+
+   FrameArena(const FrameArena &) = delete;
+   FrameArena &operator=(const FrameArena &) = delete;
+
+   // Uninitialized room for n T, valid until the next reset()
+   template <class T> Span<T> alloc(size_t n) {
+      static_assert(std::is_trivially_destructible<T>::value,
+                    "Frame arena memory is released without running destructors");
+      static_assert(alignof(T) <= kAlignment, "Over-aligned type");
+      return {(T *)alloc_bytes(n * sizeof(T)), n};
+   }
+
+   // Room for n T, every one set to `value`
+   template <class T> Span<T> alloc(size_t n, const T &value) {
+      Span<T> span = alloc<T>(n);
+      span.fill(value);
+      return span;
+   }
+
+   void *alloc_bytes(size_t size) {
+      size_t offset = (used + kAlignment - 1) & ~(kAlignment - 1);
+      if (offset + size > blocks.back().capacity) {
+         add_block(std::max(size, blocks.back().capacity * 2));
+         offset = 0;
+      }
+      used = offset + size;
+      frame_bytes += size;
+      return blocks.back().base + offset;
+   }
+
+   // Release everything allocated since the last reset
+   void reset() {
+      peak_bytes = std::max(peak_bytes, frame_bytes);
+      if (blocks.size() > 1) {
+         size_t total = 0;
+         for (auto &block : blocks) total += block.capacity;
+         blocks.clear();
+         add_block(total);
+      }
+      used = 0;
+      frame_bytes = 0;
+   }
+
+   size_t capacity() const {
+      size_t total = 0;
+      for (auto &block : blocks) total += block.capacity;
+      return total;
+   }
+
+ private:
+   void add_block(size_t capacity) {
+      Block block;
+      block.memory.reset(new u8[capacity + kAlignment]);
+      size_t address = (size_t)block.memory.get();
+      block.base = block.memory.get() + ((kAlignment - address % kAlignment) % kAlignment);
+      block.capacity = capacity;
+      blocks.push_back(std::move(block));
+      used = 0;
+   }
+};
+
+// Scratch memory of the frame being rendered, reset by the main loop once the frame is done
+FrameArena &frame_arena() {
+   static FrameArena arena;
+   return arena;
+}
+
+} // namespace fuake
@@ -0,0 +1,141 @@
+#pragma once
+
+#include <math.h>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include <amath_core.hpp>
+#include <amath_utils.hpp>
+
+#include "fuake_framebuffer.hpp"
+#include "fuake_image.hpp"
+
+using std::string;
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+/* Where the renderers draw. The wireframe and flat modes draw lines and polygons, the smooth mode
+   rasterizes on its own and hands over the finished image. Implementations: EsatBackend
+   (fuake_backend_esat.hpp) draws to the window, HeadlessBackend to memory */
+struct RenderBackend {
+   virtual ~RenderBackend() {}
+
+   virtual void clear(u8 r, u8 g, u8 b) = 0;
+   virtual void set_stroke_color(u8 r, u8 g, u8 b) = 0;
+   virtual void set_fill_color(u8 r, u8 g, u8 b) = 0;
+   virtual void draw_line(float x0, float y0, float x1, float y1) = 0;
+
+   // Polygon of `count` points as x, y pairs, outlined with the stroke color too if `stroke`
+   virtual void draw_solid_path(const float *points, size_t count, bool stroke) = 0;
+
+   // RGBA image placed at the top left corner
+   virtual void draw_image(const u8 *rgba, int width, int height) = 0;
+};
+
+/* Draws into an in-memory RGBA framebuffer, no window or GPU needed. Pixels are sampled at their
+   centers, and polygons filled with the even-odd rule */
+struct HeadlessBackend : RenderBackend {
+   FrameBufferRGBA frame;
+   u8 stroke_color[3] = {255, 255, 255};
+   u8 fill_color[3] = {255, 255, 255};
+   vector<float> crossings; // Scratch of draw_solid_path(), kept to reuse its room
+
+   HeadlessBackend(Vec2 dimensions) : frame(dimensions) {}
+
+   void clear(u8 r, u8 g, u8 b) override { frame.clear(r, g, b); }
+
+   void set_stroke_color(u8 r, u8 g, u8 b) override {
+      stroke_color[0] = r;
+      stroke_color[1] = g;
+      stroke_color[2] = b;
+   }
+
+   void set_fill_color(u8 r, u8 g, u8 b) override {
+      fill_color[0] = r;
+      fill_color[1] = g;
+      fill_color[2] = b;
+   }
+
+   void draw_line(float x0, float y0, float x1, float y1) override {
+      // Clip to the framebuffer first (Liang-Barsky), endpoints may be far off-screen
+      float t0 = 0, t1 = 1, dx = x1 - x0, dy = y1 - y0;
+      float p[4] = {-dx, dx, -dy, dy};
+      float q[4] = {x0, frame.width - x0, y0, frame.height - y0};
+      for (int i = 0; i < 4; i++) {
+         if (p[i] == 0) {
+            if (q[i] < 0) return;
+            continue;
+         }
+         float t = q[i] / p[i];
+         if (p[i] < 0) t0 = std::max(t0, t);
+         else t1 = std::min(t1, t);
+      }
+      if (t0 > t1) return;
+
+      // DDA, one pixel per step along the major axis
+      float ax = x0 + dx * t0, ay = y0 + dy * t0;
+      float bx = x0 + dx * t1, by = y0 + dy * t1;
+      int steps = (int)ceilf(std::max(fabsf(bx - ax), fabsf(by - ay)));
+      float step_x = steps ? (bx - ax) / steps : 0, step_y = steps ? (by - ay) / steps : 0;
+      for (int i = 0; i <= steps; i++) {
+         int x = (int)(ax + step_x * i), y = (int)(ay + step_y * i);
+         if (x < 0 || y < 0 || x >= frame.width || y >= frame.height) continue;
+         frame.fill_span(y, x, x + 1, stroke_color);
+      }
+   }
+
+   void draw_solid_path(const float *points, size_t count, bool stroke) override {
+      if (count < 3) return;
+
+      float min_y = points[1], max_y = points[1];
+      for (size_t i = 1; i < count; i++) {
+         min_y = std::min(min_y, points[i * 2 + 1]);
+         max_y = std::max(max_y, points[i * 2 + 1]);
+      }
+      int y0 = std::max(0, (int)ceilf(min_y - 0.5f));
+      int y1 = std::min(frame.height - 1, (int)floorf(max_y - 0.5f));
+
+      // Crossings of every edge with the row's center line, filled in pairs
+      for (int y = y0; y <= y1; y++) {
+         float cy = y + 0.5f;
+         crossings.clear();
+         for (size_t i = 0; i < count; i++) {
+            const float *a = &points[i * 2], *b = &points[((i + 1) % count) * 2];
+            if ((a[1] <= cy) == (b[1] <= cy)) continue;
+            crossings.push_back(a[0] + (cy - a[1]) * (b[0] - a[0]) / (b[1] - a[1]));
+         }
+         std::sort(crossings.begin(), crossings.end());
+
+         for (size_t i = 0; i + 1 < crossings.size(); i += 2) {
+            int x0 = std::max(0, (int)ceilf(crossings[i] - 0.5f));
+            int x1 = std::min(frame.width, (int)floorf(crossings[i + 1] - 0.5f) + 1);
+            if (x0 < x1) frame.fill_span(y, x0, x1, fill_color);
+         }
+      }
+
+      if (stroke) {
+         for (size_t i = 0; i < count; i++) {
+            const float *a = &points[i * 2], *b = &points[((i + 1) % count) * 2];
+            draw_line(a[0], a[1], b[0], b[1]);
+         }
+      }
+   }
+
+   void draw_image(const u8 *rgba, int width, int height) override {
+      int w = std::min(width, frame.width), h = std::min(height, frame.height);
+      for (int y = 0; y < h; y++)
+         std::copy(rgba + (size_t)y * width * 4,
+                   rgba + ((size_t)y * width + w) * 4,
+                   &frame.data[(size_t)y * frame.width * 4]);
+   }
+
+   // Write the frame as PNG or PPM, by extension
+   bool save(const string &filepath) const {
+      return write_image(filepath, frame.data.data(), frame.width, frame.height);
+   }
+};
+
+} // namespace fuake
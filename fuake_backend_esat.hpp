@@ -0,0 +1,37 @@
+#pragma once
+
+#include <esat/draw.h>
+#include <esat/sprite.h>
+
+#include "fuake_backend.hpp"
+
+namespace fuake {
+
+// Draws to the ESAT window, between the caller's DrawBegin() and DrawEnd()
+struct EsatBackend : RenderBackend {
+   esat::SpriteHandle image = nullptr; // Texture for draw_image(), made on first use
+   esat::SpriteTransform image_transform = {0, 0, 0, 1, 1, 0, 0};
+
+   void clear(u8 r, u8 g, u8 b) override { esat::DrawClear(r, g, b); }
+
+   void set_stroke_color(u8 r, u8 g, u8 b) override { esat::DrawSetStrokeColor(r, g, b); }
+
+   void set_fill_color(u8 r, u8 g, u8 b) override { esat::DrawSetFillColor(r, g, b); }
+
+   void draw_line(float x0, float y0, float x1, float y1) override {
+      esat::DrawLine(x0, y0, x1, y1);
+   }
+
+   void draw_solid_path(const float *points, size_t count, bool stroke) override {
+      esat::DrawSolidPath((float *)points, (unsigned int)count, stroke);
+   }
+
+   // The window doesn't change size, so the texture is made once and updated after
+   void draw_image(const u8 *rgba, int width, int height) override {
+      if (!image) image = esat::SpriteFromMemory(width, height, rgba);
+      else esat::SpriteUpdateFromMemory(image, (u8 *)rgba);
+      esat::DrawSprite(image, image_transform);
+   }
+};
+
+} // namespace fuake
@@ -0,0 +1,326 @@
+#pragma once
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include <amath_core.hpp>
+#include <amath_utils.hpp>
+
+#include "fuake_mesh.hpp"
+#include "fuake_profiler.hpp"
+
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+struct BSPNode {
+   Vec3 normal; // Plane of the node, dot(normal, p) - dist > 0 is the front side
+   float dist;
+   int32_t front = -1, back = -1;     // Child nodes, -1 when that side is empty
+   u32 first_face = 0, num_faces = 0; // Faces lying on the plane (range of BSPTree::faces)
+   u32 first_edge = 0, num_edges = 0; // Edges on or crossing the plane (range of BSPTree::edges)
+};
+
+/* Binary space partition of a mesh's faces. Every node keeps the faces lying on its plane, so
+   visiting the side away from the eye, then the node, then the side of the eye lists all faces in
+   exact back-to-front order in linear time. Faces crossing a plane are split when building. */
+struct BSPTree {
+   vector<BSPNode> nodes; // nodes[0] is the root
+   vector<u32> faces;     // Face indices grouped by node
+   vector<u32> edges;     // Edge indices (pairs in mesh.edges) grouped by node
+   u32 depth = 0;         // Nodes on the longest path from the root
+
+   bool empty() const { return nodes.empty(); }
+
+   // Entries the traversal stack of order_from needs: each pop pushes at most 3, one of them for a
+   // deeper node, so there are never more than 2 per level plus the one being visited
+   size_t stack_size() const { return 2 * (size_t)depth + 1; }
+
+   /* Faces, and edges if `edge_order` is given, in back-to-front order as seen from `eye` (in the
+      mesh's space), or front to back with `front_to_back` */
+   void order_from(const Vec3 &eye, vector<u32> &face_order, vector<u32> *edge_order = nullptr,
+                   bool front_to_back = false) const {
+      face_order.resize(faces.size());
+      if (edge_order) edge_order->resize(edges.size());
+      vector<u32> stack(stack_size());
+      order_from(eye,
+                 face_order.data(),
+                 edge_order ? edge_order->data() : nullptr,
+                 stack.data(),
+                 front_to_back);
+   }
+
+   /* Same into caller memory: `face_order` has room for faces.size() indices, `edge_order` for
+      edges.size() (either can be null to skip it) and `stack` for stack_size() */
+   void order_from(const Vec3 &eye, u32 *face_order, u32 *edge_order, u32 *stack,
+                   bool front_to_back = false) const {
+      if (nodes.empty()) return;
+
+      // Explicit stack instead of recursion, entries are node * 2 + 1 when the node's own faces
+      // are due and node * 2 when its subtrees still have to be visited
+      size_t top = 0;
+      stack[top++] = 0;
+      while (top > 0) {
+         u32 entry = stack[--top];
+         const BSPNode &node = nodes[entry >> 1];
+
+         if (entry & 1) {
+            if (face_order)
+               face_order = std::copy(faces.begin() + node.first_face,
+                                      faces.begin() + node.first_face + node.num_faces,
+                                      face_order);
+            if (edge_order)
+               edge_order = std::copy(edges.begin() + node.first_edge,
+                                      edges.begin() + node.first_edge + node.num_edges,
+                                      edge_order);
+            continue;
+         }
+
+         bool eye_in_front = dot_product(node.normal, eye) - node.dist > 0;
+         int32_t near = eye_in_front ? node.front : node.back;
+         int32_t far = eye_in_front ? node.back : node.front;
+         if (front_to_back) std::swap(near, far);
+
+         // Pushed in reverse: far side, then this node, then near side
+         if (near >= 0) stack[top++] = (u32)near << 1;
+         stack[top++] = entry | 1;
+         if (far >= 0) stack[top++] = (u32)far << 1;
+      }
+   }
+};
+
+// Polygon being partitioned, a range of vertex indices in the builder's pool
+struct BSPPolygon {
+   u32 first, count;
+};
+
+enum BSPSide {
+   kBSPSide_On = 0,
+   kBSPSide_Front = 1,
+   kBSPSide_Back = 2,
+   kBSPSide_Spanning = 3,
+};
+
+/* Build a BSP tree over `mesh`, which should be triangulated. Faces crossing a splitting plane are
+   cut in two and the mesh is rebuilt with the pieces (still triangles, vertex normals
+   interpolated). Edges keep referencing the original vertices. Each node's splitter is the best of
+   `candidates` faces, scored by the splits and imbalance it would cause. */
+BSPTree build_bsp(Mesh &mesh, int candidates = 8) {
+   FUAKE_PROFILE_SCOPE("Build BSP");
+   BSPTree tree;
+   if (mesh.num_vertices.empty()) return tree;
+
+   mesh.update_bounds();
+   Vec3 extent = mesh.bounds_max - mesh.bounds_min;
+   float epsilon = std::max(1E-6f, 1E-5f * std::max(extent.x(), std::max(extent.y(), extent.z())));
+
+   bool has_normals = mesh.normals.size() == mesh.vertices.size();
+   VertexWelder welder(mesh.vertices, epsilon);
+
+   vector<u32> pool(mesh.indices.begin(), mesh.indices.end());
+   vector<BSPPolygon> polygons(mesh.num_vertices.size());
+   for (size_t f = 0; f < polygons.size(); f++)
+      polygons[f] = {mesh.index_offsets[f], mesh.num_vertices[f]};
+
+   // Triangles of the rebuilt mesh, in the order the nodes claim them
+   vector<u32> out_indices;
+   out_indices.reserve(mesh.indices.size());
+
+   auto polygon_normal = [&](const BSPPolygon &poly) {
+      const Vec3 &v0 = mesh.vertices[pool[poly.first]];
+      Vec3 n{0, 0, 0};
+      for (u32 i = 1; i + 1 < poly.count; i++)
+         n += cross_product(mesh.vertices[pool[poly.first + i]] - v0,
+                            mesh.vertices[pool[poly.first + i + 1]] - v0);
+      return n;
+   };
+
+   auto classify = [&](const BSPPolygon &poly, const Vec3 &normal, float dist) {
+      int side = kBSPSide_On;
+      for (u32 i = 0; i < poly.count; i++) {
+         float d = dot_product(normal, mesh.vertices[pool[poly.first + i]]) - dist;
+         if (d > epsilon) side |= kBSPSide_Front;
+         else if (d < -epsilon) side |= kBSPSide_Back;
+      }
+      return side;
+   };
+
+   // Cut `poly` by the plane into a front and a back polygon appended to the pool
+   vector<u32> front_verts, back_verts;
+   auto split = [&](const BSPPolygon &poly, const Vec3 &normal, float dist, BSPPolygon &front,
+                    BSPPolygon &back) {
+      front_verts.clear();
+      back_verts.clear();
+      for (u32 i = 0; i < poly.count; i++) {
+         u32 cur = pool[poly.first + i];
+         u32 next = pool[poly.first + (i + 1) % poly.count];
+         float cur_d = dot_product(normal, mesh.vertices[cur]) - dist;
+         float next_d = dot_product(normal, mesh.vertices[next]) - dist;
+
+         if (cur_d >= -epsilon) front_verts.push_back(cur);
+         if (cur_d <= epsilon) back_verts.push_back(cur);
+
+         // Edge strictly crosses the plane
+         if ((cur_d > epsilon && next_d < -epsilon) || (cur_d < -epsilon && next_d > epsilon)) {
+            float t = cur_d / (cur_d - next_d);
+            Vec3 p = mesh.vertices[cur] + (mesh.vertices[next] - mesh.vertices[cur]) * t;
+            u32 new_idx = welder.weld(p);
+            if (has_normals && new_idx == mesh.normals.size())
+               mesh.normals.push_back(
+                   (mesh.normals[cur] + (mesh.normals[next] - mesh.normals[cur]) * t).normalized());
+            front_verts.push_back(new_idx);
+            back_verts.push_back(new_idx);
+         }
+      }
+
+      // Welding may leave repeated vertices
+      auto append = [&pool](vector<u32> &verts) {
+         BSPPolygon out = {(u32)pool.size(), 0};
+         for (u32 v : verts) {
+            if (out.count > 0 && pool.back() == v) continue;
+            pool.push_back(v);
+            out.count++;
+         }
+         while (out.count > 1 && pool.back() == pool[out.first]) {
+            pool.pop_back();
+            out.count--;
+         }
+         return out;
+      };
+      front = append(front_verts);
+      back = append(back_verts);
+   };
+
+   struct BuildTask {
+      u32 node;
+      vector<BSPPolygon> polygons;
+   };
+   vector<BuildTask> tasks;
+   tree.nodes.emplace_back();
+   tasks.push_back({0, std::move(polygons)});
+
+   while (!tasks.empty()) {
+      BuildTask task = std::move(tasks.back());
+      tasks.pop_back();
+      vector<BSPPolygon> &polys = task.polygons;
+
+      // Pick the splitter among evenly spaced candidates, scoring on a sample of the polygons
+      size_t stride = std::max<size_t>(1, polys.size() / candidates);
+      size_t sample_stride = std::max<size_t>(1, polys.size() / 256);
+      Vec3 best_normal{0, 0, 1};
+      float best_dist = 0;
+      size_t best_score = SIZE_MAX;
+      for (size_t c = 0; c < polys.size(); c += stride) {
+         Vec3 n = polygon_normal(polys[c]);
+         if (n.length() < epsilon * epsilon) continue; // Degenerate
+         n = n.normalized();
+         float d = dot_product(n, mesh.vertices[pool[polys[c].first]]);
+
+         size_t num_front = 0, num_back = 0, num_split = 0;
+         for (size_t i = 0; i < polys.size(); i += sample_stride) {
+            int side = classify(polys[i], n, d);
+            num_front += side == kBSPSide_Front;
+            num_back += side == kBSPSide_Back;
+            num_split += side == kBSPSide_Spanning;
+         }
+         size_t imbalance = num_front > num_back ? num_front - num_back : num_back - num_front;
+         size_t score = num_split * 8 + imbalance;
+         if (score < best_score) {
+            best_score = score;
+            best_normal = n;
+            best_dist = d;
+         }
+      }
+
+      // Partition. With only degenerate polygons left, they all stay in this node
+      vector<BSPPolygon> front, back;
+      tree.nodes[task.node].normal = best_normal;
+      tree.nodes[task.node].dist = best_dist;
+      tree.nodes[task.node].first_face = (u32)tree.faces.size();
+      for (const auto &poly : polys) {
+         int side = best_score == SIZE_MAX ? kBSPSide_On : classify(poly, best_normal, best_dist);
+         if (side == kBSPSide_Front) {
+            front.push_back(poly);
+         } else if (side == kBSPSide_Back) {
+            back.push_back(poly);
+         } else if (side == kBSPSide_Spanning) {
+            BSPPolygon front_piece, back_piece;
+            split(poly, best_normal, best_dist, front_piece, back_piece);
+            if (front_piece.count >= 3) front.push_back(front_piece);
+            if (back_piece.count >= 3) back.push_back(back_piece);
+         } else {
+            // On the plane: fan into triangles owned by this node
+            for (u32 i = 1; i + 1 < poly.count; i++) {
+               tree.faces.push_back((u32)(out_indices.size() / 3));
+               out_indices.push_back(pool[poly.first]);
+               out_indices.push_back(pool[poly.first + i]);
+               out_indices.push_back(pool[poly.first + i + 1]);
+            }
+         }
+      }
+      tree.nodes[task.node].num_faces = (u32)tree.faces.size() - tree.nodes[task.node].first_face;
+
+      if (!front.empty()) {
+         tree.nodes[task.node].front = (int32_t)tree.nodes.size();
+         tree.nodes.emplace_back();
+         tasks.push_back({(u32)tree.nodes.size() - 1, std::move(front)});
+      }
+      if (!back.empty()) {
+         tree.nodes[task.node].back = (int32_t)tree.nodes.size();
+         tree.nodes.emplace_back();
+         tasks.push_back({(u32)tree.nodes.size() - 1, std::move(back)});
+      }
+   }
+
+   mesh.indices.swap(out_indices);
+   mesh.num_vertices.assign(mesh.indices.size() / 3, 3);
+   mesh.calculate_offsets();
+   mesh.update_bounds();
+
+   // Edges sink to the deepest node whose plane they touch or cross, then get grouped by node
+   size_t num_edges = mesh.edges.size() / 2;
+   vector<u32> edge_node(num_edges);
+   vector<u32> node_edge_count(tree.nodes.size() + 1, 0);
+   for (size_t e = 0; e < num_edges; e++) {
+      const Vec3 &a = mesh.vertices[mesh.edges[2 * e]];
+      const Vec3 &b = mesh.vertices[mesh.edges[2 * e + 1]];
+      u32 node_idx = 0;
+      while (true) {
+         const BSPNode &node = tree.nodes[node_idx];
+         float da = dot_product(node.normal, a) - node.dist;
+         float db = dot_product(node.normal, b) - node.dist;
+         bool front = da >= -epsilon && db >= -epsilon && (da > epsilon || db > epsilon);
+         bool back = da <= epsilon && db <= epsilon && (da < -epsilon || db < -epsilon);
+         int32_t next = front ? node.front : back ? node.back : -1;
+         if (next < 0) break;
+         node_idx = (u32)next;
+      }
+      edge_node[e] = node_idx;
+      node_edge_count[node_idx + 1]++;
+   }
+   for (size_t n = 0; n < tree.nodes.size(); n++) {
+      node_edge_count[n + 1] += node_edge_count[n];
+      tree.nodes[n].first_edge = node_edge_count[n];
+      tree.nodes[n].num_edges = 0;
+   }
+   tree.edges.resize(num_edges);
+   for (size_t e = 0; e < num_edges; e++) {
+      BSPNode &node = tree.nodes[edge_node[e]];
+      tree.edges[node.first_edge + node.num_edges++] = (u32)e;
+   }
+
+   // Children are always created after their parent
+   vector<u32> node_depth(tree.nodes.size(), 1);
+   for (size_t n = 0; n < tree.nodes.size(); n++) {
+      const BSPNode &node = tree.nodes[n];
+      if (node.front >= 0) node_depth[node.front] = node_depth[n] + 1;
+      if (node.back >= 0) node_depth[node.back] = node_depth[n] + 1;
+      tree.depth = std::max(tree.depth, node_depth[n]);
+   }
+
+   return tree;
+}
+
+} // namespace fuake
@@ -0,0 +1,512 @@
+#pragma once
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include <amath_core.hpp>
+#include <amath_utils.hpp>
+
+#include "fuake_mesh.hpp"
+#include "fuake_bsp.hpp"
+#include "fuake_hiz.hpp"
+#include "fuake_profiler.hpp"
+
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+// Half-open range [begin, end) of faces or vertices
+struct IndexRange {
+   u32 begin, end;
+};
+
+// Append `range` to sorted `ranges`, extending the last one when they touch
+inline void append_range(vector<IndexRange> &ranges, IndexRange range) {
+   if (!ranges.empty() && ranges.back().end == range.begin) ranges.back().end = range.end;
+   else ranges.push_back(range);
+}
+
+// Sort `ranges` and merge the ones that touch or overlap
+void merge_ranges(vector<IndexRange> &ranges) {
+   std::sort(ranges.begin(), ranges.end(), [](IndexRange a, IndexRange b) {
+      return a.begin < b.begin;
+   });
+   size_t merged = 0;
+   for (size_t i = 0; i < ranges.size(); i++) {
+      if (merged > 0 && ranges[i].begin <= ranges[merged - 1].end)
+         ranges[merged - 1].end = std::max(ranges[merged - 1].end, ranges[i].end);
+      else
+         ranges[merged++] = ranges[i];
+   }
+   ranges.resize(merged);
+}
+
+enum FrustumTest {
+   kFrustumTest_Outside,
+   kFrustumTest_Intersecting,
+   kFrustumTest_Inside,
+};
+
+/* View frustum as 6 planes (a, b, c, d) with a*x + b*y + c*z + d >= 0 inside, extracted from an
+   object-to-clip matrix (Gribb & Hartmann), so boxes can be tested in object space. Follows the
+   renderer's clip volume: -w <= x, y <= w and 0 <= z <= w */
+struct Frustum {
+   float planes[6][4];
+
+   Frustum(const Mat4 &obj2clip) {
+      MatrixRows rows(obj2clip);
+      const float *r0 = rows.m, *r1 = rows.m + 4, *r2 = rows.m + 8, *r3 = rows.m + 12;
+      for (int i = 0; i < 4; i++) {
+         planes[0][i] = r3[i] + r0[i]; // Left
+         planes[1][i] = r3[i] - r0[i]; // Right
+         planes[2][i] = r3[i] + r1[i]; // Bottom
+         planes[3][i] = r3[i] - r1[i]; // Top
+         planes[4][i] = r2[i];         // Near
+         planes[5][i] = r3[i] - r2[i]; // Far
+      }
+   }
+
+   // Whether the sphere is outside one of the planes (conservative near the frustum's corners)
+   bool outside_sphere(const Vec3 &center, float radius) const {
+      for (const auto &p : planes) {
+         float distance = p[0] * center.x() + p[1] * center.y() + p[2] * center.z() + p[3];
+         if (distance < -radius * sqrtf(p[0] * p[0] + p[1] * p[1] + p[2] * p[2])) return true;
+      }
+      return false;
+   }
+
+   FrustumTest test_box(const Vec3 &bounds_min, const Vec3 &bounds_max) const {
+      FrustumTest result = kFrustumTest_Inside;
+      for (const auto &p : planes) {
+         // Box corners farthest along and against the plane normal
+         float far = p[3], near = p[3];
+         for (int axis = 0; axis < 3; axis++) {
+            bool positive = p[axis] >= 0;
+            far += p[axis] * (positive ? bounds_max[axis] : bounds_min[axis]);
+            near += p[axis] * (positive ? bounds_min[axis] : bounds_max[axis]);
+         }
+         if (far < 0) return kFrustumTest_Outside;
+         if (near < 0) result = kFrustumTest_Intersecting;
+      }
+      return result;
+   }
+};
+
+// Per-frame culling counters, clusters being BVH nodes
+struct CullStats {
+   size_t clusters_tested = 0;
+   size_t clusters_frustum_culled = 0;
+   size_t clusters_occluded = 0;
+   size_t occluder_triangles = 0;
+   size_t meshlets_tested = 0;
+   size_t meshlets_backfacing = 0;
+   size_t meshlets_frustum_culled = 0;
+};
+
+/* Up to kMaxMeshletFaces faces of a BVH leaf whose normals share their dominant axis, with a
+   bounding sphere and a cone holding every face normal, so the whole group can be found facing
+   away from the eye or outside the frustum in one test */
+struct Meshlet {
+   IndexRange faces, vertices;
+   Vec3 center;    // Bounding sphere
+   float radius;
+   Vec3 cone_axis; // Unit, counter-clockwise face normals
+   float cone_cutoff; // Sine of the cone's half angle, 1 when it can't be culled
+
+   /* Every face faces away from `eye` (in the mesh's space), `normal_sign` being -1 for clockwise
+      front faces. Holds for any point of the sphere, as in meshoptimizer's cone test */
+   bool faces_away(const Vec3 &eye, float normal_sign) const {
+      Vec3 to_center = center - eye;
+      return dot_product(to_center, cone_axis) * normal_sign >
+             cone_cutoff * to_center.length() + radius;
+   }
+};
+
+const u32 kMaxMeshletFaces = 64;
+
+// Which meshlets BVH::cull() rejects, besides the ones outside the frustum
+struct MeshletCulling {
+   bool backface = false;   // The ones facing away from `eye`
+   Vec3 eye;                // In the mesh's space
+   bool ccw_normals = true; // Front face winding
+};
+
+struct BVHNode {
+   Vec3 bounds_min, bounds_max;
+   u32 first_child = 0;  // Children are first_child and first_child + 1, 0 for leaves
+   IndexRange faces;     // Faces of the whole subtree, contiguous after build_bvh
+   IndexRange vertices;  // Vertices those faces use (may include a few they don't)
+   IndexRange meshlets;  // Meshlets of the whole subtree
+};
+
+/* Bounding volume hierarchy over a mesh's faces. Subtrees are contiguous ranges of faces and
+   (mostly) of vertices, so culling a subtree skips its vertex transforms as well as its faces */
+struct BVH {
+   vector<BVHNode> nodes;    // nodes[0] is the root
+   vector<Meshlet> meshlets; // In face order, leaves split by normal direction
+
+   bool empty() const { return nodes.empty(); }
+
+   /* Append the faces and vertices of `node`'s subtree. With `culling`, leave out the meshlets it
+      rejects, and the ones outside `frustum` unless the node is `inside` it */
+   void append_node(const BVHNode &node, const Frustum &frustum, bool inside,
+                    const MeshletCulling *culling, vector<IndexRange> &faces,
+                    vector<IndexRange> &vertices, CullStats *stats = nullptr) const {
+      bool backface = culling && culling->backface;
+      if (!culling || (inside && !backface) || meshlets.empty()) {
+         append_range(faces, node.faces);
+         append_range(vertices, node.vertices);
+         return;
+      }
+
+      float normal_sign = culling->ccw_normals ? 1.f : -1.f;
+      for (u32 i = node.meshlets.begin; i < node.meshlets.end; i++) {
+         const Meshlet &meshlet = meshlets[i];
+         if (stats) stats->meshlets_tested++;
+         if (backface && meshlet.faces_away(culling->eye, normal_sign)) {
+            if (stats) stats->meshlets_backfacing++;
+            continue;
+         }
+         if (!inside && frustum.outside_sphere(meshlet.center, meshlet.radius)) {
+            if (stats) stats->meshlets_frustum_culled++;
+            continue;
+         }
+         append_range(faces, meshlet.faces);
+         append_range(vertices, meshlet.vertices);
+      }
+   }
+
+   /* Face and vertex ranges of the subtrees that may be inside `frustum`, and not behind the
+      occluders in `hiz` if given. With `meshlet_culling`, the meshlets of those subtrees are culled
+      too (see append_node). Face ranges come out sorted; vertex ranges are sorted and merged too */
+   void cull(const Frustum &frustum, vector<IndexRange> &faces, vector<IndexRange> &vertices,
+             const HiZBuffer *hiz = nullptr, CullStats *stats = nullptr,
+             const MeshletCulling *meshlet_culling = nullptr) const {
+      faces.clear();
+      vertices.clear();
+      if (nodes.empty()) return;
+
+      u32 stack[64];
+      int stack_size = 0;
+      stack[stack_size++] = 0;
+      while (stack_size > 0) {
+         const BVHNode &node = nodes[stack[--stack_size]];
+         if (stats) stats->clusters_tested++;
+         FrustumTest test = frustum.test_box(node.bounds_min, node.bounds_max);
+         if (test == kFrustumTest_Outside) {
+            if (stats) stats->clusters_frustum_culled++;
+            continue;
+         }
+         if (hiz && hiz->occluded(node.bounds_min, node.bounds_max)) {
+            if (stats) stats->clusters_occluded++;
+            continue;
+         }
+
+         // Subtrees inside the frustum are taken whole, unless their children could be occluded
+         bool whole = test == kFrustumTest_Inside && !hiz;
+         if (whole || node.first_child == 0 || stack_size + 2 > 64) {
+            append_node(node,
+                        frustum,
+                        test == kFrustumTest_Inside,
+                        meshlet_culling,
+                        faces,
+                        vertices,
+                        stats);
+            continue;
+         }
+
+         // Right child first so the left subtree, with the lower faces, comes out first
+         stack[stack_size++] = node.first_child + 1;
+         stack[stack_size++] = node.first_child;
+      }
+
+      merge_ranges(vertices);
+   }
+
+   /* Whether the segment from `from` to `to` crosses a face of `mesh`, the mesh this BVH was built
+      for. Hits closer than `epsilon` (a fraction of the segment) to either end are ignored */
+   bool segment_hits(const Mesh &mesh, const Vec3 &from, const Vec3 &to,
+                     float epsilon = 1e-4f) const {
+      if (nodes.empty()) return false;
+      Vec3 dir = to - from;
+
+      u32 stack[64];
+      int stack_size = 0;
+      stack[stack_size++] = 0;
+      while (stack_size > 0) {
+         const BVHNode &node = nodes[stack[--stack_size]];
+
+         // Slab test of the segment against the node's box
+         float t_min = 0, t_max = 1;
+         for (int axis = 0; axis < 3 && t_min <= t_max; axis++) {
+            if (dir[axis] == 0) {
+               if (from[axis] < node.bounds_min[axis] || from[axis] > node.bounds_max[axis])
+                  t_min = 2;
+               continue;
+            }
+            float t0 = (node.bounds_min[axis] - from[axis]) / dir[axis];
+            float t1 = (node.bounds_max[axis] - from[axis]) / dir[axis];
+            if (t0 > t1) std::swap(t0, t1);
+            t_min = std::max(t_min, t0);
+            t_max = std::min(t_max, t1);
+         }
+         if (t_min > t_max) continue;
+
+         if (node.first_child != 0 && stack_size + 2 <= 64) {
+            stack[stack_size++] = node.first_child;
+            stack[stack_size++] = node.first_child + 1;
+            continue;
+         }
+
+         // Leaf (or out of stack), test its faces as triangle fans (Moller-Trumbore)
+         for (u32 f = node.faces.begin; f < node.faces.end; f++) {
+            const u32 *idx = &mesh.indices[mesh.index_offsets[f]];
+            const Vec3 &v0 = mesh.vertices[idx[0]];
+            for (u32 n = 2; n < mesh.num_vertices[f]; n++) {
+               Vec3 e1 = mesh.vertices[idx[n - 1]] - v0, e2 = mesh.vertices[idx[n]] - v0;
+               Vec3 p = cross_product(dir, e2);
+               float det = dot_product(e1, p);
+               if (det == 0) continue;
+               float inv_det = 1.f / det;
+               Vec3 s = from - v0;
+               float u = dot_product(s, p) * inv_det;
+               if (u < 0 || u > 1) continue;
+               Vec3 q = cross_product(s, e1);
+               float v = dot_product(dir, q) * inv_det;
+               if (v < 0 || u + v > 1) continue;
+               float t = dot_product(e2, q) * inv_det;
+               if (t > epsilon && t < 1 - epsilon) return true;
+            }
+         }
+      }
+      return false;
+   }
+};
+
+// Meshlet over the faces [begin, end) of `mesh`, whose unit normals are in `face_normals`
+Meshlet make_meshlet(const Mesh &mesh, const vector<Vec3> &face_normals, u32 begin, u32 end) {
+   Meshlet meshlet;
+   meshlet.faces = {begin, end};
+   meshlet.vertices = {UINT32_MAX, 0};
+   Vec3 bounds_min = mesh.vertices[mesh.indices[mesh.index_offsets[begin]]];
+   Vec3 bounds_max = bounds_min;
+   Vec3 normal_sum = {0, 0, 0};
+   for (u32 f = begin; f < end; f++) {
+      for (u32 n = 0; n < mesh.num_vertices[f]; n++) {
+         u32 v = mesh.indices[mesh.index_offsets[f] + n];
+         meshlet.vertices.begin = std::min(meshlet.vertices.begin, v);
+         meshlet.vertices.end = std::max(meshlet.vertices.end, v + 1);
+         for (int axis = 0; axis < 3; axis++) {
+            bounds_min[axis] = std::min(bounds_min[axis], mesh.vertices[v][axis]);
+            bounds_max[axis] = std::max(bounds_max[axis], mesh.vertices[v][axis]);
+         }
+      }
+      normal_sum += face_normals[f];
+   }
+
+   meshlet.center = (bounds_min + bounds_max) * 0.5f;
+   meshlet.radius = 0;
+   for (u32 v = meshlet.vertices.begin; v < meshlet.vertices.end; v++)
+      meshlet.radius = std::max(meshlet.radius, (mesh.vertices[v] - meshlet.center).length());
+
+   // Cones wider than a half sphere (or close to it) can't be culled, as in meshoptimizer
+   meshlet.cone_cutoff = 1;
+   meshlet.cone_axis = normal_sum;
+   if (normal_sum.length() == 0) return meshlet;
+   meshlet.cone_axis = normal_sum.normalized();
+   float min_dot = 1;
+   for (u32 f = begin; f < end; f++)
+      if (face_normals[f].length() > 0)
+         min_dot = std::min(min_dot, dot_product(face_normals[f], meshlet.cone_axis));
+   if (min_dot > 0.1f) meshlet.cone_cutoff = sqrtf(1 - min_dot * min_dot);
+   return meshlet;
+}
+
+/* Build a BVH over `mesh` by median splits along the longest axis of the face centers, with up to
+   `max_leaf_faces` faces per leaf. Faces are reordered so every subtree is a contiguous range, and
+   vertices by first use so subtrees mostly use contiguous vertices too. Within a leaf, faces are
+   grouped by the dominant axis of their normal, and every group becomes a meshlet. Face ids in
+   `bsp` and vertex ids in the mesh's edges are remapped to match */
+BVH build_bvh(Mesh &mesh, BSPTree *bsp = nullptr, u32 max_leaf_faces = kMaxMeshletFaces) {
+   FUAKE_PROFILE_SCOPE("Build BVH");
+   BVH bvh;
+   u32 num_faces = (u32)mesh.num_vertices.size();
+   if (num_faces == 0) return bvh;
+
+   // Normals of degenerate faces are left at zero, in their own group
+   vector<Vec3> face_min(num_faces), face_max(num_faces), face_center(num_faces);
+   vector<Vec3> face_normal(num_faces);
+   vector<u8> face_group(num_faces);
+   for (u32 f = 0; f < num_faces; f++) {
+      const u32 *idx = &mesh.indices[mesh.index_offsets[f]];
+      const Vec3 &v0 = mesh.vertices[idx[0]];
+      Vec3 normal = cross_product(mesh.vertices[idx[1]] - v0, mesh.vertices[idx[2]] - v0);
+      face_normal[f] = normal.length() > 0 ? normal.normalized() : Vec3{0, 0, 0};
+      int axis = fabsf(normal.x()) > fabsf(normal.y())
+                     ? (fabsf(normal.x()) > fabsf(normal.z()) ? 0 : 2)
+                     : (fabsf(normal.y()) > fabsf(normal.z()) ? 1 : 2);
+      face_group[f] = normal.length() > 0 ? (u8)(axis * 2 + (normal[axis] < 0)) : 6;
+
+      face_min[f] = face_max[f] = mesh.vertices[idx[0]];
+      for (u32 n = 1; n < mesh.num_vertices[f]; n++) {
+         const Vec3 &v = mesh.vertices[idx[n]];
+         for (int axis = 0; axis < 3; axis++) {
+            face_min[f][axis] = std::min(face_min[f][axis], v[axis]);
+            face_max[f][axis] = std::max(face_max[f][axis], v[axis]);
+         }
+      }
+      face_center[f] = (face_min[f] + face_max[f]) * 0.5f;
+   }
+
+   // Split ranges of `order` in place, so every node's faces stay contiguous
+   vector<u32> order(num_faces);
+   for (u32 f = 0; f < num_faces; f++) order[f] = f;
+
+   bvh.nodes.emplace_back();
+   bvh.nodes[0].faces = {0, num_faces};
+   vector<u32> stack = {0};
+   while (!stack.empty()) {
+      u32 node_idx = stack.back();
+      stack.pop_back();
+      IndexRange range = bvh.nodes[node_idx].faces;
+
+      Vec3 bounds_min = face_min[order[range.begin]], bounds_max = face_max[order[range.begin]];
+      Vec3 center_min = face_center[order[range.begin]], center_max = center_min;
+      for (u32 i = range.begin; i < range.end; i++) {
+         u32 f = order[i];
+         for (int axis = 0; axis < 3; axis++) {
+            bounds_min[axis] = std::min(bounds_min[axis], face_min[f][axis]);
+            bounds_max[axis] = std::max(bounds_max[axis], face_max[f][axis]);
+            center_min[axis] = std::min(center_min[axis], face_center[f][axis]);
+            center_max[axis] = std::max(center_max[axis], face_center[f][axis]);
+         }
+      }
+      bvh.nodes[node_idx].bounds_min = bounds_min;
+      bvh.nodes[node_idx].bounds_max = bounds_max;
+
+      Vec3 extent = center_max - center_min;
+      int axis = extent.x() > extent.y() ? (extent.x() > extent.z() ? 0 : 2)
+                                         : (extent.y() > extent.z() ? 1 : 2);
+      if (range.end - range.begin <= max_leaf_faces || extent[axis] <= 0) continue; // Leaf
+
+      u32 mid = range.begin + (range.end - range.begin) / 2;
+      std::nth_element(order.begin() + range.begin,
+                       order.begin() + mid,
+                       order.begin() + range.end,
+                       [&face_center, axis](u32 a, u32 b) {
+                          return face_center[a][axis] < face_center[b][axis];
+                       });
+
+      u32 first_child = (u32)bvh.nodes.size();
+      bvh.nodes[node_idx].first_child = first_child;
+      bvh.nodes.emplace_back();
+      bvh.nodes.emplace_back();
+      bvh.nodes[first_child].faces = {range.begin, mid};
+      bvh.nodes[first_child + 1].faces = {mid, range.end};
+      stack.push_back(first_child + 1);
+      stack.push_back(first_child);
+   }
+   for (auto &node : bvh.nodes)
+      if (node.first_child == 0)
+         std::stable_sort(order.begin() + node.faces.begin,
+                          order.begin() + node.faces.end,
+                          [&face_group](u32 a, u32 b) { return face_group[a] < face_group[b]; });
+
+   // Faces in tree order
+   vector<u32> new_face(num_faces);
+   vector<u32> indices;
+   vector<uint8_t> num_vertices(num_faces);
+   indices.reserve(mesh.indices.size());
+   for (u32 i = 0; i < num_faces; i++) {
+      u32 f = order[i];
+      new_face[f] = i;
+      num_vertices[i] = mesh.num_vertices[f];
+      const u32 *idx = &mesh.indices[mesh.index_offsets[f]];
+      indices.insert(indices.end(), idx, idx + mesh.num_vertices[f]);
+   }
+   if (bsp)
+      for (auto &f : bsp->faces) f = new_face[f];
+
+   // Vertices by first use, unused ones at the end
+   vector<u32> new_vertex(mesh.vertices.size(), UINT32_MAX);
+   u32 num_used = 0;
+   for (u32 &v : indices) {
+      if (new_vertex[v] == UINT32_MAX) new_vertex[v] = num_used++;
+      v = new_vertex[v];
+   }
+   for (auto &v : new_vertex)
+      if (v == UINT32_MAX) v = num_used++;
+
+   bool has_normals = mesh.normals.size() == mesh.vertices.size();
+   vector<Vec3> vertices(mesh.vertices.size()), normals(has_normals ? mesh.vertices.size() : 0);
+   for (size_t v = 0; v < mesh.vertices.size(); v++) {
+      vertices[new_vertex[v]] = mesh.vertices[v];
+      if (has_normals) normals[new_vertex[v]] = mesh.normals[v];
+   }
+   for (auto &v : mesh.edges) v = new_vertex[v];
+
+   mesh.vertices.swap(vertices);
+   if (has_normals) mesh.normals.swap(normals);
+   mesh.indices.swap(indices);
+   mesh.num_vertices.swap(num_vertices);
+   mesh.calculate_offsets();
+   mesh.update_bounds();
+
+   // Vertex ranges, children always come after their parent so a reverse pass works bottom up
+   for (size_t n = bvh.nodes.size(); n-- > 0;) {
+      BVHNode &node = bvh.nodes[n];
+      if (node.first_child != 0) {
+         const BVHNode &left = bvh.nodes[node.first_child];
+         const BVHNode &right = bvh.nodes[node.first_child + 1];
+         node.vertices = {std::min(left.vertices.begin, right.vertices.begin),
+                          std::max(left.vertices.end, right.vertices.end)};
+         continue;
+      }
+      node.vertices = {UINT32_MAX, 0};
+      for (u32 i = mesh.index_offsets[node.faces.begin];
+           i < mesh.index_offsets[node.faces.end - 1] + mesh.num_vertices[node.faces.end - 1];
+           i++) {
+         node.vertices.begin = std::min(node.vertices.begin, mesh.indices[i]);
+         node.vertices.end = std::max(node.vertices.end, mesh.indices[i] + 1);
+      }
+   }
+
+   // Meshlets of every leaf in face order, a group or up to kMaxMeshletFaces of its faces each
+   vector<Vec3> normals_in_order(num_faces);
+   vector<u8> groups_in_order(num_faces);
+   for (u32 i = 0; i < num_faces; i++) {
+      normals_in_order[i] = face_normal[order[i]];
+      groups_in_order[i] = face_group[order[i]];
+   }
+   vector<u32> leaves;
+   for (u32 n = 0; n < bvh.nodes.size(); n++)
+      if (bvh.nodes[n].first_child == 0) leaves.push_back(n);
+   std::sort(leaves.begin(), leaves.end(), [&bvh](u32 a, u32 b) {
+      return bvh.nodes[a].faces.begin < bvh.nodes[b].faces.begin;
+   });
+   for (u32 n : leaves) {
+      BVHNode &leaf = bvh.nodes[n];
+      leaf.meshlets.begin = (u32)bvh.meshlets.size();
+      for (u32 begin = leaf.faces.begin; begin < leaf.faces.end;) {
+         u32 end = begin + 1;
+         while (end < leaf.faces.end && end - begin < kMaxMeshletFaces &&
+                groups_in_order[end] == groups_in_order[begin])
+            end++;
+         bvh.meshlets.push_back(make_meshlet(mesh, normals_in_order, begin, end));
+         begin = end;
+      }
+      leaf.meshlets.end = (u32)bvh.meshlets.size();
+   }
+   for (size_t n = bvh.nodes.size(); n-- > 0;) {
+      BVHNode &node = bvh.nodes[n];
+      if (node.first_child != 0)
+         node.meshlets = {bvh.nodes[node.first_child].meshlets.begin,
+                          bvh.nodes[node.first_child + 1].meshlets.end};
+   }
+
+   return bvh;
+}
+
+} // namespace fuake
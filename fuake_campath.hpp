@@ -0,0 +1,127 @@
+#pragma once
+
+#include <math.h>
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <sstream>
+#include <algorithm>
+
+#include <amath_core.hpp>
+#include <amath_utils.hpp>
+
+using std::string;
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+// Camera pose at a point in time of a recorded path, in world space
+struct CameraKey {
+   float time; // Seconds from the start of the path
+   Vec4 position;
+   Vec4 forward;
+};
+
+/* Camera path to replay deterministically: poses are sampled by time, so the same frame times
+   always give the same frames whatever the frame rate. Stored as text, one key per line:
+   time, position x y z, forward x y z. Lines starting with # are comments */
+struct CameraPath {
+   vector<CameraKey> keys; // Sorted by time
+
+   bool empty() const { return keys.empty(); }
+   float duration() const { return keys.empty() ? 0 : keys.back().time; }
+
+   void add(float time, const Vec4 &position, const Vec4 &forward) {
+      keys.push_back({time, position, forward});
+   }
+
+   // Pose at `time`, interpolated linearly between the keys around it
+   void sample(float time, Vec4 &position, Vec4 &forward) const {
+      if (keys.empty()) return;
+      auto next = std::upper_bound(keys.begin(), keys.end(), time, [](float t, const CameraKey &k) {
+         return t < k.time;
+      });
+      if (next == keys.begin() || next == keys.end()) {
+         const CameraKey &key = next == keys.begin() ? keys.front() : keys.back();
+         position = key.position;
+         forward = key.forward;
+         return;
+      }
+
+      const CameraKey &a = *(next - 1), &b = *next;
+      float t = b.time > a.time ? (time - a.time) / (b.time - a.time) : 0;
+      position = a.position + (b.position - a.position) * t;
+      forward = (a.forward + (b.forward - a.forward) * t).normalized();
+   }
+};
+
+string camera_path_path(const string &model_path) { return model_path + ".campath"; }
+
+bool write_camera_path(const string &filepath, const CameraPath &path) {
+   std::ofstream fs(filepath, std::ios::trunc);
+   if (!fs) return false;
+   fs << "# time  position x y z  forward x y z\n";
+   char line[256];
+   for (auto &key : path.keys) {
+      snprintf(line,
+               sizeof(line),
+               "%.4f  %.4f %.4f %.4f  %.6f %.6f %.6f\n",
+               key.time,
+               key.position.x(),
+               key.position.y(),
+               key.position.z(),
+               key.forward.x(),
+               key.forward.y(),
+               key.forward.z());
+      fs << line;
+   }
+   return (bool)fs;
+}
+
+bool read_camera_path(const string &filepath, CameraPath &path) {
+   std::ifstream fs(filepath);
+   if (!fs) return false;
+
+   path.keys.clear();
+   string line;
+   while (std::getline(fs, line)) {
+      if (line.empty() || line[0] == '#') continue;
+      float t, px, py, pz, fx, fy, fz;
+      if (sscanf(line.c_str(), "%f %f %f %f %f %f %f", &t, &px, &py, &pz, &fx, &fy, &fz) != 7) {
+         printf("WARNING: Bad camera path line in %s: %s\n", filepath.c_str(), line.c_str());
+         return false;
+      }
+      if (!path.keys.empty() && t < path.keys.back().time) {
+         printf("WARNING: Camera path %s goes back in time at %f\n", filepath.c_str(), t);
+         return false;
+      }
+      path.add(t, {px, py, pz, 1}, Vec4(fx, fy, fz, 0).normalized());
+   }
+   return !path.empty();
+}
+
+/* Path for models without a recorded one: half of `duration` orbiting the bounding sphere
+   (`center`, `radius`, world space) from outside, looking at its center, then the other half
+   standing at the center and turning around once */
+CameraPath default_camera_path(const Vec3 &center, float radius, float duration = 10) {
+   CameraPath path;
+   const int steps = 32;
+   float half = duration / 2;
+   for (int i = 0; i <= steps; i++) {
+      float angle = 2 * PI * i / steps;
+      Vec4 offset = {sinf(angle) * radius * 1.5f, 0, -cosf(angle) * radius * 1.5f, 0};
+      Vec4 position = Vec4{center.x(), center.y(), center.z(), 1} + offset;
+      path.add(half * i / steps, position, (-offset).normalized());
+   }
+   for (int i = 0; i <= steps; i++) {
+      float angle = 2 * PI * i / steps;
+      path.add(half + half * i / steps,
+               {center.x(), center.y(), center.z(), 1},
+               {sinf(angle), 0, cosf(angle), 0});
+   }
+   return path;
+}
+
+} // namespace fuake
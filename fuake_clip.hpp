@@ -0,0 +1,147 @@
+#pragma once
+
+#include <vector>
+#include <algorithm>
+
+#include <amath_core.hpp>
+#include <amath_utils.hpp>
+
+#include "fuake_transform.hpp"
+
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+/* Planes of the clip volume, as outcode bits. Clip space follows the renderer's projection:
+   0 <= z <= w in depth, and the side planes are pushed out to a guard band of +-guard_band * w, so
+   polygons that are just partly off-screen skip clipping and are cut by the rasterizer instead */
+enum ClipPlane {
+   kClipPlane_Near = 1 << 0,
+   kClipPlane_Far = 1 << 1,
+   kClipPlane_Left = 1 << 2,
+   kClipPlane_Right = 1 << 3,
+   kClipPlane_Bottom = 1 << 4,
+   kClipPlane_Top = 1 << 5,
+};
+
+const u8 kClipPlanes_Depth = kClipPlane_Near | kClipPlane_Far;
+const u8 kClipPlanes_All = 0x3F;
+
+/* Clip space vertex with attributes interpolated along: intensity for smooth shading, and
+   lightmap coordinates u, v, which stay linear in clip space before the divide */
+struct ClipVertex {
+   float x, y, z, w;
+   float attribute;
+   float u, v;
+};
+
+// Polygons grow by at most a vertex per plane, so anything up to kMaxClipInput vertices fits
+const int kMaxClipVertices = 32;
+const int kMaxClipInput = kMaxClipVertices - 6;
+
+// Fixed size polygon, so clipping never allocates
+struct ClipPolygon {
+   ClipVertex v[kMaxClipVertices];
+   int count = 0;
+};
+
+// Signed distance to a plane of the clip volume, >= 0 inside
+inline float clip_distance(const ClipVertex &v, int plane, float guard_band) {
+   switch (plane) {
+      case kClipPlane_Near: return v.z;
+      case kClipPlane_Far: return v.w - v.z;
+      case kClipPlane_Left: return v.x + guard_band * v.w;
+      case kClipPlane_Right: return guard_band * v.w - v.x;
+      case kClipPlane_Bottom: return v.y + guard_band * v.w;
+      default: return guard_band * v.w - v.y;
+   }
+}
+
+// Outcode of a clip space point: the planes it is outside of
+inline u8 clip_code(float x, float y, float z, float w, float guard_band) {
+   float g = guard_band * w;
+   return (z < 0 ? kClipPlane_Near : 0) | (z > w ? kClipPlane_Far : 0) |
+          (x < -g ? kClipPlane_Left : 0) | (x > g ? kClipPlane_Right : 0) |
+          (y < -g ? kClipPlane_Bottom : 0) | (y > g ? kClipPlane_Top : 0);
+}
+
+// Outcodes of clip[begin, end) into codes[begin, end)
+void compute_clip_codes(const PointSpan &clip, size_t begin, size_t end, float guard_band,
+                        Span<u8> codes) {
+   for (size_t i = begin; i < end; i++)
+      codes[i] = clip_code(clip.x[i], clip.y[i], clip.z[i], clip.w[i], guard_band);
+}
+
+inline ClipVertex lerp_clip_vertex(const ClipVertex &a, const ClipVertex &b, float t) {
+   return {a.x + (b.x - a.x) * t,
+           a.y + (b.y - a.y) * t,
+           a.z + (b.z - a.z) * t,
+           a.w + (b.w - a.w) * t,
+           a.attribute + (b.attribute - a.attribute) * t,
+           a.u + (b.u - a.u) * t,
+           a.v + (b.v - a.v) * t};
+}
+
+/* Sutherland-Hodgman clipping of a convex polygon against the planes in `planes`, in place.
+   Returns false if nothing is left (fewer than 3 vertices) */
+bool clip_polygon(ClipPolygon &poly, u8 planes, float guard_band) {
+   if (poly.count > kMaxClipInput) return false;
+
+   ClipPolygon scratch;
+   ClipPolygon *in = &poly, *out = &scratch;
+   for (int plane = 1; plane <= kClipPlane_Top; plane <<= 1) {
+      if (!(planes & plane)) continue;
+
+      out->count = 0;
+      const ClipVertex *prev = &in->v[in->count - 1];
+      float prev_d = clip_distance(*prev, plane, guard_band);
+      for (int i = 0; i < in->count; i++) {
+         const ClipVertex *cur = &in->v[i];
+         float d = clip_distance(*cur, plane, guard_band);
+         if ((d >= 0) != (prev_d >= 0))
+            out->v[out->count++] = lerp_clip_vertex(*prev, *cur, prev_d / (prev_d - d));
+         if (d >= 0) out->v[out->count++] = *cur;
+         prev = cur;
+         prev_d = d;
+      }
+      std::swap(in, out);
+      if (in->count < 3) return false;
+   }
+
+   if (in != &poly) poly = *in;
+   return true;
+}
+
+/* Liang-Barsky clipping of the segment a-b against the planes in `planes`, in place.
+   Returns false if it is completely outside */
+bool clip_segment(ClipVertex &a, ClipVertex &b, u8 planes, float guard_band) {
+   float t0 = 0, t1 = 1;
+   for (int plane = 1; plane <= kClipPlane_Top; plane <<= 1) {
+      if (!(planes & plane)) continue;
+
+      float da = clip_distance(a, plane, guard_band), db = clip_distance(b, plane, guard_band);
+      if (da < 0 && db < 0) return false;
+      if (da < 0) t0 = std::max(t0, da / (da - db));
+      else if (db < 0) t1 = std::min(t1, da / (da - db));
+      if (t0 > t1) return false;
+   }
+
+   ClipVertex start = lerp_clip_vertex(a, b, t0);
+   b = lerp_clip_vertex(a, b, t1);
+   a = start;
+   return true;
+}
+
+// Divide by w and map to the viewport, giving screen x, y in pixels and z ∈ [0,1]
+inline Vec4 project_clip_vertex(const ClipVertex &v, const MatrixRows &viewport) {
+   const float *m = viewport.m;
+   float inv_w = 1.f / v.w;
+   float x = v.x * inv_w, y = v.y * inv_w, z = v.z * inv_w;
+   return Vec4{m[0] * x + m[1] * y + m[2] * z + m[3],
+               m[4] * x + m[5] * y + m[6] * z + m[7],
+               m[8] * x + m[9] * y + m[10] * z + m[11],
+               v.w};
+}
+
+} // namespace fuake
@@ -0,0 +1,89 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include <amath_core.hpp>
+#include <amath_utils.hpp>
+
+#include "fuake_backend.hpp"
+
+using std::string;
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+enum RenderMode {
+   kRenderMode_Wireframe,
+   kRenderMode_Flat,
+   kRenderMode_Gouraud,
+};
+
+const char *RENDER_MODES[] = {
+    "Wireframe",
+    "Flat",
+    "Gouraud",
+};
+
+struct RenderContext {
+
+   RenderMode mode = kRenderMode_Flat;
+
+   bool show_normals = false;
+   bool z_sorting = true;
+   bool bsp_sorting = true;       // Z sort by walking the BSP when there is one, else by depth
+   bool backface_culling = true;
+   bool viewport_culling = true;
+   bool frustum_culling = true;   // Skip BVH nodes outside the view frustum before transforming
+   bool clip_sides = true;        // Clip to the guard band too, not only to the near and far planes
+   bool use_pvs = true;           // Only draw what a map's PVS sees from the camera's cell
+   bool occlusion_culling = true; // Skip BVH nodes behind the nearest faces (HiZ), solid modes
+   bool meshlet_culling = true;   // Skip meshlets facing away or outside the frustum, per BVH leaf
+   bool color_by_depth = true;
+   bool map_lights = true;        // Light maps with their light entities instead of the sun
+   bool baked_lighting = true;    // Light maps with their baked lightmaps first, if they have any
+   bool ccw_normals = true;
+   bool show_diagonals = false;   // Draw the quad diagonals added by triangulate() in wireframe
+
+   float fov_degrees = Rad2Deg(PI / 2);
+   float fov = PI / 2;
+   float zNear = 0.01f;
+   float zFar = 20000.f;
+   float aspect;
+   Vec2 window_dimensions;
+
+   float normal_length = 100;
+   float guard_band = 2;       // Side clip planes, in viewport half sizes from the center
+   int occluder_budget = 2048; // Triangles rasterized into the HiZ buffer per frame
+
+   Mat4 persp;
+   Mat4 viewport;
+
+   RenderBackend *backend = nullptr; // Where the renderers draw, set by the application
+
+   RenderContext(Vec2 window_dimensions)
+       : aspect(window_dimensions.x() / window_dimensions.y()),
+         window_dimensions(window_dimensions) {
+      persp = Mat4::perspective(fov, aspect, zNear, zFar);
+      viewport = Mat4::transform({window_dimensions.x() / 2, window_dimensions.y() / 2, 0},
+                                 {window_dimensions.x() / 2, window_dimensions.y() / 2, 1},
+                                 {0, 0, 0});
+   }
+
+   void Update() {
+      fov = Deg2Rad(fov_degrees);
+      UpdateMatrices();
+   }
+
+   void UpdateMatrices() {
+      persp = Mat4::perspective(fov, aspect, zNear, zFar);
+
+      // Viewport won't change
+      // viewport = generate_transform({window_dimensions.x() / 2, window_dimensions.y() / 2, 0},
+      //                               {window_dimensions.x() / 2, window_dimensions.y() / 2, 1},
+      //                               {0, 0, 0});
+   }
+};
+
+} // namespace fuake
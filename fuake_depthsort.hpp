@@ -0,0 +1,138 @@
+#pragma once
+
+#include <vector>
+#include <cstdint>
+#include <cstring>
+#include <algorithm>
+
+#include "fuake_arena.hpp"
+
+using std::vector;
+
+namespace fuake {
+
+// Float bits as an unsigned key that sorts in the same order: negatives flipped, positives
+// above them
+inline u32 float_sort_key(float value) {
+   u32 bits;
+   memcpy(&bits, &value, sizeof(bits));
+   return (bits & 0x80000000u) ? ~bits : bits | 0x80000000u;
+}
+
+// Sorts by descending depths[index], stably, and stops once it would shift more than `max_moves`
+// items, which leaves `indices` a permutation of itself. Returns whether it finished
+inline bool insertion_sort_back_to_front(const float *depths, Span<u32> indices,
+                                         size_t max_moves) {
+   size_t moves = 0;
+   for (size_t i = 1; i < indices.size(); i++) {
+      u32 item = indices[i];
+      float depth = depths[item];
+      size_t j = i;
+      for (; j > 0 && depths[indices[j - 1]] < depth; j--) indices[j] = indices[j - 1];
+      indices[j] = item;
+      moves += i - j;
+      if (moves > max_moves) return false;
+   }
+   return true;
+}
+
+/* Sort `indices` by descending depths[index], farthest first for the painter's algorithm. LSD radix
+   sort of the 32-bit key and the index packed in one 64-bit word, 11 bits of key per pass, so
+   three passes at most. Passes where every key has the same digit are skipped, which is common
+   for the high bits since depths share their sign and exponent. Stable; scratch comes from
+   `arena` */
+void radix_sort_back_to_front(const float *depths, Span<u32> indices, FrameArena &arena) {
+   size_t n = indices.size();
+   if (n < 64) {
+      insertion_sort_back_to_front(depths, indices, SIZE_MAX);
+      return;
+   }
+
+   const int kDigitBits = 11, kPasses = 3;
+   const u32 kBuckets = 1 << kDigitBits;
+   Span<uint64_t> items = arena.alloc<uint64_t>(n), scratch = arena.alloc<uint64_t>(n);
+   Span<u32> counts = arena.alloc<u32>(kPasses * kBuckets, 0);
+
+   // Complemented keys so ascending order is farthest first, and every pass's histogram at once
+   for (size_t i = 0; i < n; i++) {
+      u32 key = ~float_sort_key(depths[indices[i]]);
+      items[i] = (uint64_t)key << 32 | indices[i];
+      for (int pass = 0; pass < kPasses; pass++)
+         counts[pass * kBuckets + ((key >> (pass * kDigitBits)) & (kBuckets - 1))]++;
+   }
+
+   for (int pass = 0; pass < kPasses; pass++) {
+      u32 *count = counts.data() + pass * kBuckets;
+      int shift = 32 + pass * kDigitBits;
+      if (count[(items[0] >> shift) & (kBuckets - 1)] == n) continue;
+
+      // Counts to bucket starts, then scatter
+      u32 offset = 0;
+      for (u32 b = 0; b < kBuckets; b++) {
+         u32 c = count[b];
+         count[b] = offset;
+         offset += c;
+      }
+      for (size_t i = 0; i < n; i++)
+         scratch[count[(items[i] >> shift) & (kBuckets - 1)]++] = items[i];
+      std::swap(items, scratch);
+   }
+
+   for (size_t i = 0; i < n; i++) indices[i] = (u32)items[i];
+}
+
+/* Back to front order of a mesh's faces or edges, kept from frame to frame. When the camera
+   barely moves, last frame's order of the items still in view is nearly sorted: insertion sort
+   fixes it in close to linear time, and the items new to the view are radix sorted and merged in.
+   Whether it's nearly sorted is guessed from its descents (neighbors out of order), and insertion
+   sort gives up past kMaxMovesPerItem shifts per item anyway. Otherwise everything is radix sorted,
+   starting from last frame's order too. Either way ties keep last frame's order, so coplanar faces
+   don't flicker */
+struct DepthOrder {
+   static const size_t kMaxMovesPerItem = 4;
+   static const size_t kMaxDescentsFraction = 32; // At most 1 / this of the items
+
+   vector<u32> order; // Last frame's
+
+   /* Sort `indices`, the items drawn this frame out of `num_items`, by descending depths[index].
+      Scratch comes from `arena` */
+   void sort(const float *depths, Span<u32> indices, size_t num_items, FrameArena &arena) {
+      size_t n = indices.size();
+      Span<u8> state = arena.alloc<u8>(num_items, 0); // 1 wanted, 2 taken from last frame
+      for (u32 i : indices) state[i] = 1;
+
+      Span<u32> kept = arena.alloc<u32>(n);
+      size_t num_kept = 0;
+      for (u32 i : order) {
+         if (i < num_items && state[i] == 1) {
+            kept[num_kept++] = i;
+            state[i] = 2;
+         }
+      }
+      kept = kept.first(num_kept);
+      Span<u32> added = arena.alloc<u32>(n - num_kept);
+      size_t num_added = 0;
+      for (u32 i : indices)
+         if (state[i] == 1) added[num_added++] = i;
+
+      size_t descents = 0;
+      for (size_t i = 1; i < num_kept; i++) descents += depths[kept[i - 1]] < depths[kept[i]];
+      if (num_kept > 0 && descents * kMaxDescentsFraction <= num_kept &&
+          insertion_sort_back_to_front(depths, kept, kMaxMovesPerItem * num_kept)) {
+         radix_sort_back_to_front(depths, added, arena);
+         std::merge(kept.begin(),
+                    kept.end(),
+                    added.begin(),
+                    added.end(),
+                    indices.begin(),
+                    [depths](u32 left, u32 right) { return depths[left] > depths[right]; });
+      } else {
+         std::copy(kept.begin(), kept.end(), indices.begin());
+         std::copy(added.begin(), added.end(), indices.begin() + num_kept);
+         radix_sort_back_to_front(depths, indices, arena);
+      }
+      order.assign(indices.begin(), indices.end());
+   }
+};
+
+} // namespace fuake
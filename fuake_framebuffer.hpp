@@ -2,6 +2,7 @@
 
 #include <vector>
 #include <string>
+#include <algorithm>
 #include <amath_core.hpp>
 #include <amath_utils.hpp>
 
@@ -13,21 +14,95 @@ namespace fuake {
 
 struct FrameBufferMono {
    vector<u8> data;
+   vector<u8> rgba_data; // RGBA copy of data, kept around to avoid per-frame allocations
    Vec2 dims;
+   int width, height;
    size_t size;
 
    FrameBufferMono(Vec2 viewport_dimensions) : dims(viewport_dimensions) {
-      size = (size_t)dims.x() * (size_t)dims.y();
+      width = (int)dims.x();
+      height = (int)dims.y();
+      size = (size_t)width * (size_t)height;
       data = vector<u8>(size, 0);
+      rgba_data = vector<u8>(size * 4, 255);
    }
 
-   vector<u8> asRGB() {
-      vector<u8> rgba_data(size, 0);
+   void clear(u8 value = 0) { std::fill(data.begin(), data.end(), value); }
 
-      for (int i = 0; i < size; i += 4) {
-         
+   void clear(int x0, int y0, int x1, int y1, u8 value = 0) {
+      for (int y = y0; y < y1; y++) {
+         u8 *row = data.data() + (size_t)y * width;
+         std::fill(row + x0, row + x1, value);
       }
-      return rgba_data;
+   }
+
+   // Expand mono intensities to RGBA inside [x0, x1) x [y0, y1) (alpha is left at 255)
+   void to_rgba(int x0, int y0, int x1, int y1) {
+      for (int y = y0; y < y1; y++) {
+         const u8 *in = &data[(size_t)y * width + x0];
+         u8 *out = &rgba_data[((size_t)y * width + x0) * 4];
+         for (int x = x0; x < x1; x++, out += 4) out[0] = out[1] = out[2] = *in++;
+      }
+   }
+
+   const u8 *asRGBA() {
+      to_rgba(0, 0, width, height);
+      return rgba_data.data();
    }
 };
+
+struct FrameBufferRGBA {
+   vector<u8> data;
+   int width, height;
+   size_t size;
+
+   FrameBufferRGBA(Vec2 viewport_dimensions) {
+      width = (int)viewport_dimensions.x();
+      height = (int)viewport_dimensions.y();
+      size = (size_t)width * (size_t)height;
+      data = vector<u8>(size * 4, 255);
+   }
+
+   void clear(u8 r, u8 g, u8 b) {
+      for (size_t p = 0; p < size; p++) {
+         data[p * 4] = r;
+         data[p * 4 + 1] = g;
+         data[p * 4 + 2] = b;
+         data[p * 4 + 3] = 255;
+      }
+   }
+
+   void fill_span(int y, int x0, int x1, const u8 color[3]) {
+      u8 *out = &data[((size_t)y * width + x0) * 4];
+      for (int x = x0; x < x1; x++, out += 4) {
+         out[0] = color[0];
+         out[1] = color[1];
+         out[2] = color[2];
+      }
+   }
+};
+
+struct DepthBuffer {
+   vector<float> data;
+   int width, height;
+   size_t size;
+
+   DepthBuffer(Vec2 viewport_dimensions) {
+      width = (int)viewport_dimensions.x();
+      height = (int)viewport_dimensions.y();
+      size = (size_t)width * (size_t)height;
+      data = vector<float>(size, 1.f);
+   }
+
+   // Depth is stored as screen z ∈ [0,1], so clearing to 1 means "far plane"
+   void clear(float value = 1.f) { std::fill(data.begin(), data.end(), value); }
+
+   void clear(int x0, int y0, int x1, int y1, float value = 1.f) {
+      for (int y = y0; y < y1; y++) {
+         float *row = data.data() + (size_t)y * width;
+         std::fill(row + x0, row + x1, value);
+      }
+   }
+};
+
 } // namespace fuake
\ No newline at end of file
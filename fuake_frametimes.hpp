@@ -0,0 +1,39 @@
+#pragma once
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+using std::vector;
+
+namespace fuake {
+
+// Distribution of a run's frame times, in milliseconds
+struct FrameTimeStats {
+   size_t frames = 0;
+   double mean = 0, p50 = 0, p95 = 0, p99 = 0, max = 0;
+};
+
+// Nearest-rank percentile `p` ∈ [0, 100] of `sorted` frame times
+double percentile(const vector<double> &sorted, double p) {
+   if (sorted.empty()) return 0;
+   size_t rank = (size_t)ceil(p / 100 * sorted.size());
+   return sorted[std::min(std::max(rank, (size_t)1), sorted.size()) - 1];
+}
+
+FrameTimeStats summarize_frame_times(vector<double> frame_ms) {
+   FrameTimeStats stats;
+   if (frame_ms.empty()) return stats;
+
+   std::sort(frame_ms.begin(), frame_ms.end());
+   stats.frames = frame_ms.size();
+   for (double ms : frame_ms) stats.mean += ms;
+   stats.mean /= frame_ms.size();
+   stats.p50 = percentile(frame_ms, 50);
+   stats.p95 = percentile(frame_ms, 95);
+   stats.p99 = percentile(frame_ms, 99);
+   stats.max = frame_ms.back();
+   return stats;
+}
+
+} // namespace fuake
@@ -1,10 +1,12 @@
 #pragma once
 
 #include <esat_extra/imgui.h>
+#include "fuake_arena.hpp"
 #include "fuake_render.hpp"
 #include "fuake_settings.hpp"
 #include "fuake_utils.hpp"
 #include "fuake_fpsmeter.hpp"
+#include "fuake_profiler.hpp"
 
 namespace fuake {
 
@@ -23,7 +25,8 @@ string join_strings_with_zeros(vector<string> string_sequence) {
 
 void ImGuiSpacer() { ImGui::Dummy(ImVec2(0.0f, 10.0f)); }
 
-void DrawGui(RenderContext &ctxt, FuakeSettings &settings, FPSMeter &fps_meter, Camera &camera) {
+void DrawGui(RenderContext &ctxt, FuakeSettings &settings, FPSMeter &fps_meter, Camera &camera,
+             const CullStats &cull_stats) {
 
    ImGui::Begin("FUAKE RENDERING OPTIONS");
 
@@ -45,13 +48,60 @@ void DrawGui(RenderContext &ctxt, FuakeSettings &settings, FPSMeter &fps_meter,
       ImGui::Text("FPS: %.2f", fps_meter.fps);
       ImGui::Text("Frame counter: %d", fps_meter.frame_counter);
       ImGui::Text("Window length: %d", fps_meter.window_length);
+      ImGui::Text("Transform kernel: %s", TRANSFORM_KERNEL_NAMES[transform_kernel_idx]);
+      ImGui::Text("Clusters tested: %zu", cull_stats.clusters_tested);
+      ImGui::Text("Clusters frustum culled: %zu", cull_stats.clusters_frustum_culled);
+      ImGui::Text("Clusters occluded: %zu", cull_stats.clusters_occluded);
+      ImGui::Text("Occluder triangles: %zu", cull_stats.occluder_triangles);
+      ImGui::Text("Meshlets tested: %zu", cull_stats.meshlets_tested);
+      ImGui::Text("Meshlets backfacing: %zu", cull_stats.meshlets_backfacing);
+      ImGui::Text("Meshlets frustum culled: %zu", cull_stats.meshlets_frustum_culled);
+      ImGui::Text("Frame arena: %zu / %zu KB",
+                  frame_arena().frame_bytes / 1024,
+                  frame_arena().capacity() / 1024);
 
       ImGui::TreePop();
    }
    ImGuiSpacer();
 
+   if (ImGui::TreeNodeEx("Profiler", ImGuiTreeNodeFlags_DefaultOpen)) {
+#if FUAKE_PROFILE
+      Profiler &prof = profiler();
+      ImGui::Text("%-24s %8s %8s %6s", "Scope", "Last ms", "Avg ms", "Calls");
+      for (auto &zone : prof.zones) {
+         if (zone.last_calls == 0) continue;
+         ImGui::Text("%*s%-*s %8.3f %8.3f %6u",
+                     zone.depth * 2,
+                     "",
+                     24 - zone.depth * 2,
+                     zone.name,
+                     zone.last_ms,
+                     zone.average_ms,
+                     zone.last_calls);
+      }
+      ImGuiSpacer();
+      for (int c = 0; c < kNumProfileCounters; c++)
+         ImGui::Text(
+             "%s: %llu", PROFILE_COUNTER_NAMES[c], (unsigned long long)prof.last_counters[c]);
+      if (prof.last_dropped_events)
+         ImGui::Text("Scopes dropped, over %zu: %zu",
+                     Profiler::kMaxFrameEvents,
+                     prof.last_dropped_events);
+
+      if (prof.capturing())
+         ImGui::Text("Capturing trace, %zu frames left", prof.capture_frames_left);
+      else if (ImGui::Button("Capture trace (120 frames)"))
+         prof.start_capture("fuake_trace.json", 120);
+#else
+      ImGui::Text("Built with FUAKE_PROFILE=0");
+#endif
+      ImGui::TreePop();
+   }
+   ImGuiSpacer();
+
    if (ImGui::TreeNodeEx("3D model selection", ImGuiTreeNodeFlags_DefaultOpen)) {
-      ImGui::Combo("Type:", (int *)&settings.model_group, MODEL_GROUPS, 2, 2);
+      ImGui::Combo(
+          "Type:", (int *)&settings.model_group, MODEL_GROUPS, kNumModelGroups, kNumModelGroups);
 
       string list_objects = join_strings_with_zeros(settings.model_names[settings.model_group]);
 
@@ -81,8 +131,13 @@ void DrawGui(RenderContext &ctxt, FuakeSettings &settings, FPSMeter &fps_meter,
 
       ImGui::Checkbox("Color by depth", &ctxt.color_by_depth);
 
+      ImGui::Checkbox("Map lights (point lights of light entities)", &ctxt.map_lights);
+      ImGui::Checkbox("Baked lightmaps (built by bake_lightmaps)", &ctxt.baked_lighting);
+
       ImGui::Checkbox("Show normals", &ctxt.show_normals);
 
+      ImGui::Checkbox("Show triangulation diagonals", &ctxt.show_diagonals);
+
       ImGui::Checkbox("Swap axes (for Quake OBJ files)", &settings.exchange_axes);
 
       ImGui::TreePop();
@@ -93,7 +148,14 @@ void DrawGui(RenderContext &ctxt, FuakeSettings &settings, FPSMeter &fps_meter,
 
       ImGui::Checkbox("Backface culling", &ctxt.backface_culling);
       ImGui::Checkbox("Z sorting", &ctxt.z_sorting);
+      ImGui::Checkbox("Z sorting by BSP (else by depth)", &ctxt.bsp_sorting);
       ImGui::Checkbox("Viewport culling", &ctxt.viewport_culling);
+      ImGui::Checkbox("Frustum culling (BVH)", &ctxt.frustum_culling);
+      ImGui::Checkbox("Clip to guard band", &ctxt.clip_sides);
+      ImGui::Checkbox("Potentially visible set (maps)", &ctxt.use_pvs);
+      ImGui::Checkbox("Occlusion culling (HiZ)", &ctxt.occlusion_culling);
+      ImGui::Checkbox("Meshlet culling (cones, spheres)", &ctxt.meshlet_culling);
+      ImGui::DragInt("Occluder triangles", &ctxt.occluder_budget, 64, 0, 65536);
 
       ImGui::TreePop();
    }
@@ -0,0 +1,192 @@
+#pragma once
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include <amath_core.hpp>
+#include <amath_utils.hpp>
+
+#include "fuake_clip.hpp"
+#include "fuake_transform.hpp"
+
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+/* Hierarchical depth buffer for occlusion culling. Level 0 is the screen downscaled by
+   `downscale`, and every texel holds the farthest depth (z ∈ [0,1] after the divide) of the
+   occluders fully covering it, 1 where there are none. Each next level halves the size keeping
+   the farthest of its 4 texels, so a box can be tested against a few texels of the level that
+   matches its size on screen. Conservative: only covered texels are written, with the farthest
+   depth of the occluder over them, so boxes are only rejected when really hidden */
+struct HiZBuffer {
+   int downscale;
+   vector<int> widths, heights;
+   vector<vector<float>> levels;
+
+   MatrixRows obj2clip = MatrixRows(Mat4());  // Of the current frame, set by clear()
+   MatrixRows viewport = MatrixRows(Mat4());  // Viewport scaled down to level 0
+
+   HiZBuffer(Vec2 dimensions, int downscale = 4) : downscale(downscale) {
+      int width = std::max(1, (int)dimensions.x() / downscale);
+      int height = std::max(1, (int)dimensions.y() / downscale);
+      while (true) {
+         widths.push_back(width);
+         heights.push_back(height);
+         levels.emplace_back((size_t)width * height, 1.f);
+         if (width == 1 && height == 1) break;
+         width = (width + 1) / 2;
+         height = (height + 1) / 2;
+      }
+   }
+
+   int width() const { return widths[0]; }
+   int height() const { return heights[0]; }
+
+   // Start a frame: forget the occluders and take the frame's matrices
+   void clear(const Mat4 &obj2clip_mat, const Mat4 &viewport_mat) {
+      std::fill(levels[0].begin(), levels[0].end(), 1.f);
+      obj2clip = MatrixRows(obj2clip_mat);
+      Mat4 scale = Mat4::transform({0, 0, 0}, {1.f / downscale, 1.f / downscale, 1}, {0, 0, 0});
+      viewport = MatrixRows(scale * viewport_mat);
+   }
+
+   // Write an occluder triangle given in clip space, clipping it first if it needs to
+   void add_occluder(const ClipVertex &a, const ClipVertex &b, const ClipVertex &c) {
+      u8 code_a = clip_code(a.x, a.y, a.z, a.w, 1);
+      u8 code_b = clip_code(b.x, b.y, b.z, b.w, 1);
+      u8 code_c = clip_code(c.x, c.y, c.z, c.w, 1);
+      if (code_a & code_b & code_c) return;
+
+      ClipPolygon poly;
+      poly.v[0] = a;
+      poly.v[1] = b;
+      poly.v[2] = c;
+      poly.count = 3;
+      u8 crossed = code_a | code_b | code_c;
+      if (crossed && !clip_polygon(poly, crossed, 1)) return;
+
+      Vec4 screen[kMaxClipVertices];
+      for (int n = 0; n < poly.count; n++) screen[n] = project_clip_vertex(poly.v[n], viewport);
+      for (int n = 2; n < poly.count; n++) rasterize_occluder(screen[0], screen[n - 1], screen[n]);
+   }
+
+   // Conservative raster into level 0: texels entirely inside the triangle get its farthest depth
+   void rasterize_occluder(Vec4 v0, Vec4 v1, Vec4 v2) {
+      float area = (v1.x() - v0.x()) * (v2.y() - v0.y()) - (v2.x() - v0.x()) * (v1.y() - v0.y());
+      if (area == 0 || area != area) return;
+      if (area < 0) {
+         std::swap(v1, v2);
+         area = -area;
+      }
+
+      float min_x = std::min(v0.x(), std::min(v1.x(), v2.x()));
+      float max_x = std::max(v0.x(), std::max(v1.x(), v2.x()));
+      float min_y = std::min(v0.y(), std::min(v1.y(), v2.y()));
+      float max_y = std::max(v0.y(), std::max(v1.y(), v2.y()));
+      int x0 = std::max(0, (int)floorf(min_x)), x1 = std::min(width(), (int)ceilf(max_x));
+      int y0 = std::max(0, (int)floorf(min_y)), y1 = std::min(height(), (int)ceilf(max_y));
+      if (x0 >= x1 || y0 >= y1) return;
+
+      // Edge functions E = a * x + b * y + c, >= 0 inside. Their minimum over a texel is at its
+      // center minus half the gradient's L1 norm, likewise the depth plane's maximum
+      const Vec4 *verts[3] = {&v0, &v1, &v2};
+      float ea[3], eb[3], ec[3];
+      for (int e = 0; e < 3; e++) {
+         const Vec4 &p = *verts[e], &q = *verts[(e + 1) % 3];
+         ea[e] = -(q.y() - p.y());
+         eb[e] = q.x() - p.x();
+         ec[e] = -(ea[e] * p.x() + eb[e] * p.y()) - 0.5f * (fabsf(ea[e]) + fabsf(eb[e]));
+      }
+
+      float inv_area = 1.f / area;
+      float e1x = v1.x() - v0.x(), e1y = v1.y() - v0.y();
+      float e2x = v2.x() - v0.x(), e2y = v2.y() - v0.y();
+      float dz_dx = ((v1.z() - v0.z()) * e2y - (v2.z() - v0.z()) * e1y) * inv_area;
+      float dz_dy = ((v2.z() - v0.z()) * e1x - (v1.z() - v0.z()) * e2x) * inv_area;
+      float z_origin = v0.z() - dz_dx * v0.x() - dz_dy * v0.y() +
+                       0.5f * (fabsf(dz_dx) + fabsf(dz_dy));
+
+      // Solve the edge functions for the span of covered texel centers of each row
+      vector<float> &depth = levels[0];
+      for (int py = y0; py < y1; py++) {
+         float cy = py + 0.5f;
+         float span_min = x0 + 0.5f, span_max = x1 - 0.5f;
+         for (int e = 0; e < 3; e++) {
+            float rest = eb[e] * cy + ec[e];
+            if (ea[e] > 0) span_min = std::max(span_min, -rest / ea[e]);
+            else if (ea[e] < 0) span_max = std::min(span_max, -rest / ea[e]);
+            else if (rest < 0) span_max = -1;
+         }
+         if (span_min > span_max) continue;
+
+         int px0 = (int)ceilf(span_min - 0.5f), px1 = (int)floorf(span_max - 0.5f);
+         float *row = &depth[(size_t)py * width()];
+         float z_row = z_origin + dz_dy * cy + dz_dx * 0.5f;
+         for (int px = px0; px <= px1; px++) row[px] = std::min(row[px], z_row + dz_dx * px);
+      }
+   }
+
+   // Build every level above 0 after adding the occluders
+   void build_pyramid() {
+      for (size_t l = 1; l < levels.size(); l++) {
+         const vector<float> &src = levels[l - 1];
+         int src_w = widths[l - 1], src_h = heights[l - 1];
+         for (int y = 0; y < heights[l]; y++) {
+            for (int x = 0; x < widths[l]; x++) {
+               int sx = x * 2, sy = y * 2;
+               int sx1 = std::min(sx + 1, src_w - 1), sy1 = std::min(sy + 1, src_h - 1);
+               const float *row0 = &src[(size_t)sy * src_w], *row1 = &src[(size_t)sy1 * src_w];
+               levels[l][(size_t)y * widths[l] + x] =
+                   std::max(std::max(row0[sx], row0[sx1]), std::max(row1[sx], row1[sx1]));
+            }
+         }
+      }
+   }
+
+   // Whether the object space box is completely behind the occluders
+   bool occluded(const Vec3 &bounds_min, const Vec3 &bounds_max) const {
+      const float *m = obj2clip.m;
+      float min_x = 1e30f, max_x = -1e30f, min_y = 1e30f, max_y = -1e30f, min_z = 1e30f;
+      for (int corner = 0; corner < 8; corner++) {
+         float p[3] = {corner & 1 ? bounds_max.x() : bounds_min.x(),
+                       corner & 2 ? bounds_max.y() : bounds_min.y(),
+                       corner & 4 ? bounds_max.z() : bounds_min.z()};
+         float clip[4];
+         for (int row = 0; row < 4; row++)
+            clip[row] = m[row * 4] * p[0] + m[row * 4 + 1] * p[1] + m[row * 4 + 2] * p[2] +
+                        m[row * 4 + 3];
+
+         // Boxes reaching the near plane can't be projected, and can't be hidden either
+         if (clip[2] < 0 || clip[3] <= 0) return false;
+
+         Vec4 screen = project_clip_vertex({clip[0], clip[1], clip[2], clip[3], 0}, viewport);
+         min_x = std::min(min_x, screen.x());
+         max_x = std::max(max_x, screen.x());
+         min_y = std::min(min_y, screen.y());
+         max_y = std::max(max_y, screen.y());
+         min_z = std::min(min_z, screen.z());
+      }
+
+      int x0 = std::max(0, (int)floorf(min_x)), x1 = std::min(width() - 1, (int)floorf(max_x));
+      int y0 = std::max(0, (int)floorf(min_y)), y1 = std::min(height() - 1, (int)floorf(max_y));
+      if (x0 > x1 || y0 > y1) return false; // Off-screen, that's for frustum culling
+
+      // Level where the box covers at most 2x2 texels
+      size_t level = 0;
+      while (level + 1 < levels.size() && ((x1 >> level) - (x0 >> level) > 1 ||
+                                           (y1 >> level) - (y0 >> level) > 1))
+         level++;
+
+      const vector<float> &depth = levels[level];
+      int width = widths[level];
+      for (int y = y0 >> level; y <= y1 >> level; y++)
+         for (int x = x0 >> level; x <= x1 >> level; x++)
+            if (min_z <= depth[(size_t)y * width + x]) return false;
+      return true;
+   }
+};
+
+} // namespace fuake
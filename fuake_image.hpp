@@ -0,0 +1,120 @@
+#pragma once
+
+#include <cstdio>
+#include <vector>
+#include <string>
+#include <fstream>
+#include <cctype>
+#include <algorithm>
+
+#include <amath_core.hpp>
+
+using std::string;
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+// Binary PPM (P6) of an RGBA image, alpha is dropped
+bool write_ppm(const string &filepath, const u8 *rgba, int width, int height) {
+   std::ofstream fs(filepath, std::ios::binary | std::ios::trunc);
+   if (!fs) return false;
+   fs << "P6\n" << width << " " << height << "\n255\n";
+
+   vector<u8> row((size_t)width * 3);
+   for (int y = 0; y < height; y++) {
+      const u8 *in = rgba + (size_t)y * width * 4;
+      for (int x = 0; x < width; x++) {
+         row[x * 3] = in[x * 4];
+         row[x * 3 + 1] = in[x * 4 + 1];
+         row[x * 3 + 2] = in[x * 4 + 2];
+      }
+      fs.write((const char *)row.data(), row.size());
+   }
+   return (bool)fs;
+}
+
+u32 crc32(const u8 *data, size_t size, u32 crc = 0) {
+   static u32 table[256];
+   static bool table_ready = false;
+   if (!table_ready) {
+      for (u32 n = 0; n < 256; n++) {
+         u32 c = n;
+         for (int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320u ^ (c >> 1) : c >> 1;
+         table[n] = c;
+      }
+      table_ready = true;
+   }
+
+   crc = ~crc;
+   for (size_t i = 0; i < size; i++) crc = table[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+   return ~crc;
+}
+
+/* 8-bit RGBA PNG. The pixels go in stored (uncompressed) deflate blocks, which keeps this free of
+   zlib at the cost of larger files: it's meant for test and benchmark output */
+bool write_png(const string &filepath, const u8 *rgba, int width, int height) {
+   auto put_u32 = [](vector<u8> &out, u32 value) {
+      for (int shift = 24; shift >= 0; shift -= 8) out.push_back((u8)(value >> shift));
+   };
+
+   // Scanlines, each with filter type 0 (none) in front
+   size_t row_bytes = (size_t)width * 4;
+   vector<u8> raw;
+   raw.reserve((row_bytes + 1) * height);
+   for (int y = 0; y < height; y++) {
+      raw.push_back(0);
+      raw.insert(raw.end(), rgba + y * row_bytes, rgba + (y + 1) * row_bytes);
+   }
+
+   // zlib stream: header, stored blocks of up to 65535 bytes, Adler-32 of the raw data
+   vector<u8> zlib = {0x78, 0x01};
+   size_t at = 0;
+   do {
+      size_t len = std::min(raw.size() - at, (size_t)0xFFFF);
+      zlib.push_back(at + len == raw.size() ? 1 : 0);
+      zlib.insert(zlib.end(), {(u8)len, (u8)(len >> 8), (u8)~len, (u8)(~len >> 8)});
+      zlib.insert(zlib.end(), raw.begin() + at, raw.begin() + at + len);
+      at += len;
+   } while (at < raw.size());
+   u32 a = 1, b = 0;
+   for (u8 byte : raw) {
+      a = (a + byte) % 65521;
+      b = (b + a) % 65521;
+   }
+   put_u32(zlib, (b << 16) | a);
+
+   vector<u8> png = {0x89, 'P', 'N', 'G', '\r', '\n', 0x1A, '\n'};
+   auto chunk = [&](const char *type, const vector<u8> &data) {
+      put_u32(png, (u32)data.size());
+      size_t type_at = png.size();
+      png.insert(png.end(), type, type + 4);
+      png.insert(png.end(), data.begin(), data.end());
+      put_u32(png, crc32(&png[type_at], png.size() - type_at));
+   };
+
+   vector<u8> header;
+   put_u32(header, width);
+   put_u32(header, height);
+   header.insert(header.end(), {8, 6, 0, 0, 0}); // 8 bits, RGBA, deflate, no filter, no interlace
+   chunk("IHDR", header);
+   chunk("IDAT", zlib);
+   chunk("IEND", {});
+
+   std::ofstream fs(filepath, std::ios::binary | std::ios::trunc);
+   if (!fs) return false;
+   fs.write((const char *)png.data(), png.size());
+   return (bool)fs;
+}
+
+// PNG or PPM depending on the extension of `filepath`
+bool write_image(const string &filepath, const u8 *rgba, int width, int height) {
+   string ext = filepath.substr(std::min(filepath.size(), filepath.rfind('.')));
+   for (auto &c : ext) c = (char)tolower(c);
+   if (ext == ".png") return write_png(filepath, rgba, width, height);
+   if (ext == ".ppm") return write_ppm(filepath, rgba, width, height);
+   printf("WARNING: Unknown image format %s, use .png or .ppm\n", filepath.c_str());
+   return false;
+}
+
+} // namespace fuake
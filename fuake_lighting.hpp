@@ -2,9 +2,14 @@
 
 #include <vector>
 #include <string>
+#include <cstdint>
 #include <amath_core.hpp>
 #include <amath_utils.hpp>
 
+#include "fuake_arena.hpp"
+#include "fuake_transform.hpp"
+#include "fuake_trimesh.hpp"
+
 using std::string;
 using std::vector;
 using namespace amath;
@@ -17,12 +22,400 @@ enum LightType {
    kLightType_Diffuse
 };
 
+// Light levels out of 255: the fixed sun's ambient and directional shares, and the ambient left
+// when a map's own lights are on
+const float kAmbientLight = 100, kDirectionalLight = 155, kMapAmbientLight = 32;
+
+/* Point lights fade linearly, intensity * (1 - distance / radius), as in Quake's light tool. They
+   are placed in the space of the meshes they light */
 struct Light {
 
    LightType type;
    Vec4 direction;
+   Vec3 position;       // Point lights
+   float intensity = 0; // Point lights, out of 255 at the light itself
+   float radius = 0;
 
    Light(LightType type, Vec4 direction) : direction(direction), type(type) {}
+   Light(Vec3 position, float intensity, float radius)
+       : type(kLightType_Point), position(position), intensity(intensity), radius(radius) {}
+};
+
+// Light reaching a point with unit normal (nx, ny, nz) from a point light (dx, dy, dz) away
+inline float point_light(const Light &light, float dx, float dy, float dz, float nx, float ny,
+                         float nz) {
+   float distance = sqrtf(dx * dx + dy * dy + dz * dz);
+   float falloff = std::max(0.f, 1 - distance / light.radius);
+   float lambert = std::max(0.f, dx * nx + dy * ny + dz * nz) / std::max(distance, 1E-6f);
+   return lambert * falloff * light.intensity;
+}
+
+/* Point lights near each cluster of a mesh: the blocks of kClusterSize consecutive vertices, and
+   of faces. build_bvh() orders both spatially, so a cluster's bounding box is small and lists
+   only the few lights whose sphere touches it. Map lights don't move, so they're built once */
+struct LightClusters {
+   static const u32 kClusterSize = 64;
+
+   vector<u32> vertex_first, vertex_lights; // Lights of vertex cluster c from vertex_first[c] on
+   vector<u32> face_first, face_lights;     // Same for face clusters
+
+   Span<const u32> vertex_cluster(size_t c) const {
+      return {vertex_lights.data() + vertex_first[c], vertex_first[c + 1] - vertex_first[c]};
+   }
+   Span<const u32> face_cluster(size_t c) const {
+      return {face_lights.data() + face_first[c], face_first[c + 1] - face_first[c]};
+   }
+};
+
+// Point lights of a scene, with the clusters of each of its meshes
+struct PointLights {
+   vector<Light> lights;
+   vector<LightClusters> clusters; // One per mesh
+
+   bool empty() const { return lights.empty(); }
+};
+
+/* A lightmap as the rasterizer samples it: a point p of the face is at luxel coordinates
+   u = dot(p, s) + s_offset and v = dot(p, t) + t_offset, luxel (i, j) being at (i, j) */
+struct FaceLightmap {
+   Vec3 s, t; // Texture axes over the luxel size
+   float s_offset, t_offset;
+   u32 width, height;    // Luxels along u and v
+   uint64_t first_luxel; // width * height luxels in BakedLighting::luxels, rows along u
 };
 
+/* Static lighting of a map's meshes from its baked lightmaps, loaded with it (see
+   fuake_lightmap.hpp). Faces on a lightmap surface are lit per pixel from its luxels. Every vertex
+   and face also gets an intensity out of 255 sampled from them, for the flat renderer and the
+   faces on no surface. Either way it's used as is in place of any light, only scaled for depth
+   coloring */
+struct BakedLighting {
+   static constexpr u32 kNoLightmap = UINT32_MAX;
+
+   vector<vector<float>> vertex, face; // One of each per mesh, empty without lightmaps
+   vector<vector<u32>> face_lightmap;  // Per mesh, the lightmap of every face or kNoLightmap
+   vector<FaceLightmap> lightmaps;
+   vector<u8> luxels;
+
+   bool empty() const { return vertex.empty(); }
+};
+
+// Append the point lights whose sphere touches the box to `out`
+void append_lights_touching(const vector<Light> &lights, const Vec3 &bounds_min,
+                            const Vec3 &bounds_max, vector<u32> &out) {
+   for (u32 l = 0; l < lights.size(); l++) {
+      const Light &light = lights[l];
+      if (light.type != kLightType_Point) continue;
+      float distance2 = 0;
+      for (int axis = 0; axis < 3; axis++) {
+         float d = std::max(bounds_min[axis] - light.position[axis],
+                            std::max(0.f, light.position[axis] - bounds_max[axis]));
+         distance2 += d * d;
+      }
+      if (distance2 < light.radius * light.radius) out.push_back(l);
+   }
+}
+
+// Clusters of `mesh` (in its final, BVH order) and the point lights among `lights` reaching them
+LightClusters build_light_clusters(const TriMesh &mesh, const vector<Light> &lights) {
+   const u32 size = LightClusters::kClusterSize;
+   LightClusters clusters;
+   clusters.vertex_first.push_back(0);
+   for (size_t begin = 0; begin < mesh.num_vertices; begin += size) {
+      Vec3 bounds_min = mesh.position((u32)begin), bounds_max = bounds_min;
+      for (size_t v = begin; v < std::min(begin + size, mesh.num_vertices); v++) {
+         Vec3 p = mesh.position((u32)v);
+         for (int axis = 0; axis < 3; axis++) {
+            bounds_min[axis] = std::min(bounds_min[axis], p[axis]);
+            bounds_max[axis] = std::max(bounds_max[axis], p[axis]);
+         }
+      }
+      append_lights_touching(lights, bounds_min, bounds_max, clusters.vertex_lights);
+      clusters.vertex_first.push_back((u32)clusters.vertex_lights.size());
+   }
+
+   clusters.face_first.push_back(0);
+   for (size_t begin = 0; begin < mesh.num_triangles; begin += size) {
+      u32 idx[3];
+      mesh.triangle(begin, idx);
+      Vec3 bounds_min = mesh.position(idx[0]), bounds_max = bounds_min;
+      for (size_t f = begin; f < std::min(begin + size, mesh.num_triangles); f++) {
+         mesh.triangle(f, idx);
+         for (int n = 0; n < 3; n++) {
+            Vec3 p = mesh.position(idx[n]);
+            for (int axis = 0; axis < 3; axis++) {
+               bounds_min[axis] = std::min(bounds_min[axis], p[axis]);
+               bounds_max[axis] = std::max(bounds_max[axis], p[axis]);
+            }
+         }
+      }
+      append_lights_touching(lights, bounds_min, bounds_max, clusters.face_lights);
+      clusters.face_first.push_back((u32)clusters.face_lights.size());
+   }
+   return clusters;
+}
+
+// Light of `lights` at a point of face `face` of the clustered mesh with unit `normal`
+float point_lights_at(const LightClusters &clusters, const vector<Light> &lights, size_t face,
+                      const Vec3 &point, const Vec3 &normal) {
+   float sum = 0;
+   for (u32 l : clusters.face_cluster(face / LightClusters::kClusterSize)) {
+      const Light &light = lights[l];
+      Vec3 d = light.position - point;
+      // Most lights of the cluster are out of reach or behind this face
+      if (dot_product(d, d) >= light.radius * light.radius || dot_product(d, normal) <= 0) continue;
+      sum += point_light(light, d.x(), d.y(), d.z(), normal.x(), normal.y(), normal.z());
+   }
+   return sum;
+}
+
+/* Per-frame constants of vertex lighting: intensity = (max(0, light . normal) * directional +
+   ambient) * (depth_offset + depth_scale * view z), where normal is the unit `normal_to_view`
+   (row major 3x3) times the object space normal. `light` is in view space with the normal sign
+   folded in. The depth factor is 1 without depth coloring. With add_to_out, what the output
+   already holds (the point lights) is added to the ambient */
+struct VertexLighting {
+   float normal_to_view[9];
+   float light[3];
+   float ambient, directional;
+   float depth_offset = 1, depth_scale = 0;
+   bool add_to_out = false;
+};
+
+/* Light `count` vertices with normals stored as int16 (any scale, they're normalized after the
+   transform) and view space depths `view_z`, into `out`. Zero normals only get the ambient */
+typedef void (*LightingKernel)(const VertexLighting &lighting, const int16_t *nx,
+                               const int16_t *ny, const int16_t *nz, const float *view_z,
+                               size_t count, float *out);
+
+void light_vertices_scalar(const VertexLighting &lighting, const int16_t *nx, const int16_t *ny,
+                           const int16_t *nz, const float *view_z, size_t count, float *out) {
+   const float *m = lighting.normal_to_view;
+   const float *l = lighting.light;
+   for (size_t i = 0; i < count; i++) {
+      float px = nx[i], py = ny[i], pz = nz[i];
+      float tx = m[0] * px + m[1] * py + m[2] * pz;
+      float ty = m[3] * px + m[4] * py + m[5] * pz;
+      float tz = m[6] * px + m[7] * py + m[8] * pz;
+      float length = sqrtf(std::max(tx * tx + ty * ty + tz * tz, 1E-30f));
+      float d = std::max(0.f, l[0] * tx + l[1] * ty + l[2] * tz) / length;
+      float depth = lighting.depth_offset + lighting.depth_scale * view_z[i];
+      float ambient = lighting.ambient + (lighting.add_to_out ? out[i] : 0);
+      out[i] = (d * lighting.directional + ambient) * depth;
+   }
+}
+
+#ifdef FUAKE_X86
+
+// 4 or 8 signed 16-bit values as floats
+inline __m128 load4(const int16_t *p) {
+   __m128i packed = _mm_loadl_epi64((const __m128i *)p);
+   return _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(packed, packed), 16));
+}
+FUAKE_TARGET_AVX2 inline __m256 load8(const int16_t *p) {
+   return _mm256_cvtepi32_ps(_mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *)p)));
+}
+
+void light_vertices_sse(const VertexLighting &lighting, const int16_t *nx, const int16_t *ny,
+                        const int16_t *nz, const float *view_z, size_t count, float *out) {
+   __m128 m[9], l[3];
+   for (int i = 0; i < 9; i++) m[i] = _mm_set1_ps(lighting.normal_to_view[i]);
+   for (int i = 0; i < 3; i++) l[i] = _mm_set1_ps(lighting.light[i]);
+   const __m128 ambient = _mm_set1_ps(lighting.ambient);
+   const __m128 directional = _mm_set1_ps(lighting.directional);
+   const __m128 depth_offset = _mm_set1_ps(lighting.depth_offset);
+   const __m128 depth_scale = _mm_set1_ps(lighting.depth_scale);
+   const __m128 min_length2 = _mm_set1_ps(1E-30f), zero = _mm_setzero_ps();
+
+   size_t i = 0;
+   for (; i + 4 <= count; i += 4) {
+      __m128 px = load4(nx + i), py = load4(ny + i), pz = load4(nz + i);
+      __m128 t[3];
+      for (int r = 0; r < 3; r++) {
+         t[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r * 3], px), _mm_mul_ps(m[r * 3 + 1], py)),
+                           _mm_mul_ps(m[r * 3 + 2], pz));
+      }
+      __m128 length2 = _mm_add_ps(_mm_add_ps(_mm_mul_ps(t[0], t[0]), _mm_mul_ps(t[1], t[1])),
+                                  _mm_mul_ps(t[2], t[2]));
+      __m128 length = _mm_sqrt_ps(_mm_max_ps(length2, min_length2));
+      __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(l[0], t[0]), _mm_mul_ps(l[1], t[1])),
+                            _mm_mul_ps(l[2], t[2]));
+      d = _mm_div_ps(_mm_max_ps(d, zero), length);
+      __m128 depth = _mm_add_ps(depth_offset, _mm_mul_ps(depth_scale, _mm_loadu_ps(view_z + i)));
+      __m128 base = lighting.add_to_out ? _mm_add_ps(ambient, _mm_loadu_ps(out + i)) : ambient;
+      _mm_storeu_ps(out + i, _mm_mul_ps(_mm_add_ps(_mm_mul_ps(d, directional), base), depth));
+   }
+   light_vertices_scalar(lighting, nx + i, ny + i, nz + i, view_z + i, count - i, out + i);
+}
+
+FUAKE_TARGET_AVX2 void light_vertices_avx2(const VertexLighting &lighting, const int16_t *nx,
+                                           const int16_t *ny, const int16_t *nz,
+                                           const float *view_z, size_t count, float *out) {
+   __m256 m[9], l[3];
+   for (int i = 0; i < 9; i++) m[i] = _mm256_set1_ps(lighting.normal_to_view[i]);
+   for (int i = 0; i < 3; i++) l[i] = _mm256_set1_ps(lighting.light[i]);
+   const __m256 ambient = _mm256_set1_ps(lighting.ambient);
+   const __m256 directional = _mm256_set1_ps(lighting.directional);
+   const __m256 depth_offset = _mm256_set1_ps(lighting.depth_offset);
+   const __m256 depth_scale = _mm256_set1_ps(lighting.depth_scale);
+   const __m256 min_length2 = _mm256_set1_ps(1E-30f), zero = _mm256_setzero_ps();
+
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8) {
+      __m256 px = load8(nx + i), py = load8(ny + i), pz = load8(nz + i);
+      __m256 t[3];
+      for (int r = 0; r < 3; r++) {
+         t[r] = _mm256_mul_ps(m[r * 3], px);
+         t[r] = _mm256_fmadd_ps(m[r * 3 + 1], py, t[r]);
+         t[r] = _mm256_fmadd_ps(m[r * 3 + 2], pz, t[r]);
+      }
+      __m256 length2 = _mm256_mul_ps(t[0], t[0]);
+      length2 = _mm256_fmadd_ps(t[1], t[1], length2);
+      length2 = _mm256_fmadd_ps(t[2], t[2], length2);
+      __m256 length = _mm256_sqrt_ps(_mm256_max_ps(length2, min_length2));
+      __m256 d = _mm256_mul_ps(l[0], t[0]);
+      d = _mm256_fmadd_ps(l[1], t[1], d);
+      d = _mm256_fmadd_ps(l[2], t[2], d);
+      d = _mm256_div_ps(_mm256_max_ps(d, zero), length);
+      __m256 depth = _mm256_fmadd_ps(depth_scale, _mm256_loadu_ps(view_z + i), depth_offset);
+      __m256 base =
+          lighting.add_to_out ? _mm256_add_ps(ambient, _mm256_loadu_ps(out + i)) : ambient;
+      _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_fmadd_ps(d, directional, base), depth));
+   }
+   light_vertices_scalar(lighting, nx + i, ny + i, nz + i, view_z + i, count - i, out + i);
+}
+
+#endif // FUAKE_X86
+
+// Index into TRANSFORM_KERNEL_NAMES, the same instruction sets as the transform kernels
+LightingKernel get_lighting_kernel(int kernel) {
+#ifdef FUAKE_X86
+   if (kernel == 2) return light_vertices_avx2;
+   if (kernel == 1) return light_vertices_sse;
+#endif
+   return light_vertices_scalar;
+}
+
+LightingKernel light_vertices_kernel = get_lighting_kernel(transform_kernel_idx);
+
+/* Add the light of a point light to `count` points with unit normals, in the light's space, into
+   `out`. Same as point_light(), a batch at a time */
+typedef void (*PointLightKernel)(const Light &light, const float *px, const float *py,
+                                 const float *pz, const float *nx, const float *ny,
+                                 const float *nz, size_t count, float *out);
+
+void add_point_light_scalar(const Light &light, const float *px, const float *py, const float *pz,
+                            const float *nx, const float *ny, const float *nz, size_t count,
+                            float *out) {
+   for (size_t i = 0; i < count; i++) {
+      out[i] += point_light(light,
+                            light.position.x() - px[i],
+                            light.position.y() - py[i],
+                            light.position.z() - pz[i],
+                            nx[i],
+                            ny[i],
+                            nz[i]);
+   }
+}
+
+#ifdef FUAKE_X86
+
+void add_point_light_sse(const Light &light, const float *px, const float *py, const float *pz,
+                         const float *nx, const float *ny, const float *nz, size_t count,
+                         float *out) {
+   const __m128 lx = _mm_set1_ps(light.position.x()), ly = _mm_set1_ps(light.position.y()),
+                lz = _mm_set1_ps(light.position.z());
+   const __m128 inv_radius = _mm_set1_ps(1 / light.radius);
+   const __m128 intensity = _mm_set1_ps(light.intensity);
+   const __m128 one = _mm_set1_ps(1.f), min_distance = _mm_set1_ps(1E-6f),
+                zero = _mm_setzero_ps();
+
+   size_t i = 0;
+   for (; i + 4 <= count; i += 4) {
+      __m128 dx = _mm_sub_ps(lx, _mm_loadu_ps(px + i)), dy = _mm_sub_ps(ly, _mm_loadu_ps(py + i)),
+             dz = _mm_sub_ps(lz, _mm_loadu_ps(pz + i));
+      __m128 distance = _mm_sqrt_ps(_mm_add_ps(
+          _mm_add_ps(_mm_mul_ps(dx, dx), _mm_mul_ps(dy, dy)), _mm_mul_ps(dz, dz)));
+      __m128 falloff = _mm_max_ps(zero, _mm_sub_ps(one, _mm_mul_ps(distance, inv_radius)));
+      __m128 d = _mm_add_ps(_mm_add_ps(_mm_mul_ps(dx, _mm_loadu_ps(nx + i)),
+                                       _mm_mul_ps(dy, _mm_loadu_ps(ny + i))),
+                            _mm_mul_ps(dz, _mm_loadu_ps(nz + i)));
+      __m128 lambert = _mm_div_ps(_mm_max_ps(d, zero), _mm_max_ps(distance, min_distance));
+      __m128 light_out = _mm_mul_ps(_mm_mul_ps(lambert, falloff), intensity);
+      _mm_storeu_ps(out + i, _mm_add_ps(_mm_loadu_ps(out + i), light_out));
+   }
+   add_point_light_scalar(
+       light, px + i, py + i, pz + i, nx + i, ny + i, nz + i, count - i, out + i);
+}
+
+FUAKE_TARGET_AVX2 void add_point_light_avx2(const Light &light, const float *px, const float *py,
+                                            const float *pz, const float *nx, const float *ny,
+                                            const float *nz, size_t count, float *out) {
+   const __m256 lx = _mm256_set1_ps(light.position.x()), ly = _mm256_set1_ps(light.position.y()),
+                lz = _mm256_set1_ps(light.position.z());
+   const __m256 inv_radius = _mm256_set1_ps(1 / light.radius);
+   const __m256 intensity = _mm256_set1_ps(light.intensity);
+   const __m256 one = _mm256_set1_ps(1.f), min_distance = _mm256_set1_ps(1E-6f),
+                zero = _mm256_setzero_ps();
+
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8) {
+      __m256 dx = _mm256_sub_ps(lx, _mm256_loadu_ps(px + i));
+      __m256 dy = _mm256_sub_ps(ly, _mm256_loadu_ps(py + i));
+      __m256 dz = _mm256_sub_ps(lz, _mm256_loadu_ps(pz + i));
+      __m256 distance2 = _mm256_mul_ps(dx, dx);
+      distance2 = _mm256_fmadd_ps(dy, dy, distance2);
+      distance2 = _mm256_fmadd_ps(dz, dz, distance2);
+      __m256 distance = _mm256_sqrt_ps(distance2);
+      __m256 falloff = _mm256_max_ps(zero, _mm256_fnmadd_ps(distance, inv_radius, one));
+      __m256 d = _mm256_mul_ps(dx, _mm256_loadu_ps(nx + i));
+      d = _mm256_fmadd_ps(dy, _mm256_loadu_ps(ny + i), d);
+      d = _mm256_fmadd_ps(dz, _mm256_loadu_ps(nz + i), d);
+      __m256 lambert =
+          _mm256_div_ps(_mm256_max_ps(d, zero), _mm256_max_ps(distance, min_distance));
+      __m256 light_out = _mm256_mul_ps(_mm256_mul_ps(lambert, falloff), intensity);
+      _mm256_storeu_ps(out + i, _mm256_add_ps(_mm256_loadu_ps(out + i), light_out));
+   }
+   add_point_light_scalar(
+       light, px + i, py + i, pz + i, nx + i, ny + i, nz + i, count - i, out + i);
+}
+
+#endif // FUAKE_X86
+
+PointLightKernel get_point_light_kernel(int kernel) {
+#ifdef FUAKE_X86
+   if (kernel == 2) return add_point_light_avx2;
+   if (kernel == 1) return add_point_light_sse;
+#endif
+   return add_point_light_scalar;
+}
+
+PointLightKernel add_point_light_kernel = get_point_light_kernel(transform_kernel_idx);
+
+/* Add the light of `lights` reaching vertices [begin, end) of `mesh`, in its space, to
+   out[0, end - begin). Each cluster only evaluates its own list. Returns the number of light and
+   vertex pairs evaluated */
+size_t add_point_lights(const TriMesh &mesh, const LightClusters &clusters,
+                        const vector<Light> &lights, size_t begin, size_t end, float *out) {
+   const u32 size = LightClusters::kClusterSize;
+   float px[size], py[size], pz[size], nx[size], ny[size], nz[size];
+   size_t evaluated = 0;
+   for (size_t c = begin / size; c * size < end; c++) {
+      Span<const u32> cluster = clusters.vertex_cluster(c);
+      if (cluster.empty()) continue;
+
+      // Positions and normals of the cluster's part of the range as floats, then light by light
+      size_t first = std::max(begin, c * size), count = std::min(end, (c + 1) * size) - first;
+      for (size_t i = 0; i < count; i++) {
+         Vec3 p = mesh.position((u32)(first + i)), n = mesh.normal((u32)(first + i));
+         px[i] = p.x(), py[i] = p.y(), pz[i] = p.z();
+         nx[i] = n.x(), ny[i] = n.y(), nz[i] = n.z();
+      }
+      for (u32 l : cluster)
+         add_point_light_kernel(lights[l], px, py, pz, nx, ny, nz, count, out + (first - begin));
+      evaluated += cluster.size() * count;
+   }
+   return evaluated;
+}
+
 } // namespace fuake
\ No newline at end of file
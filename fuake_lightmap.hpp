@@ -0,0 +1,641 @@
+#pragma once
+
+#include <math.h>
+#include <chrono>
+#include <vector>
+#include <string>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+#include <unordered_map>
+
+#include <amath_core.hpp>
+#include <amath_utils.hpp>
+
+#include "fuake_bvh.hpp"
+#include "fuake_lighting.hpp"
+#include "fuake_mapcompiler.hpp"
+#include "fuake_meshcache.hpp"
+#include "fuake_mmap.hpp"
+#include "fuake_profiler.hpp"
+#include "fuake_threadpool.hpp"
+
+using std::string;
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+/* .lightmap: direct lighting of a compiled map, baked offline next to the .MAP (see
+   bake_lightmaps.cpp). As in Quake, every brush face is a surface with a grid of luxels every
+   kLuxelSize units along its texture axes, lit by the map's light entities and shadowed by the
+   world's brushes. Layout: LightmapHeader, surfaces (LightmapSurfaceRecord), polygon vertices
+   (float x, y then z arrays), luxels (u8), every array at a 16 byte boundary. */
+const u32 kLightmapMagic = 0x504D4C46; // "FLMP"
+const u32 kLightmapVersion = 1;
+const float kLuxelSize = 16;
+
+struct LightmapHeader {
+   u32 magic;
+   u32 version;
+   u32 exchange_axes;
+   u32 reserved;
+
+   // Source MAP stamp, the lightmaps are stale when it doesn't match
+   uint64_t source_size;
+   int64_t source_mtime;
+   uint64_t source_hash;
+
+   u32 num_surfaces;
+   u32 num_vertices;
+   uint64_t num_luxels;
+};
+
+/* A brush face and its luxels, in the space of compile_map()'s meshes. Luxel (i, j) sits where
+   s = (mins[0] + i) * kLuxelSize and t = (mins[1] + j) * kLuxelSize on the plane, s and t being
+   dot products with the axes, so the grid covers the whole face */
+struct LightmapSurface {
+   Vec3 normal; // Unit, out of the brush
+   float dist;  // dot(normal, p) == dist on the face
+   Vec3 s_axis, t_axis;
+   int32_t mins[2];
+   u32 width, height;              // Luxels along s and t
+   u32 first_vertex, num_vertices; // Polygon in Lightmaps::vertices, counter-clockwise from outside
+   uint64_t first_luxel;           // width * height luxels in Lightmaps::luxels, rows along s
+
+   // Point of the plane at luxel coordinates (s, t): solves s_axis, t_axis and normal for p
+   Vec3 point_at(float s, float t) const {
+      Vec3 s_dual = cross_product(t_axis, normal), t_dual = cross_product(normal, s_axis);
+      float det = dot_product(s_axis, s_dual);
+      return (s_dual * s + t_dual * t + cross_product(s_axis, t_axis) * dist) * (1 / det);
+   }
+};
+
+// LightmapSurface as stored in the file
+struct LightmapSurfaceRecord {
+   float normal[3], dist;
+   float s_axis[3], t_axis[3];
+   int32_t mins[2];
+   u32 width, height;
+   u32 first_vertex, num_vertices;
+   uint64_t first_luxel;
+};
+
+struct Lightmaps {
+   vector<LightmapSurface> surfaces;
+   vector<Vec3> vertices;
+   vector<u8> luxels;
+
+   bool empty() const { return surfaces.empty(); }
+
+   // Bilinear sample of `surface`'s luxels at `p` (on its plane), clamped to the grid
+   float sample(const LightmapSurface &surface, const Vec3 &p) const {
+      float u = dot_product(p, surface.s_axis) / kLuxelSize - surface.mins[0];
+      float v = dot_product(p, surface.t_axis) / kLuxelSize - surface.mins[1];
+      u = std::max(0.f, std::min(u, (float)(surface.width - 1)));
+      v = std::max(0.f, std::min(v, (float)(surface.height - 1)));
+      u32 i0 = (u32)u, j0 = (u32)v;
+      u32 i1 = std::min(i0 + 1, surface.width - 1), j1 = std::min(j0 + 1, surface.height - 1);
+      float fu = u - i0, fv = v - j0;
+      const u8 *row0 = luxels.data() + surface.first_luxel + (size_t)j0 * surface.width;
+      const u8 *row1 = luxels.data() + surface.first_luxel + (size_t)j1 * surface.width;
+      float top = row0[i0] + (row0[i1] - row0[i0]) * fu;
+      float bottom = row1[i0] + (row1[i1] - row1[i0]) * fu;
+      return top + (bottom - top) * fv;
+   }
+};
+
+// Quake's Z-up coordinates to the renderer's, as compile_map() does with exchange_axes
+inline Vec3 exchange_quake_axes(const Vec3 &v) { return Vec3{v.x(), -v.z(), v.y()}; }
+
+/* Texture axes of a plane with unit `normal` in Quake's space, as qbsp's TextureAxisFromPlane()
+   picks them: the world axes across the nearest of floor, ceiling and the four wall directions.
+   Texture rotation and scale don't change where Quake's luxels go, so they're left out */
+void quake_texture_axes(const Vec3 &normal, Vec3 &s_axis, Vec3 &t_axis) {
+   static const float kBaseAxes[6][3][3] = {
+       {{0, 0, 1}, {1, 0, 0}, {0, -1, 0}},  // Floor
+       {{0, 0, -1}, {1, 0, 0}, {0, -1, 0}}, // Ceiling
+       {{1, 0, 0}, {0, 1, 0}, {0, 0, -1}},  // West wall
+       {{-1, 0, 0}, {0, 1, 0}, {0, 0, -1}}, // East wall
+       {{0, 1, 0}, {1, 0, 0}, {0, 0, -1}},  // South wall
+       {{0, -1, 0}, {1, 0, 0}, {0, 0, -1}}, // North wall
+   };
+   int best = 0;
+   float best_dot = 0;
+   for (int i = 0; i < 6; i++) {
+      const float *axis = kBaseAxes[i][0];
+      float d = normal.x() * axis[0] + normal.y() * axis[1] + normal.z() * axis[2];
+      if (d > best_dot) {
+         best_dot = d;
+         best = i;
+      }
+   }
+   const float(*axes)[3] = kBaseAxes[best];
+   s_axis = Vec3{axes[1][0], axes[1][1], axes[1][2]};
+   t_axis = Vec3{axes[2][0], axes[2][1], axes[2][2]};
+}
+
+// Nearest point of a convex `polygon` (counter-clockwise around `normal`) to `p` on its plane
+Vec3 closest_point_in_polygon(const Vec3 *polygon, u32 count, const Vec3 &normal, const Vec3 &p) {
+   bool inside = true;
+   for (u32 k = 0; k < count && inside; k++) {
+      const Vec3 &a = polygon[k], &b = polygon[(k + 1) % count];
+      inside = dot_product(p - a, cross_product(b - a, normal)) <= 0;
+   }
+   if (inside) return p;
+
+   Vec3 best = polygon[0];
+   float best_distance2 = INFINITY;
+   for (u32 k = 0; k < count; k++) {
+      const Vec3 &a = polygon[k], &b = polygon[(k + 1) % count];
+      Vec3 edge = b - a;
+      float length2 = dot_product(edge, edge);
+      float t = length2 > 0 ? std::max(0.f, std::min(1.f, dot_product(p - a, edge) / length2)) : 0;
+      Vec3 q = a + edge * t;
+      float distance2 = dot_product(p - q, p - q);
+      if (distance2 < best_distance2) {
+         best_distance2 = distance2;
+         best = q;
+      }
+   }
+   return best;
+}
+
+/* Triangles that block light, with a BVH for shadow rays. Quake's light tool only traces the
+   world, so doors, platforms and other brush entities don't cast shadows */
+struct ShadowCasters {
+   static const u32 kMaxLeafFaces = 8;
+
+   Mesh mesh; // In BVH order
+   BVH bvh;
+
+   explicit ShadowCasters(Mesh casters) : mesh(std::move(casters)) {
+      if (mesh.num_vertices.empty()) return;
+      mesh.calculate_offsets();
+      bvh = build_bvh(mesh, nullptr, kMaxLeafFaces);
+   }
+
+   // Whether a triangle crosses the segment from `from` to `to`, either side facing
+   bool blocked(const Vec3 &from, const Vec3 &to) const { return bvh.segment_hits(mesh, from, to); }
+};
+
+// What bake_lightmaps() did, per thread so luxels per second per thread can be told apart
+struct LightmapBakeStats {
+   vector<uint64_t> thread_luxels, thread_rays;
+   vector<double> thread_seconds; // Busy time of each thread
+   double seconds = 0;            // Wall time of the parallel bake
+
+   uint64_t luxels() const {
+      uint64_t total = 0;
+      for (auto n : thread_luxels) total += n;
+      return total;
+   }
+   uint64_t rays() const {
+      uint64_t total = 0;
+      for (auto n : thread_rays) total += n;
+      return total;
+   }
+};
+
+/* Bake the direct lighting of every brush face of `map` (brushes of any entity) from its light
+   entities: kMapAmbientLight plus each light that reaches a luxel unblocked by the world, with
+   the falloff of point_light(). Luxels are placed as qbsp and light do, then moved inside their
+   face if the grid overhangs it, so they don't sample the inside of a neighboring brush, and one
+   unit off the face. Faces are baked in parallel */
+Lightmaps bake_lightmaps(const QuakeMap &map, bool exchange_axes = true,
+                         LightmapBakeStats *stats = nullptr,
+                         ThreadPool &pool = default_thread_pool()) {
+   FUAKE_PROFILE_SCOPE("Bake lightmaps");
+   vector<Light> lights = compile_lights(map, exchange_axes);
+
+   vector<const QuakeBrush *> brushes;
+   vector<u8> brush_in_world;
+   for (size_t e = 0; e < map.entities.size(); e++) {
+      bool world = map.entities[e].get_property("classname") == "worldspawn";
+      for (const auto &brush : map.entities[e].brushes) {
+         brushes.push_back(&brush);
+         brush_in_world.push_back(world);
+      }
+   }
+   vector<Mesh> brush_meshes(brushes.size());
+   pool.parallel_ranges(brushes.size(), 64, [&](size_t begin, size_t end, size_t) {
+      for (size_t b = begin; b < end; b++) {
+         brush_meshes[b] = brushes[b]->to_mesh();
+         if (exchange_axes)
+            for (auto &v : brush_meshes[b].vertices) v = exchange_quake_axes(v);
+      }
+   });
+
+   // Every face of every brush is a surface, the world's are also fanned into shadow casters
+   Lightmaps lightmaps;
+   Mesh casters;
+   for (size_t b = 0; b < brushes.size(); b++) {
+      const Mesh &mesh = brush_meshes[b];
+      size_t first = 0;
+      for (size_t f = 0; f < mesh.num_vertices.size(); f++) {
+         const u32 *idx = &mesh.indices[first];
+         u32 count = mesh.num_vertices[f];
+         first += count;
+
+         Vec3 normal{0, 0, 0}; // Newell's method
+         for (u32 k = 0; k < count; k++) {
+            const Vec3 &a = mesh.vertices[idx[k]], &c = mesh.vertices[idx[(k + 1) % count]];
+            normal += cross_product(a, c);
+         }
+         if (normal.length() == 0) continue;
+
+         LightmapSurface surface;
+         surface.normal = normal.normalized();
+         surface.dist = dot_product(surface.normal, mesh.vertices[idx[0]]);
+         if (exchange_axes) {
+            // Axes come from the Quake space normal: x, -z, y back to x, y, z
+            Vec3 quake_normal{surface.normal.x(), surface.normal.z(), -surface.normal.y()};
+            quake_texture_axes(quake_normal, surface.s_axis, surface.t_axis);
+            surface.s_axis = exchange_quake_axes(surface.s_axis);
+            surface.t_axis = exchange_quake_axes(surface.t_axis);
+         } else {
+            quake_texture_axes(surface.normal, surface.s_axis, surface.t_axis);
+         }
+
+         float s_min = INFINITY, s_max = -INFINITY, t_min = INFINITY, t_max = -INFINITY;
+         surface.first_vertex = (u32)lightmaps.vertices.size();
+         surface.num_vertices = count;
+         for (u32 k = 0; k < count; k++) {
+            const Vec3 &v = mesh.vertices[idx[k]];
+            lightmaps.vertices.push_back(v);
+            float s = dot_product(v, surface.s_axis), t = dot_product(v, surface.t_axis);
+            s_min = std::min(s_min, s), s_max = std::max(s_max, s);
+            t_min = std::min(t_min, t), t_max = std::max(t_max, t);
+         }
+         surface.mins[0] = (int32_t)floorf(s_min / kLuxelSize);
+         surface.mins[1] = (int32_t)floorf(t_min / kLuxelSize);
+         surface.width = (u32)((int32_t)ceilf(s_max / kLuxelSize) - surface.mins[0] + 1);
+         surface.height = (u32)((int32_t)ceilf(t_max / kLuxelSize) - surface.mins[1] + 1);
+         surface.first_luxel = lightmaps.luxels.size();
+         lightmaps.luxels.resize(lightmaps.luxels.size() + (size_t)surface.width * surface.height);
+         lightmaps.surfaces.push_back(surface);
+
+         if (!brush_in_world[b]) continue;
+         u32 base = (u32)casters.vertices.size();
+         for (u32 k = 0; k < count; k++) casters.vertices.push_back(mesh.vertices[idx[k]]);
+         for (u32 k = 1; k + 1 < count; k++) {
+            casters.indices.insert(casters.indices.end(), {base, base + k, base + k + 1});
+            casters.num_vertices.push_back(3);
+         }
+      }
+   }
+   brush_meshes.clear();
+   ShadowCasters shadow_casters(std::move(casters));
+
+   if (stats) {
+      *stats = LightmapBakeStats();
+      stats->thread_luxels.assign(pool.size(), 0);
+      stats->thread_rays.assign(pool.size(), 0);
+      stats->thread_seconds.assign(pool.size(), 0);
+   }
+   auto start = std::chrono::steady_clock::now();
+   size_t num_surfaces = lightmaps.surfaces.size();
+   pool.parallel_ranges(num_surfaces, 16, [&](size_t begin, size_t end, size_t thread) {
+      auto range_start = std::chrono::steady_clock::now();
+      vector<u32> nearby;
+      uint64_t luxels = 0, rays = 0;
+      for (size_t i = begin; i < end; i++) {
+         const LightmapSurface &surface = lightmaps.surfaces[i];
+         const Vec3 *polygon = lightmaps.vertices.data() + surface.first_vertex;
+
+         Vec3 bounds_min = polygon[0], bounds_max = polygon[0], center{0, 0, 0};
+         for (u32 k = 0; k < surface.num_vertices; k++) {
+            for (int axis = 0; axis < 3; axis++) {
+               bounds_min[axis] = std::min(bounds_min[axis], polygon[k][axis] - 1);
+               bounds_max[axis] = std::max(bounds_max[axis], polygon[k][axis] + 1);
+            }
+            center += polygon[k];
+         }
+         center *= 1.f / surface.num_vertices;
+         nearby.clear();
+         append_lights_touching(lights, bounds_min, bounds_max, nearby);
+
+         u8 *out = lightmaps.luxels.data() + surface.first_luxel;
+         for (u32 j = 0; j < surface.height; j++) {
+            for (u32 i = 0; i < surface.width; i++) {
+               Vec3 p = surface.point_at((surface.mins[0] + (int)i) * kLuxelSize,
+                                         (surface.mins[1] + (int)j) * kLuxelSize);
+               Vec3 q = closest_point_in_polygon(polygon, surface.num_vertices, surface.normal, p);
+               if (dot_product(q - p, q - p) > 0) {
+                  Vec3 inward = center - q;
+                  float length = inward.length();
+                  if (length > 0) q += inward * (std::min(length, 1.f) / length);
+               }
+               Vec3 sample = q + surface.normal;
+
+               float light = kMapAmbientLight;
+               for (u32 l : nearby) {
+                  const Light &point = lights[l];
+                  Vec3 d = point.position - sample;
+                  if (dot_product(d, surface.normal) <= 0) continue;
+                  float value = point_light(point,
+                                            d.x(),
+                                            d.y(),
+                                            d.z(),
+                                            surface.normal.x(),
+                                            surface.normal.y(),
+                                            surface.normal.z());
+                  if (value <= 0) continue;
+                  rays++;
+                  if (!shadow_casters.blocked(sample, point.position)) light += value;
+               }
+               out[(size_t)j * surface.width + i] = (u8)std::min(255.f, roundf(light));
+            }
+         }
+         luxels += (uint64_t)surface.width * surface.height;
+      }
+      if (stats) {
+         stats->thread_luxels[thread] += luxels;
+         stats->thread_rays[thread] += rays;
+         stats->thread_seconds[thread] +=
+             std::chrono::duration<double>(std::chrono::steady_clock::now() - range_start).count();
+      }
+   });
+   if (stats)
+      stats->seconds =
+          std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+   return lightmaps;
+}
+
+string lightmap_path(const string &map_path) { return map_path + ".lightmap"; }
+
+bool write_lightmaps(const string &filepath, const Lightmaps &lightmaps, LightmapHeader header) {
+   header.magic = kLightmapMagic;
+   header.version = kLightmapVersion;
+   header.num_surfaces = (u32)lightmaps.surfaces.size();
+   header.num_vertices = (u32)lightmaps.vertices.size();
+   header.num_luxels = lightmaps.luxels.size();
+
+   vector<LightmapSurfaceRecord> records(lightmaps.surfaces.size());
+   for (size_t i = 0; i < records.size(); i++) {
+      const LightmapSurface &surface = lightmaps.surfaces[i];
+      LightmapSurfaceRecord &record = records[i];
+      for (int axis = 0; axis < 3; axis++) {
+         record.normal[axis] = surface.normal[axis];
+         record.s_axis[axis] = surface.s_axis[axis];
+         record.t_axis[axis] = surface.t_axis[axis];
+      }
+      record.dist = surface.dist;
+      record.mins[0] = surface.mins[0];
+      record.mins[1] = surface.mins[1];
+      record.width = surface.width;
+      record.height = surface.height;
+      record.first_vertex = surface.first_vertex;
+      record.num_vertices = surface.num_vertices;
+      record.first_luxel = surface.first_luxel;
+   }
+
+   vector<char> out(sizeof(LightmapHeader));
+   memcpy(out.data(), &header, sizeof(header));
+
+   auto append = [&out](const void *data, size_t bytes) {
+      out.resize(align16(out.size()));
+      out.insert(out.end(), (const char *)data, (const char *)data + bytes);
+   };
+   append(records.data(), records.size() * sizeof(LightmapSurfaceRecord));
+   vector<float> coords(lightmaps.vertices.size());
+   for (int axis = 0; axis < 3; axis++) {
+      for (size_t v = 0; v < coords.size(); v++) coords[v] = lightmaps.vertices[v][axis];
+      append(coords.data(), coords.size() * sizeof(float));
+   }
+   append(lightmaps.luxels.data(), lightmaps.luxels.size());
+
+   // Write to a temporary file first so a crash never leaves half written lightmaps behind
+   string tmp_path = filepath + ".tmp";
+   {
+      std::ofstream fs(tmp_path, std::ios::binary | std::ios::trunc);
+      if (!fs) return false;
+      fs.write(out.data(), out.size());
+      if (!fs) return false;
+   }
+   std::error_code error;
+   std::filesystem::rename(tmp_path, filepath, error);
+   return !error;
+}
+
+// Read a .lightmap into `lightmaps` if it exists and matches `stamp`. `source` is only hashed if
+// needed
+bool read_lightmaps(const string &filepath, const LightmapHeader &stamp, const MappedFile &source,
+                    Lightmaps &lightmaps) {
+   MappedFile file(filepath);
+   if (!file.is_open || file.size < sizeof(LightmapHeader)) return false;
+
+   LightmapHeader header;
+   memcpy(&header, file.data, sizeof(header));
+   if (header.magic != kLightmapMagic || header.version != kLightmapVersion) return false;
+   if (header.exchange_axes != stamp.exchange_axes) return false;
+   if (header.source_size != stamp.source_size) return false;
+   if (header.source_mtime != stamp.source_mtime &&
+       header.source_hash != hash_bytes(source.data, source.size))
+      return false;
+
+   size_t num_surfaces = header.num_surfaces, num_vertices = header.num_vertices;
+   size_t surfaces_at = align16(sizeof(LightmapHeader));
+   size_t vertices_at[3];
+   vertices_at[0] = align16(surfaces_at + num_surfaces * sizeof(LightmapSurfaceRecord));
+   for (int axis = 1; axis < 3; axis++)
+      vertices_at[axis] = align16(vertices_at[axis - 1] + num_vertices * sizeof(float));
+   size_t luxels_at = align16(vertices_at[2] + num_vertices * sizeof(float));
+   if (luxels_at + header.num_luxels > file.size) return false;
+
+   lightmaps = Lightmaps();
+   lightmaps.surfaces.resize(num_surfaces);
+   for (size_t i = 0; i < num_surfaces; i++) {
+      LightmapSurfaceRecord record;
+      memcpy(&record, file.data + surfaces_at + i * sizeof(record), sizeof(record));
+      LightmapSurface &surface = lightmaps.surfaces[i];
+      for (int axis = 0; axis < 3; axis++) {
+         surface.normal[axis] = record.normal[axis];
+         surface.s_axis[axis] = record.s_axis[axis];
+         surface.t_axis[axis] = record.t_axis[axis];
+      }
+      surface.dist = record.dist;
+      surface.mins[0] = record.mins[0];
+      surface.mins[1] = record.mins[1];
+      surface.width = record.width;
+      surface.height = record.height;
+      surface.first_vertex = record.first_vertex;
+      surface.num_vertices = record.num_vertices;
+      surface.first_luxel = record.first_luxel;
+      if (record.width == 0 || record.height == 0 || record.num_vertices < 3 ||
+          (uint64_t)record.first_vertex + record.num_vertices > num_vertices ||
+          record.first_luxel + (uint64_t)record.width * record.height > header.num_luxels)
+         return false;
+   }
+   lightmaps.vertices.resize(num_vertices);
+   for (int axis = 0; axis < 3; axis++) {
+      const char *coords = file.data + vertices_at[axis];
+      for (size_t v = 0; v < num_vertices; v++) {
+         float coord;
+         memcpy(&coord, coords + v * sizeof(float), sizeof(coord));
+         lightmaps.vertices[v][axis] = coord;
+      }
+   }
+   lightmaps.luxels.assign((const u8 *)file.data + luxels_at,
+                           (const u8 *)file.data + luxels_at + header.num_luxels);
+   return true;
+}
+
+// Stamp of the source MAP for write_lightmaps() and read_lightmaps()
+LightmapHeader lightmap_stamp(const string &map_path, const MappedFile &source,
+                              bool exchange_axes) {
+   LightmapHeader stamp = {};
+   stamp.exchange_axes = exchange_axes;
+   stamp.source_size = source.size;
+   stamp.source_mtime = file_mtime(map_path);
+   return stamp;
+}
+
+/* Load the lightmaps baked offline for the map at `map_path`. Leaves `lightmaps` empty if there
+   are none or they are out of date */
+bool load_lightmaps(const string &map_path, bool exchange_axes, Lightmaps &lightmaps) {
+   FUAKE_PROFILE_SCOPE("Load lightmaps");
+   lightmaps = Lightmaps();
+   MappedFile source(map_path);
+   if (!source.is_open) return false;
+
+   if (!read_lightmaps(lightmap_path(map_path),
+                       lightmap_stamp(map_path, source, exchange_axes),
+                       source,
+                       lightmaps)) {
+      printf("WARNING: No up to date lightmaps for %s, run bake_lightmaps to build them\n",
+             map_path.c_str());
+      lightmaps = Lightmaps();
+      return false;
+   }
+   return true;
+}
+
+/* Finds the surface a face of the compiled map lies on. Surfaces are listed in the cells of a
+   coarse grid their polygon's bounds touch, and a point matches the one whose plane holds it and
+   whose polygon contains it */
+struct LightmapLookup {
+   static constexpr float kCellSize = 128;
+   static constexpr float kTolerance = 0.1f; // Units off the plane or outside the polygon
+
+   const Lightmaps &lightmaps;
+   std::unordered_map<uint64_t, vector<u32>> cells;
+
+   static uint64_t cell_key(int x, int y, int z) {
+      const int kBias = 1 << 20;
+      return (uint64_t)(x + kBias) << 42 | (uint64_t)(y + kBias) << 21 | (uint64_t)(z + kBias);
+   }
+
+   static int cell_coord(float value) { return (int)floorf(value / kCellSize); }
+
+   explicit LightmapLookup(const Lightmaps &lightmaps) : lightmaps(lightmaps) {
+      for (u32 s = 0; s < lightmaps.surfaces.size(); s++) {
+         const LightmapSurface &surface = lightmaps.surfaces[s];
+         const Vec3 *polygon = lightmaps.vertices.data() + surface.first_vertex;
+         Vec3 bounds_min = polygon[0], bounds_max = polygon[0];
+         for (u32 k = 1; k < surface.num_vertices; k++) {
+            for (int axis = 0; axis < 3; axis++) {
+               bounds_min[axis] = std::min(bounds_min[axis], polygon[k][axis]);
+               bounds_max[axis] = std::max(bounds_max[axis], polygon[k][axis]);
+            }
+         }
+         int lo[3], hi[3];
+         for (int axis = 0; axis < 3; axis++) {
+            lo[axis] = cell_coord(bounds_min[axis] - kTolerance);
+            hi[axis] = cell_coord(bounds_max[axis] + kTolerance);
+         }
+         for (int x = lo[0]; x <= hi[0]; x++)
+            for (int y = lo[1]; y <= hi[1]; y++)
+               for (int z = lo[2]; z <= hi[2]; z++) cells[cell_key(x, y, z)].push_back(s);
+      }
+   }
+
+   // Surface holding `point` and facing along unit `normal`, nullptr if there is none
+   const LightmapSurface *find(const Vec3 &point, const Vec3 &normal) const {
+      auto found = cells.find(
+          cell_key(cell_coord(point.x()), cell_coord(point.y()), cell_coord(point.z())));
+      if (found == cells.end()) return nullptr;
+      for (u32 s : found->second) {
+         const LightmapSurface &surface = lightmaps.surfaces[s];
+         if (dot_product(surface.normal, normal) < 0.99f) continue;
+         if (fabsf(dot_product(surface.normal, point) - surface.dist) > kTolerance) continue;
+
+         const Vec3 *polygon = lightmaps.vertices.data() + surface.first_vertex;
+         bool inside = true;
+         for (u32 k = 0; k < surface.num_vertices && inside; k++) {
+            const Vec3 &a = polygon[k], &b = polygon[(k + 1) % surface.num_vertices];
+            Vec3 outward = cross_product(b - a, surface.normal);
+            float length = outward.length();
+            inside = length == 0 || dot_product(point - a, outward) <= kTolerance * length;
+         }
+         if (inside) return &surface;
+      }
+      return nullptr;
+   }
+};
+
+/* Sample `lightmaps` for the faces and vertices of `mesh`, a compiled map's batch: a face gets
+   the index of its surface, which is also its FaceLightmap (see make_face_lightmaps()), and the
+   mean of its lightmap at its corners and center, and a vertex the mean at its position over the
+   faces using it. Faces on no surface get kNoLightmap and kMapAmbientLight. Returns how many */
+size_t sample_lightmaps(const LightmapLookup &lookup, const Mesh &mesh,
+                        vector<u32> &face_lightmap, vector<float> &vertex_light,
+                        vector<float> &face_light) {
+   const Lightmaps &lightmaps = lookup.lightmaps;
+   size_t num_faces = mesh.num_vertices.size(), unmatched = 0;
+   face_lightmap.assign(num_faces, BakedLighting::kNoLightmap);
+   face_light.assign(num_faces, kMapAmbientLight);
+   vertex_light.assign(mesh.vertices.size(), 0);
+   vector<u8> uses(mesh.vertices.size(), 0);
+
+   for (size_t f = 0; f < num_faces; f++) {
+      const u32 *idx = &mesh.indices[mesh.index_offsets[f]];
+      u32 count = mesh.num_vertices[f];
+      const Vec3 &p0 = mesh.vertices[idx[0]];
+      Vec3 normal = cross_product(mesh.vertices[idx[1]] - p0, mesh.vertices[idx[2]] - p0);
+      Vec3 center{0, 0, 0};
+      for (u32 n = 0; n < count; n++) center += mesh.vertices[idx[n]];
+      center *= 1.f / count;
+
+      float length = normal.length();
+      const LightmapSurface *surface =
+          length > 0 ? lookup.find(center, normal * (1 / length)) : nullptr;
+      if (!surface) {
+         unmatched++;
+         continue;
+      }
+
+      face_lightmap[f] = (u32)(surface - lightmaps.surfaces.data());
+      float sum = lightmaps.sample(*surface, center);
+      for (u32 n = 0; n < count; n++) {
+         float value = lightmaps.sample(*surface, mesh.vertices[idx[n]]);
+         sum += value;
+         if (uses[idx[n]] == 255) continue;
+         vertex_light[idx[n]] += value;
+         uses[idx[n]]++;
+      }
+      face_light[f] = sum / (count + 1);
+   }
+   for (size_t v = 0; v < vertex_light.size(); v++)
+      vertex_light[v] = uses[v] ? vertex_light[v] / uses[v] : kMapAmbientLight;
+   return unmatched;
+}
+
+// Move the luxels of `lightmaps` into `baked`, with a FaceLightmap for each surface in order
+void make_face_lightmaps(Lightmaps &lightmaps, BakedLighting &baked) {
+   baked.lightmaps.resize(lightmaps.surfaces.size());
+   for (size_t s = 0; s < lightmaps.surfaces.size(); s++) {
+      const LightmapSurface &surface = lightmaps.surfaces[s];
+      baked.lightmaps[s] = {surface.s_axis * (1 / kLuxelSize),
+                            surface.t_axis * (1 / kLuxelSize),
+                            (float)-surface.mins[0],
+                            (float)-surface.mins[1],
+                            surface.width,
+                            surface.height,
+                            surface.first_luxel};
+   }
+   baked.luxels = std::move(lightmaps.luxels);
+}
+
+} // namespace fuake
@@ -0,0 +1,160 @@
+#pragma once
+
+#include <math.h>
+#include <cstdio>
+#include <cstdlib>
+#include <vector>
+#include <string>
+#include <algorithm>
+
+#include "fuake_lighting.hpp"
+#include "fuake_mesh.hpp"
+#include "fuake_maploader.hpp"
+#include "fuake_profiler.hpp"
+#include "fuake_threadpool.hpp"
+
+using std::string;
+using std::vector;
+
+namespace fuake {
+
+// Brushes that end up in the same batch: same entity and same cell of the region grid
+struct MapBatchKey {
+   u32 entity;
+   int cell[3];
+
+   bool operator<(const MapBatchKey &other) const {
+      if (entity != other.entity) return entity < other.entity;
+      for (int axis = 0; axis < 3; axis++)
+         if (cell[axis] != other.cell[axis]) return cell[axis] < other.cell[axis];
+      return false;
+   }
+   bool operator==(const MapBatchKey &other) const { return !(*this < other || other < *this); }
+};
+
+/* Convert every brush of `map` into render-ready meshes (triangulated, with edges and normals),
+   merged into one batch per entity and region_size cube of the world, so the renderer draws a few
+   large meshes instead of thousands of brushes. Brushes are converted in parallel, then batches
+   are merged in parallel. With exchange_axes, Quake's Z-up coordinates are rotated the same way
+   the OBJ loader rotates the Quake OBJ files. */
+vector<Mesh> compile_map(const QuakeMap &map, bool exchange_axes = true, float region_size = 1024,
+                         ThreadPool &pool = default_thread_pool()) {
+   FUAKE_PROFILE_SCOPE("Compile map");
+
+   vector<const QuakeBrush *> brushes;
+   vector<u32> brush_entity;
+   for (size_t e = 0; e < map.entities.size(); e++) {
+      for (const auto &brush : map.entities[e].brushes) {
+         brushes.push_back(&brush);
+         brush_entity.push_back((u32)e);
+      }
+   }
+
+   // Brushes to meshes, each one placed in the region of its bounding box center
+   vector<Mesh> brush_meshes(brushes.size());
+   vector<MapBatchKey> keys(brushes.size());
+   pool.parallel_ranges(brushes.size(), 64, [&](size_t begin, size_t end, size_t) {
+      for (size_t b = begin; b < end; b++) {
+         Mesh &mesh = brush_meshes[b];
+         mesh = brushes[b]->to_mesh();
+
+         keys[b].entity = brush_entity[b];
+         for (int axis = 0; axis < 3; axis++) {
+            float center = (mesh.bounds_min[axis] + mesh.bounds_max[axis]) / 2;
+            keys[b].cell[axis] = (int)floorf(center / region_size);
+         }
+      }
+   });
+
+   // Sort brushes by batch, skipping the ones that don't enclose a volume
+   vector<u32> order;
+   order.reserve(brushes.size());
+   for (u32 b = 0; b < brushes.size(); b++)
+      if (!brush_meshes[b].num_vertices.empty()) order.push_back(b);
+   std::stable_sort(order.begin(), order.end(), [&keys](u32 left, u32 right) {
+      return keys[left] < keys[right];
+   });
+
+   vector<size_t> batch_begin;
+   for (size_t i = 0; i < order.size(); i++)
+      if (i == 0 || !(keys[order[i]] == keys[order[i - 1]])) batch_begin.push_back(i);
+   batch_begin.push_back(order.size());
+
+   // Merge every batch in one mesh. Brushes keep their own vertices, so normals aren't smoothed
+   // across brushes
+   vector<Mesh> batches(batch_begin.size() - 1);
+   pool.parallel_for(batches.size(), [&](size_t batch_idx, size_t) {
+      Mesh &batch = batches[batch_idx];
+      size_t begin = batch_begin[batch_idx], end = batch_begin[batch_idx + 1];
+
+      size_t num_vertices = 0, num_indices = 0, num_faces = 0;
+      for (size_t i = begin; i < end; i++) {
+         const Mesh &mesh = brush_meshes[order[i]];
+         num_vertices += mesh.vertices.size();
+         num_indices += mesh.indices.size();
+         num_faces += mesh.num_vertices.size();
+      }
+      batch.vertices.reserve(num_vertices);
+      batch.indices.reserve(num_indices);
+      batch.num_vertices.reserve(num_faces);
+
+      for (size_t i = begin; i < end; i++) {
+         const Mesh &mesh = brush_meshes[order[i]];
+         u32 first_vertex = (u32)batch.vertices.size();
+         for (Vec3 vertex : mesh.vertices) {
+            if (exchange_axes) {
+               float y = vertex.y();
+               vertex.y() = -vertex.z();
+               vertex.z() = y;
+            }
+            batch.vertices.push_back(vertex);
+         }
+         for (u32 idx : mesh.indices) batch.indices.push_back(first_vertex + idx);
+         batch.num_vertices.insert(
+             batch.num_vertices.end(), mesh.num_vertices.begin(), mesh.num_vertices.end());
+      }
+
+      const MapBatchKey &key = keys[order[begin]];
+      batch.name = map.entities[key.entity].get_property("classname") + " " +
+                   std::to_string(key.entity) + " (" + std::to_string(key.cell[0]) + ", " +
+                   std::to_string(key.cell[1]) + ", " + std::to_string(key.cell[2]) + ")";
+
+      batch.calculate_offsets();
+      triangulate(batch);
+      calculate_vertex_normals(batch);
+      batch.update_bounds();
+   });
+
+   return batches;
+}
+
+/* Point lights of the map's light entities (light, light_fluoro, light_torch_small_walltorch...),
+   in the space of compile_map()'s meshes. The "light" key gives the brightness, 300 by default,
+   which fades to nothing that many units away as in Quake's light tool. Styles, colors and
+   negative lights are left out */
+vector<Light> compile_lights(const QuakeMap &map, bool exchange_axes = true) {
+   vector<Light> lights;
+   for (const auto &entity : map.entities) {
+      if (entity.get_property("classname").rfind("light", 0) != 0) continue;
+      Vec3 origin;
+      if (sscanf(entity.get_property("origin").c_str(),
+                 "%f %f %f",
+                 &origin.x(),
+                 &origin.y(),
+                 &origin.z()) != 3)
+         continue;
+      string value = entity.get_property("light");
+      float brightness = value.empty() ? 300 : (float)atof(value.c_str());
+      if (brightness <= 0) continue;
+
+      if (exchange_axes) {
+         float y = origin.y();
+         origin.y() = -origin.z();
+         origin.z() = y;
+      }
+      lights.emplace_back(origin, brightness, brightness);
+   }
+   return lights;
+}
+
+} // namespace fuake
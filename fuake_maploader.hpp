@@ -6,8 +6,14 @@
 #include <sstream>
 #include <string>
 #include <iostream>
+#include <charconv>
+#include <algorithm>
+#include <string_view>
+#include <unordered_map>
 
 #include "fuake_mesh.hpp"
+#include "fuake_mmap.hpp"
+#include "fuake_profiler.hpp"
 #include <amath_eq.hpp>
 #include <amath_geometry.hpp>
 
@@ -15,125 +21,184 @@ using std::vector;
 
 namespace fuake {
 
-vector<Vec3> &sort_points_CW(vector<Vec3> &points);
+// Brush plane as written in a .MAP file: three points, clockwise when seen from outside
+struct BrushPlane {
+   Vec3 points[3];
+   Vec3 normal; // Points out of the brush
+   float dist;  // Points p on the plane satisfy dot(normal, p) == dist
+
+   // Texture attributes
+   u32 texture = 0; // Index into QuakeMap::textures
+   float texture_offset[2] = {0, 0};
+   float texture_rotation = 0; // Degrees
+   float texture_scale[2] = {1, 1};
+
+   BrushPlane(Vec3 p0, Vec3 p1, Vec3 p2) {
+      points[0] = p0, points[1] = p1, points[2] = p2;
+      // Same convention as Quake's qbsp
+      normal = cross_product(p0 - p1, p2 - p1).normalized();
+      dist = dot_product(p1, normal);
+   }
 
-struct Face {
-   vector<size_t> vert_indices;
+   // Signed distance, positive outside the brush
+   float distance(const Vec3 &p) const { return dot_product(normal, p) - dist; }
+
+   void print() {
+      printf("( %g %g %g ) ( %g %g %g ) ( %g %g %g )\n",
+             points[0].x(),
+             points[0].y(),
+             points[0].z(),
+             points[1].x(),
+             points[1].y(),
+             points[1].z(),
+             points[2].x(),
+             points[2].y(),
+             points[2].z());
+   }
 };
 
 struct QuakeBrush {
-   vector<amath::Plane> planes;
+   vector<BrushPlane> planes;
 
-   Mesh to_mesh() {
+   /* Convex polyhedron bounded by the brush planes, as a mesh of convex polygons wound
+      counter-clockwise when seen from outside. Empty if the planes don't enclose a volume */
+   Mesh to_mesh() const {
 
       // Algorithm adapted from:
       // https://merlin3d.wordpress.com/2018/09/10/importing-quake-1-levels-from-map-files/
       // and Michael Abrash
 
-      // Start with a big cube spanning from -4096 to 4096 in each dimension
-      vector<uint8_t> num_vertices = {4, 4, 4, 4};
-
-      vector<Vec3> vertices = {{1.000000, 1.000000, -1.000000},
-                               {1.000000, -1.000000, -1.000000},
-                               {1.000000, 1.000000, 1.000000},
-                               {1.000000, -1.000000, 1.000000},
-                               {-1.000000, 1.000000, -1.000000},
-                               {-1.000000, -1.000000, -1.000000},
-                               {-1.000000, 1.000000, 1.000000},
-                               {-1.000000, -1.000000, 1.000000}};
+      // Start with a big cube spanning from -4096 to 4096 in each dimension, corner i has
+      // +4096 in x, y, z when bit 0, 1, 2 of i is set
+      vector<Vec3> vertices;
+      for (int i = 0; i < 8; i++)
+         vertices.push_back(Vec3{i & 1 ? 4096.f : -4096.f,
+                                 i & 2 ? 4096.f : -4096.f,
+                                 i & 4 ? 4096.f : -4096.f});
 
-      for (auto &v : vertices) v *= 4096;
+      vector<vector<u32>> faces = {
+          {0, 4, 6, 2}, {1, 3, 7, 5}, {0, 1, 5, 4}, {2, 6, 7, 3}, {0, 2, 3, 1}, {4, 5, 7, 6}};
 
-      size_t face_indexes[6][4] = {
-          {1, 5, 7, 3}, {4, 3, 7, 8}, {8, 7, 5, 6}, {6, 2, 4, 8}, {2, 1, 3, 4}, {6, 5, 1, 2}};
+      VertexWelder welder(vertices);
+      const float kPlaneEpsilon = 1E-2f; // Same as qbsp ON_EPSILON
 
-      vector<Face> faces;
-      for (size_t i = 0; i < 6; i++) faces.emplace_back(face_indexes[i]);
+      vector<float> dists;
+      vector<u32> updated_face;
 
       // Loop over all planes (planes face outwards)
-      for (const auto &plane : planes) {
-         // C: Clipped face indexes, newly created by intersecting current plane
-         vector<size_t> clipped_face;
+      for (size_t plane_idx = 0; plane_idx < planes.size(); plane_idx++) {
+         const auto &plane = planes[plane_idx];
 
-         // Newly created vertices -> just insert them in mesh.vertices
-         // vector<Vec3> new_vertices;
-
-         // Loop over current faces
-         // size_t num_faces = mesh.num_vertices.size();
-
-         for (auto &face : faces) {
-            // V: Vertices for this face after clipping
-            vector<size_t> updated_face;
-            u32 num_verts = face.vert_indices.size();
+         // Some maps repeat a plane, clipping again would only add a duplicate cap
+         bool duplicate = false;
+         for (size_t i = 0; i < plane_idx && !duplicate; i++)
+            duplicate = dot_product(planes[i].normal, plane.normal) > 0.9999f &&
+                        fabsf(planes[i].dist - plane.dist) < kPlaneEpsilon;
+         if (duplicate) continue;
 
-            vector<Vec3> face_coords;
-            for (int v = 0; v < num_verts; v++)
-               face_coords.push_back(vertices[face.vert_indices[v]]);
+         // Vertices of the new cap face lying on this plane
+         vector<u32> cap_face;
 
-            float curdot = dot_product(face_coords[0], plane.normal());
-            bool curin = (curdot >= plane.D); // Is this point inside the plane?
+         dists.resize(vertices.size());
+         for (size_t i = 0; i < vertices.size(); i++) dists[i] = plane.distance(vertices[i]);
 
-            // Loop over vertices of face
-            for (int vert_idx = 0; vert_idx < num_verts; vert_idx++) {
-               u32 nextvert = (vert_idx + 1) % num_verts;
-
-               // Keep the current vertex if it's inside the plane
-               if (curin) updated_face.push_back(face.vert_indices[vert_idx]);
-
-               float nextdot = dot_product(face_coords[nextvert], plane.normal());
-               bool nextin = (nextdot >= plane.D);
+         for (auto &face : faces) {
+            updated_face.clear();
+            size_t num_verts = face.size();
+
+            // Loop over vertices of face, keeping the part behind the plane
+            for (size_t vert_idx = 0; vert_idx < num_verts; vert_idx++) {
+               u32 cur = face[vert_idx];
+               u32 next = face[(vert_idx + 1) % num_verts];
+               float curdist = dists[cur], nextdist = dists[next];
+               bool curin = curdist <= kPlaneEpsilon;
+               bool nextin = nextdist <= kPlaneEpsilon;
+
+               if (curin) {
+                  updated_face.push_back(cur);
+                  if (curdist >= -kPlaneEpsilon) cap_face.push_back(cur);
+               }
 
                // Add clipped vertex if current and next vert on different sides of plane
                if (curin != nextin) {
-                  float scale = (plane.D - curdot) / (nextdot - curdot);
-                  Vec3 new_vert = face_coords[vert_idx] +
-                                  (face_coords[nextvert] - face_coords[vert_idx]) * scale;
-
-                  // After new vertex is created, add it to vertices list and get its index
-                  bool is_new_vert = true;
-                  size_t new_vert_idx;
-                  for (size_t i = 0; i < vertices.size(); i++) {
-                     if (vec_equal(new_vert, vertices[i], 1E-5f)) {
-                        is_new_vert = false;
-                        new_vert_idx = i;
-                        break;
-                     }
-                  }
-
-                  if (is_new_vert) {
-                     vertices.push_back(new_vert);
-                     new_vert_idx = vertices.size() - 1;
-                  }
+                  float scale = curdist / (curdist - nextdist);
+                  Vec3 new_vert = vertices[cur] + (vertices[next] - vertices[cur]) * scale;
+
+                  u32 new_vert_idx = welder.weld(new_vert);
+                  if (new_vert_idx >= dists.size()) dists.push_back(0); // On the plane
 
                   updated_face.push_back(new_vert_idx);
-                  clipped_face.push_back(new_vert_idx);
+                  cap_face.push_back(new_vert_idx);
                }
-
-               curdot = nextdot;
-               curin = nextin;
             }
 
-            // When we're done clipping this face, replace  vertex indexes with updated ones
-            face.vert_indices = updated_face;
+            // When we're done clipping this face, replace vertex indexes with updated ones
+            face.swap(updated_face);
          }
 
-         if (!clipped_face.empty()) {
-            Face new_face;
-            // Loop over new face vertices, some are duplicates, we need to dedup and order CW
-            for (size_t vert_idx = 0; vert_idx < clipped_face.size(); vert_idx++) {
-               // If vertex not already in new face, insert it in correct winding order
-            }
-            faces.push_back(new_face);
+         // Drop faces that were clipped away, and repeated vertices left by welding
+         for (auto &face : faces) {
+            size_t n = 0;
+            for (size_t i = 0; i < face.size(); i++)
+               if (n == 0 || face[i] != face[n - 1]) face[n++] = face[i];
+            while (n > 1 && face[n - 1] == face[0]) n--;
+            face.resize(n);
          }
+         faces.erase(std::remove_if(faces.begin(),
+                                    faces.end(),
+                                    [](const vector<u32> &f) { return f.size() < 3; }),
+                     faces.end());
+
+         // Cap vertices are unordered and repeated, dedup and sort them CCW around the normal
+         std::sort(cap_face.begin(), cap_face.end());
+         cap_face.erase(std::unique(cap_face.begin(), cap_face.end()), cap_face.end());
+         if (cap_face.size() < 3) continue;
+
+         Vec3 center{0, 0, 0};
+         for (u32 v : cap_face) center += vertices[v];
+         center *= 1.f / cap_face.size();
+
+         Vec3 axis_u = fabsf(plane.normal.x()) < 0.9f ? Vec3{1, 0, 0} : Vec3{0, 1, 0};
+         axis_u = cross_product(axis_u, plane.normal).normalized();
+         Vec3 axis_v = cross_product(plane.normal, axis_u);
+
+         vector<float> angles(vertices.size());
+         for (u32 v : cap_face) {
+            Vec3 d = vertices[v] - center;
+            angles[v] = atan2f(dot_product(d, axis_v), dot_product(d, axis_u));
+         }
+         std::sort(cap_face.begin(), cap_face.end(), [&angles](u32 a, u32 b) {
+            return angles[a] < angles[b];
+         });
+         faces.push_back(cap_face);
       }
 
       // Create mesh from faces and vertices, dropping unused vertices
-      vector<size_t> old_indices;
-      vector<size_t> new_indices;
+      Mesh mesh;
+      vector<u32> new_indices(vertices.size(), UINT32_MAX);
+      for (auto &face : faces) {
+         for (u32 v : face) {
+            if (new_indices[v] == UINT32_MAX) {
+               new_indices[v] = (u32)mesh.vertices.size();
+               mesh.vertices.push_back(vertices[v]);
+            }
+            mesh.indices.push_back(new_indices[v]);
+         }
+         mesh.num_vertices.push_back((uint8_t)face.size());
+      }
+
+      // Faces still touching the starting cube mean the brush isn't closed
+      for (const auto &v : mesh.vertices) {
+         if (fabsf(v.x()) >= 4096 || fabsf(v.y()) >= 4096 || fabsf(v.z()) >= 4096) {
+            return Mesh();
+         }
+      }
 
+      mesh.calculate_offsets();
+      mesh.update_bounds();
       return mesh;
    }
-}; // namespace fuake
+};
 
 struct QuakeEntityParam {
    string key;
@@ -145,77 +210,278 @@ struct QuakeEntityParam {
 struct QuakeEntity {
    vector<QuakeEntityParam> properties;
    vector<QuakeBrush> brushes;
+
+   // Value of property `key`, or an empty string if the entity doesn't have it
+   string get_property(const string &key) const {
+      for (const auto &property : properties)
+         if (property.key == key) return property.value;
+      return "";
+   }
+};
+
+// Position and description of the first syntax error in a .MAP file
+struct MapParseError {
+   int line = 0; // 1-based, 0 when there was no error
+   int column = 0;
+   string message;
+
+   void print(const string &filepath) const {
+      printf("%s:%d:%d: Map parsing error: %s\n", filepath.c_str(), line, column, message.c_str());
+   }
+};
+
+/* Single pass tokenizer over a whole .MAP file in memory. Strings are returned as views into the
+   buffer, so nothing is copied until the parser decides to keep it */
+struct MapTokenizer {
+   const char *p, *end;
+   const char *line_start;
+   int line = 1;
+   MapParseError error;
+
+   MapTokenizer(const char *data, size_t size) : p(data), end(data + size), line_start(data) {}
+
+   // Skip whitespace and // comments
+   void skip_spaces() {
+      while (p < end) {
+         if (*p == '\n') {
+            line_start = ++p;
+            line++;
+         } else if (*p == ' ' || *p == '\t' || *p == '\r') {
+            p++;
+         } else if (*p == '/' && p + 1 < end && p[1] == '/') {
+            while (p < end && *p != '\n') p++;
+         } else {
+            break;
+         }
+      }
+   }
+
+   // Record an error at the current position, only the first one is kept
+   bool fail(const char *message) {
+      if (error.line == 0) {
+         error.line = line;
+         error.column = (int)(p - line_start) + 1;
+         error.message = message;
+      }
+      return false;
+   }
+
+   bool at_end() {
+      skip_spaces();
+      return p >= end;
+   }
+
+   char peek() {
+      skip_spaces();
+      return p < end ? *p : 0;
+   }
+
+   // Consume `c` if it comes next
+   bool accept(char c) {
+      if (peek() != c) return false;
+      p++;
+      return true;
+   }
+
+   bool expect(char c, const char *message) { return accept(c) || fail(message); }
+
+   bool number(float &value) {
+      skip_spaces();
+      if (p < end && *p == '+') p++;
+      auto result = std::from_chars(p, end, value);
+      if (result.ptr == p) return fail("expected a number");
+      p = result.ptr;
+      return true;
+   }
+
+   // "..." string, which may span several lines
+   bool quoted(std::string_view &value) {
+      if (peek() != '"') return fail("expected a quoted string");
+      const char *start = p + 1;
+      const char *close = start;
+      int newlines = 0;
+      const char *last_line_start = line_start;
+      for (; close < end && *close != '"'; close++) {
+         if (*close == '\n') {
+            newlines++;
+            last_line_start = close + 1;
+         }
+      }
+      if (close >= end) return fail("unterminated string");
+
+      value = std::string_view(start, close - start);
+      p = close + 1;
+      line += newlines;
+      line_start = last_line_start;
+      return true;
+   }
+
+   // Anything up to the next whitespace, such as a texture name
+   bool word(std::string_view &value) {
+      skip_spaces();
+      const char *start = p;
+      while (p < end && *p != ' ' && *p != '\t' && *p != '\r' && *p != '\n') p++;
+      if (p == start) return fail("expected a texture name");
+      value = std::string_view(start, p - start);
+      return true;
+   }
 };
 
 struct QuakeMap {
    vector<QuakeEntity> entities;
+   vector<string> textures; // Texture names, indexed by BrushPlane::texture
+   MapParseError error;     // error.line is 0 if the whole file was parsed
+
+   QuakeMap() {}
 
    QuakeMap(const string filepath) {
-      bool in_entity = false, in_brush = false;
+      FUAKE_PROFILE_SCOPE("Parse map");
+      MappedFile file(filepath);
+      if (!file.is_open) {
+         error.message = "couldn't open file";
+         printf("WARNING: Couldn't open %s\n", filepath.c_str());
+         return;
+      }
+      if (!parse(file.data, file.size)) error.print(filepath);
+   }
 
-      std::fstream fs(filepath);
-      string line;
-      int state = 0; // 0 - root, 1 = in entity, 2 = in brush
-      QuakeEntity tmp_entity;
-      QuakeBrush tmp_brush;
-      vector<Vec3> tmp_pts(3);
+   bool ok() const { return error.line == 0 && error.message.empty(); }
+
+   // Parse a whole .MAP file. On error, keeps everything parsed before it and fills `error`
+   bool parse(const char *data, size_t size) {
+      MapTokenizer tokens(data, size);
+      std::unordered_map<std::string_view, u32> texture_ids;
+
+      while (!tokens.at_end()) {
+         if (!tokens.expect('{', "expected '{' opening an entity")) break;
+         QuakeEntity &entity = entities.emplace_back();
+
+         bool entity_ok = true;
+         while (entity_ok && !tokens.accept('}')) {
+            char next = tokens.peek();
+            if (next == '"') {
+               std::string_view key, value;
+               entity_ok = tokens.quoted(key) && tokens.quoted(value);
+               if (entity_ok) entity.properties.emplace_back(string(key), string(value));
+            } else if (next == '{') {
+               tokens.accept('{');
+               entity_ok = parse_brush(tokens, texture_ids, entity.brushes.emplace_back());
+            } else {
+               entity_ok = tokens.fail(next ? "expected a property, a brush or '}'"
+                                            : "missing '}' closing the entity");
+            }
+         }
+         if (!entity_ok) break;
+      }
 
-      int endkey, startval, endval;
+      error = tokens.error;
+      return error.line == 0;
+   }
 
-      while (getline(fs, line)) {
+   // Brush planes up to the closing '}', whose opening '{' was already read
+   bool parse_brush(MapTokenizer &tokens, std::unordered_map<std::string_view, u32> &texture_ids,
+                    QuakeBrush &brush) {
+      while (!tokens.accept('}')) {
+         Vec3 points[3];
+         for (int i = 0; i < 3; i++) {
+            if (!tokens.expect('(', "expected '(' or '}' in brush")) return false;
+            for (int axis = 0; axis < 3; axis++)
+               if (!tokens.number(points[i][axis])) return false;
+            if (!tokens.expect(')', "expected ')' after plane point")) return false;
+         }
 
-         switch (line[0]) {
+         std::string_view texture_name;
+         float attributes[5];
+         if (!tokens.word(texture_name)) return false;
+         for (int i = 0; i < 5; i++)
+            if (!tokens.number(attributes[i])) return false;
 
-         case '{':
-            if (state == 2) {
-               std::cout << "Map parsing error: max depth level should be 2, but 3 reached.\n";
-               return;
-            }
-            if (state == 1) tmp_brush = QuakeBrush();
-            if (state == 0) tmp_entity = QuakeEntity();
-            state++;
-            break;
+         BrushPlane &plane = brush.planes.emplace_back(points[0], points[1], points[2]);
 
-         case '}':
-            if (state == 0) {
-               std::cout << "Map parsing error: found '}' token while at root level.\n";
-               return;
-            }
-            if (state == 1) entities.push_back(tmp_entity);
-            if (state == 2) tmp_entity.brushes.push_back(tmp_brush);
-            state--;
-            break;
-         case '"':
-            if (state != 1) {
-               std::cout << "Map parsing error: found entity property at incorrect level.\n";
-               return;
-            }
+         // Texture names repeat a lot, keep each one once
+         auto found = texture_ids.find(texture_name);
+         if (found == texture_ids.end()) {
+            textures.emplace_back(texture_name);
+            found = texture_ids.emplace(texture_name, (u32)textures.size() - 1).first;
+         }
+         plane.texture = found->second;
+         plane.texture_offset[0] = attributes[0];
+         plane.texture_offset[1] = attributes[1];
+         plane.texture_rotation = attributes[2];
+         plane.texture_scale[0] = attributes[3];
+         plane.texture_scale[1] = attributes[4];
+      }
+      return true;
+   }
+};
 
-            endkey = line.find_first_of('"', 1);
-            startval = line.find_first_of('"', endkey + 1);
-            endval = line.find_last_of('"');
+// Line based parser, kept to compare against QuakeMap's tokenizer. Reads no texture attributes
+QuakeMap read_map_stream(const string filepath) {
+   QuakeMap map;
 
-            tmp_entity.properties.emplace_back(line.substr(0, endkey),
-                                               line.substr(startval + 1, endval));
-            break;
-         case '(':
-            if (state != 2) {
-               std::cout << "Map parsing error: found brush plane at incorrect level.\n";
-               return;
-            }
+   std::fstream fs(filepath);
+   string line;
+   int state = 0; // 0 - root, 1 = in entity, 2 = in brush
+   QuakeEntity tmp_entity;
+   QuakeBrush tmp_brush;
+   vector<Vec3> tmp_pts(3);
 
-            for (int i = 0, start = 1; i < 3; i++) {
-               int end = line.find_first_of(')', start);
-               std::stringstream ss(line.substr(start, end));
-               ss >> tmp_pts[i].x() >> tmp_pts[i].y() >> tmp_pts[i].z();
-               start = line.find_first_of('(', end + 1) + 1;
-            }
+   int endkey, startval, endval;
 
-            tmp_brush.planes.emplace_back(tmp_pts[0], tmp_pts[1], tmp_pts[2]);
-            break;
+   while (getline(fs, line)) {
+
+      switch (line[0]) {
+
+      case '{':
+         if (state == 2) {
+            std::cout << "Map parsing error: max depth level should be 2, but 3 reached.\n";
+            return map;
+         }
+         if (state == 1) tmp_brush = QuakeBrush();
+         if (state == 0) tmp_entity = QuakeEntity();
+         state++;
+         break;
+
+      case '}':
+         if (state == 0) {
+            std::cout << "Map parsing error: found '}' token while at root level.\n";
+            return map;
+         }
+         if (state == 1) map.entities.push_back(tmp_entity);
+         if (state == 2) tmp_entity.brushes.push_back(tmp_brush);
+         state--;
+         break;
+      case '"':
+         if (state != 1) {
+            std::cout << "Map parsing error: found entity property at incorrect level.\n";
+            return map;
+         }
+
+         endkey = line.find_first_of('"', 1);
+         startval = line.find_first_of('"', endkey + 1);
+         endval = line.find_last_of('"');
+
+         tmp_entity.properties.emplace_back(line.substr(1, endkey - 1),
+                                            line.substr(startval + 1, endval - startval - 1));
+         break;
+      case '(':
+         if (state != 2) {
+            std::cout << "Map parsing error: found brush plane at incorrect level.\n";
+            return map;
+         }
+
+         for (int i = 0, start = 1; i < 3; i++) {
+            int end = line.find_first_of(')', start);
+            std::stringstream ss(line.substr(start, end));
+            ss >> tmp_pts[i].x() >> tmp_pts[i].y() >> tmp_pts[i].z();
+            start = line.find_first_of('(', end + 1) + 1;
          }
+
+         tmp_brush.planes.emplace_back(tmp_pts[0], tmp_pts[1], tmp_pts[2]);
+         break;
       }
    }
-};
+   return map;
+}
 
 } // namespace fuake
\ No newline at end of file
@@ -1,18 +1,15 @@
 #pragma once
 
-#include <esat/draw.h>
-#include <esat/time.h>
-#include <esat/input.h>
-#include <esat/window.h>
-
-#include <esat_extra/imgui.h>
-
 #include <amath_core.hpp>
 #include <amath_utils.hpp>
+#include <amath_eq.hpp>
 
 #include <vector>
 #include <string>
 #include <iostream>
+#include <algorithm>
+#include <unordered_set>
+#include <unordered_map>
 
 using std::string;
 using std::vector;
@@ -24,24 +21,131 @@ struct Mesh final {
    string name;
    vector<Vec3> vertices;        // Vertex positions (access with vertex_idx)
    vector<Vec3> normals;         // Vertex normals (access with vertex_idx)
-   vector<size_t> indices;       // Vertex indeces (access with index_offsets + i)
+   vector<Vec3> corner_normals;  // Normals read from the file, per index until split_vertices()
+   vector<u32> indices;          // Vertex indeces (access with index_offsets + i)
    vector<uint8_t> num_vertices; // Num of vertices per face (access with face_idx)
-   vector<size_t>
+   vector<u32>
        index_offsets; // 1st vertex index per face (access with face_idx, use to access indices)
+   vector<u32> edges;     // Unique edges as vertex index pairs (access with 2 * edge_idx + 0/1)
+   size_t num_outline_edges = 0; // Edges past this one are diagonals added by triangulate()
+   Vec3 bounds_min, bounds_max;  // Axis aligned bounding box of the vertices
 
    // Calculate vertex position offsets to quickly index into them
    void calculate_offsets() {
 
       index_offsets.resize(num_vertices.size());
+      if (num_vertices.empty()) return;
       index_offsets[0] = 0;
       for (size_t i = 1; i < num_vertices.size(); i++)
          index_offsets[i] = index_offsets[i - 1] + num_vertices[i - 1];
    }
+
+   // Call after changing vertices
+   void update_bounds() {
+      bounds_min = bounds_max = Vec3{0, 0, 0};
+      if (vertices.empty()) return;
+      bounds_min = bounds_max = vertices[0];
+      for (const auto &v : vertices) {
+         for (int axis = 0; axis < 3; axis++) {
+            bounds_min[axis] = std::min(bounds_min[axis], v[axis]);
+            bounds_max[axis] = std::max(bounds_max[axis], v[axis]);
+         }
+      }
+   }
+};
+
+/* Merges vertices closer than `epsilon` through a hash grid of cell size `epsilon`. A vertex can
+   only match vertices in its own or a neighbouring cell, so each lookup is O(1) instead of a scan
+   over every vertex */
+struct VertexWelder {
+   vector<Vec3> &vertices;
+   float epsilon;
+   float inv_cell;
+   std::unordered_map<uint64_t, u32> cell_heads; // First vertex per cell
+   vector<u32> next_in_cell;                      // Linked list of vertices sharing a cell
+
+   VertexWelder(vector<Vec3> &vertices, float epsilon = 1E-2f)
+       : vertices(vertices), epsilon(epsilon), inv_cell(1.f / epsilon) {
+      for (u32 i = 0; i < vertices.size(); i++) insert_new(i);
+   }
+
+   static uint64_t cell_key(int64_t x, int64_t y, int64_t z) {
+      // 21 bits per axis covers the +-4096 Quake world at the default cell size. Farther cells
+      // wrap around and share lists, which is slower but still correct
+      const int64_t mask = (1 << 21) - 1;
+      return ((uint64_t)(x & mask) << 42) | ((uint64_t)(y & mask) << 21) | (uint64_t)(z & mask);
+   }
+
+   void insert_new(u32 idx) {
+      const Vec3 &v = vertices[idx];
+      uint64_t key = cell_key((int64_t)floorf(v.x() * inv_cell),
+                              (int64_t)floorf(v.y() * inv_cell),
+                              (int64_t)floorf(v.z() * inv_cell));
+      auto it = cell_heads.find(key);
+      next_in_cell.resize(vertices.size(), UINT32_MAX);
+      next_in_cell[idx] = it == cell_heads.end() ? UINT32_MAX : it->second;
+      cell_heads[key] = idx;
+   }
+
+   // Index of a vertex within epsilon of `v`, adding `v` as a new vertex if there is none
+   u32 weld(const Vec3 &v) {
+      int64_t cx = (int64_t)floorf(v.x() * inv_cell);
+      int64_t cy = (int64_t)floorf(v.y() * inv_cell);
+      int64_t cz = (int64_t)floorf(v.z() * inv_cell);
+
+      for (int64_t dx = -1; dx <= 1; dx++)
+         for (int64_t dy = -1; dy <= 1; dy++)
+            for (int64_t dz = -1; dz <= 1; dz++) {
+               auto it = cell_heads.find(cell_key(cx + dx, cy + dy, cz + dz));
+               if (it == cell_heads.end()) continue;
+               for (u32 i = it->second; i != UINT32_MAX; i = next_in_cell[i])
+                  if (vec_equal(v, vertices[i], epsilon)) return i;
+            }
+
+      vertices.push_back(v);
+      insert_new((u32)vertices.size() - 1);
+      return (u32)vertices.size() - 1;
+   }
 };
 
+// Append the face edges not seen yet to mesh.edges
+void append_unique_edges(Mesh &mesh, std::unordered_set<uint64_t> &seen) {
+   for (size_t face_idx = 0; face_idx < mesh.num_vertices.size(); face_idx++) {
+      size_t offset = mesh.index_offsets[face_idx];
+      size_t num_vertices = mesh.num_vertices[face_idx];
+
+      for (size_t n = 0; n < num_vertices; n++) {
+         u32 a = mesh.indices[offset + n];
+         u32 b = mesh.indices[offset + (n + 1) % num_vertices];
+         uint64_t key = a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a;
+         if (!seen.insert(key).second) continue;
+         mesh.edges.push_back(a);
+         mesh.edges.push_back(b);
+      }
+   }
+}
+
+// Build the unique edge list from the current faces (all of them count as outline edges)
+void build_edges(Mesh &mesh) {
+   std::unordered_set<uint64_t> seen;
+   seen.reserve(mesh.indices.size());
+   mesh.edges.clear();
+   append_unique_edges(mesh, seen);
+   mesh.num_outline_edges = mesh.edges.size() / 2;
+}
+
 void triangulate(Mesh &mesh) {
-   vector<size_t> new_indices;
+   // Polygon outlines go first in the edge list, so the diagonals added here can be skipped
+   std::unordered_set<uint64_t> seen;
+   seen.reserve(mesh.indices.size() * 2);
+   mesh.edges.clear();
+   append_unique_edges(mesh, seen);
+   mesh.num_outline_edges = mesh.edges.size() / 2;
+
+   vector<u32> new_indices;
    vector<uint8_t> new_num_vertices;
+   vector<Vec3> new_corner_normals;
+   bool has_corner_normals = mesh.corner_normals.size() == mesh.indices.size();
 
    for (int f = 0; f < mesh.num_vertices.size(); f++) {
       vector<size_t> sequence(6);
@@ -51,7 +155,7 @@ void triangulate(Mesh &mesh) {
       case 3:
          // Tris go untouched
          new_num_vertices.push_back(3);
-         for (int i = 0; i < 3; i++) new_indices.push_back(mesh.indices[offset + i]);
+         sequence = {0, 1, 2};
          break;
       case 4:
          // Get coordinates for each vertex of the quad
@@ -62,73 +166,160 @@ void triangulate(Mesh &mesh) {
             sequence = {0, 1, 3, 1, 2, 3};
          else sequence = {0, 1, 2, 0, 2, 3};
 
-         for (int i = 0; i < 6; i++) new_indices.push_back(mesh.indices[offset + sequence[i]]);
-
          new_num_vertices.push_back(3);
          new_num_vertices.push_back(3);
 
          break;
       default:
-         std::cout << "Wrong number of vertices " << mesh.num_vertices[f]
-                   << ". Only tris and quads are currently supported.";
-         return;
+         // Larger polygons (brush faces) are convex, so a fan around the first vertex works
+         sequence.clear();
+         for (int i = 1; i + 1 < mesh.num_vertices[f]; i++) {
+            sequence.insert(sequence.end(), {0, (size_t)i, (size_t)i + 1});
+            new_num_vertices.push_back(3);
+         }
+         break;
+      }
+      for (size_t corner : sequence) {
+         new_indices.push_back(mesh.indices[offset + corner]);
+         if (has_corner_normals) new_corner_normals.push_back(mesh.corner_normals[offset + corner]);
       }
    }
    mesh.indices = new_indices;
    mesh.num_vertices = new_num_vertices;
+   mesh.corner_normals = new_corner_normals;
    mesh.calculate_offsets();
-}
 
-vector<Vec4> generate_edges(const Mesh &mesh) {
-
-   size_t total_edges = 0;
-   for (auto n : mesh.num_vertices) total_edges += n;
-
-   vector<Vec4> edges;
-   edges.reserve(total_edges);
+   // Only the diagonals are new at this point
+   append_unique_edges(mesh, seen);
+}
 
-   size_t idx_first, idx_second;
+/* Give every vertex one normal from mesh.corner_normals (one per index). Corners of a vertex
+   with the same normal, up to `tolerance` in their dot product, share it, and every other normal
+   gets a copy of the vertex appended. Indices and edges are remapped to the copies, an edge to
+   the first triangle side that had it. corner_normals is cleared */
+void split_vertices(Mesh &mesh, float tolerance = 1E-4f) {
+   size_t num_original = mesh.vertices.size();
+   vector<uint8_t> used(num_original, 0);
+   vector<u32> next_copy(num_original, UINT32_MAX); // Linked list of the copies of a vertex
+   mesh.normals.assign(num_original, Vec3{0, 0, 0});
+   vector<u32> original_indices = mesh.indices;
+
+   for (size_t i = 0; i < mesh.indices.size(); i++) {
+      u32 v = mesh.indices[i];
+      float length = mesh.corner_normals[i].length();
+      Vec3 n = length > 0 ? mesh.corner_normals[i] * (1 / length) : Vec3{0, 0, 0};
+      u32 match = UINT32_MAX, last = UINT32_MAX;
+      for (u32 c = used[v] ? v : UINT32_MAX; c != UINT32_MAX; last = c, c = next_copy[c]) {
+         // Corners without a normal take any
+         if (length == 0 || dot_product(mesh.normals[c], n) >= 1 - tolerance) {
+            match = c;
+            break;
+         }
+      }
+      if (match == UINT32_MAX && last == UINT32_MAX) {
+         // The first normal keeps the vertex, later ones go to appended copies
+         match = v;
+         mesh.normals[v] = n;
+         used[v] = 1;
+      } else if (match == UINT32_MAX) {
+         match = (u32)mesh.vertices.size();
+         mesh.vertices.push_back(mesh.vertices[v]);
+         mesh.normals.push_back(n);
+         next_copy.push_back(UINT32_MAX);
+         next_copy[last] = match;
+      }
+      mesh.indices[i] = match;
+   }
+   mesh.corner_normals.clear();
+   if (mesh.vertices.size() == num_original || mesh.edges.empty()) return;
 
+   // Each edge as the first triangle side over the same original vertices
+   std::unordered_map<uint64_t, uint64_t> sides;
+   sides.reserve(mesh.edges.size());
    for (size_t face_idx = 0; face_idx < mesh.num_vertices.size(); face_idx++) {
       size_t offset = mesh.index_offsets[face_idx];
       size_t num_vertices = mesh.num_vertices[face_idx];
-
-      for (int vert_idx = 0; vert_idx < num_vertices; vert_idx++) {
-
-         idx_first = mesh.indices[offset + vert_idx];
-         idx_second = mesh.indices[offset + ((vert_idx + 1) % num_vertices)];
-
-         edges.push_back(Vec4{mesh.vertices[idx_first].x(),
-                              mesh.vertices[idx_first].y(),
-                              mesh.vertices[idx_first].z(),
-                              1});
-         edges.push_back(Vec4{mesh.vertices[idx_second].x(),
-                              mesh.vertices[idx_second].y(),
-                              mesh.vertices[idx_second].z(),
-                              1});
+      for (size_t n = 0; n < num_vertices; n++) {
+         size_t i = offset + n, j = offset + (n + 1) % num_vertices;
+         u32 a = original_indices[i], b = original_indices[j];
+         u32 new_a = mesh.indices[i], new_b = mesh.indices[j];
+         if (a > b) {
+            std::swap(a, b);
+            std::swap(new_a, new_b);
+         }
+         sides.emplace(((uint64_t)a << 32) | b, ((uint64_t)new_a << 32) | new_b);
       }
    }
-   return edges;
+   for (size_t e = 0; e < mesh.edges.size(); e += 2) {
+      u32 a = mesh.edges[e], b = mesh.edges[e + 1];
+      auto it = sides.find(a < b ? ((uint64_t)a << 32) | b : ((uint64_t)b << 32) | a);
+      if (it == sides.end()) continue;
+      u32 new_low = (u32)(it->second >> 32), new_high = (u32)it->second;
+      mesh.edges[e] = a < b ? new_low : new_high;
+      mesh.edges[e + 1] = a < b ? new_high : new_low;
+   }
 }
 
-vector<Vec4> generate_faces(const Mesh &mesh) {
-
-   size_t total_edges = 0;
-   for (auto n : mesh.num_vertices) total_edges += n;
-
-   vector<Vec4> faces;
-   faces.reserve(total_edges);
+/* Vertex normals as the area-weighted sum of adjacent face normals (CCW winding assumed), split
+   at creases: a face only smooths with the faces around a vertex whose normals are within
+   `crease_degrees` of its own, and vertices with several normals are duplicated (see
+   split_vertices). Normals read from the file (mesh.corner_normals) are used instead when
+   present. Call after triangulate() so the edges are remapped too */
+void calculate_vertex_normals(Mesh &mesh, float crease_degrees = 60) {
+   if (mesh.corner_normals.size() == mesh.indices.size() && !mesh.indices.empty()) {
+      split_vertices(mesh);
+      return;
+   }
 
-   for (size_t face_idx = 0; face_idx < mesh.num_vertices.size(); face_idx++) {
+   // Area-weighted (unnormalized) and unit normal of every face
+   size_t num_faces = mesh.num_vertices.size();
+   vector<Vec3> face_normals(num_faces, Vec3{0, 0, 0}), face_units(num_faces);
+   for (size_t face_idx = 0; face_idx < num_faces; face_idx++) {
+      const u32 *idx = &mesh.indices[mesh.index_offsets[face_idx]];
+      const Vec3 &v0 = mesh.vertices[idx[0]];
+
+      // Fan around the first vertex so quads and n-gons are also handled
+      for (int i = 1; i + 1 < mesh.num_vertices[face_idx]; i++) {
+         // Unnormalized cross product is proportional to the triangle area
+         face_normals[face_idx] +=
+             cross_product(mesh.vertices[idx[i]] - v0, mesh.vertices[idx[i + 1]] - v0);
+      }
+      float length = face_normals[face_idx].length();
+      face_units[face_idx] = length > 0 ? face_normals[face_idx] * (1 / length) : Vec3{0, 0, 0};
+   }
 
-      for (int vert_idx = 0; vert_idx < mesh.num_vertices[face_idx]; vert_idx++) {
+   // Faces around each vertex, in compressed rows
+   size_t num_vertices = mesh.vertices.size();
+   vector<u32> first_face(num_vertices + 1, 0), vertex_faces(mesh.indices.size());
+   for (u32 v : mesh.indices) first_face[v + 1]++;
+   for (size_t v = 0; v < num_vertices; v++) first_face[v + 1] += first_face[v];
+   vector<u32> fill(first_face.begin(), first_face.end() - 1);
+   for (size_t face_idx = 0; face_idx < num_faces; face_idx++) {
+      size_t offset = mesh.index_offsets[face_idx];
+      for (size_t n = 0; n < mesh.num_vertices[face_idx]; n++)
+         vertex_faces[fill[mesh.indices[offset + n]]++] = (u32)face_idx;
+   }
 
-         size_t idx = mesh.indices[mesh.index_offsets[face_idx] + vert_idx];
-         faces.push_back(
-             Vec4{mesh.vertices[idx].x(), mesh.vertices[idx].y(), mesh.vertices[idx].z(), 1});
+   // Corners sum the faces within the crease angle of theirs, in the same order for every corner
+   // of a smooth region, which then gets the exact same normal. Degenerate faces take all of them
+   float min_cos = cosf(crease_degrees * 3.14159265f / 180);
+   mesh.corner_normals.resize(mesh.indices.size());
+   for (size_t face_idx = 0; face_idx < num_faces; face_idx++) {
+      size_t offset = mesh.index_offsets[face_idx];
+      const Vec3 &unit = face_units[face_idx];
+      bool degenerate = dot_product(unit, unit) == 0;
+      for (size_t n = 0; n < mesh.num_vertices[face_idx]; n++) {
+         u32 v = mesh.indices[offset + n];
+         Vec3 sum{0, 0, 0};
+         for (u32 i = first_face[v]; i < first_face[v + 1]; i++) {
+            u32 other = vertex_faces[i];
+            if (degenerate || dot_product(unit, face_units[other]) >= min_cos)
+               sum += face_normals[other];
+         }
+         mesh.corner_normals[offset + n] = sum;
       }
    }
-   return faces;
+   split_vertices(mesh);
 }
 
 Vec4 get_face_normal(const Vec4 *face, uint8_t num_vertices, bool ccw_winding = false) {
@@ -143,18 +334,6 @@ Vec4 get_face_normal(const Vec4 *face, uint8_t num_vertices, bool ccw_winding =
    return n.normalized();
 }
 
-vector<Vec4> get_mesh_face_normals(Mesh mesh, const vector<Vec4> &faces, bool ccw_winding = false) {
-
-   vector<Vec4> normals;
-   normals.reserve(mesh.num_vertices.size());
-   size_t offset = 0;
-   for (auto n : mesh.num_vertices) {
-      normals.push_back(get_face_normal(&faces[offset], n, ccw_winding));
-      offset += n;
-   }
-   return normals;
-}
-
 Vec4 get_face_center(const Vec4 *face, uint8_t num_vertices) {
 
    // if (face.size() < 3) throw std::runtime_error("Face had less than 3 vertices.");
@@ -163,17 +342,4 @@ Vec4 get_face_center(const Vec4 *face, uint8_t num_vertices) {
    return center * (1.f / num_vertices);
 }
 
-// * This could be done with SIMD
-vector<Vec4> get_mesh_face_centers(Mesh mesh, const vector<Vec4> &faces) {
-
-   vector<Vec4> centers;
-   centers.reserve(mesh.num_vertices.size());
-   size_t offset = 0;
-   for (auto n : mesh.num_vertices) {
-      centers.push_back(get_face_center(&faces[offset], n));
-      offset += n;
-   }
-   return centers;
-}
-
 } // namespace fuake
\ No newline at end of file
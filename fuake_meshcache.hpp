@@ -0,0 +1,244 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstddef>
+#include <cstring>
+#include <fstream>
+#include <filesystem>
+
+#include "fuake_mesh.hpp"
+#include "fuake_mmap.hpp"
+#include "fuake_objloader.hpp"
+#include "fuake_profiler.hpp"
+
+using std::string;
+using std::vector;
+
+namespace fuake {
+
+/* .fmesh: a mesh after loading, triangulation, offsets, edges and normals, stored as flat arrays
+   so loading is a handful of bulk copies. Layout: FMeshHeader, then each array in the order of
+   the header counts, every one starting at a 16 byte boundary:
+   name (chars), x, y, z (floats), normal x, y, z (floats), indices (u32), num_vertices (u8),
+   index_offsets (u32), edges (u32). */
+const u32 kFMeshMagic = 0x48534D46; // "FMSH"
+const u32 kFMeshVersion = 2; // 2: normals from vn, split at creases
+
+struct FMeshHeader {
+   u32 magic;
+   u32 version;
+   u32 exchange_axes;
+   u32 reserved;
+
+   // Source OBJ stamp, the cache is stale when it doesn't match
+   uint64_t source_size;
+   int64_t source_mtime;
+   uint64_t source_hash;
+
+   uint64_t name_length;
+   uint64_t num_vertices;
+   uint64_t num_normals;
+   uint64_t num_indices;
+   uint64_t num_faces;
+   uint64_t num_edges; // Edge index count, 2 per edge
+   uint64_t num_outline_edges;
+};
+
+// FNV-1a, only needed when the source mtime changed but its contents might not have
+uint64_t hash_bytes(const char *data, size_t size) {
+   uint64_t hash = 14695981039346656037ull;
+   for (size_t i = 0; i < size; i++) {
+      hash ^= (u8)data[i];
+      hash *= 1099511628211ull;
+   }
+   return hash;
+}
+
+int64_t file_mtime(const string &filepath) {
+   std::error_code error;
+   auto time = std::filesystem::last_write_time(filepath, error);
+   return error ? 0 : (int64_t)time.time_since_epoch().count();
+}
+
+/* Write `mtime` over the source mtime stamp at `offset` of a cache file. For a source that was
+   touched but hashes the same, so later loads don't hash it again */
+bool restamp_source_mtime(const string &filepath, size_t offset, int64_t mtime) {
+   std::fstream fs(filepath, std::ios::binary | std::ios::in | std::ios::out);
+   if (!fs) return false;
+   fs.seekp(offset);
+   fs.write((const char *)&mtime, sizeof(mtime));
+   return (bool)fs;
+}
+
+size_t align16(size_t offset) { return (offset + 15) & ~(size_t)15; }
+
+string fmesh_path(const string &obj_path) { return obj_path + ".fmesh"; }
+
+bool write_fmesh(const string &filepath, const Mesh &mesh, FMeshHeader header) {
+   header.magic = kFMeshMagic;
+   header.version = kFMeshVersion;
+   header.name_length = mesh.name.size();
+   header.num_vertices = mesh.vertices.size();
+   header.num_normals = mesh.normals.size();
+   header.num_indices = mesh.indices.size();
+   header.num_faces = mesh.num_vertices.size();
+   header.num_edges = mesh.edges.size();
+   header.num_outline_edges = mesh.num_outline_edges;
+
+   vector<char> out(sizeof(FMeshHeader));
+   memcpy(out.data(), &header, sizeof(header));
+
+   auto append = [&out](const void *data, size_t bytes) {
+      out.resize(align16(out.size()));
+      out.insert(out.end(), (const char *)data, (const char *)data + bytes);
+   };
+   auto append_floats = [&append](const vector<Vec3> &v, int axis) {
+      vector<float> tmp(v.size());
+      for (size_t i = 0; i < v.size(); i++) tmp[i] = v[i][axis];
+      append(tmp.data(), tmp.size() * sizeof(float));
+   };
+
+   append(mesh.name.data(), mesh.name.size());
+   for (int axis = 0; axis < 3; axis++) append_floats(mesh.vertices, axis);
+   for (int axis = 0; axis < 3; axis++) append_floats(mesh.normals, axis);
+   append(mesh.indices.data(), mesh.indices.size() * sizeof(u32));
+   append(mesh.num_vertices.data(), mesh.num_vertices.size());
+   append(mesh.index_offsets.data(), mesh.index_offsets.size() * sizeof(u32));
+   append(mesh.edges.data(), mesh.edges.size() * sizeof(u32));
+
+   // Write to a temporary file first so a crash never leaves a half written cache behind
+   string tmp_path = filepath + ".tmp";
+   {
+      std::ofstream fs(tmp_path, std::ios::binary | std::ios::trunc);
+      if (!fs) return false;
+      fs.write(out.data(), out.size());
+      if (!fs) return false;
+   }
+   std::error_code error;
+   std::filesystem::rename(tmp_path, filepath, error);
+   return !error;
+}
+
+// Read a .fmesh into `mesh` if it exists and matches `stamp`. `source` is only hashed if needed
+bool read_fmesh(const string &filepath, const FMeshHeader &stamp, const MappedFile &source,
+                Mesh &mesh) {
+   MappedFile file(filepath);
+   if (!file.is_open || file.size < sizeof(FMeshHeader)) return false;
+
+   FMeshHeader header;
+   memcpy(&header, file.data, sizeof(header));
+   if (header.magic != kFMeshMagic || header.version != kFMeshVersion) return false;
+   if (header.exchange_axes != stamp.exchange_axes) return false;
+   if (header.source_size != stamp.source_size) return false;
+   if (header.source_mtime != stamp.source_mtime &&
+       header.source_hash != hash_bytes(source.data, source.size))
+      return false;
+
+   uint64_t nv = header.num_vertices, nn = header.num_normals;
+   if ((nn != 0 && nn != nv) || header.num_edges % 2 != 0 ||
+       header.num_outline_edges > header.num_edges / 2)
+      return false;
+
+   // Check every array fits in the file before copying anything. Counts are bounded by the bytes
+   // left before they're multiplied, so a corrupt one can't wrap around
+   struct Array {
+      uint64_t count, element_size;
+   } arrays[] = {{header.name_length, 1},
+                 {nv, 4},
+                 {nv, 4},
+                 {nv, 4},
+                 {nn, 4},
+                 {nn, 4},
+                 {nn, 4},
+                 {header.num_indices, 4},
+                 {header.num_faces, 1},
+                 {header.num_faces, 4},
+                 {header.num_edges, 4}};
+   const size_t num_arrays = sizeof(arrays) / sizeof(arrays[0]);
+   size_t offsets[num_arrays];
+   size_t offset = sizeof(FMeshHeader);
+   for (size_t i = 0; i < num_arrays; i++) {
+      offsets[i] = align16(offset);
+      if (offsets[i] > file.size ||
+          arrays[i].count > (file.size - offsets[i]) / arrays[i].element_size)
+         return false;
+      offset = offsets[i] + arrays[i].count * arrays[i].element_size;
+   }
+
+   const char *data = file.data;
+   auto floats = [&](int array) { return (const float *)(data + offsets[array]); };
+   auto u32s = [&](int array) { return (const u32 *)(data + offsets[array]); };
+
+   mesh = Mesh();
+   mesh.name.assign(data + offsets[0], header.name_length);
+
+   mesh.vertices.resize(nv);
+   const float *x = floats(1), *y = floats(2), *z = floats(3);
+   for (size_t i = 0; i < nv; i++) mesh.vertices[i] = Vec3{x[i], y[i], z[i]};
+   mesh.update_bounds();
+
+   mesh.normals.resize(nn);
+   const float *nx = floats(4), *ny = floats(5), *nz = floats(6);
+   for (size_t i = 0; i < nn; i++) mesh.normals[i] = Vec3{nx[i], ny[i], nz[i]};
+
+   mesh.indices.assign(u32s(7), u32s(7) + header.num_indices);
+   mesh.num_vertices.assign((const u8 *)(data + offsets[8]),
+                            (const u8 *)(data + offsets[8]) + header.num_faces);
+   mesh.index_offsets.assign(u32s(9), u32s(9) + header.num_faces);
+   mesh.edges.assign(u32s(10), u32s(10) + header.num_edges);
+   mesh.num_outline_edges = header.num_outline_edges;
+
+   // A cache with the right stamp can still be corrupt: every index must be in range before the
+   // renderer follows it
+   bool valid = true;
+   for (u32 v : mesh.indices) valid &= v < nv;
+   for (u32 v : mesh.edges) valid &= v < nv;
+   for (size_t f = 0; f < header.num_faces && valid; f++)
+      valid = mesh.num_vertices[f] >= 3 &&
+              (uint64_t)mesh.index_offsets[f] + mesh.num_vertices[f] <= header.num_indices;
+   if (!valid) {
+      mesh = Mesh();
+      return false;
+   }
+
+   if (header.source_mtime != stamp.source_mtime) {
+      file.close();
+      restamp_source_mtime(filepath, offsetof(FMeshHeader, source_mtime), stamp.source_mtime);
+   }
+   return true;
+}
+
+/* Load an OBJ ready for rendering (triangulated, with edges and normals). The result is cached
+   next to the OBJ as <name>.obj.fmesh and rebuilt when the OBJ's size, mtime or contents change. */
+Mesh load_mesh_cached(const string &obj_path, bool exchange_axes = true) {
+   FUAKE_PROFILE_SCOPE("Load mesh");
+   Mesh mesh;
+
+   MappedFile source(obj_path);
+   if (!source.is_open) {
+      printf("WARNING: Couldn't open %s\n", obj_path.c_str());
+      return mesh;
+   }
+
+   FMeshHeader stamp = {};
+   stamp.exchange_axes = exchange_axes;
+   stamp.source_size = source.size;
+   stamp.source_mtime = file_mtime(obj_path);
+
+   // A stale or damaged cache is rebuilt from the OBJ
+   string cache_path = fmesh_path(obj_path);
+   if (read_fmesh(cache_path, stamp, source, mesh)) return mesh;
+
+   mesh = read_obj(obj_path, exchange_axes);
+   triangulate(mesh);
+   calculate_vertex_normals(mesh);
+
+   stamp.source_hash = hash_bytes(source.data, source.size);
+   if (!write_fmesh(cache_path, mesh, stamp))
+      printf("WARNING: Couldn't write mesh cache %s\n", cache_path.c_str());
+
+   return mesh;
+}
+
+} // namespace fuake
@@ -0,0 +1,115 @@
+#pragma once
+
+#include <string>
+
+#if defined(_WIN32)
+#ifndef WIN32_LEAN_AND_MEAN
+#define WIN32_LEAN_AND_MEAN
+#endif
+#ifndef NOMINMAX
+#define NOMINMAX
+#endif
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+using std::string;
+
+namespace fuake {
+
+// Read-only memory mapping of a whole file. An empty file maps to data == nullptr, size == 0
+struct MappedFile {
+   const char *data = nullptr;
+   size_t size = 0;
+   bool is_open = false;
+
+#if defined(_WIN32)
+   HANDLE file = INVALID_HANDLE_VALUE;
+   HANDLE mapping = NULL;
+#else
+   int fd = -1;
+#endif
+
+   MappedFile() {}
+   MappedFile(const string &filepath) { open(filepath); }
+   ~MappedFile() { close(); }
+
+   MappedFile(const MappedFile &) = delete;
+   MappedFile &operator=(const MappedFile &) = delete;
+
+   bool open(const string &filepath) {
+      close();
+#if defined(_WIN32)
+      file = CreateFileA(filepath.c_str(),
+                         GENERIC_READ,
+                         FILE_SHARE_READ,
+                         NULL,
+                         OPEN_EXISTING,
+                         FILE_FLAG_SEQUENTIAL_SCAN,
+                         NULL);
+      if (file == INVALID_HANDLE_VALUE) return false;
+
+      LARGE_INTEGER file_size;
+      GetFileSizeEx(file, &file_size);
+      size = (size_t)file_size.QuadPart;
+
+      if (size > 0) {
+         mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+         if (mapping == NULL) {
+            close();
+            return false;
+         }
+         data = (const char *)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+         if (data == nullptr) {
+            close();
+            return false;
+         }
+      }
+#else
+      fd = ::open(filepath.c_str(), O_RDONLY);
+      if (fd < 0) return false;
+
+      struct stat st;
+      if (fstat(fd, &st) != 0) {
+         close();
+         return false;
+      }
+      size = (size_t)st.st_size;
+
+      if (size > 0) {
+         void *ptr = mmap(nullptr, size, PROT_READ, MAP_PRIVATE, fd, 0);
+         if (ptr == MAP_FAILED) {
+            close();
+            return false;
+         }
+         data = (const char *)ptr;
+         madvise(ptr, size, MADV_SEQUENTIAL);
+      }
+#endif
+      is_open = true;
+      return true;
+   }
+
+   void close() {
+#if defined(_WIN32)
+      if (data) UnmapViewOfFile(data);
+      if (mapping != NULL) CloseHandle(mapping);
+      if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+      mapping = NULL;
+      file = INVALID_HANDLE_VALUE;
+#else
+      if (data) munmap((void *)data, size);
+      if (fd >= 0) ::close(fd);
+      fd = -1;
+#endif
+      data = nullptr;
+      size = 0;
+      is_open = false;
+   }
+};
+
+} // namespace fuake
@@ -4,8 +4,12 @@
 #include <string>
 #include <fstream>
 #include <sstream>
+#include <charconv>
 
 #include "fuake_mesh.hpp"
+#include "fuake_mmap.hpp"
+#include "fuake_profiler.hpp"
+#include "fuake_threadpool.hpp"
 
 using namespace std;
 
@@ -36,7 +40,8 @@ ObjToken get_token(const string token) {
    return kToken_Unknown;
 }
 
-Mesh read_obj(const string filepath, bool exchange_axes = true) {
+// Original stream based loader, kept as a reference for bench_objload
+Mesh read_obj_stream(const string filepath, bool exchange_axes = true) {
 
    Mesh mesh;
    string buf;
@@ -86,6 +91,260 @@ Mesh read_obj(const string filepath, bool exchange_axes = true) {
    }
 
    mesh.calculate_offsets();
+   mesh.update_bounds();
+   return mesh;
+}
+
+// Geometry parsed from one chunk of an OBJ file. Negative (relative) face indices that point
+// before the chunk can't be resolved until all chunks are parsed, so they are stored relative
+// to the chunk's first vertex (or normal) and listed in relative_slots (relative_normal_slots)
+// for the merge to fix up.
+struct ObjChunk {
+   string name;
+   vector<Vec3> vertices;
+   vector<Vec3> normals;       // vn
+   vector<u32> indices;
+   vector<u32> normal_indices; // Per corner, UINT32_MAX for corners without one
+   vector<uint8_t> num_vertices;
+   vector<size_t> relative_slots, relative_normal_slots;
+   size_t skipped_faces = 0; // With more vertices than Mesh::num_vertices can count
+};
+
+inline bool obj_is_space(char c) { return c == ' ' || c == '\t' || c == '\r'; }
+
+inline const char *obj_skip_spaces(const char *p, const char *end) {
+   while (p < end && obj_is_space(*p)) p++;
+   return p;
+}
+
+inline const char *obj_skip_line(const char *p, const char *end) {
+   while (p < end && *p != '\n') p++;
+   return p < end ? p + 1 : end;
+}
+
+// Three floats after a v or vn token, with the axes exchanged as for positions
+inline const char *obj_parse_vec3(const char *p, const char *end, bool exchange_axes, Vec3 &out) {
+   for (int i = 0; i < 3; i++) {
+      p = obj_skip_spaces(p, end);
+      if (p < end && *p == '+') p++;
+      auto result = std::from_chars(p, end, out[i]);
+      p = result.ptr;
+   }
+   if (exchange_axes) {
+      float y = out.y();
+      out.y() = -out.z();
+      out.z() = y;
+   }
+   return p;
+}
+
+// Parse [begin, end), which must start at the beginning of a line
+void parse_obj_chunk(const char *begin, const char *end, bool exchange_axes, ObjChunk &chunk) {
+   const char *p = begin;
+
+   while (p < end) {
+      p = obj_skip_spaces(p, end);
+      if (p >= end) break;
+
+      const char *token = p;
+      while (p < end && !obj_is_space(*p) && *p != '\n') p++;
+      size_t token_len = p - token;
+
+      if (token_len == 1 && token[0] == 'v') {
+         Vec3 vertex;
+         p = obj_parse_vec3(p, end, exchange_axes, vertex);
+         chunk.vertices.push_back(vertex);
+
+      } else if (token_len == 2 && token[0] == 'v' && token[1] == 'n') {
+         Vec3 normal;
+         p = obj_parse_vec3(p, end, exchange_axes, normal);
+         chunk.normals.push_back(normal);
+
+      } else if (token_len == 1 && token[0] == 'f') {
+         size_t num_vert = 0, first_index = chunk.indices.size();
+         size_t first_slot = chunk.relative_slots.size();
+         size_t first_normal_slot = chunk.relative_normal_slots.size();
+         while (true) {
+            p = obj_skip_spaces(p, end);
+            if (p >= end || *p == '\n' || *p == '#') break;
+
+            // Position and normal indices of v, v/vt, v//vn and v/vt/vn, texture coords are skipped
+            long long idx = 0;
+            auto result = std::from_chars(p, end, idx);
+            if (result.ptr == p) break; // Malformed face, ignore the rest of the line
+            p = result.ptr;
+            long long normal_idx = 0;
+            if (p < end && *p == '/') {
+               p++;
+               while (p < end && *p != '/' && !obj_is_space(*p) && *p != '\n') p++;
+               if (p < end && *p == '/') {
+                  auto normal_result = std::from_chars(p + 1, end, normal_idx);
+                  if (normal_result.ptr != p + 1) p = normal_result.ptr;
+               }
+            }
+            while (p < end && !obj_is_space(*p) && *p != '\n') p++;
+
+            // Index 0 and indices past u32 become UINT32_MAX, which the merge finds out of range
+            if (idx < 0) {
+               chunk.relative_slots.push_back(chunk.indices.size());
+               chunk.indices.push_back((u32)((long long)chunk.vertices.size() + idx));
+            } else {
+               chunk.indices.push_back(idx > 0 && idx <= UINT32_MAX ? (u32)(idx - 1) : UINT32_MAX);
+            }
+            if (normal_idx < 0) {
+               chunk.relative_normal_slots.push_back(chunk.normal_indices.size());
+               chunk.normal_indices.push_back((u32)((long long)chunk.normals.size() + normal_idx));
+            } else {
+               chunk.normal_indices.push_back(normal_idx > 0 ? (u32)(normal_idx - 1) : UINT32_MAX);
+            }
+            num_vert++;
+         }
+         if (num_vert > UINT8_MAX) {
+            chunk.indices.resize(first_index);
+            chunk.normal_indices.resize(first_index);
+            chunk.relative_slots.resize(first_slot);
+            chunk.relative_normal_slots.resize(first_normal_slot);
+            chunk.skipped_faces++;
+         } else {
+            chunk.num_vertices.push_back((uint8_t)num_vert);
+         }
+
+      } else if (token_len == 1 && token[0] == 'o' && chunk.name.empty()) {
+         p = obj_skip_spaces(p, end);
+         const char *name_end = p;
+         while (name_end < end && *name_end != '\n' && *name_end != '\r') name_end++;
+         chunk.name.assign(p, name_end);
+      }
+
+      // Comments, texture coords, groups... are skipped for now
+      p = obj_skip_line(p, end);
+   }
+}
+
+/* Memory-mapped OBJ loader: the file is split in line-aligned chunks parsed in parallel. Normals
+   (vn) come back per index in mesh.corner_normals */
+Mesh read_obj(const string filepath, bool exchange_axes = true) {
+   FUAKE_PROFILE_SCOPE("Read OBJ");
+
+   Mesh mesh;
+   MappedFile file(filepath);
+   if (!file.is_open) {
+      printf("WARNING: Couldn't open %s\n", filepath.c_str());
+      return mesh;
+   }
+
+   ThreadPool &pool = default_thread_pool();
+   const char *data = file.data;
+   const char *data_end = file.data + file.size;
+
+   // Split in chunks of at least 256KB, ending right after a newline
+   const size_t min_chunk_size = 1 << 18;
+   size_t num_chunks = std::max<size_t>(1, std::min(pool.size() * 4, file.size / min_chunk_size));
+   vector<const char *> bounds(num_chunks + 1, data_end);
+   bounds[0] = data;
+   for (size_t c = 1; c < num_chunks; c++) {
+      const char *p = std::max(bounds[c - 1], data + file.size * c / num_chunks);
+      bounds[c] = obj_skip_line(p, data_end);
+   }
+
+   vector<ObjChunk> chunks(num_chunks);
+   pool.parallel_for(num_chunks, [&](size_t c, size_t) {
+      parse_obj_chunk(bounds[c], bounds[c + 1], exchange_axes, chunks[c]);
+   });
+
+   // Prefix sums give each chunk its place in the merged arrays
+   vector<size_t> vertex_base(num_chunks + 1, 0), index_base(num_chunks + 1, 0),
+       face_base(num_chunks + 1, 0), normal_base(num_chunks + 1, 0);
+   for (size_t c = 0; c < num_chunks; c++) {
+      vertex_base[c + 1] = vertex_base[c] + chunks[c].vertices.size();
+      index_base[c + 1] = index_base[c] + chunks[c].indices.size();
+      face_base[c + 1] = face_base[c] + chunks[c].num_vertices.size();
+      normal_base[c + 1] = normal_base[c] + chunks[c].normals.size();
+   }
+   mesh.vertices.resize(vertex_base[num_chunks]);
+   mesh.indices.resize(index_base[num_chunks]);
+   mesh.num_vertices.resize(face_base[num_chunks]);
+   vector<Vec3> normals(normal_base[num_chunks]);
+   vector<u32> normal_indices(normal_base[num_chunks] ? index_base[num_chunks] : 0);
+
+   pool.parallel_for(num_chunks, [&](size_t c, size_t) {
+      ObjChunk &chunk = chunks[c];
+      std::copy(
+          chunk.vertices.begin(), chunk.vertices.end(), mesh.vertices.data() + vertex_base[c]);
+      std::copy(chunk.num_vertices.begin(),
+                chunk.num_vertices.end(),
+                mesh.num_vertices.data() + face_base[c]);
+
+      // Relative indices only become absolute once the vertices before the chunk are known
+      for (size_t slot : chunk.relative_slots) chunk.indices[slot] += (u32)vertex_base[c];
+      std::copy(chunk.indices.begin(), chunk.indices.end(), mesh.indices.data() + index_base[c]);
+
+      if (normals.empty()) return;
+      std::copy(chunk.normals.begin(), chunk.normals.end(), normals.data() + normal_base[c]);
+      for (size_t slot : chunk.relative_normal_slots)
+         chunk.normal_indices[slot] += (u32)normal_base[c];
+      std::copy(chunk.normal_indices.begin(),
+                chunk.normal_indices.end(),
+                normal_indices.data() + index_base[c]);
+   });
+
+   size_t skipped_faces = 0;
+   for (auto &chunk : chunks) skipped_faces += chunk.skipped_faces;
+   if (skipped_faces > 0)
+      printf("WARNING: Skipped %zu faces of %s with more than %d vertices\n",
+             skipped_faces,
+             filepath.c_str(),
+             UINT8_MAX);
+   for (auto &chunk : chunks) {
+      if (!chunk.name.empty()) {
+         mesh.name = chunk.name;
+         break;
+      }
+   }
+
+   // Drop the faces using a vertex that doesn't exist, along with their corners
+   size_t num_faces = 0, num_indices = 0, bad_faces = 0;
+   for (size_t f = 0, first = 0; f < mesh.num_vertices.size(); f++) {
+      u32 count = mesh.num_vertices[f];
+      bool valid = true;
+      for (u32 k = 0; k < count; k++) valid &= mesh.indices[first + k] < mesh.vertices.size();
+      if (valid) {
+         u32 *indices = mesh.indices.data();
+         std::copy(indices + first, indices + first + count, indices + num_indices);
+         if (!normal_indices.empty())
+            std::copy(normal_indices.data() + first,
+                      normal_indices.data() + first + count,
+                      normal_indices.data() + num_indices);
+         mesh.num_vertices[num_faces++] = (uint8_t)count;
+         num_indices += count;
+      } else {
+         bad_faces++;
+      }
+      first += count;
+   }
+   if (bad_faces > 0) {
+      printf("WARNING: %zu faces of %s use vertices that don't exist, ignoring them\n",
+             bad_faces,
+             filepath.c_str());
+      mesh.num_vertices.resize(num_faces);
+      mesh.indices.resize(num_indices);
+      if (!normal_indices.empty()) normal_indices.resize(num_indices);
+   }
+
+   // File normals are only used when every corner has one, calculate_vertex_normals() splits the
+   // vertices by them
+   size_t num_with_normal = 0;
+   for (u32 n : normal_indices) num_with_normal += n < normals.size();
+   if (num_with_normal > 0 && num_with_normal == normal_indices.size()) {
+      mesh.corner_normals.resize(normal_indices.size());
+      for (size_t i = 0; i < normal_indices.size(); i++)
+         mesh.corner_normals[i] = normals[normal_indices[i]];
+   } else if (num_with_normal > 0) {
+      printf("WARNING: Only some faces of %s have normals, ignoring them\n", filepath.c_str());
+   }
+
+   mesh.calculate_offsets();
+   mesh.update_bounds();
    return mesh;
 }
 
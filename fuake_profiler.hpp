@@ -0,0 +1,274 @@
+#pragma once
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+#include <amath_core.hpp>
+
+using std::string;
+using std::vector;
+using namespace amath;
+
+/* Scoped timers and counters for the hot paths. Build with FUAKE_PROFILE=0 to compile every
+   FUAKE_PROFILE_* macro out, arguments included */
+#ifndef FUAKE_PROFILE
+#define FUAKE_PROFILE 1
+#endif
+
+namespace fuake {
+
+enum ProfileCounter {
+   kProfileCounter_FacesIn,
+   kProfileCounter_FacesBackfaceCulled,
+   kProfileCounter_FacesViewportCulled,
+   kProfileCounter_VerticesTransformed,
+   kProfileCounter_DrawCalls,
+   kProfileCounter_PointLightsEvaluated,
+   kNumProfileCounters,
+};
+
+const char *PROFILE_COUNTER_NAMES[] = {
+    "Faces in",
+    "Faces backface culled",
+    "Faces viewport culled",
+    "Vertices transformed",
+    "Draw calls",
+    "Point lights evaluated",
+};
+
+// Time spent in a named scope, over the last frame and on average
+struct ProfileZone {
+   const char *name;
+   int depth;         // Nesting when first seen, for display
+   double last_ms = 0;
+   double average_ms = 0;
+   u32 last_calls = 0;
+};
+
+/* Collects the scopes and counters of a frame, summarized by end_frame(). Scopes of any thread can
+   be recorded, but the ones around parallel stages are on the calling thread so they measure wall
+   time. While capturing, events are kept for a Chrome trace (chrome://tracing, Perfetto) */
+struct Profiler {
+   using Clock = std::chrono::steady_clock;
+
+   struct Event {
+      const char *name;
+      u32 thread;
+      int depth;
+      double start_us, duration_us;
+   };
+
+   // Tools that never call end_frame() would keep every scope they record, so a frame keeps this
+   // many events at most and drops the rest
+   static const size_t kMaxFrameEvents = 1 << 16;
+
+   Clock::time_point epoch = Clock::now();
+   std::mutex mutex;
+   vector<Event> frame_events;
+   size_t dropped_events = 0; // Of the current frame
+   std::atomic<uint64_t> counters[kNumProfileCounters] = {};
+
+   // Summary of the last frame
+   vector<ProfileZone> zones; // In order of first appearance
+   uint64_t last_counters[kNumProfileCounters] = {};
+   size_t last_dropped_events = 0;
+   size_t frame_counter = 0;
+
+   // Trace capture
+   vector<Event> trace_events;
+   vector<std::pair<double, vector<uint64_t>>> trace_counters; // Per frame
+   string capture_path;
+   size_t capture_frames_left = 0;
+
+   double now_us() const {
+      return std::chrono::duration<double, std::micro>(Clock::now() - epoch).count();
+   }
+
+   // Small ids for the trace, in order of first use
+   static u32 thread_id() {
+      static std::atomic<u32> next_id{0};
+      thread_local u32 id = next_id++;
+      return id;
+   }
+
+   static int &thread_depth() {
+      thread_local int depth = 0;
+      return depth;
+   }
+
+   void record(const char *name, int depth, double start_us, double end_us) {
+      std::lock_guard<std::mutex> lock(mutex);
+      if (frame_events.size() >= kMaxFrameEvents) {
+         dropped_events++;
+         return;
+      }
+      frame_events.push_back({name, thread_id(), depth, start_us, end_us - start_us});
+   }
+
+   void count(ProfileCounter counter, uint64_t n) {
+      counters[counter].fetch_add(n, std::memory_order_relaxed);
+   }
+
+   bool capturing() const { return capture_frames_left > 0; }
+
+   // Capture the next `frames` frames into a Chrome trace written to `filepath`
+   void start_capture(const string &filepath, size_t frames) {
+      std::lock_guard<std::mutex> lock(mutex);
+      capture_path = filepath;
+      capture_frames_left = frames;
+      trace_events.clear();
+      trace_counters.clear();
+   }
+
+   // Summarize the frame's scopes and counters and start the next frame
+   void end_frame() {
+      std::lock_guard<std::mutex> lock(mutex);
+      for (auto &zone : zones) {
+         zone.last_ms = 0;
+         zone.last_calls = 0;
+      }
+      for (auto &event : frame_events) {
+         size_t z = 0;
+         while (z < zones.size() && strcmp(zones[z].name, event.name) != 0) z++;
+         if (z == zones.size()) zones.push_back({event.name, event.depth});
+         zones[z].last_ms += event.duration_us / 1000;
+         zones[z].last_calls++;
+      }
+      for (auto &zone : zones)
+         zone.average_ms = frame_counter ? zone.average_ms * 0.95 + zone.last_ms * 0.05
+                                         : zone.last_ms;
+      for (int c = 0; c < kNumProfileCounters; c++)
+         last_counters[c] = counters[c].exchange(0, std::memory_order_relaxed);
+
+      if (capture_frames_left > 0) {
+         trace_events.insert(trace_events.end(), frame_events.begin(), frame_events.end());
+         trace_counters.push_back(
+             {now_us(), vector<uint64_t>(last_counters, last_counters + kNumProfileCounters)});
+         if (--capture_frames_left == 0) write_trace();
+      }
+      frame_events.clear();
+      last_dropped_events = dropped_events;
+      dropped_events = 0;
+      frame_counter++;
+   }
+
+   // Write the capture so far and stop capturing
+   bool stop_capture() {
+      std::lock_guard<std::mutex> lock(mutex);
+      capture_frames_left = 0;
+      return write_trace();
+   }
+
+ private:
+   // Chrome trace event format: complete events for scopes, counter events per frame
+   bool write_trace() {
+      std::ofstream fs(capture_path, std::ios::trunc);
+      if (!fs) {
+         printf("WARNING: Couldn't write trace %s\n", capture_path.c_str());
+         return false;
+      }
+
+      fs << "{\"displayTimeUnit\": \"ms\", \"traceEvents\": [\n";
+      char line[512];
+      bool first = true;
+      for (auto &event : trace_events) {
+         snprintf(line,
+                  sizeof(line),
+                  "%s{\"name\": \"%s\", \"cat\": \"fuake\", \"ph\": \"X\", \"ts\": %.3f, "
+                  "\"dur\": %.3f, \"pid\": 1, \"tid\": %u}",
+                  first ? "" : ",\n",
+                  event.name,
+                  event.start_us,
+                  event.duration_us,
+                  event.thread);
+         fs << line;
+         first = false;
+      }
+      for (auto &frame : trace_counters) {
+         fs << (first ? "" : ",\n");
+         snprintf(line,
+                  sizeof(line),
+                  "{\"name\": \"counters\", \"ph\": \"C\", \"ts\": %.3f, \"pid\": 1, \"args\": {",
+                  frame.first);
+         fs << line;
+         for (int c = 0; c < kNumProfileCounters; c++)
+            fs << (c ? ", " : "") << "\"" << PROFILE_COUNTER_NAMES[c] << "\": " << frame.second[c];
+         fs << "}}";
+         first = false;
+      }
+      fs << "\n]}\n";
+
+      printf("Trace of %zu frames written to %s\n", trace_counters.size(), capture_path.c_str());
+      trace_events.clear();
+      trace_counters.clear();
+      return (bool)fs;
+   }
+};
+
+Profiler &profiler() {
+   static Profiler instance;
+   return instance;
+}
+
+// Records the time from construction to destruction under `name` (a string literal)
+struct ProfileScope {
+   const char *name;
+   double start_us;
+
+   ProfileScope(const char *name) : name(name), start_us(profiler().now_us()) {
+      Profiler::thread_depth()++;
+   }
+
+   ~ProfileScope() {
+      int depth = --Profiler::thread_depth();
+      profiler().record(name, depth, start_us, profiler().now_us());
+   }
+};
+
+/* Consecutive stages of a pipeline: each next() ends the current stage and starts another, so a
+   function can time its stages without a block around each. The last one ends with the object */
+struct ProfileStages {
+   const char *name = nullptr;
+   double start_us = 0;
+
+   void next(const char *next_name) {
+      double now_us = profiler().now_us();
+      if (name) {
+         int depth = --Profiler::thread_depth();
+         profiler().record(name, depth, start_us, now_us);
+      }
+      name = next_name;
+      start_us = now_us;
+      if (name) Profiler::thread_depth()++;
+   }
+
+   ~ProfileStages() { next(nullptr); }
+};
+
+} // namespace fuake
+
+#if FUAKE_PROFILE
+#define FUAKE_PROFILE_CONCAT_(a, b) a##b
+#define FUAKE_PROFILE_CONCAT(a, b) FUAKE_PROFILE_CONCAT_(a, b)
+#define FUAKE_PROFILE_SCOPE(name) \
+   fuake::ProfileScope FUAKE_PROFILE_CONCAT(profile_scope_, __LINE__)(name)
+#define FUAKE_PROFILE_STAGES() fuake::ProfileStages profile_stages_
+#define FUAKE_PROFILE_STAGE(name) profile_stages_.next(name)
+#define FUAKE_PROFILE_STAGE_END() profile_stages_.next(nullptr)
+#define FUAKE_PROFILE_COUNT(counter, n) fuake::profiler().count(counter, n)
+#define FUAKE_PROFILE_FRAME() fuake::profiler().end_frame()
+#else
+#define FUAKE_PROFILE_SCOPE(name) ((void)0)
+#define FUAKE_PROFILE_STAGES() ((void)0)
+#define FUAKE_PROFILE_STAGE(name) ((void)0)
+#define FUAKE_PROFILE_STAGE_END() ((void)0)
+#define FUAKE_PROFILE_COUNT(counter, n) ((void)sizeof(n)) // Keeps local tallies "used"
+#define FUAKE_PROFILE_FRAME() ((void)0)
+#endif
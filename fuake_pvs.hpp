@@ -0,0 +1,758 @@
+#pragma once
+
+#include <math.h>
+#include <vector>
+#include <string>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <algorithm>
+#include <filesystem>
+
+#include <amath_core.hpp>
+#include <amath_utils.hpp>
+
+#include "fuake_mesh.hpp"
+#include "fuake_mmap.hpp"
+#include "fuake_accel.hpp"
+#include "fuake_maploader.hpp"
+#include "fuake_meshcache.hpp"
+#include "fuake_profiler.hpp"
+#include "fuake_threadpool.hpp"
+
+using std::string;
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+/* .pvs: potentially visible set of a compiled map, computed offline next to the .MAP (see
+   vis_maps.cpp). The map's bounds are split in a grid of cubic cells, and every cell stores a
+   bitset of the cells that can be seen from anywhere inside it. Bitsets are compressed the way
+   Quake does it: runs of zero bytes are stored as a 0 followed by the run length. Layout:
+   PVSHeader, row offsets (u32, num_cells + 1), rows (u8), every array at a 16 byte boundary. */
+const u32 kPVSMagic = 0x53565046; // "FPVS"
+const u32 kPVSVersion = 3;
+
+struct PVSHeader {
+   u32 magic;
+   u32 version;
+   u32 exchange_axes;
+   u32 reserved;
+
+   // Source MAP stamp, the PVS is stale when it doesn't match
+   uint64_t source_size;
+   int64_t source_mtime;
+   uint64_t source_hash;
+
+   float origin[3];
+   float cell_size;
+   int32_t dims[3];
+   u32 num_row_bytes;
+};
+
+// A BVH leaf of one of the map's meshes
+struct PVSLeaf {
+   u32 mesh, node;
+};
+
+// Runs of zero bytes as 0, count (up to 255)
+void compress_row(const vector<u8> &bits, vector<u8> &out) {
+   for (size_t i = 0; i < bits.size(); i++) {
+      out.push_back(bits[i]);
+      if (bits[i] != 0) continue;
+
+      u8 run = 1;
+      while (i + 1 < bits.size() && bits[i + 1] == 0 && run < 255) {
+         run++;
+         i++;
+      }
+      out.push_back(run);
+   }
+}
+
+struct PVS {
+   Vec3 origin;
+   float cell_size = 0;
+   int dims[3] = {0, 0, 0};
+   vector<u32> row_offsets; // Start of each cell's compressed row in `rows`
+   vector<u8> rows;         // Compressed visibility bitsets, one per cell
+
+   // Cells to the BVH leaves they overlap, rebuilt after loading by link()
+   vector<u32> cell_leaf_offsets;
+   vector<PVSLeaf> cell_leaves;
+   vector<u32> leaf_base; // First global leaf id of each mesh, for leaf_stamp
+
+   // Per-frame scratch
+   vector<u8> row;
+   vector<u32> leaf_stamp;
+   vector<vector<u32>> mesh_leaves;
+   u32 stamp = 0;
+
+   bool empty() const { return row_offsets.empty(); }
+   size_t num_cells() const { return (size_t)dims[0] * dims[1] * dims[2]; }
+   size_t row_bytes() const { return (num_cells() + 7) / 8; }
+
+   int cell_index(int x, int y, int z) const { return (z * dims[1] + y) * dims[0] + x; }
+
+   // Cell containing `p`, -1 when it is outside the grid
+   int find_cell(const Vec3 &p) const {
+      int c[3];
+      for (int axis = 0; axis < 3; axis++) {
+         c[axis] = (int)floorf((p[axis] - origin[axis]) / cell_size);
+         if (c[axis] < 0 || c[axis] >= dims[axis]) return -1;
+      }
+      return cell_index(c[0], c[1], c[2]);
+   }
+
+   void cell_coords(int cell, int c[3]) const {
+      c[0] = cell % dims[0];
+      c[1] = (cell / dims[0]) % dims[1];
+      c[2] = cell / (dims[0] * dims[1]);
+   }
+
+   Vec3 cell_min(int cell) const {
+      int c[3];
+      cell_coords(cell, c);
+      return Vec3{origin.x() + c[0] * cell_size,
+                  origin.y() + c[1] * cell_size,
+                  origin.z() + c[2] * cell_size};
+   }
+
+   // Bitset of the cells visible from `cell`
+   void decompress(int cell, vector<u8> &bits) const {
+      bits.assign(row_bytes(), 0);
+      size_t out = 0;
+      for (u32 i = row_offsets[cell]; i < row_offsets[cell + 1] && out < bits.size(); i++) {
+         if (rows[i] != 0) {
+            bits[out++] = rows[i];
+         } else {
+            out += rows[++i]; // Already zeroed
+         }
+      }
+   }
+
+   // Rebuild the cell to leaf links for the meshes of `accels` after loading or building
+   void link(const vector<MeshAccel> &accels) {
+      leaf_base.assign(1, 0);
+      for (auto &accel : accels) leaf_base.push_back(leaf_base.back() + accel.bvh.nodes.size());
+      leaf_stamp.assign(leaf_base.back(), 0);
+      mesh_leaves.resize(accels.size());
+      stamp = 0;
+
+      // Count, then fill (CSR), every leaf in all the cells its box overlaps
+      auto for_each_overlap = [&](auto &&fn) {
+         for (size_t m = 0; m < accels.size(); m++) {
+            const vector<BVHNode> &nodes = accels[m].bvh.nodes;
+            for (u32 n = 0; n < nodes.size(); n++) {
+               if (nodes[n].first_child != 0) continue;
+               int c0[3], c1[3];
+               for (int axis = 0; axis < 3; axis++) {
+                  float lo = (nodes[n].bounds_min[axis] - origin[axis]) / cell_size;
+                  float hi = (nodes[n].bounds_max[axis] - origin[axis]) / cell_size;
+                  c0[axis] = std::max(0, (int)floorf(lo));
+                  c1[axis] = std::min(dims[axis] - 1, (int)floorf(hi));
+               }
+               for (int z = c0[2]; z <= c1[2]; z++)
+                  for (int y = c0[1]; y <= c1[1]; y++)
+                     for (int x = c0[0]; x <= c1[0]; x++) fn(cell_index(x, y, z), (u32)m, n);
+            }
+         }
+      };
+
+      cell_leaf_offsets.assign(num_cells() + 1, 0);
+      for_each_overlap([&](int cell, u32, u32) { cell_leaf_offsets[cell + 1]++; });
+      for (size_t c = 0; c < num_cells(); c++) cell_leaf_offsets[c + 1] += cell_leaf_offsets[c];
+
+      cell_leaves.resize(cell_leaf_offsets.back());
+      vector<u32> fill(cell_leaf_offsets.begin(), cell_leaf_offsets.end() - 1);
+      for_each_overlap([&](int cell, u32 m, u32 n) { cell_leaves[fill[cell]++] = {m, n}; });
+   }
+
+   /* Visible parts of every mesh from `eye` (in the meshes' space): the leaves of the cells in the
+      eye cell's PVS, and of those only the ones inside the frustum with `frustum_culling` and not
+      behind `hiz` if given, and their meshlets `meshlets` keeps (see BVH::append_node). The work
+      done depends on the visible cells only. Outside the grid, every mesh falls back to BVH
+      culling */
+   void find_visible(const Vec3 &eye, const Mat4 &obj2clip, bool frustum_culling,
+                     const vector<TriMesh> &meshes, const vector<MeshAccel> &accels,
+                     vector<VisibleSet> &out, const HiZBuffer *hiz = nullptr,
+                     CullStats *stats = nullptr, const MeshletCulling *meshlets = nullptr) {
+      out.resize(meshes.size());
+      int eye_cell = empty() ? -1 : find_cell(eye);
+      if (eye_cell < 0) {
+         for (size_t m = 0; m < meshes.size(); m++)
+            fuake::find_visible(
+                meshes[m], &accels[m], obj2clip, frustum_culling, out[m], hiz, stats, meshlets);
+         return;
+      }
+
+      // New stamp so leaves linked to several cells are only taken once, without clearing
+      if (++stamp == 0) {
+         std::fill(leaf_stamp.begin(), leaf_stamp.end(), 0);
+         stamp = 1;
+      }
+
+      Frustum frustum(obj2clip);
+      for (auto &leaves : mesh_leaves) leaves.clear();
+      decompress(eye_cell, row);
+      for (size_t byte = 0; byte < row.size(); byte++) {
+         if (row[byte] == 0) continue;
+         for (int bit = 0; bit < 8; bit++) {
+            if (!(row[byte] & (1 << bit))) continue;
+            size_t cell = byte * 8 + bit;
+            for (u32 i = cell_leaf_offsets[cell]; i < cell_leaf_offsets[cell + 1]; i++) {
+               PVSLeaf leaf = cell_leaves[i];
+               u32 &leaf_stamp_ref = leaf_stamp[leaf_base[leaf.mesh] + leaf.node];
+               if (leaf_stamp_ref == stamp) continue;
+               leaf_stamp_ref = stamp;
+
+               const BVHNode &node = accels[leaf.mesh].bvh.nodes[leaf.node];
+               if (stats) stats->clusters_tested++;
+               if (frustum_culling &&
+                   frustum.test_box(node.bounds_min, node.bounds_max) == kFrustumTest_Outside) {
+                  if (stats) stats->clusters_frustum_culled++;
+                  continue;
+               }
+               if (hiz && hiz->occluded(node.bounds_min, node.bounds_max)) {
+                  if (stats) stats->clusters_occluded++;
+                  continue;
+               }
+               mesh_leaves[leaf.mesh].push_back(leaf.node);
+            }
+         }
+      }
+
+      // Leaves are face ranges, sort them to merge the adjacent ones
+      for (size_t m = 0; m < meshes.size(); m++) {
+         const BVH &bvh = accels[m].bvh;
+         const vector<BVHNode> &nodes = bvh.nodes;
+         vector<u32> &leaves = mesh_leaves[m];
+         std::sort(leaves.begin(), leaves.end(), [&nodes](u32 a, u32 b) {
+            return nodes[a].faces.begin < nodes[b].faces.begin;
+         });
+
+         VisibleSet &visible = out[m];
+         visible.faces.clear();
+         visible.vertices.clear();
+         for (u32 n : leaves) {
+            const BVHNode &node = nodes[n];
+            // Only meshlet culling needs to know, the leaf was tested before
+            bool inside = !frustum_culling;
+            if (meshlets && !inside)
+               inside = frustum.test_box(node.bounds_min, node.bounds_max) == kFrustumTest_Inside;
+            bvh.append_node(
+                node, frustum, inside, meshlets, visible.faces, visible.vertices, stats);
+         }
+         merge_ranges(visible.vertices);
+         visible.update_counts();
+      }
+   }
+};
+
+// Axis aligned box of the world
+struct PVSBox {
+   Vec3 min, max;
+
+   Vec3 center() const { return (min + max) * 0.5f; }
+};
+
+/* Opaque space of a map on a grid of cubic voxels, to prove that cells hide each other. A voxel is
+   opaque when it's inside one of the world's brushes, or outside the map: the camera never goes
+   there, and sight from inside can only get there through a wall. Opaque voxels are counted in a
+   summed volume table, so whether a box of voxels is all opaque takes 8 lookups, however many
+   brushes it spans */
+struct PVSVoxels {
+   Vec3 origin;
+   float size = 0;
+   int dims[3] = {0, 0, 0};
+   vector<u32> sums; // Opaque voxels in [0, x) x [0, y) x [0, z), dims + 1 per axis
+   vector<u32> bits; // One per voxel, a quicker test than `sums` for a single one
+
+   size_t voxel_index(int x, int y, int z) const {
+      return ((size_t)z * dims[1] + y) * dims[0] + x;
+   }
+
+   bool opaque(int x, int y, int z) const {
+      size_t v = voxel_index(x, y, z);
+      return (bits[v >> 5] >> (v & 31)) & 1;
+   }
+
+   size_t sum_index(int x, int y, int z) const {
+      return ((size_t)z * (dims[1] + 1) + y) * (dims[0] + 1) + x;
+   }
+
+   // Voxels touching [lo, hi] along `axis`
+   void voxel_range(int axis, float lo, float hi, int &first, int &last) const {
+      first = (int)floorf((lo - origin[axis]) / size);
+      last = (int)floorf((hi - origin[axis]) / size);
+   }
+
+   // Whether voxels [first, last] are all opaque, false when they leave the grid
+   bool opaque(const int first[3], const int last[3]) const {
+      for (int axis = 0; axis < 3; axis++)
+         if (first[axis] < 0 || last[axis] >= dims[axis]) return false;
+      int x0 = first[0], y0 = first[1], z0 = first[2];
+      int x1 = last[0] + 1, y1 = last[1] + 1, z1 = last[2] + 1;
+      int64_t count = (int64_t)sums[sum_index(x1, y1, z1)] - sums[sum_index(x0, y1, z1)] -
+                      sums[sum_index(x1, y0, z1)] - sums[sum_index(x1, y1, z0)] +
+                      sums[sum_index(x0, y0, z1)] + sums[sum_index(x0, y1, z0)] +
+                      sums[sum_index(x1, y0, z0)] - sums[sum_index(x0, y0, z0)];
+      return count == (int64_t)(x1 - x0) * (y1 - y0) * (z1 - z0);
+   }
+
+   bool opaque(const PVSBox &box) const {
+      int first[3], last[3];
+      for (int axis = 0; axis < 3; axis++)
+         voxel_range(axis, box.min[axis], box.max[axis], first[axis], last[axis]);
+      return opaque(first, last);
+   }
+};
+
+/* Voxelize `map` over [bounds_min, bounds_max], in the space of compile_map()'s meshes. Voxels
+   stay on the 8 unit grid Quake editors snap brushes to, so walls built from several brushes are
+   solid all the way through. Brush entities are left out, as doors open and platforms move, and
+   so are liquids and clip brushes, which can be seen through. Voxels no brush touches, reached
+   from the border of the grid, are outside the map. Cracks between brushes are thinner than a
+   voxel, so the outside only gets in through a real hole. Then it reaches a point entity, and
+   only the brushes are opaque */
+PVSVoxels voxelize_pvs(const QuakeMap &map, bool exchange_axes, const Vec3 &bounds_min,
+                       const Vec3 &bounds_max, float voxel_size = 8) {
+   PVSVoxels voxels;
+   voxels.size = voxel_size;
+   for (int axis = 0; axis < 3; axis++) { // With a layer of air all around
+      voxels.origin[axis] = (floorf(bounds_min[axis] / voxel_size) - 1) * voxel_size;
+      voxels.dims[axis] = (int)ceilf((bounds_max[axis] - voxels.origin[axis]) / voxel_size) + 1;
+   }
+   int nx = voxels.dims[0], ny = voxels.dims[1], nz = voxels.dims[2];
+   const u8 kAir = 0, kSolid = 1, kOutside = 2, kTouched = 3;
+   vector<u8> state((size_t)nx * ny * nz, kAir);
+
+   for (const auto &entity : map.entities) {
+      if (entity.get_property("classname") != "worldspawn") continue;
+      for (const auto &brush : entity.brushes) {
+         bool see_through = false;
+         for (const auto &plane : brush.planes) {
+            string texture = map.textures[plane.texture];
+            for (auto &c : texture) c = (char)tolower(c);
+            see_through |= texture[0] == '*' || texture == "clip" || texture == "trigger";
+         }
+         if (see_through) continue;
+
+         Mesh mesh = brush.to_mesh();
+         if (mesh.vertices.empty()) continue;
+         // As compile_map() exchanges the axes
+         if (exchange_axes)
+            for (auto &v : mesh.vertices) v = Vec3{v.x(), -v.z(), v.y()};
+         Vec3 min = mesh.vertices[0], max = mesh.vertices[0];
+         for (const Vec3 &v : mesh.vertices) {
+            for (int axis = 0; axis < 3; axis++) {
+               min[axis] = std::min(min[axis], v[axis]);
+               max[axis] = std::max(max[axis], v[axis]);
+            }
+         }
+
+         /* Voxels touching the brush bounds are solid when their corners are all inside its
+            planes, and touched when no plane has them all outside. A few voxels near its edges
+            pass that without touching it, which only keeps the outside from flooding them */
+         int first[3], last[3];
+         for (int axis = 0; axis < 3; axis++) {
+            first[axis] = std::max(0, (int)floorf((min[axis] - voxels.origin[axis]) / voxel_size));
+            last[axis] = std::min(voxels.dims[axis] - 1,
+                                  (int)floorf((max[axis] - voxels.origin[axis]) / voxel_size));
+         }
+         for (int z = first[2]; z <= last[2]; z++) {
+            for (int y = first[1]; y <= last[1]; y++) {
+               for (int x = first[0]; x <= last[0]; x++) {
+                  Vec3 corners[8];
+                  for (int corner = 0; corner < 8; corner++) {
+                     Vec3 p = voxels.origin + Vec3{(float)(x + (corner & 1)),
+                                                   (float)(y + ((corner >> 1) & 1)),
+                                                   (float)(z + (corner >> 2))} *
+                                                  voxel_size;
+                     // Back to the map's axes
+                     corners[corner] = exchange_axes ? Vec3{p.x(), p.z(), -p.y()} : p;
+                  }
+                  bool inside = true, touching = true;
+                  for (const auto &plane : brush.planes) {
+                     float nearest = plane.distance(corners[0]), farthest = nearest;
+                     for (int corner = 1; corner < 8; corner++) {
+                        float distance = plane.distance(corners[corner]);
+                        nearest = std::min(nearest, distance);
+                        farthest = std::max(farthest, distance);
+                     }
+                     inside &= farthest <= 1E-3f;
+                     touching &= nearest <= 1E-3f;
+                  }
+                  u8 &voxel = state[voxels.voxel_index(x, y, z)];
+                  if (inside)
+                     voxel = kSolid;
+                  else if (touching && voxel == kAir)
+                     voxel = kTouched;
+               }
+            }
+         }
+      }
+   }
+
+   // Flood the outside from a corner, which the layer of air keeps out of the brushes
+   vector<u32> queue = {0};
+   state[0] = kOutside;
+   for (size_t next = 0; next < queue.size(); next++) {
+      u32 v = queue[next];
+      int x = (int)(v % nx), y = (int)(v / nx % ny), z = (int)(v / ((size_t)nx * ny));
+      auto flood = [&](bool in_grid, u32 neighbour) {
+         if (!in_grid || state[neighbour] != kAir) return;
+         state[neighbour] = kOutside;
+         queue.push_back(neighbour);
+      };
+      flood(x > 0, v - 1);
+      flood(x < nx - 1, v + 1);
+      flood(y > 0, v - nx);
+      flood(y < ny - 1, v + nx);
+      flood(z > 0, v - (u32)nx * ny);
+      flood(z < nz - 1, v + (u32)nx * ny);
+   }
+   for (const auto &entity : map.entities) {
+      Vec3 origin;
+      if (!entity.brushes.empty() || sscanf(entity.get_property("origin").c_str(),
+                                            "%f %f %f",
+                                            &origin.x(),
+                                            &origin.y(),
+                                            &origin.z()) != 3)
+         continue;
+      if (exchange_axes) origin = Vec3{origin.x(), -origin.z(), origin.y()};
+      int c[3];
+      for (int axis = 0; axis < 3; axis++)
+         c[axis] = (int)floorf((origin[axis] - voxels.origin[axis]) / voxel_size);
+      bool in_grid = c[0] >= 0 && c[0] < nx && c[1] >= 0 && c[1] < ny && c[2] >= 0 && c[2] < nz;
+      if (in_grid && state[voxels.voxel_index(c[0], c[1], c[2])] != kOutside) continue;
+
+      printf("WARNING: %s at (%g, %g, %g) is outside the map, the PVS only hides behind "
+             "brushes\n",
+             entity.get_property("classname").c_str(),
+             origin.x(),
+             origin.y(),
+             origin.z());
+      for (u32 v : queue) state[v] = kAir;
+      break;
+   }
+
+   voxels.sums.assign((size_t)(nx + 1) * (ny + 1) * (nz + 1), 0);
+   voxels.bits.assign((state.size() + 31) / 32, 0);
+   for (int z = 0; z < nz; z++) {
+      for (int y = 0; y < ny; y++) {
+         for (int x = 0; x < nx; x++) {
+            auto sum = [&](int dx, int dy, int dz) {
+               return voxels.sums[voxels.sum_index(x + dx, y + dy, z + dz)];
+            };
+            size_t v = voxels.voxel_index(x, y, z);
+            u32 opaque = state[v] == kSolid || state[v] == kOutside;
+            voxels.bits[v >> 5] |= opaque << (v & 31);
+            voxels.sums[voxels.sum_index(x + 1, y + 1, z + 1)] =
+                opaque + sum(0, 1, 1) + sum(1, 0, 1) + sum(1, 1, 0) - sum(0, 0, 1) -
+                sum(0, 1, 0) - sum(1, 0, 0) + sum(0, 0, 0);
+         }
+      }
+   }
+   return voxels;
+}
+
+/* Whether every segment from a point of `a` to a point of `b` goes through opaque voxels: the
+   boxes are apart along an axis, and on one of the planes through the middle of the voxel layers
+   between them, the segments all cross it within opaque voxels. A segment from p to q crosses the
+   plane x = s at t = (s - p.x) / (q.x - p.x), which is smallest from the upper corners of both
+   boxes and largest from their lower ones. Its other coordinates there are bounded by those of
+   the corners of the boxes, taken at both ends of that range of t */
+bool pvs_shaft_blocked(const PVSBox &a, const PVSBox &b, const PVSVoxels &voxels) {
+   for (int axis = 0; axis < 3; axis++) {
+      const PVSBox *lower = &a, *upper = &b;
+      if (b.max[axis] <= a.min[axis])
+         std::swap(lower, upper);
+      else if (a.max[axis] > b.min[axis])
+         continue;
+
+      float origin = voxels.origin[axis];
+      int first_layer = (int)ceilf((lower->max[axis] - origin) / voxels.size - 0.5f);
+      int last_layer = (int)floorf((upper->min[axis] - origin) / voxels.size - 0.5f);
+      first_layer = std::max(first_layer, 0);
+      last_layer = std::min(last_layer, voxels.dims[axis] - 1);
+      if (first_layer > last_layer) continue;
+
+      /* t and so the bounds on the other axes are linear in s, step them from the first layer, in
+         voxels from the origin of the grid, widened a little against rounding */
+      float s = origin + (first_layer + 0.5f) * voxels.size;
+      float max_span = upper->max[axis] - lower->max[axis];
+      float min_span = upper->min[axis] - lower->min[axis];
+      float t0 = (s - lower->max[axis]) / max_span, t0_step = voxels.size / max_span;
+      float t1 = (s - lower->min[axis]) / min_span, t1_step = voxels.size / min_span;
+      float lo[3], lo_step[3], hi[3], hi_step[3];
+      for (int other = 0; other < 3; other++) {
+         if (other == axis) continue;
+         float min_delta = (upper->min[other] - lower->min[other]) / voxels.size;
+         float max_delta = (upper->max[other] - lower->max[other]) / voxels.size;
+         lo[other] = (lower->min[other] - voxels.origin[other]) / voxels.size +
+                     min_delta * (min_delta > 0 ? t0 : t1) - 1E-3f;
+         lo_step[other] = min_delta * (min_delta > 0 ? t0_step : t1_step);
+         hi[other] = (lower->max[other] - voxels.origin[other]) / voxels.size +
+                     max_delta * (max_delta > 0 ? t1 : t0) + 1E-3f;
+         hi_step[other] = max_delta * (max_delta > 0 ? t1_step : t0_step);
+      }
+
+      for (int layer = first_layer; layer <= last_layer; layer++) {
+         int first[3], last[3];
+         first[axis] = last[axis] = layer;
+         bool in_grid = true;
+         float step = (float)(layer - first_layer);
+         for (int other = 0; other < 3; other++) {
+            if (other == axis) continue;
+            first[other] = (int)floorf(lo[other] + lo_step[other] * step);
+            last[other] = (int)floorf(hi[other] + hi_step[other] * step);
+            in_grid &= first[other] >= 0 && last[other] < voxels.dims[other];
+         }
+         // Most layers have air in the middle of the shaft, which is quicker to find
+         if (in_grid &&
+             voxels.opaque((first[0] + last[0]) / 2,
+                           (first[1] + last[1]) / 2,
+                           (first[2] + last[2]) / 2) &&
+             voxels.opaque(first, last))
+            return true;
+      }
+   }
+   return false;
+}
+
+/* Compute the PVS of a compiled map (`meshes` with their `accels`, compiled from `map`) on a grid
+   of `cell_size` cells. It is conservative: two cells are only hidden from each other when every
+   segment between them is proven to go through opaque space (see voxelize_pvs()). Proofs
+   split the cells in halves, the larger one first, and try every pair of halves again, so parts
+   of a cell can be hidden by different walls. A segment between two box centers that crosses no
+   face of the world proves they see each other, and so does running out of `max_splits`. Cell
+   pairs run in parallel */
+PVS build_pvs(const QuakeMap &map, bool exchange_axes, const vector<Mesh> &meshes,
+              const vector<MeshAccel> &accels, float cell_size = 256, int max_splits = 256,
+              ThreadPool &pool = default_thread_pool()) {
+   FUAKE_PROFILE_SCOPE("Build PVS");
+   PVS pvs;
+   if (meshes.empty()) return pvs;
+
+   Vec3 bounds_min = meshes[0].bounds_min, bounds_max = meshes[0].bounds_max;
+   for (auto &mesh : meshes) {
+      for (int axis = 0; axis < 3; axis++) {
+         bounds_min[axis] = std::min(bounds_min[axis], mesh.bounds_min[axis]);
+         bounds_max[axis] = std::max(bounds_max[axis], mesh.bounds_max[axis]);
+      }
+   }
+   pvs.cell_size = cell_size;
+   pvs.origin = bounds_min;
+   for (int axis = 0; axis < 3; axis++)
+      pvs.dims[axis] = std::max(1, (int)ceilf((bounds_max[axis] - bounds_min[axis]) / cell_size));
+   pvs.link(accels);
+
+   // Only pairs with a cell holding geometry matter, a row's bits for empty cells are never read
+   size_t num_cells = pvs.num_cells();
+   vector<u8> has_leaves(num_cells);
+   for (size_t c = 0; c < num_cells; c++)
+      has_leaves[c] = pvs.cell_leaf_offsets[c + 1] > pvs.cell_leaf_offsets[c];
+
+   // Segments are traced against the world only, brush entities don't hide anything (see above).
+   // compile_map() names batches after their entity's class
+   vector<u32> world;
+   for (u32 m = 0; m < meshes.size(); m++)
+      if (meshes[m].name.rfind("worldspawn ", 0) == 0) world.push_back(m);
+   auto segment_free = [&](const Vec3 &from, const Vec3 &to) {
+      for (u32 m : world)
+         if (accels[m].bvh.segment_hits(meshes[m], from, to)) return false;
+      return true;
+   };
+
+   PVSVoxels voxels = voxelize_pvs(map, exchange_axes, bounds_min, bounds_max);
+   auto cell_box = [&](size_t cell) {
+      Vec3 min = pvs.cell_min((int)cell);
+      return PVSBox{min, min + Vec3{cell_size, cell_size, cell_size}};
+   };
+
+   struct BoxPair {
+      PVSBox a, b;
+   };
+   vector<vector<BoxPair>> thread_stacks(pool.size());
+
+   // Symmetric, so each pair is only tested once, by the lower cell's task
+   vector<u8> visible(num_cells * num_cells, 0);
+   pool.parallel_for(num_cells, [&](size_t a, size_t thread) {
+      int ca[3];
+      pvs.cell_coords((int)a, ca);
+      vector<BoxPair> &stack = thread_stacks[thread];
+
+      for (size_t b = a; b < num_cells; b++) {
+         if (!has_leaves[a] && !has_leaves[b]) continue;
+
+         int cb[3];
+         pvs.cell_coords((int)b, cb);
+         bool seen = abs(ca[0] - cb[0]) <= 1 && abs(ca[1] - cb[1]) <= 1 &&
+                     abs(ca[2] - cb[2]) <= 1;
+
+         stack.assign(seen ? 0 : 1, BoxPair{cell_box(a), cell_box(b)});
+         int splits = 0;
+         while (!stack.empty() && !seen) {
+            BoxPair pair = stack.back();
+            stack.pop_back();
+
+            // Hidden if either box is all opaque, or opaque space is between them
+            if (voxels.opaque(pair.a) || voxels.opaque(pair.b) ||
+                pvs_shaft_blocked(pair.a, pair.b, voxels))
+               continue;
+            if (segment_free(pair.a.center(), pair.b.center()) || ++splits > max_splits) {
+               seen = true;
+               break;
+            }
+
+            // Split the larger box across its longest side
+            PVSBox *split = &pair.a;
+            Vec3 size_a = pair.a.max - pair.a.min, size_b = pair.b.max - pair.b.min;
+            int axis_a = size_a.x() > size_a.y() ? (size_a.x() > size_a.z() ? 0 : 2)
+                                                 : (size_a.y() > size_a.z() ? 1 : 2);
+            int axis_b = size_b.x() > size_b.y() ? (size_b.x() > size_b.z() ? 0 : 2)
+                                                 : (size_b.y() > size_b.z() ? 1 : 2);
+            int axis = axis_a;
+            if (size_b[axis_b] > size_a[axis_a]) {
+               split = &pair.b;
+               axis = axis_b;
+            }
+            float middle = (split->min[axis] + split->max[axis]) / 2;
+            BoxPair halves[2] = {pair, pair};
+            PVSBox &low = split == &pair.a ? halves[0].a : halves[0].b;
+            PVSBox &high = split == &pair.a ? halves[1].a : halves[1].b;
+            low.max[axis] = middle;
+            high.min[axis] = middle;
+            stack.push_back(halves[1]);
+            stack.push_back(halves[0]);
+         }
+
+         visible[a * num_cells + b] = visible[b * num_cells + a] = seen;
+      }
+   });
+
+   // Bits of cells without geometry stay 0, which compresses better
+   vector<u8> bits(pvs.row_bytes());
+   pvs.row_offsets.push_back(0);
+   for (size_t a = 0; a < num_cells; a++) {
+      std::fill(bits.begin(), bits.end(), 0);
+      for (size_t b = 0; b < num_cells; b++)
+         if (visible[a * num_cells + b] && has_leaves[b]) bits[b >> 3] |= 1 << (b & 7);
+      compress_row(bits, pvs.rows);
+      pvs.row_offsets.push_back((u32)pvs.rows.size());
+   }
+   return pvs;
+}
+
+string pvs_path(const string &map_path) { return map_path + ".pvs"; }
+
+bool write_pvs(const string &filepath, const PVS &pvs, PVSHeader header) {
+   header.magic = kPVSMagic;
+   header.version = kPVSVersion;
+   for (int axis = 0; axis < 3; axis++) {
+      header.origin[axis] = pvs.origin[axis];
+      header.dims[axis] = pvs.dims[axis];
+   }
+   header.cell_size = pvs.cell_size;
+   header.num_row_bytes = (u32)pvs.rows.size();
+
+   vector<char> out(sizeof(PVSHeader));
+   memcpy(out.data(), &header, sizeof(header));
+
+   auto append = [&out](const void *data, size_t bytes) {
+      out.resize(align16(out.size()));
+      out.insert(out.end(), (const char *)data, (const char *)data + bytes);
+   };
+   append(pvs.row_offsets.data(), pvs.row_offsets.size() * sizeof(u32));
+   append(pvs.rows.data(), pvs.rows.size());
+
+   // Write to a temporary file first so a crash never leaves a half written PVS behind
+   string tmp_path = filepath + ".tmp";
+   {
+      std::ofstream fs(tmp_path, std::ios::binary | std::ios::trunc);
+      if (!fs) return false;
+      fs.write(out.data(), out.size());
+      if (!fs) return false;
+   }
+   std::error_code error;
+   std::filesystem::rename(tmp_path, filepath, error);
+   return !error;
+}
+
+// Read a .pvs into `pvs` if it exists and matches `stamp`. `source` is only hashed if needed
+bool read_pvs(const string &filepath, const PVSHeader &stamp, const MappedFile &source, PVS &pvs) {
+   MappedFile file(filepath);
+   if (!file.is_open || file.size < sizeof(PVSHeader)) return false;
+
+   PVSHeader header;
+   memcpy(&header, file.data, sizeof(header));
+   if (header.magic != kPVSMagic || header.version != kPVSVersion) return false;
+   if (header.exchange_axes != stamp.exchange_axes) return false;
+   if (header.source_size != stamp.source_size) return false;
+   if (header.source_mtime != stamp.source_mtime &&
+       header.source_hash != hash_bytes(source.data, source.size))
+      return false;
+
+   // Every cell has a row offset, so the grid is bounded by the file size before it's multiplied
+   if (!(header.cell_size > 0)) return false;
+   uint64_t num_cells = 1;
+   for (int axis = 0; axis < 3; axis++) {
+      if (header.dims[axis] <= 0 || num_cells > file.size / sizeof(u32) / header.dims[axis])
+         return false;
+      num_cells *= header.dims[axis];
+   }
+   size_t offsets_at = align16(sizeof(PVSHeader));
+   size_t rows_at = align16(offsets_at + (num_cells + 1) * sizeof(u32));
+   if (rows_at > file.size || header.num_row_bytes > file.size - rows_at) return false;
+
+   // Rows in order within the row bytes, and no run of zeros cut off by the end of its row
+   const u32 *offsets = (const u32 *)(file.data + offsets_at);
+   const u8 *rows = (const u8 *)file.data + rows_at;
+   if (offsets[0] != 0 || offsets[num_cells] != header.num_row_bytes) return false;
+   for (size_t c = 0; c < num_cells; c++) {
+      if (offsets[c] > offsets[c + 1] || offsets[c + 1] > header.num_row_bytes) return false;
+      for (u32 i = offsets[c]; i < offsets[c + 1]; i++)
+         if (rows[i] == 0 && ++i == offsets[c + 1]) return false;
+   }
+
+   pvs = PVS();
+   for (int axis = 0; axis < 3; axis++) {
+      pvs.origin[axis] = header.origin[axis];
+      pvs.dims[axis] = header.dims[axis];
+   }
+   pvs.cell_size = header.cell_size;
+   pvs.row_offsets.assign(offsets, offsets + num_cells + 1);
+   pvs.rows.assign(rows, rows + header.num_row_bytes);
+   return true;
+}
+
+// Stamp of the source MAP for write_pvs() and read_pvs()
+PVSHeader pvs_stamp(const string &map_path, const MappedFile &source, bool exchange_axes) {
+   PVSHeader stamp = {};
+   stamp.exchange_axes = exchange_axes;
+   stamp.source_size = source.size;
+   stamp.source_mtime = file_mtime(map_path);
+   return stamp;
+}
+
+/* Load the PVS computed offline for the map at `map_path` and link it to the `accels` of the
+   compiled map. Leaves `pvs` empty if there is none or it is out of date */
+bool load_pvs(const string &map_path, bool exchange_axes, const vector<MeshAccel> &accels,
+              PVS &pvs) {
+   FUAKE_PROFILE_SCOPE("Load PVS");
+   pvs = PVS();
+   MappedFile source(map_path);
+   if (!source.is_open) return false;
+
+   if (!read_pvs(pvs_path(map_path), pvs_stamp(map_path, source, exchange_axes), source, pvs)) {
+      printf("WARNING: No up to date PVS for %s, run vis_maps to build it\n", map_path.c_str());
+      pvs = PVS();
+      return false;
+   }
+   pvs.link(accels);
+   return true;
+}
+
+} // namespace fuake
@@ -0,0 +1,630 @@
+#pragma once
+
+#include <math.h>
+#include <vector>
+#include <algorithm>
+
+#include <amath_core.hpp>
+#include <amath_utils.hpp>
+
+#include "fuake_accel.hpp"
+#include "fuake_clip.hpp"
+#include "fuake_context.hpp"
+#include "fuake_framebuffer.hpp"
+#include "fuake_lighting.hpp"
+#include "fuake_profiler.hpp"
+#include "fuake_threadpool.hpp"
+#include "fuake_trimesh.hpp"
+
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+/* Screen-space vertex as consumed by the rasterizer: x, y in pixels, z ∈ [0,1] and intensity.
+   With a lightmap, also its luxel coordinates u, v divided by w, and 1 / w */
+struct RasterVertex {
+   float x, y, z;
+   float intensity;
+   float u_w, v_w, inv_w;
+};
+
+// Luxels of the lightmap a triangle is lit with, in rows of `width`. nullptr without one
+struct RasterLightmap {
+   const u8 *luxels;
+   u32 width, height;
+};
+
+// Luxel coordinate in 16.16 fixed point, clamped to [0, max]
+inline int32_t fixed_luxel(float value, int32_t max) {
+   float fixed = value * 65536;
+   return fixed <= 0 ? 0 : (fixed >= max ? max : (int32_t)fixed);
+}
+
+/* Scanline rasterizer with per-pixel depth test and interpolated (Gouraud) intensity.
+   Pixel centers are sampled at +0.5. Spans are left-inclusive and right-exclusive, so triangles
+   sharing an edge don't draw the same pixel twice. Both windings are accepted.
+   Only pixels inside the clip rect [clip_x0, clip_x1) x [clip_y0, clip_y1) are touched.
+   With a `lightmap`, the intensity is scaled by a bilinear sample of it at every pixel, its
+   coordinates interpolated with perspective correction. */
+void rasterize_triangle(RasterVertex v0, RasterVertex v1, RasterVertex v2, FrameBufferMono &fb,
+                        DepthBuffer &db, int clip_x0, int clip_y0, int clip_x1, int clip_y1,
+                        const RasterLightmap *lightmap = nullptr) {
+
+   float area = (v1.x - v0.x) * (v2.y - v0.y) - (v2.x - v0.x) * (v1.y - v0.y);
+   if (area == 0 || area != area) return; // Degenerate or NaN
+   if (area < 0) {
+      std::swap(v1, v2);
+      area = -area;
+   }
+
+   // Caculate bounding box, clamped to the framebuffer
+   float min_x = std::min(v0.x, std::min(v1.x, v2.x));
+   float max_x = std::max(v0.x, std::max(v1.x, v2.x));
+   float min_y = std::min(v0.y, std::min(v1.y, v2.y));
+   float max_y = std::max(v0.y, std::max(v1.y, v2.y));
+
+   int row_start = std::max(clip_y0, (int)ceilf(min_y - 0.5f));
+   int row_end = std::min(clip_y1, (int)ceilf(max_y - 0.5f));
+   if (row_start >= row_end || max_x < clip_x0 || min_x > clip_x1) return;
+
+   // Attribute gradients (constant over the triangle's plane)
+   float inv_area = 1.f / area;
+   float e1x = v1.x - v0.x, e1y = v1.y - v0.y;
+   float e2x = v2.x - v0.x, e2y = v2.y - v0.y;
+
+   float dz_dx = ((v1.z - v0.z) * e2y - (v2.z - v0.z) * e1y) * inv_area;
+   float dz_dy = ((v2.z - v0.z) * e1x - (v1.z - v0.z) * e2x) * inv_area;
+   float di_dx = ((v1.intensity - v0.intensity) * e2y - (v2.intensity - v0.intensity) * e1y) *
+                 inv_area;
+   float di_dy = ((v2.intensity - v0.intensity) * e1x - (v1.intensity - v0.intensity) * e2x) *
+                 inv_area;
+
+   // Same for the lightmap coordinates, linear in screen space once divided by w. In fixed point
+   // they stop short of the last luxel, whose neighbour is then itself only along an axis with a
+   // single luxel
+   float du_dx = 0, du_dy = 0, dv_dx = 0, dv_dy = 0, dw_dx = 0, dw_dy = 0;
+   int32_t max_u = 0, max_v = 0;
+   u32 next_u = 0, next_v = 0;
+   if (lightmap) {
+      max_u = lightmap->width > 1 ? (int32_t)(lightmap->width - 1) * 65536 - 1 : 0;
+      max_v = lightmap->height > 1 ? (int32_t)(lightmap->height - 1) * 65536 - 1 : 0;
+      next_u = lightmap->width > 1 ? 1 : 0;
+      next_v = lightmap->height > 1 ? lightmap->width : 0;
+      du_dx = ((v1.u_w - v0.u_w) * e2y - (v2.u_w - v0.u_w) * e1y) * inv_area;
+      du_dy = ((v2.u_w - v0.u_w) * e1x - (v1.u_w - v0.u_w) * e2x) * inv_area;
+      dv_dx = ((v1.v_w - v0.v_w) * e2y - (v2.v_w - v0.v_w) * e1y) * inv_area;
+      dv_dy = ((v2.v_w - v0.v_w) * e1x - (v1.v_w - v0.v_w) * e2x) * inv_area;
+      dw_dx = ((v1.inv_w - v0.inv_w) * e2y - (v2.inv_w - v0.inv_w) * e1y) * inv_area;
+      dw_dy = ((v2.inv_w - v0.inv_w) * e1x - (v1.inv_w - v0.inv_w) * e2x) * inv_area;
+   }
+
+   const RasterVertex *verts[3] = {&v0, &v1, &v2};
+
+   for (int py = row_start; py < row_end; py++) {
+      float cy = py + 0.5f;
+
+      // Intersect the scan line with the three edge half-planes to get the span [left, right)
+      float left = min_x, right = max_x;
+      bool empty = false;
+      for (int e = 0; e < 3; e++) {
+         const RasterVertex &a = *verts[e];
+         const RasterVertex &b = *verts[(e + 1) % 3];
+         // Edge function: (b.x - a.x) * (y - a.y) - (b.y - a.y) * (x - a.x) >= 0 inside
+         float dy = b.y - a.y;
+         float k = (b.x - a.x) * (cy - a.y) + dy * a.x;
+         if (dy > 0) right = std::min(right, k / dy);
+         else if (dy < 0) left = std::max(left, k / dy);
+         else if (k < 0) empty = true;
+      }
+      if (empty) continue;
+
+      int px_start = std::max(clip_x0, (int)ceilf(left - 0.5f));
+      int px_end = std::min(clip_x1, (int)ceilf(right - 0.5f));
+      if (px_start >= px_end) continue;
+
+      // Attributes at the first pixel center of the span, then step along x
+      float cx = px_start + 0.5f;
+      float z = v0.z + dz_dx * (cx - v0.x) + dz_dy * (cy - v0.y);
+      float intensity = v0.intensity + di_dx * (cx - v0.x) + di_dy * (cy - v0.y);
+
+      size_t row = (size_t)py * fb.width;
+      float *depth = &db.data[row];
+      u8 *color = &fb.data[row];
+
+      // Lightmap coordinates are divided by w every kLightmapStep pixels and stepped linearly in
+      // between in 16.16 fixed point, as Quake did for its textures. They're clamped at the ends
+      // of each step so every pixel's luxel has neighbours to filter with
+      if (lightmap) {
+         const int kLightmapStep = 16;
+         float u_w = v0.u_w + du_dx * (cx - v0.x) + du_dy * (cy - v0.y);
+         float v_w = v0.v_w + dv_dx * (cx - v0.x) + dv_dy * (cy - v0.y);
+         float inv_w = v0.inv_w + dw_dx * (cx - v0.x) + dw_dy * (cy - v0.y);
+         int32_t u = fixed_luxel(u_w / inv_w, max_u), v = fixed_luxel(v_w / inv_w, max_v);
+         for (int px = px_start; px < px_end;) {
+            int count = std::min(kLightmapStep, px_end - px);
+            u_w += du_dx * count;
+            v_w += dv_dx * count;
+            inv_w += dw_dx * count;
+            int32_t u_next = fixed_luxel(u_w / inv_w, max_u);
+            int32_t v_next = fixed_luxel(v_w / inv_w, max_v);
+            int32_t du = (u_next - u) / count, dv = (v_next - v) / count;
+
+            for (int end = px + count; px < end; px++) {
+               if (z < depth[px]) {
+                  depth[px] = z;
+                  // Bilinear filter, the luxel value times 65536
+                  const u8 *p = lightmap->luxels + (v >> 16) * lightmap->width + (u >> 16);
+                  int32_t fu = (u >> 8) & 255, fv = (v >> 8) & 255;
+                  int32_t top = (p[0] << 8) + (p[next_u] - p[0]) * fu;
+                  int32_t bottom = (p[next_v] << 8) + (p[next_v + next_u] - p[next_v]) * fu;
+                  int32_t luxel = (top << 8) + (bottom - top) * fv;
+                  float i = intensity * luxel * (1.f / 65536);
+                  i = i < 0 ? 0 : (i > 255 ? 255 : i);
+                  color[px] = (u8)i;
+               }
+               z += dz_dx;
+               intensity += di_dx;
+               u += du;
+               v += dv;
+            }
+            u = u_next;
+            v = v_next;
+         }
+         continue;
+      }
+
+      for (int px = px_start; px < px_end; px++) {
+         if (z < depth[px]) {
+            depth[px] = z;
+            float i = intensity < 0 ? 0 : (intensity > 255 ? 255 : intensity);
+            color[px] = (u8)i;
+         }
+         z += dz_dx;
+         intensity += di_dx;
+      }
+   }
+}
+
+void rasterize_triangle(const RasterVertex &v0, const RasterVertex &v1, const RasterVertex &v2,
+                        FrameBufferMono &fb, DepthBuffer &db) {
+   rasterize_triangle(v0, v1, v2, fb, db, 0, 0, fb.width, fb.height);
+}
+
+struct RasterTriangle {
+   RasterVertex v[3];
+   bool visible;
+   RasterLightmap lightmap;
+};
+
+// Range of a mesh's vertices or faces left by frustum culling
+struct MeshSegment {
+   u32 mesh;
+   IndexRange range;
+};
+
+/* Offscreen color + depth target, split in square tiles that are rasterized in parallel.
+   Each tile only ever writes its own slice of the buffers, so no locking is needed. */
+struct RasterTarget {
+   FrameBufferMono color;
+   DepthBuffer depth;
+
+   int tile_size;
+   int tiles_x, tiles_y;
+
+   // Per-frame scratch, kept between frames to reuse its capacity
+   PointStream verts_view;           // Unique vertices in camera space
+   PointStream verts_clip;           // Unique vertices in clip space (before the divide)
+   PointStream verts_screen;         // Unique vertices in screen space (divided by w)
+   vector<u8> clip_codes;            // Clip planes each unique vertex is outside of
+   vector<float> intensities;        // Lit intensity per unique vertex
+   vector<RasterTriangle> triangles; // Triangles in screen space
+   vector<vector<RasterTriangle>> clipped_triangles; // Triangles made by clipping, per thread
+   vector<vector<vector<u32>>> bins; // Triangle indices per [thread][tile]
+   vector<float> thread_min_z, thread_max_z;
+   vector<size_t> vertex_base;       // Where each mesh's vertices start in the arrays above
+   vector<VisibleSet> visible;       // Visible faces and vertices per mesh
+   vector<MeshSegment> vertex_segments, face_segments;    // Visible ranges of all meshes
+   vector<size_t> vertex_segment_base, face_segment_base; // Prefix sums of the segment sizes
+
+   RasterTarget(Vec2 dimensions, int tile_size = 64)
+       : color(dimensions), depth(dimensions), tile_size(tile_size) {
+      tiles_x = (color.width + tile_size - 1) / tile_size;
+      tiles_y = (color.height + tile_size - 1) / tile_size;
+   }
+
+   size_t num_tiles() const { return (size_t)tiles_x * tiles_y; }
+
+   // Put every visible triangle in the bins of all the tiles its bounding box overlaps
+   void bin_triangles(ThreadPool &pool) {
+      bins.resize(pool.size());
+      for (auto &thread_bins : bins) {
+         thread_bins.resize(num_tiles());
+         for (auto &bin : thread_bins) bin.clear();
+      }
+
+      pool.parallel_ranges(triangles.size(), 4096, [&](size_t begin, size_t end, size_t thread) {
+         auto &thread_bins = bins[thread];
+         for (size_t t = begin; t < end; t++) {
+            const RasterTriangle &tri = triangles[t];
+            if (!tri.visible) continue;
+
+            float min_x = std::min(tri.v[0].x, std::min(tri.v[1].x, tri.v[2].x));
+            float max_x = std::max(tri.v[0].x, std::max(tri.v[1].x, tri.v[2].x));
+            float min_y = std::min(tri.v[0].y, std::min(tri.v[1].y, tri.v[2].y));
+            float max_y = std::max(tri.v[0].y, std::max(tri.v[1].y, tri.v[2].y));
+            if (max_x < 0 || max_y < 0 || min_x >= color.width || min_y >= color.height) continue;
+
+            int tx0 = (int)std::max(min_x, 0.f) / tile_size;
+            int ty0 = (int)std::max(min_y, 0.f) / tile_size;
+            int tx1 = (int)std::min(max_x, color.width - 1.f) / tile_size;
+            int ty1 = (int)std::min(max_y, color.height - 1.f) / tile_size;
+
+            for (int ty = ty0; ty <= ty1; ty++)
+               for (int tx = tx0; tx <= tx1; tx++) thread_bins[ty * tiles_x + tx].push_back(t);
+         }
+      });
+   }
+
+   // Clear, rasterize and convert to RGBA each tile on its own thread
+   void rasterize_tiles(ThreadPool &pool) {
+      pool.parallel_for(num_tiles(), [&](size_t tile, size_t) {
+         int x0 = (int)(tile % tiles_x) * tile_size;
+         int y0 = (int)(tile / tiles_x) * tile_size;
+         int x1 = std::min(x0 + tile_size, color.width);
+         int y1 = std::min(y0 + tile_size, color.height);
+
+         color.clear(x0, y0, x1, y1);
+         depth.clear(x0, y0, x1, y1);
+
+         for (auto &thread_bins : bins) {
+            for (u32 t : thread_bins[tile]) {
+               const RasterTriangle &tri = triangles[t];
+               rasterize_triangle(tri.v[0],
+                                  tri.v[1],
+                                  tri.v[2],
+                                  color,
+                                  depth,
+                                  x0,
+                                  y0,
+                                  x1,
+                                  y1,
+                                  tri.lightmap.luxels ? &tri.lightmap : nullptr);
+            }
+         }
+
+         color.to_rgba(x0, y0, x1, y1);
+      });
+   }
+};
+
+/* Split [begin, end) of items concatenated from several meshes or segments (m starting at base[m])
+   into one range per mesh, calling fn(m, begin, end) with the global bounds of each */
+template <typename F>
+void for_each_mesh_range(const vector<size_t> &base, size_t begin, size_t end, F &&fn) {
+   size_t m = std::upper_bound(base.begin(), base.end(), begin) - base.begin() - 1;
+   for (; begin < end; m++) {
+      size_t range_end = std::min(end, base[m + 1]);
+      if (begin < range_end) fn(m, begin, range_end);
+      begin = range_end;
+   }
+}
+
+/* Gouraud-shaded, depth-buffered render of triangulated meshes into an offscreen target. All the
+   meshes go through each stage together, so many batches cost the same as one big mesh. With
+   `accels` (one per mesh) and frustum culling on, only the faces and vertices of BVH nodes inside
+   the frustum are processed at all. With `visible` (one per mesh), only those are. With
+   `point_lights` (clustered for these meshes) and context.map_lights, they replace the sun. With
+   `baked` lighting and context.baked_lighting, faces on its lightmaps are lit from them per pixel
+   and the other vertices take its intensities, none of them lit.
+   Doesn't need a window, so it can also be used to benchmark the rasterizer. */
+void render_mesh_smooth_offscreen(const TriMesh *meshes, size_t num_meshes, const Mat4 &model,
+                                  const Mat4 &view, const Vec4 &light_dir,
+                                  const RenderContext &context, RasterTarget &target,
+                                  ThreadPool &pool, const MeshAccel *accels = nullptr,
+                                  const VisibleSet *visible_sets = nullptr,
+                                  const PointLights *point_lights = nullptr,
+                                  const BakedLighting *baked = nullptr) {
+   FUAKE_PROFILE_SCOPE("Gouraud");
+   FUAKE_PROFILE_STAGES();
+
+   // Get partial transformation matrices
+   Mat4 obj2view = view * model;
+   Mat4 view2screen = context.viewport * context.persp;
+
+   // Light to camera space to match cam space normals
+   Vec4 tr_light = view * light_dir;
+   float normal_sign = context.ccw_normals ? 1.f : -1.f;
+
+   // Vertices of all meshes are laid out one mesh after another in the scratch arrays. The visible
+   // ranges of vertices and faces are listed as segments, so threads split them evenly
+   Mat4 obj2clip = context.persp * obj2view;
+   target.vertex_base.resize(num_meshes + 1);
+   target.visible.resize(num_meshes);
+   target.vertex_segments.clear();
+   target.face_segments.clear();
+   target.vertex_segment_base.assign(1, 0);
+   target.face_segment_base.assign(1, 0);
+   target.vertex_base[0] = 0;
+   for (size_t m = 0; m < num_meshes; m++) {
+      target.vertex_base[m + 1] = target.vertex_base[m] + meshes[m].num_vertices;
+
+      VisibleSet &visible = target.visible[m];
+      if (visible_sets)
+         visible = visible_sets[m];
+      else
+         find_visible(
+             meshes[m], accels ? &accels[m] : nullptr, obj2clip, context.frustum_culling, visible);
+      for (auto &range : visible.vertices) {
+         target.vertex_segments.push_back({(u32)m, range});
+         target.vertex_segment_base.push_back(target.vertex_segment_base.back() +
+                                              (range.end - range.begin));
+      }
+      for (auto &range : visible.faces) {
+         target.face_segments.push_back({(u32)m, range});
+         target.face_segment_base.push_back(target.face_segment_base.back() +
+                                            (range.end - range.begin));
+      }
+   }
+   const vector<size_t> &vertex_base = target.vertex_base;
+   const vector<MeshSegment> &vertex_segments = target.vertex_segments;
+   const vector<MeshSegment> &face_segments = target.face_segments;
+   const vector<size_t> &vertex_segment_base = target.vertex_segment_base;
+   const vector<size_t> &face_segment_base = target.face_segment_base;
+
+   size_t num_vertices = vertex_segment_base.back();
+   size_t num_faces = face_segment_base.back();
+   const size_t grain = 2048;
+   FUAKE_PROFILE_COUNT(kProfileCounter_FacesIn, num_faces);
+   FUAKE_PROFILE_COUNT(kProfileCounter_VerticesTransformed, num_vertices);
+
+   target.verts_view.resize(vertex_base[num_meshes]);
+   target.verts_clip.resize(vertex_base[num_meshes]);
+   target.verts_screen.resize(vertex_base[num_meshes]);
+   target.clip_codes.resize(vertex_base[num_meshes]);
+   target.intensities.resize(vertex_base[num_meshes]);
+   target.triangles.resize(num_faces);
+   target.thread_min_z.assign(pool.size(), 99999999999);
+   target.thread_max_z.assign(pool.size(), 0);
+
+   // Calls fn(mesh_idx, local_begin, local_end) for the visible vertices in [begin, end)
+   auto for_each_vertex_range = [&](size_t begin, size_t end, auto &&fn) {
+      for_each_mesh_range(vertex_segment_base, begin, end, [&](size_t s, size_t begin, size_t end) {
+         const MeshSegment &segment = vertex_segments[s];
+         size_t local = segment.range.begin + (begin - vertex_segment_base[s]);
+         fn(segment.mesh, local, local + (end - begin));
+      });
+   };
+
+   // Transform every visible unique vertex once, to camera, clip and screen space
+   FUAKE_PROFILE_STAGE("Transform");
+   MatrixRows obj2view_rows(obj2view), obj2clip_rows(obj2clip),
+       obj2screen_rows(view2screen * obj2view);
+   pool.parallel_ranges(num_vertices, grain, [&](size_t begin, size_t end, size_t thread) {
+      float &min_z = target.thread_min_z[thread];
+      float &max_z = target.thread_max_z[thread];
+      for_each_vertex_range(begin, end, [&](size_t m, size_t begin, size_t end) {
+         const TriMesh &mesh = meshes[m];
+         size_t out_begin = vertex_base[m] + begin, out_end = vertex_base[m] + end;
+         transform_positions(obj2view_rows, mesh, target.verts_view, false, begin, end, out_begin);
+         transform_positions(obj2clip_rows, mesh, target.verts_clip, false, begin, end, out_begin);
+         transform_positions(
+             obj2screen_rows, mesh, target.verts_screen, true, begin, end, out_begin);
+         compute_clip_codes(target.verts_clip, out_begin, out_end, context.guard_band,
+                            target.clip_codes);
+
+         for (size_t v = out_begin; v < out_end; v++) {
+            min_z = std::min(min_z, target.verts_view.z[v]);
+            max_z = std::max(max_z, target.verts_view.z[v]);
+         }
+      });
+   });
+
+   // Scaling brightness by depth
+   float min_z = 99999999999, max_z = 0;
+   if (context.color_by_depth) {
+      for (size_t t = 0; t < pool.size(); t++) {
+         min_z = std::min(min_z, target.thread_min_z[t]);
+         max_z = std::max(max_z, target.thread_max_z[t]);
+      }
+   }
+   min_z = max(min_z, 0);
+
+   // With the map's lights, only an ambient is left of the sun. Baked lighting replaces both
+   bool use_baked = baked && !baked->empty() && context.baked_lighting;
+   bool use_point_lights =
+       !use_baked && point_lights && !point_lights->empty() && context.map_lights;
+   float diffuse = use_point_lights ? kMapAmbientLight : kAmbientLight;
+   float directional = use_point_lights ? 0 : kDirectionalLight;
+
+   // Light every visible unique vertex once, a batch per vertex range: the point lights of its
+   // clusters in mesh space, then the sun in cam space
+   FUAKE_PROFILE_STAGE("Lighting");
+   VertexLighting lighting;
+   for (int row = 0; row < 3; row++) {
+      for (int col = 0; col < 3; col++)
+         lighting.normal_to_view[row * 3 + col] = obj2view_rows.m[row * 4 + col];
+      lighting.light[row] = tr_light[row] * normal_sign;
+   }
+   lighting.ambient = diffuse;
+   lighting.directional = directional;
+   lighting.add_to_out = use_point_lights;
+   if (context.color_by_depth) {
+      lighting.depth_offset = max_z / (max_z - min_z);
+      lighting.depth_scale = -1 / (max_z - min_z);
+   }
+   pool.parallel_ranges(num_vertices, grain, [&](size_t begin, size_t end, size_t) {
+      for_each_vertex_range(begin, end, [&](size_t m, size_t begin, size_t end) {
+         const TriMesh &mesh = meshes[m];
+         size_t out_begin = vertex_base[m] + begin;
+         if (use_baked) {
+            const float *in = baked->vertex[m].data() + begin;
+            const float *view_z = target.verts_view.z.data() + out_begin;
+            float *out = target.intensities.data() + out_begin;
+            for (size_t i = 0; i < end - begin; i++)
+               out[i] = in[i] * (lighting.depth_offset + lighting.depth_scale * view_z[i]);
+            return;
+         }
+         if (!mesh.has_normals()) return;
+         if (use_point_lights) {
+            float *out = target.intensities.data() + out_begin;
+            std::fill(out, out + (end - begin), 0.f);
+            size_t evaluated = add_point_lights(
+                mesh, point_lights->clusters[m], point_lights->lights, begin, end, out);
+            FUAKE_PROFILE_COUNT(kProfileCounter_PointLightsEvaluated, evaluated);
+         }
+         light_vertices_kernel(lighting,
+                               mesh.nx.data() + begin,
+                               mesh.ny.data() + begin,
+                               mesh.nz.data() + begin,
+                               target.verts_view.z.data() + out_begin,
+                               end - begin,
+                               target.intensities.data() + out_begin);
+      });
+   });
+
+   // Backface culling in cam space, then assemble screen space triangles of the visible faces.
+   // Triangles crossing the clip planes in use are clipped before the divide, and the pieces are
+   // appended after the rest
+   MatrixRows viewport_rows(context.viewport);
+   u8 clip_planes = context.clip_sides ? kClipPlanes_All : kClipPlanes_Depth;
+   target.clipped_triangles.resize(pool.size());
+   for (auto &clipped : target.clipped_triangles) clipped.clear();
+
+   FUAKE_PROFILE_STAGE("Triangle setup");
+   pool.parallel_ranges(num_faces, grain, [&](size_t begin, size_t end, size_t thread) {
+      size_t backface_culled = 0, viewport_culled = 0;
+      for_each_mesh_range(face_segment_base, begin, end, [&](size_t s, size_t begin, size_t end) {
+         const MeshSegment &segment = face_segments[s];
+         const TriMesh &mesh = meshes[segment.mesh];
+         bool has_vertex_normals = mesh.has_normals();
+         size_t first_vertex = vertex_base[segment.mesh];
+         const u32 *face_lightmap =
+             use_baked ? baked->face_lightmap[segment.mesh].data() : nullptr;
+
+         for (size_t t = begin; t < end; t++) {
+            size_t f = segment.range.begin + (t - face_segment_base[s]);
+            u32 idx[3];
+            mesh.triangle(f, idx);
+            RasterTriangle &tri = target.triangles[t];
+
+            Vec4 face[3] = {target.verts_view.get(first_vertex + idx[0]),
+                            target.verts_view.get(first_vertex + idx[1]),
+                            target.verts_view.get(first_vertex + idx[2])};
+            Vec4 face_normal = get_face_normal(face, 3, context.ccw_normals);
+
+            tri.visible = !(context.backface_culling &&
+                            dot_product(get_face_center(face, 3), face_normal) > 0);
+            if (!tri.visible) {
+               backface_culled++;
+               continue;
+            }
+
+            // Drop triangles outside any clip plane
+            const u8 *codes = &target.clip_codes[first_vertex];
+            u8 codes_or = codes[idx[0]] | codes[idx[1]] | codes[idx[2]];
+            if (codes[idx[0]] & codes[idx[1]] & codes[idx[2]]) {
+               tri.visible = false;
+               viewport_culled++;
+               continue;
+            }
+
+            // Without vertex normals, fall back to one intensity per face
+            float face_intensity = 0;
+            if (!has_vertex_normals) {
+               float b = max(0, dot_product(tr_light, face_normal)) * directional + diffuse;
+               float depth_multiplier = context.color_by_depth
+                                            ? (max_z - get_face_center(face, 3).z()) /
+                                                  (max_z - min_z)
+                                            : 1;
+               face_intensity = b * depth_multiplier;
+            }
+
+            // Faces on a lightmap get its luxel coordinates at their corners, which then only
+            // carry the depth coloring
+            float intensities[3], u[3] = {}, v[3] = {};
+            for (size_t n = 0; n < 3; n++)
+               intensities[n] =
+                   has_vertex_normals ? target.intensities[first_vertex + idx[n]] : face_intensity;
+            tri.lightmap = {nullptr, 0, 0};
+            if (face_lightmap && face_lightmap[f] != BakedLighting::kNoLightmap) {
+               const FaceLightmap &lightmap = baked->lightmaps[face_lightmap[f]];
+               tri.lightmap = {
+                   baked->luxels.data() + lightmap.first_luxel, lightmap.width, lightmap.height};
+               for (size_t n = 0; n < 3; n++) {
+                  Vec3 p = mesh.position(idx[n]);
+                  float view_z = target.verts_view.z[first_vertex + idx[n]];
+                  u[n] = dot_product(p, lightmap.s) + lightmap.s_offset;
+                  v[n] = dot_product(p, lightmap.t) + lightmap.t_offset;
+                  intensities[n] = lighting.depth_offset + lighting.depth_scale * view_z;
+               }
+            }
+
+            if (!(codes_or & clip_planes)) {
+               for (size_t n = 0; n < 3; n++) {
+                  size_t vertex = first_vertex + idx[n];
+                  const PointStream &screen = target.verts_screen;
+                  float inv_w = 1 / target.verts_clip.w[vertex];
+                  tri.v[n] = {screen.x[vertex],
+                              screen.y[vertex],
+                              screen.z[vertex],
+                              intensities[n],
+                              u[n] * inv_w,
+                              v[n] * inv_w,
+                              inv_w};
+               }
+               continue;
+            }
+
+            // Clip in homogeneous space, then fan the polygon left into triangles
+            tri.visible = false;
+            ClipPolygon poly;
+            poly.count = 3;
+            for (size_t n = 0; n < 3; n++) {
+               size_t vertex = first_vertex + idx[n];
+               const PointStream &clip = target.verts_clip;
+               poly.v[n] = {
+                   clip.x[vertex], clip.y[vertex], clip.z[vertex], clip.w[vertex], intensities[n],
+                   u[n], v[n]};
+            }
+            if (!clip_polygon(poly, codes_or & clip_planes, context.guard_band)) continue;
+
+            RasterVertex projected[kMaxClipVertices];
+            for (int n = 0; n < poly.count; n++) {
+               const ClipVertex &clipped = poly.v[n];
+               Vec4 pt = project_clip_vertex(clipped, viewport_rows);
+               float inv_w = 1 / pt.w();
+               projected[n] = {pt.x(),
+                               pt.y(),
+                               pt.z(),
+                               clipped.attribute,
+                               clipped.u * inv_w,
+                               clipped.v * inv_w,
+                               inv_w};
+            }
+            for (int n = 2; n < poly.count; n++)
+               target.clipped_triangles[thread].push_back(
+                   {{projected[0], projected[n - 1], projected[n]}, true, tri.lightmap});
+         }
+      });
+      FUAKE_PROFILE_COUNT(kProfileCounter_FacesBackfaceCulled, backface_culled);
+      FUAKE_PROFILE_COUNT(kProfileCounter_FacesViewportCulled, viewport_culled);
+   });
+   for (auto &clipped : target.clipped_triangles)
+      target.triangles.insert(target.triangles.end(), clipped.begin(), clipped.end());
+
+   // TILED RASTERIZATION, no sorting needed thanks to the depth buffer
+   FUAKE_PROFILE_STAGE("Binning");
+   target.bin_triangles(pool);
+   FUAKE_PROFILE_STAGE("Rasterization");
+   target.rasterize_tiles(pool);
+}
+
+void render_mesh_smooth_offscreen(const TriMesh &mesh, const Mat4 &model, const Mat4 &view,
+                                  const Vec4 &light_dir, const RenderContext &context,
+                                  RasterTarget &target, ThreadPool &pool,
+                                  const MeshAccel *accel = nullptr) {
+   render_mesh_smooth_offscreen(&mesh, 1, model, view, light_dir, context, target, pool, accel);
+}
+
+} // namespace fuake
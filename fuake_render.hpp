@@ -1,14 +1,6 @@
 
 #pragma once
 
-#include <esat/draw.h>
-#include <esat/time.h>
-#include <esat/input.h>
-#include <esat/window.h>
-#include <esat/sprite.h>
-
-#include <esat_extra/imgui.h>
-
 #include <amath_core.hpp>
 #include <amath_utils.hpp>
 
@@ -16,8 +8,19 @@
 #include <string>
 #include <algorithm>
 
-#include "fuake_mesh.hpp"
+#include "fuake_accel.hpp"
+#include "fuake_arena.hpp"
+#include "fuake_backend.hpp"
+#include "fuake_clip.hpp"
+#include "fuake_context.hpp"
+#include "fuake_depthsort.hpp"
 #include "fuake_framebuffer.hpp"
+#include "fuake_hiz.hpp"
+#include "fuake_lighting.hpp"
+#include "fuake_profiler.hpp"
+#include "fuake_pvs.hpp"
+#include "fuake_raster.hpp"
+#include "fuake_trimesh.hpp"
 
 using std::string;
 using std::vector;
@@ -25,273 +28,512 @@ using namespace amath;
 
 namespace fuake {
 
-enum RenderMode {
-   kRenderMode_Wireframe,
-   kRenderMode_Flat,
-   kRenderMode_Gouraud,
-};
-
-const char *RENDER_MODES[] = {
-    "Wireframe",
-    "Flat",
-    "Gouraud",
-};
-
-struct RenderContext {
-
-   RenderMode mode = kRenderMode_Flat;
-
-   bool show_normals = false;
-   bool z_sorting = true;
-   bool backface_culling = true;
-   bool viewport_culling = true;
-   bool color_by_depth = true;
-   bool ccw_normals = true;
-
-   float fov_degrees = Rad2Deg(PI / 2);
-   float fov = PI / 2;
-   float zNear = 0.01f;
-   float zFar = 20000.f;
-   float aspect;
-   Vec2 window_dimensions;
-
-   float normal_length = 100;
-
-   Mat4 persp;
-   Mat4 viewport;
-
-   RenderContext(Vec2 window_dimensions)
-       : aspect(window_dimensions.x() / window_dimensions.y()),
-         window_dimensions(window_dimensions) {
-      persp = Mat4::perspective(fov, aspect, zNear, zFar);
-      viewport = Mat4::transform({window_dimensions.x() / 2, window_dimensions.y() / 2, 0},
-                                 {window_dimensions.x() / 2, window_dimensions.y() / 2, 1},
-                                 {0, 0, 0});
+void render_mesh_wireframe(const TriMesh &mesh, const Mat4 &model, const Mat4 &view,
+                           RenderContext context, const MeshAccel *accel = nullptr,
+                           const VisibleSet *visible = nullptr,
+                           DepthOrder *depth_order = nullptr) {
+   FUAKE_PROFILE_SCOPE("Wireframe");
+   FUAKE_PROFILE_STAGES();
+
+   Mat4 obj2clip = context.persp * view * model;
+   Mat4 tr = context.viewport * obj2clip;
+
+   // Transform every unique vertex once, to clip space and to screen space with the divide fused
+   // in, edges index into the result. Only the vertices of BVH nodes inside the frustum (or of
+   // `visible`, when the caller already found them) are transformed, the rest are marked as skipped.
+   // Scratch comes from the frame arena
+   FrameArena &arena = frame_arena();
+   static VisibleSet culled;
+   if (!visible) {
+      find_visible(mesh, accel, obj2clip, context.frustum_culling, culled);
+      visible = &culled;
    }
 
-   void Update() {
-      fov = Deg2Rad(fov_degrees);
-      UpdateMatrices();
+   FUAKE_PROFILE_STAGE("Transform");
+   size_t num_unique = mesh.num_vertices;
+   PointSpan verts_clip(arena, num_unique), verts(arena, num_unique);
+   Span<u8> clip_codes = arena.alloc<u8>(num_unique);
+   Span<u8> transformed = arena.alloc<u8>(num_unique, 0);
+   MatrixRows obj2clip_rows(obj2clip), tr_rows(tr);
+   for (auto &range : visible->vertices) {
+      transform_positions(obj2clip_rows, mesh, verts_clip, false, range.begin, range.end);
+      transform_positions(tr_rows, mesh, verts, true, range.begin, range.end);
+      compute_clip_codes(verts_clip, range.begin, range.end, context.guard_band, clip_codes);
+      std::fill(transformed.begin() + range.begin, transformed.begin() + range.end, 1);
    }
+   FUAKE_PROFILE_COUNT(kProfileCounter_FacesIn, visible->num_faces);
+   FUAKE_PROFILE_COUNT(kProfileCounter_VerticesTransformed, visible->num_vertices);
 
-   void UpdateMatrices() {
-      persp = Mat4::perspective(fov, aspect, zNear, zFar);
-
-      // Viewport won't change
-      // viewport = generate_transform({window_dimensions.x() / 2, window_dimensions.y() / 2, 0},
-      //                               {window_dimensions.x() / 2, window_dimensions.y() / 2, 1},
-      //                               {0, 0, 0});
-   }
-};
+   // Unique edges were built at load time, diagonals from triangulation go last
+   size_t total_edges = context.show_diagonals ? mesh.num_edges : mesh.num_outline_edges;
 
-void render_mesh_wireframe(const Mesh &mesh, const Mat4 &model, const Mat4 &view,
-                           RenderContext context) {
+   // Edges of culled faces only, an endpoint wasn't transformed
+   auto is_culled = [&mesh, transformed](u32 edge) {
+      u32 v1, v2;
+      mesh.edge(edge, v1, v2);
+      return !transformed[v1] || !transformed[v2];
+   };
 
-   Mat4 tr = mat_concat({model, view, context.persp, context.viewport});
-
-   vector<Vec4> edges = generate_edges(mesh);
-
-   size_t total_edges = edges.size() / 2;
-
-   vector<float> point_z(total_edges * 2);
-   vector<float> edge_z(total_edges);
-   vector<float> edge_z_sorted(total_edges);
-
-   vector<Vec4> transformed_edges;
-   transformed_edges.reserve(total_edges);
-   for (size_t i = 0; i < edges.size(); i++) {
-      Vec4 transformed_pt = mat_mul(tr, edges[i]);
-      point_z[i] = fabs(transformed_pt.z());
-      float d = 1.f / transformed_pt.w();
-      transformed_edges.push_back(transformed_pt * d);
-   }
+   Span<float> edge_z = arena.alloc<float>(total_edges);
 
    float min_z = 99999999999, max_z = 0;
-   if (context.color_by_depth) {
-      for (size_t i = 0; i < edges.size() / 2; i++) {
-         float z = (point_z[2 * i] + point_z[2 * i + 1]) / 2;
-         if (z < min_z) min_z = z;
-         if (z > max_z) max_z = z;
-         edge_z[i] = z;
-      }
+   for (size_t i = 0; i < total_edges; i++) {
+      // Undivided clip space z
+      if (is_culled(i)) continue;
+      u32 v1, v2;
+      mesh.edge(i, v1, v2);
+      float z = (fabs(verts_clip.z[v1]) + fabs(verts_clip.z[v2])) / 2;
+      if (z < min_z) min_z = z;
+      if (z > max_z) max_z = z;
+      edge_z[i] = z;
    }
 
-   vector<size_t> sort_indices(edge_z.size());
-   if (context.z_sorting) sort_indices = argsort(edge_z, true);
-   else
-      for (size_t i = 0; i < edge_z.size(); i++) sort_indices[i] = i;
+   // Z-sorting of edges: walk the BSP from the camera if there is one, else sort by depth, from
+   // last frame's order with `depth_order`
+   FUAKE_PROFILE_STAGE("Sort");
+   Span<u32> sort_indices;
+   size_t num_sorted = 0;
+   if (context.z_sorting && context.bsp_sorting && accel && !accel->bsp.empty()) {
+      const BSPTree &bsp = accel->bsp;
+      Vec3 eye = inverse_transform_origin(MatrixRows(view * model));
+      sort_indices = arena.alloc<u32>(bsp.edges.size());
+      bsp.order_from(eye, nullptr, sort_indices.data(), arena.alloc<u32>(bsp.stack_size()).data());
+      auto is_skipped = [total_edges, &is_culled](u32 edge) {
+         return edge >= total_edges || is_culled(edge);
+      };
+      num_sorted = std::remove_if(sort_indices.begin(), sort_indices.end(), is_skipped) -
+                   sort_indices.begin();
+   } else {
+      sort_indices = arena.alloc<u32>(total_edges);
+      for (size_t i = 0; i < total_edges; i++)
+         if (!is_culled(i)) sort_indices[num_sorted++] = i;
+
+      if (context.z_sorting && depth_order)
+         depth_order->sort(edge_z.data(), sort_indices.first(num_sorted), total_edges, arena);
+      else if (context.z_sorting)
+         radix_sort_back_to_front(edge_z.data(), sort_indices.first(num_sorted), arena);
+   }
+   sort_indices = sort_indices.first(num_sorted);
 
    float max_x = context.window_dimensions.x();
    float max_y = context.window_dimensions.y();
 
-   for (int i = 0; i < transformed_edges.size() / 2; i++) {
-      size_t idx = sort_indices[i];
+   FUAKE_PROFILE_STAGE("Draw");
+   MatrixRows viewport_rows(context.viewport);
+   u8 clip_planes = context.clip_sides ? kClipPlanes_All : kClipPlanes_Depth;
+   size_t draw_calls = 0;
 
-      Vec4 &pt1 = transformed_edges[2 * idx];
-      Vec4 &pt2 = transformed_edges[2 * idx + 1];
+   for (size_t i = 0; i < sort_indices.size(); i++) {
+      size_t idx = sort_indices[i];
+      u32 v1, v2;
+      mesh.edge(idx, v1, v2);
+
+      // Drop edges outside any clip plane, and clip the ones crossing the planes in use, so
+      // endpoints behind the camera are never divided by a negative w
+      if (clip_codes[v1] & clip_codes[v2]) continue;
+
+      Vec4 pt1 = verts.get(v1);
+      Vec4 pt2 = verts.get(v2);
+      u8 crossed = (clip_codes[v1] | clip_codes[v2]) & clip_planes;
+      if (crossed) {
+         ClipVertex a = {verts_clip.x[v1], verts_clip.y[v1], verts_clip.z[v1], verts_clip.w[v1], 0};
+         ClipVertex b = {verts_clip.x[v2], verts_clip.y[v2], verts_clip.z[v2], verts_clip.w[v2], 0};
+         if (!clip_segment(a, b, crossed, context.guard_band)) continue;
+         pt1 = project_clip_vertex(a, viewport_rows);
+         pt2 = project_clip_vertex(b, viewport_rows);
+      }
 
-      // Viewport culling: Check for x,y ∈ [-1,1] and z ∈ [0,1]
-      bool edge_out = (pt1.x() < 0 || pt1.x() > max_x || pt1.y() < 0 || pt1.y() > max_y ||
-                       pt1.z() < 0 || pt1.z() > 1) &&
-                      (pt2.x() < 0 || pt2.x() > max_x || pt2.y() < 0 || pt2.y() > max_y ||
-                       pt2.z() < 0 || pt2.z() > 1);
+      // Viewport culling: both points past the same edge of the screen
+      bool edge_out = (pt1.x() < 0 && pt2.x() < 0) || (pt1.x() > max_x && pt2.x() > max_x) ||
+                      (pt1.y() < 0 && pt2.y() < 0) || (pt1.y() > max_y && pt2.y() > max_y);
 
       if (context.viewport_culling && edge_out) continue;
 
       float b = context.color_by_depth ? (max_z - edge_z[idx]) / (max_z - min_z) : 1;
       b *= 255;
-      esat::DrawSetStrokeColor(b, b, b);
+      context.backend->set_stroke_color(b, b, b);
 
-      esat::DrawLine(pt1.x(), pt1.y(), pt2.x(), pt2.y());
+      context.backend->draw_line(pt1.x(), pt1.y(), pt2.x(), pt2.y());
+      draw_calls++;
    }
+   FUAKE_PROFILE_COUNT(kProfileCounter_DrawCalls, draw_calls);
 }
 
-void render_mesh_flat(const Mesh &mesh, const Mat4 &model, const Mat4 &view, const Vec4 &light_dir,
-                      RenderContext context) {
+void render_mesh_flat(const TriMesh &mesh, const Mat4 &model, const Mat4 &view,
+                      const Vec4 &light_dir, RenderContext context,
+                      const MeshAccel *accel = nullptr, const VisibleSet *visible = nullptr,
+                      DepthOrder *depth_order = nullptr, const vector<Light> *lights = nullptr,
+                      const LightClusters *light_clusters = nullptr,
+                      const vector<float> *baked_face_light = nullptr) {
+   FUAKE_PROFILE_SCOPE("Flat");
+   FUAKE_PROFILE_STAGES();
 
    // Get partial transformation matrices
    Mat4 obj2view = view * model;
    Mat4 view2screen = context.viewport * context.persp;
 
-   // Faces to camera space
-   vector<Vec4> faces = generate_faces(mesh);
-
-   // TODO: Frustum clipping 
+   // Only the faces and vertices of BVH nodes inside the frustum go any further, or the ones in
+   // `visible` when the caller already found them. Scratch comes from the frame arena
+   FrameArena &arena = frame_arena();
+   static VisibleSet culled;
+   if (!visible) {
+      find_visible(mesh, accel, context.persp * obj2view, context.frustum_culling, culled);
+      visible = &culled;
+   }
 
-   faces = obj2view.transform_points(faces);
+   // Transform every unique vertex once: to camera space, to clip space for clipping, and straight
+   // to screen space with the divide fused in. Triangles index into all of them
+   FUAKE_PROFILE_STAGE("Transform");
+   size_t num_unique = mesh.num_vertices;
+   PointSpan verts_view(arena, num_unique), verts_clip(arena, num_unique), verts(arena, num_unique);
+   Span<u8> clip_codes = arena.alloc<u8>(num_unique);
+   MatrixRows obj2view_rows(obj2view), obj2clip_rows(context.persp * obj2view),
+       obj2screen_rows(view2screen * obj2view);
+   for (auto &range : visible->vertices) {
+      transform_positions(obj2view_rows, mesh, verts_view, false, range.begin, range.end);
+      transform_positions(obj2clip_rows, mesh, verts_clip, false, range.begin, range.end);
+      transform_positions(obj2screen_rows, mesh, verts, true, range.begin, range.end);
+      compute_clip_codes(verts_clip, range.begin, range.end, context.guard_band, clip_codes);
+   }
+   FUAKE_PROFILE_COUNT(kProfileCounter_VerticesTransformed, visible->num_vertices);
+
+   // Get cam space normals for backface culling and lighting, and face centers for z-ordering
+   FUAKE_PROFILE_STAGE("Normals");
+   size_t num_faces = mesh.num_triangles;
+   Span<Vec4> normals = arena.alloc<Vec4>(num_faces), centers = arena.alloc<Vec4>(num_faces);
+   Span<u32> indices = arena.alloc<u32>(num_faces);
+   Span<u8> face_visible = arena.alloc<u8>(num_faces, 0);
+   size_t num_indices = 0;
+   for (auto &range : visible->faces) {
+      for (u32 i = range.begin; i < range.end; i++) {
+         u32 idx[3];
+         mesh.triangle(i, idx);
+         Vec4 corners[3] = {
+             verts_view.get(idx[0]), verts_view.get(idx[1]), verts_view.get(idx[2])};
+         normals[i] = get_face_normal(corners, 3, context.ccw_normals);
+         centers[i] = get_face_center(corners, 3);
+
+         face_visible[i] = 1;
+         indices[num_indices++] = i;
+      }
+   }
+   indices = indices.first(num_indices);
+   FUAKE_PROFILE_COUNT(kProfileCounter_FacesIn, num_indices);
 
-   // Get cam space normals for backface culling and lighting
-   vector<Vec4> normals = get_mesh_face_normals(mesh, faces, context.ccw_normals);
-   // Light to camera space to match cam space normals
+   // Light to camera space to match cam space normals. Point lights stay in mesh space
    Vec4 tr_light = view * light_dir;
-
-   // Get face centers in cam/view space for z-ordering
-   vector<Vec4> centers = get_mesh_face_centers(mesh, faces);
+   bool use_baked = baked_face_light && context.baked_lighting;
+   bool use_point_lights = !use_baked && lights && light_clusters && context.map_lights;
+   float normal_sign = context.ccw_normals ? 1.f : -1.f;
 
    // Scaling brightness by depth
    float min_z = 99999999999, max_z = 0;
    if (context.color_by_depth) {
-      for (int i = 0; i < centers.size(); i++) {
+      for (u32 i : indices) {
          if (centers[i].z() < min_z) min_z = centers[i].z();
          if (centers[i].z() > max_z) max_z = centers[i].z();
       }
    }
    min_z = max(min_z, 0);
 
-   // Get screen-space centers if drawing normals
-   vector<Vec4> tr_centers;
-   vector<Vec4> tr_normals;
-   if (context.show_normals) {
-      tr_centers = view2screen.transform_points(centers);
-      tr_normals = view2screen.transform_points(normals);
-      for (auto &pt : tr_centers) pt *= (1.f / pt.w());
-      for (auto &pt : tr_normals) pt *= (1.f / pt.w());
-   }
-
-   // Transform faces to screen space
-   faces = view2screen.transform_points(faces);
-   for (auto &pt : faces) pt *= (1.f / pt.w());
-
-   // Z-sorting of faces
-   vector<size_t> indices(centers.size());
-   for (size_t i = 0; i < centers.size(); i++) indices[i] = i;
-
-   if (context.z_sorting)
-      std::sort(indices.begin(), indices.end(), [&centers](size_t left, size_t right) {
-         return centers[left].z() > centers[right].z();
+   // Z-sorting of faces: exact order from the BSP if there is one, else sort by center depth, from
+   // last frame's order with `depth_order`
+   FUAKE_PROFILE_STAGE("Sort");
+   if (context.z_sorting && context.bsp_sorting && accel && !accel->bsp.empty()) {
+      // Every face once, so the visible ones fill `indices` exactly
+      const BSPTree &bsp = accel->bsp;
+      Span<u32> order = arena.alloc<u32>(bsp.faces.size());
+      bsp.order_from(inverse_transform_origin(MatrixRows(obj2view)),
+                     order.data(),
+                     nullptr,
+                     arena.alloc<u32>(bsp.stack_size()).data());
+      std::copy_if(order.begin(), order.end(), indices.begin(), [face_visible](u32 face) {
+         return face_visible[face];
       });
+   } else if (context.z_sorting) {
+      Span<float> depths = arena.alloc<float>(num_faces);
+      for (u32 i : indices) depths[i] = centers[i].z();
+      if (depth_order) depth_order->sort(depths.data(), indices, num_faces, arena);
+      else radix_sort_back_to_front(depths.data(), indices, arena);
+   }
 
-   auto &num_vertices = mesh.num_vertices;
-
-   // Get viewport resolution for culling (assuming no prior frustum culling)
+   // Get viewport resolution to cull the faces left by frustum culling
    float max_x = context.window_dimensions.x();
    float max_y = context.window_dimensions.y();
 
+   FUAKE_PROFILE_STAGE("Draw");
+   MatrixRows viewport_rows(context.viewport);
+   u8 clip_planes = context.clip_sides ? kClipPlanes_All : kClipPlanes_Depth;
+   Span<Vec2> points = arena.alloc<Vec2>(256); // Clipped or not, faces have under 256 vertices
+   size_t backface_culled = 0, viewport_culled = 0, draw_calls = 0, lights_evaluated = 0;
+
    for (auto i : indices) {
 
       // NOTE: this could be done in screen space
       // Backface culling
-      if (context.backface_culling && dot_product(centers[i], normals[i]) > 0) continue;
-
-      size_t offset = mesh.index_offsets[i];
-
-      // TODO: this would be better as frustum culling or even clipping
-      // Get x, y coordinates for DrawSolidPath + viewport culling
-      vector<Vec2> points(num_vertices[i]);
-      bool cull_xy = true, cull_z = false; 
-      for (size_t n = 0; n < num_vertices[i]; n++) {
-         Vec4 pt = faces[offset + n];
-         points[n] = {pt.x(), pt.y()};
-         // Viewport culling XY: x,y ∈ [-1,1] for any point
-         bool point_out = (pt.x() < 0 || pt.x() > max_x || pt.y() < 0 || pt.y() > max_y);
-         cull_xy = cull_xy && point_out;
-
-         // Viewport culling Z: z ∈ [0,1] for all points
-         cull_z = cull_z || (pt.z() < 0 || pt.z() > 1);
+      if (context.backface_culling && dot_product(centers[i], normals[i]) > 0) {
+         backface_culled++;
+         continue;
+      }
+
+      u32 idx[3];
+      mesh.triangle(i, idx);
+
+      // Drop faces outside any clip plane, and clip the ones crossing the planes in use
+      u8 codes_or = 0, codes_and = kClipPlanes_All;
+      for (size_t n = 0; n < 3; n++) {
+         codes_or |= clip_codes[idx[n]];
+         codes_and &= clip_codes[idx[n]];
+      }
+      if (codes_and) {
+         viewport_culled++;
+         continue;
       }
-      if (context.viewport_culling && (cull_xy || cull_z)) continue;
 
-      float b = dot_product(tr_light, normals[i]);
-      uint8_t diffuse = 100;
-      uint8_t directional = 255 - diffuse;
-      b = max(0, b) * directional + diffuse;
+      // Get x, y coordinates for DrawSolidPath
+      size_t num_points = 0;
+      if (codes_or & clip_planes) {
+         ClipPolygon poly;
+         poly.count = 3;
+         for (int n = 0; n < poly.count; n++) {
+            u32 v = idx[n];
+            poly.v[n] = {verts_clip.x[v], verts_clip.y[v], verts_clip.z[v], verts_clip.w[v], 0};
+         }
+         if (!clip_polygon(poly, codes_or & clip_planes, context.guard_band)) continue;
+
+         for (int n = 0; n < poly.count; n++) {
+            Vec4 pt = project_clip_vertex(poly.v[n], viewport_rows);
+            points[num_points++] = {pt.x(), pt.y()};
+         }
+      } else {
+         for (size_t n = 0; n < 3; n++)
+            points[num_points++] = {verts.x[idx[n]], verts.y[idx[n]]};
+      }
+
+      // Viewport culling: every point past the same edge of the screen
+      if (context.viewport_culling) {
+         int edges_out = 0xF;
+         for (auto &pt : points.first(num_points))
+            edges_out &= (pt.x() < 0) | (pt.x() > max_x) << 1 | (pt.y() < 0) << 2 |
+                         (pt.y() > max_y) << 3;
+         if (edges_out) {
+            viewport_culled++;
+            continue;
+         }
+      }
+
+      // The face's baked lighting, else the map's point lights near its cluster, else the sun
+      float b;
+      if (use_baked) {
+         b = (*baked_face_light)[i];
+      } else if (use_point_lights) {
+         Vec3 p0 = mesh.position(idx[0]), p1 = mesh.position(idx[1]), p2 = mesh.position(idx[2]);
+         Vec3 normal = cross_product(p1 - p0, p2 - p0);
+         float length = normal.length();
+         normal = length > 0 ? normal * (normal_sign / length) : normal;
+         b = kMapAmbientLight +
+             point_lights_at(*light_clusters, *lights, i, (p0 + p1 + p2) * (1.f / 3), normal);
+         lights_evaluated += light_clusters->face_cluster(i / LightClusters::kClusterSize).size();
+      } else {
+         b = max(0, dot_product(tr_light, normals[i])) * kDirectionalLight + kAmbientLight;
+      }
 
       float depth_multiplier =
           context.color_by_depth ? (max_z - centers[i].z()) / (max_z - min_z) : 1;
       //  context.color_by_depth ? (context.zFar - centers[i].z()) / (context.zFar - context.zNear)
       //  : 1;
 
-      b *= depth_multiplier;
+      b = std::min(b * depth_multiplier, 255.f);
 
-      esat::DrawSetFillColor(b, b, b);
-      esat::DrawSetStrokeColor(b, b, b);
-      esat::DrawSolidPath((float *)points.data(), points.size(), true);
+      context.backend->set_fill_color(b, b, b);
+      context.backend->set_stroke_color(b, b, b);
+      context.backend->draw_solid_path((const float *)points.data(), num_points, true);
+      draw_calls++;
 
+      // Screen-space center, only for the faces drawn
       if (context.show_normals) {
-         esat::DrawSetStrokeColor(255, 0, 0);
-         esat::DrawLine(
-             tr_centers[i].x(),
-             tr_centers[i].y(),
-             // (tr_centers[i] + normals[i] * context.normal_length / centers[i].z()).x(),
-             // (tr_centers[i] + normals[i] * context.normal_length / centers[i].z()).y());
-             (tr_centers[i] + normals[i] * context.normal_length).x(),
-             (tr_centers[i] + normals[i] * context.normal_length).y());
+         Vec4 tr_center = view2screen * centers[i];
+         tr_center *= 1.f / tr_center.w();
+         context.backend->set_stroke_color(255, 0, 0);
+         context.backend->draw_line(
+             tr_center.x(),
+             tr_center.y(),
+             // (tr_center + normals[i] * context.normal_length / centers[i].z()).x(),
+             // (tr_center + normals[i] * context.normal_length / centers[i].z()).y());
+             (tr_center + normals[i] * context.normal_length).x(),
+             (tr_center + normals[i] * context.normal_length).y());
+         draw_calls++;
       }
    }
+   FUAKE_PROFILE_COUNT(kProfileCounter_FacesBackfaceCulled, backface_culled);
+   FUAKE_PROFILE_COUNT(kProfileCounter_FacesViewportCulled, viewport_culled);
+   FUAKE_PROFILE_COUNT(kProfileCounter_DrawCalls, draw_calls);
+   FUAKE_PROFILE_COUNT(kProfileCounter_PointLightsEvaluated, lights_evaluated);
 }
 
-void render_mesh_smooth(const Mesh &mesh, const Mat4 &model, const Mat4 &view,
-                        const Vec4 &light_dir, RenderContext context) {
+// Order to draw several meshes in the painter's algorithm: farthest bounding box center first
+Span<size_t> back_to_front(const vector<TriMesh> &meshes, const Mat4 &obj2view, FrameArena &arena) {
+   Span<float> depths = arena.alloc<float>(meshes.size());
+   for (size_t m = 0; m < meshes.size(); m++) {
+      Vec3 center = (meshes[m].bounds_min + meshes[m].bounds_max) * 0.5f;
+      depths[m] = (obj2view * Vec4{center.x(), center.y(), center.z(), 1}).z();
+   }
 
-   // Initialize frame buffer and render texture
-   static FrameBufferMono framebuffer(context.window_dimensions);
+   Span<size_t> order = arena.alloc<size_t>(meshes.size());
+   for (size_t m = 0; m < meshes.size(); m++) order[m] = m;
+   std::sort(order.begin(), order.end(), [depths](size_t left, size_t right) {
+      return depths[left] > depths[right];
+   });
+   return order;
+}
 
-   static esat::SpriteHandle render_texture = esat::SpriteFromMemory(
-       context.window_dimensions.x(), context.window_dimensions.y(), framebuffer.asRGB().data());
+// All meshes share one depth buffer, so batches of a map are drawn in a single pass. `accels` and
+// `visible` are parallel to `meshes` when given
+void render_mesh_smooth(const vector<TriMesh> &meshes, const Mat4 &model, const Mat4 &view,
+                        const Vec4 &light_dir, RenderContext context,
+                        const MeshAccel *accels = nullptr, const VisibleSet *visible = nullptr,
+                        const PointLights *point_lights = nullptr,
+                        const BakedLighting *baked = nullptr) {
+
+   // Tiled render target, the backend gets the finished image
+   static RasterTarget target(context.window_dimensions);
+
+   render_mesh_smooth_offscreen(meshes.data(),
+                                meshes.size(),
+                                model,
+                                view,
+                                light_dir,
+                                context,
+                                target,
+                                default_thread_pool(),
+                                accels,
+                                visible,
+                                point_lights,
+                                baked);
+
+   // Tiles already converted themselves to RGBA
+   FUAKE_PROFILE_SCOPE("Present");
+   context.backend->draw_image(
+       target.color.rgba_data.data(), target.color.width, target.color.height);
+   FUAKE_PROFILE_COUNT(kProfileCounter_DrawCalls, 1);
+}
 
-   static esat::SpriteTransform tr = {0, 0, 0, 1, 1, 0, 0};
+// Per-frame visibility of a scene, kept between frames to reuse its buffers
+struct SceneFrame {
+   HiZBuffer hiz;              // Occluders, in the solid modes
+   vector<VisibleSet> visible; // One per mesh
+   vector<DepthOrder> face_orders, edge_orders; // One per mesh, when not sorting by BSP
+   CullStats cull_stats;
 
-   // SPAN RASTERIZATION
-   // Sort edges by scan line
+   SceneFrame(Vec2 window_dimensions) : hiz(window_dimensions) {}
+};
 
-   // Iterate over scan lines
-   for (int i = 0; i < context.window_dimensions.y(); i++) { /* code */
+/* Render `meshes` (with their `accels`, and the map's `pvs`, `point_lights` and `baked` lighting
+   if there are any) in the context's mode. Finds the parts of every mesh that may be visible
+   first: the ones the PVS sees from the camera's cell, inside the frustum and, in the solid modes,
+   not behind the nearest faces nor facing away */
+void render_scene(const vector<TriMesh> &meshes, const vector<MeshAccel> &accels, PVS *pvs,
+                  const Mat4 &model, const Mat4 &view, const Vec4 &light_dir,
+                  const RenderContext &context, SceneFrame &frame,
+                  const PointLights *point_lights = nullptr,
+                  const BakedLighting *baked = nullptr) {
+   FUAKE_PROFILE_STAGES();
+   Mat4 obj2clip = context.persp * view * model;
+   Vec3 eye = inverse_transform_origin(MatrixRows(view * model));
+   bool use_pvs = context.use_pvs && pvs && !pvs->empty();
+   bool use_hiz = context.occlusion_culling && context.frustum_culling &&
+                  context.mode != kRenderMode_Wireframe;
+
+   frame.cull_stats = CullStats();
+   FUAKE_PROFILE_STAGE("Occluders");
+   if (use_hiz)
+      build_hiz(frame.hiz,
+                meshes,
+                accels,
+                obj2clip,
+                context.viewport,
+                eye,
+                context.backface_culling,
+                context.ccw_normals,
+                (size_t)std::max(0, context.occluder_budget),
+                &frame.cull_stats);
+   const HiZBuffer *occluders = use_hiz ? &frame.hiz : nullptr;
+
+   // Wireframe draws back faces, so its meshlets are only culled against the frustum
+   FUAKE_PROFILE_STAGE("Visibility");
+   MeshletCulling meshlet_culling;
+   meshlet_culling.backface = context.backface_culling && context.mode != kRenderMode_Wireframe;
+   meshlet_culling.eye = eye;
+   meshlet_culling.ccw_normals = context.ccw_normals;
+   const MeshletCulling *meshlets = context.meshlet_culling ? &meshlet_culling : nullptr;
+   vector<VisibleSet> &visible = frame.visible;
+   if (use_pvs) {
+      pvs->find_visible(eye,
+                        obj2clip,
+                        context.frustum_culling,
+                        meshes,
+                        accels,
+                        visible,
+                        occluders,
+                        &frame.cull_stats,
+                        meshlets);
+   } else {
+      visible.resize(meshes.size());
+      for (size_t m = 0; m < meshes.size(); m++)
+         find_visible(meshes[m],
+                      &accels[m],
+                      obj2clip,
+                      context.frustum_culling,
+                      visible[m],
+                      occluders,
+                      &frame.cull_stats,
+                      meshlets);
    }
-
-   // Update texture and draw
-
-   esat::SpriteUpdateFromMemory(render_texture, framebuffer.asRGB().data());
-   esat::DrawSprite(render_texture, tr);
-}
-
-void rasterize_triangle(vector<Vec2> pts, FrameBufferMono fb) {
-   if (pts.size() != 3) {
-      printf("WARNING: Non-triangular shaped passed to rasterize_triangle");
-      return;
+   FUAKE_PROFILE_STAGE_END();
+
+   if (point_lights && point_lights->empty()) point_lights = nullptr;
+   if (baked && baked->empty()) baked = nullptr;
+   switch (context.mode) {
+      case kRenderMode_Wireframe:
+         frame.edge_orders.resize(meshes.size());
+         for (size_t m = 0; m < meshes.size(); m++)
+            if (visible[m].num_faces > 0)
+               render_mesh_wireframe(meshes[m],
+                                     model,
+                                     view,
+                                     context,
+                                     &accels[m],
+                                     &visible[m],
+                                     &frame.edge_orders[m]);
+         break;
+      case kRenderMode_Flat:
+         frame.face_orders.resize(meshes.size());
+         for (size_t m : back_to_front(meshes, view * model, frame_arena()))
+            if (visible[m].num_faces > 0)
+               render_mesh_flat(meshes[m],
+                                model,
+                                view,
+                                light_dir,
+                                context,
+                                &accels[m],
+                                &visible[m],
+                                &frame.face_orders[m],
+                                point_lights ? &point_lights->lights : nullptr,
+                                point_lights ? &point_lights->clusters[m] : nullptr,
+                                baked ? &baked->face[m] : nullptr);
+         break;
+      case kRenderMode_Gouraud:
+         render_mesh_smooth(meshes,
+                            model,
+                            view,
+                            light_dir,
+                            context,
+                            accels.data(),
+                            visible.data(),
+                            point_lights,
+                            baked);
+         break;
    }
-
-   // Caculate bounding box
-   u32 max_x = 0, min_x = UINT32_MAX, max_y = 0, min_y = UINT32_MAX;
 }
 
 } // namespace fuake
\ No newline at end of file
@@ -0,0 +1,87 @@
+#pragma once
+
+#include <vector>
+#include <string>
+
+#include "fuake_accel.hpp"
+#include "fuake_lightmap.hpp"
+#include "fuake_mapcompiler.hpp"
+#include "fuake_meshcache.hpp"
+#include "fuake_profiler.hpp"
+#include "fuake_pvs.hpp"
+#include "fuake_settings.hpp"
+#include "fuake_threadpool.hpp"
+#include "fuake_trimesh.hpp"
+
+using std::string;
+using std::vector;
+
+namespace fuake {
+
+// What render_scene() draws: a single mesh for OBJ files, one per batch for maps
+struct Scene {
+   vector<TriMesh> meshes;
+   vector<MeshAccel> accels; // One per mesh
+   PVS pvs;                  // Maps only, built offline by vis_maps
+   PointLights point_lights; // Maps only, from their light entities
+   BakedLighting baked;      // Maps only, sampled from the lightmaps of bake_lightmaps
+
+   size_t num_triangles() const {
+      size_t total = 0;
+      for (auto &mesh : meshes) total += mesh.num_triangles;
+      return total;
+   }
+
+   size_t memory_bytes() const {
+      size_t total = 0;
+      for (auto &mesh : meshes) total += mesh.memory_bytes();
+      return total;
+   }
+};
+
+/* Load the OBJ (through its .fmesh cache) or compile the MAP at `path` into `scene`, with the
+   acceleration structures of every mesh, and the map's PVS, lights and baked lighting. Meshes are
+   converted to TriMesh once their structures are built, and the loader's copies freed */
+bool load_scene(const string &path, bool exchange_axes, Scene &scene, bool quantize = true) {
+   FUAKE_PROFILE_SCOPE("Load scene");
+   scene = Scene();
+   bool is_map = has_extension(path, ".map");
+
+   vector<Mesh> meshes;
+   Lightmaps lightmaps;
+   if (is_map) {
+      QuakeMap map(path);
+      if (!map.ok()) return false;
+      meshes = compile_map(map, exchange_axes);
+      scene.point_lights.lights = compile_lights(map, exchange_axes);
+      load_lightmaps(path, exchange_axes, lightmaps);
+   } else {
+      meshes.push_back(load_mesh_cached(path, exchange_axes));
+      if (meshes[0].vertices.empty()) return false;
+   }
+
+   PointLights &point_lights = scene.point_lights;
+   scene.meshes.resize(meshes.size());
+   scene.accels.resize(meshes.size());
+   point_lights.clusters.resize(point_lights.empty() ? 0 : meshes.size());
+   LightmapLookup lightmap_lookup(lightmaps);
+   BakedLighting &baked = scene.baked;
+   baked.vertex.resize(lightmaps.empty() ? 0 : meshes.size());
+   baked.face.resize(baked.vertex.size());
+   baked.face_lightmap.resize(baked.vertex.size());
+   default_thread_pool().parallel_for(meshes.size(), [&](size_t m, size_t) {
+      scene.accels[m] = build_accel(meshes[m]);
+      if (!lightmaps.empty())
+         sample_lightmaps(
+             lightmap_lookup, meshes[m], baked.face_lightmap[m], baked.vertex[m], baked.face[m]);
+      scene.meshes[m] = make_trimesh(meshes[m], quantize);
+      meshes[m] = Mesh();
+      if (!point_lights.empty())
+         point_lights.clusters[m] = build_light_clusters(scene.meshes[m], point_lights.lights);
+   });
+   make_face_lightmaps(lightmaps, baked);
+   if (is_map) load_pvs(path, exchange_axes, scene.accels, scene.pvs);
+   return true;
+}
+
+} // namespace fuake
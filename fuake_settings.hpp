@@ -6,6 +6,7 @@
 #include <string>
 #include <filesystem>
 #include <algorithm>
+#include <cctype>
 
 #include <amath_core.hpp>
 #include <amath_utils.hpp>
@@ -17,8 +18,16 @@ namespace fs = std::filesystem;
 
 namespace fuake {
 
-const char *MODEL_PATHS[] = {"assets/demo_objects", "assets/quake_objs"};
-const char *MODEL_GROUPS[] = {"Demo", "Quake"};
+const char *MODEL_PATHS[] = {"assets/demo_objects", "assets/quake_objs", "assets/quake_maps"};
+const char *MODEL_GROUPS[] = {"Demo", "Quake", "Quake maps"};
+const int kNumModelGroups = 3;
+
+// Case insensitive, Quake maps come as both .map and .MAP
+bool has_extension(const fs::path &path, const string &extension) {
+   string ext = path.extension().string();
+   for (auto &c : ext) c = (char)tolower(c);
+   return ext == extension;
+}
 
 struct FuakeSettings {
    u32 model_group = 0;
@@ -33,14 +42,17 @@ struct FuakeSettings {
    bool exchange_axes = true;
 
    FuakeSettings() {
-      model_names.resize(2);
+      model_names.resize(kNumModelGroups);
       update_model_list();
    }
 
    void update_model_list() {
-      for (int i = 0; i < 2; i++) {
+      for (int i = 0; i < kNumModelGroups; i++) {
          model_names[i].clear();
          for (auto &entry : fs::directory_iterator(MODEL_PATHS[i])) {
+            // Skip .fmesh caches and map notes
+            if (!has_extension(entry.path(), ".obj") && !has_extension(entry.path(), ".map"))
+               continue;
             string path = entry.path().string();
             std::replace(path.begin(), path.end(), '\\', '/');
             model_names[i].push_back(path);
@@ -48,6 +60,12 @@ struct FuakeSettings {
       }
    }
 
-   string get_mesh_name() { return model_names[model_group][model_object]; }
+   string get_mesh_name() {
+      // The selected object may not exist after switching to a group with fewer of them
+      if (model_object >= model_names[model_group].size()) model_object = 0;
+      return model_names[model_group][model_object];
+   }
+
+   bool is_map() { return has_extension(get_mesh_name(), ".map"); }
 };
 }; // namespace fuake
\ No newline at end of file
@@ -0,0 +1,114 @@
+#pragma once
+
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <atomic>
+#include <functional>
+#include <condition_variable>
+#include <algorithm>
+
+using std::vector;
+
+namespace fuake {
+
+/* Persistent worker threads for data-parallel loops. The calling thread also takes work
+   (thread index 0), so a pool of size 1 has no workers and runs everything inline.
+   parallel_for is not reentrant: don't call it from inside a job. */
+struct ThreadPool {
+   vector<std::thread> workers;
+
+   std::mutex mutex;
+   std::condition_variable wake;
+   std::condition_variable done;
+
+   std::function<void(size_t, size_t)> job; // job(item_index, thread_index)
+   size_t job_count = 0;
+   std::atomic<size_t> next_item{0};
+   size_t generation = 0;
+   size_t busy_workers = 0;
+   bool stopping = false;
+
+   ThreadPool(size_t num_threads = std::thread::hardware_concurrency()) {
+      if (num_threads == 0) num_threads = 1;
+      for (size_t t = 1; t < num_threads; t++) workers.emplace_back([this, t] { worker_loop(t); });
+   }
+
+   ~ThreadPool() {
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         stopping = true;
+      }
+      wake.notify_all();
+      for (auto &w : workers) w.join();
+   }
+
+   ThreadPool(const ThreadPool &) = delete;
+   ThreadPool &operator=(const ThreadPool &) = delete;
+
+   size_t size() const { return workers.size() + 1; }
+
+   // Call fn(i, thread_index) for every i in [0, count), spread over all threads
+   template <typename F> void parallel_for(size_t count, F &&fn) {
+      if (count == 0) return;
+      if (workers.empty() || count == 1) {
+         for (size_t i = 0; i < count; i++) fn(i, 0);
+         return;
+      }
+
+      {
+         std::lock_guard<std::mutex> lock(mutex);
+         job = [&fn](size_t i, size_t thread_idx) { fn(i, thread_idx); };
+         job_count = count;
+         next_item = 0;
+         busy_workers = workers.size();
+         generation++;
+      }
+      wake.notify_all();
+
+      run_items(0);
+
+      std::unique_lock<std::mutex> lock(mutex);
+      done.wait(lock, [this] { return busy_workers == 0; });
+      job = nullptr;
+   }
+
+   // Split [0, count) in ranges of grain_size and call fn(begin, end, thread_index) on each
+   template <typename F> void parallel_ranges(size_t count, size_t grain_size, F &&fn) {
+      grain_size = std::max<size_t>(grain_size, 1);
+      size_t num_ranges = (count + grain_size - 1) / grain_size;
+      parallel_for(num_ranges, [&](size_t r, size_t thread_idx) {
+         size_t begin = r * grain_size;
+         fn(begin, std::min(count, begin + grain_size), thread_idx);
+      });
+   }
+
+   void run_items(size_t thread_idx) {
+      for (size_t i = next_item++; i < job_count; i = next_item++) job(i, thread_idx);
+   }
+
+   void worker_loop(size_t thread_idx) {
+      size_t seen_generation = 0;
+      while (true) {
+         {
+            std::unique_lock<std::mutex> lock(mutex);
+            wake.wait(lock, [&] { return stopping || generation != seen_generation; });
+            if (stopping) return;
+            seen_generation = generation;
+         }
+
+         run_items(thread_idx);
+
+         std::lock_guard<std::mutex> lock(mutex);
+         if (--busy_workers == 0) done.notify_one();
+      }
+   }
+};
+
+// Shared pool used by the renderer and loaders, one thread per hardware core
+ThreadPool &default_thread_pool() {
+   static ThreadPool pool;
+   return pool;
+}
+
+} // namespace fuake
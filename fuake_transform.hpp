@@ -0,0 +1,274 @@
+#pragma once
+
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include <amath_core.hpp>
+#include <amath_utils.hpp>
+
+#include "fuake_arena.hpp"
+
+#if defined(_M_X64) || defined(_M_IX86) || defined(__x86_64__) || defined(__i386__)
+#define FUAKE_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER)
+#include <intrin.h>
+#endif
+#endif
+
+// MSVC lets any function use any intrinsic, GCC/Clang need the target enabled per function
+#if defined(FUAKE_X86) && (defined(__GNUC__) || defined(__clang__))
+#define FUAKE_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#else
+#define FUAKE_TARGET_AVX2
+#endif
+
+using std::string;
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+// Structure-of-arrays stream of points, so the transform kernels can load 4/8 coordinates at once
+struct PointStream {
+   vector<float> x, y, z, w;
+
+   size_t size() const { return x.size(); }
+
+   void resize(size_t n) {
+      x.resize(n);
+      y.resize(n);
+      z.resize(n);
+      w.resize(n);
+   }
+
+   Vec4 get(size_t i) const { return Vec4{x[i], y[i], z[i], w[i]}; }
+};
+
+// Same layout over memory owned elsewhere, such as per-frame scratch in a FrameArena
+struct PointSpan {
+   Span<float> x, y, z, w;
+
+   PointSpan() {}
+   PointSpan(PointStream &stream) : x(stream.x), y(stream.y), z(stream.z), w(stream.w) {}
+   PointSpan(FrameArena &arena, size_t n)
+       : x(arena.alloc<float>(n)), y(arena.alloc<float>(n)), z(arena.alloc<float>(n)),
+         w(arena.alloc<float>(n)) {}
+
+   size_t size() const { return x.size(); }
+
+   Vec4 get(size_t i) const { return Vec4{x[i], y[i], z[i], w[i]}; }
+};
+
+// Mat4 as plain row-major floats, extracted through Mat4 * Vec4 so it doesn't depend on layout
+struct MatrixRows {
+   float m[16];
+
+   MatrixRows(const Mat4 &mat) {
+      Vec4 basis[4] = {{1, 0, 0, 0}, {0, 1, 0, 0}, {0, 0, 1, 0}, {0, 0, 0, 1}};
+      for (int col = 0; col < 4; col++) {
+         Vec4 c = mat * basis[col];
+         for (int row = 0; row < 4; row++) m[row * 4 + col] = c[row];
+      }
+   }
+};
+
+/* Point that `mat` maps to the origin, such as the camera position in object space for an
+   object-to-view matrix. Only valid for affine matrices (rotation, scale and translation) */
+Vec3 inverse_transform_origin(const MatrixRows &mat) {
+   const float *m = mat.m;
+   float a = m[0], b = m[1], c = m[2], d = m[4], e = m[5], f = m[6], g = m[8], h = m[9], i = m[10];
+   float det = a * (e * i - f * h) - b * (d * i - f * g) + c * (d * h - e * g);
+   if (det == 0) return Vec3{0, 0, 0};
+
+   // p = -inverse(A) * t, with the inverse as adjugate / determinant
+   float tx = -m[3] / det, ty = -m[7] / det, tz = -m[11] / det;
+   return Vec3{(e * i - f * h) * tx + (c * h - b * i) * ty + (b * f - c * e) * tz,
+               (f * g - d * i) * tx + (a * i - c * g) * ty + (c * d - a * f) * tz,
+               (d * h - e * g) * tx + (b * g - a * h) * ty + (a * e - b * d) * tz};
+}
+
+/* Transform `count` positions (w = 1) by `mat`. With `project`, x, y and z are divided by w in
+   the same pass (a viewport matrix folded into `mat` maps straight to pixels) and the undivided w
+   is kept in out_w. Without it, the output is the plain homogeneous product. Coordinates come as
+   floats, or as uint16_t grid steps for quantized meshes (the scale goes into `mat`) */
+template <class T>
+using TransformKernelOf = void (*)(const MatrixRows &mat, const T *x, const T *y, const T *z,
+                                   size_t count, float *out_x, float *out_y, float *out_z,
+                                   float *out_w, bool project);
+typedef TransformKernelOf<float> TransformKernel;
+
+template <class T>
+void transform_points_scalar(const MatrixRows &mat, const T *x, const T *y, const T *z,
+                             size_t count, float *out_x, float *out_y, float *out_z, float *out_w,
+                             bool project) {
+   const float *m = mat.m;
+   for (size_t i = 0; i < count; i++) {
+      float px = (float)x[i], py = (float)y[i], pz = (float)z[i];
+      float tx = m[0] * px + m[1] * py + m[2] * pz + m[3];
+      float ty = m[4] * px + m[5] * py + m[6] * pz + m[7];
+      float tz = m[8] * px + m[9] * py + m[10] * pz + m[11];
+      float tw = m[12] * px + m[13] * py + m[14] * pz + m[15];
+      float d = project ? 1.f / tw : 1.f;
+      out_x[i] = tx * d;
+      out_y[i] = ty * d;
+      out_z[i] = tz * d;
+      out_w[i] = tw;
+   }
+}
+
+#ifdef FUAKE_X86
+
+// 4 or 8 coordinates as floats
+inline __m128 load4(const float *p) { return _mm_loadu_ps(p); }
+inline __m128 load4(const uint16_t *p) {
+   __m128i packed = _mm_loadl_epi64((const __m128i *)p);
+   return _mm_cvtepi32_ps(_mm_unpacklo_epi16(packed, _mm_setzero_si128()));
+}
+
+FUAKE_TARGET_AVX2 inline __m256 load8(const float *p) { return _mm256_loadu_ps(p); }
+FUAKE_TARGET_AVX2 inline __m256 load8(const uint16_t *p) {
+   return _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)p)));
+}
+
+template <class T>
+void transform_points_sse(const MatrixRows &mat, const T *x, const T *y, const T *z, size_t count,
+                          float *out_x, float *out_y, float *out_z, float *out_w, bool project) {
+   __m128 m[16];
+   for (int i = 0; i < 16; i++) m[i] = _mm_set1_ps(mat.m[i]);
+   const __m128 one = _mm_set1_ps(1.f);
+
+   size_t i = 0;
+   for (; i + 4 <= count; i += 4) {
+      __m128 px = load4(x + i), py = load4(y + i), pz = load4(z + i);
+      __m128 t[4];
+      for (int r = 0; r < 4; r++) {
+         t[r] = _mm_add_ps(_mm_add_ps(_mm_mul_ps(m[r * 4], px), _mm_mul_ps(m[r * 4 + 1], py)),
+                           _mm_add_ps(_mm_mul_ps(m[r * 4 + 2], pz), m[r * 4 + 3]));
+      }
+      __m128 d = project ? _mm_div_ps(one, t[3]) : one;
+      _mm_storeu_ps(out_x + i, _mm_mul_ps(t[0], d));
+      _mm_storeu_ps(out_y + i, _mm_mul_ps(t[1], d));
+      _mm_storeu_ps(out_z + i, _mm_mul_ps(t[2], d));
+      _mm_storeu_ps(out_w + i, t[3]);
+   }
+   transform_points_scalar(mat,
+                           x + i,
+                           y + i,
+                           z + i,
+                           count - i,
+                           out_x + i,
+                           out_y + i,
+                           out_z + i,
+                           out_w + i,
+                           project);
+}
+
+template <class T>
+FUAKE_TARGET_AVX2 void transform_points_avx2(const MatrixRows &mat, const T *x, const T *y,
+                                             const T *z, size_t count, float *out_x, float *out_y,
+                                             float *out_z, float *out_w, bool project) {
+   __m256 m[16];
+   for (int i = 0; i < 16; i++) m[i] = _mm256_set1_ps(mat.m[i]);
+   const __m256 one = _mm256_set1_ps(1.f);
+
+   size_t i = 0;
+   for (; i + 8 <= count; i += 8) {
+      __m256 px = load8(x + i), py = load8(y + i), pz = load8(z + i);
+      __m256 t[4];
+      for (int r = 0; r < 4; r++) {
+         t[r] = _mm256_fmadd_ps(m[r * 4], px, m[r * 4 + 3]);
+         t[r] = _mm256_fmadd_ps(m[r * 4 + 1], py, t[r]);
+         t[r] = _mm256_fmadd_ps(m[r * 4 + 2], pz, t[r]);
+      }
+      __m256 d = project ? _mm256_div_ps(one, t[3]) : one;
+      _mm256_storeu_ps(out_x + i, _mm256_mul_ps(t[0], d));
+      _mm256_storeu_ps(out_y + i, _mm256_mul_ps(t[1], d));
+      _mm256_storeu_ps(out_z + i, _mm256_mul_ps(t[2], d));
+      _mm256_storeu_ps(out_w + i, t[3]);
+   }
+   transform_points_scalar(mat,
+                           x + i,
+                           y + i,
+                           z + i,
+                           count - i,
+                           out_x + i,
+                           out_y + i,
+                           out_z + i,
+                           out_w + i,
+                           project);
+}
+
+bool cpu_supports_avx2() {
+#if defined(_MSC_VER)
+   int info[4];
+   __cpuid(info, 0);
+   if (info[0] < 7) return false;
+   __cpuid(info, 1);
+   bool osxsave = (info[2] & (1 << 27)) != 0;
+   bool avx = (info[2] & (1 << 28)) != 0;
+   bool fma = (info[2] & (1 << 12)) != 0;
+   if (!(osxsave && avx && fma)) return false;
+   if ((_xgetbv(0) & 6) != 6) return false; // OS saves YMM registers
+   __cpuidex(info, 7, 0);
+   return (info[1] & (1 << 5)) != 0;
+#else
+   return __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma");
+#endif
+}
+
+#endif // FUAKE_X86
+
+const char *TRANSFORM_KERNEL_NAMES[] = {"Scalar", "SSE", "AVX2"};
+
+// Index into TRANSFORM_KERNEL_NAMES of the best kernel for this CPU
+int detect_transform_kernel() {
+#ifdef FUAKE_X86
+   return cpu_supports_avx2() ? 2 : 1; // SSE2 is part of x86-64
+#else
+   return 0;
+#endif
+}
+
+template <class T> TransformKernelOf<T> get_transform_kernel(int kernel) {
+#ifdef FUAKE_X86
+   if (kernel == 2) return transform_points_avx2<T>;
+   if (kernel == 1) return transform_points_sse<T>;
+#endif
+   return transform_points_scalar<T>;
+}
+
+// Selected once at startup by CPU feature detection
+int transform_kernel_idx = detect_transform_kernel();
+TransformKernel transform_points_kernel = get_transform_kernel<float>(transform_kernel_idx);
+TransformKernelOf<uint16_t> transform_points_kernel_u16 =
+    get_transform_kernel<uint16_t>(transform_kernel_idx);
+
+// Transform the range [begin, end) of `in` into `out` from out_begin on (`out` must be sized)
+void transform_points(const MatrixRows &mat, const PointStream &in, PointSpan out, bool project,
+                      size_t begin, size_t end, size_t out_begin) {
+   transform_points_kernel(mat,
+                           in.x.data() + begin,
+                           in.y.data() + begin,
+                           in.z.data() + begin,
+                           end - begin,
+                           out.x.data() + out_begin,
+                           out.y.data() + out_begin,
+                           out.z.data() + out_begin,
+                           out.w.data() + out_begin,
+                           project);
+}
+
+// Transform the range [begin, end) of `in` into the same range of `out` (which must be sized)
+void transform_points(const MatrixRows &mat, const PointStream &in, PointSpan out, bool project,
+                      size_t begin, size_t end) {
+   transform_points(mat, in, out, project, begin, end, begin);
+}
+
+void transform_points(const Mat4 &mat, const PointStream &in, PointStream &out, bool project) {
+   out.resize(in.size());
+   transform_points(MatrixRows(mat), in, out, project, 0, in.size());
+}
+
+} // namespace fuake
@@ -0,0 +1,213 @@
+#pragma once
+
+#include <math.h>
+#include <vector>
+#include <string>
+#include <cstdint>
+
+#include <amath_core.hpp>
+#include <amath_utils.hpp>
+
+#include "fuake_mesh.hpp"
+#include "fuake_transform.hpp"
+
+using std::string;
+using std::vector;
+using namespace amath;
+
+namespace fuake {
+
+/* Render layout of a triangulated Mesh. Positions and normals are separate x, y, z arrays, and
+   each triangle is three consecutive indices, with no index_offsets or num_vertices. Indices and
+   edges are 16-bit when every vertex fits, 32-bit otherwise. Positions on a grid (Quake geometry)
+   are stored as 16-bit steps from `origin`, and the transform matrix does the dequantization.
+   Vertices and triangles keep the order of the source mesh, so its MeshAccel and VisibleSets
+   apply as they are */
+struct TriMesh final {
+   // Most vertices 16-bit indices can address
+   static const size_t kMaxNarrowVertices = 1 << 16;
+
+   string name;
+   size_t num_vertices = 0, num_triangles = 0;
+
+   vector<float> x, y, z;       // Positions, when not quantized (access with vertex_idx)
+   vector<uint16_t> qx, qy, qz; // Quantized positions: origin + q * step (access with vertex_idx)
+   Vec3 origin;
+   float step = 0; // 0 when the positions aren't quantized
+
+   vector<int16_t> nx, ny, nz; // Unit vertex normals times 32767, empty without normals
+
+   vector<uint16_t> indices16, edges16; // With up to kMaxNarrowVertices vertices
+   vector<u32> indices32, edges32;      // With more
+   size_t num_edges = 0;
+   size_t num_outline_edges = 0; // Edges past this one are diagonals added by triangulate()
+   Vec3 bounds_min, bounds_max;  // Axis aligned bounding box of the vertices
+
+   bool quantized() const { return step != 0; }
+   bool has_normals() const { return !nx.empty(); }
+   bool wide_indices() const { return num_vertices > kMaxNarrowVertices; }
+
+   Vec3 position(u32 v) const {
+      if (quantized())
+         return origin + Vec3{(float)qx[v], (float)qy[v], (float)qz[v]} * step;
+      return Vec3{x[v], y[v], z[v]};
+   }
+
+   // Unit length up to the quantization
+   Vec3 normal(u32 v) const {
+      const float scale = 1.f / 32767;
+      return Vec3{nx[v] * scale, ny[v] * scale, nz[v] * scale};
+   }
+
+   void triangle(size_t t, u32 v[3]) const {
+      for (int n = 0; n < 3; n++)
+         v[n] = wide_indices() ? indices32[3 * t + n] : indices16[3 * t + n];
+   }
+
+   void edge(size_t e, u32 &a, u32 &b) const {
+      a = wide_indices() ? edges32[2 * e] : edges16[2 * e];
+      b = wide_indices() ? edges32[2 * e + 1] : edges16[2 * e + 1];
+   }
+
+   // Heap memory of the arrays
+   size_t memory_bytes() const {
+      return name.capacity() + (x.capacity() + y.capacity() + z.capacity()) * sizeof(float) +
+             (qx.capacity() + qy.capacity() + qz.capacity()) * sizeof(uint16_t) +
+             (nx.capacity() + ny.capacity() + nz.capacity()) * sizeof(int16_t) +
+             (indices16.capacity() + edges16.capacity()) * sizeof(uint16_t) +
+             (indices32.capacity() + edges32.capacity()) * sizeof(u32);
+   }
+};
+
+// Heap memory of a Mesh's arrays, to compare with TriMesh::memory_bytes()
+size_t mesh_memory_bytes(const Mesh &mesh) {
+   return mesh.name.capacity() + mesh.vertices.capacity() * sizeof(Vec3) +
+          mesh.normals.capacity() * sizeof(Vec3) + mesh.indices.capacity() * sizeof(u32) +
+          mesh.num_vertices.capacity() + mesh.index_offsets.capacity() * sizeof(u32) +
+          mesh.edges.capacity() * sizeof(u32);
+}
+
+/* Quantize the positions of `mesh` into `out`, on the finest power of two grid that spans its
+   bounds in 16 bits. Vertices move by half a step at most, under 1 / 131070 of the largest
+   extent. Levels under 65535 units get a step of 1 or finer, so integer brush coordinates (most
+   of Quake's) come back exactly */
+void quantize_positions(const Mesh &mesh, TriMesh &out) {
+   Vec3 extent = mesh.bounds_max - mesh.bounds_min;
+   float max_extent = std::max(extent.x(), std::max(extent.y(), extent.z()));
+   float step = 1;
+   while (step * 65535 < max_extent) step *= 2;
+   while (step * 0.5f * 65535 >= max_extent && step > 1.f / 65536) step *= 0.5f;
+
+   out.origin = mesh.bounds_min;
+   out.step = step;
+   vector<uint16_t> *q[3] = {&out.qx, &out.qy, &out.qz};
+   for (int axis = 0; axis < 3; axis++) {
+      q[axis]->resize(mesh.vertices.size());
+      for (size_t v = 0; v < mesh.vertices.size(); v++) {
+         float steps = roundf((mesh.vertices[v][axis] - mesh.bounds_min[axis]) / step);
+         (*q[axis])[v] = (uint16_t)std::max(0.f, std::min(65535.f, steps));
+      }
+   }
+}
+
+/* Convert a triangulated `mesh` (after build_accel, which reorders it) for rendering. Without
+   `quantize`, positions are kept as floats */
+TriMesh make_trimesh(const Mesh &mesh, bool quantize = true) {
+   TriMesh out;
+   out.name = mesh.name;
+   out.num_vertices = mesh.vertices.size();
+   out.num_triangles = mesh.num_vertices.size();
+   out.bounds_min = mesh.bounds_min;
+   out.bounds_max = mesh.bounds_max;
+
+   if (quantize) {
+      quantize_positions(mesh, out);
+   } else {
+      out.x.resize(out.num_vertices);
+      out.y.resize(out.num_vertices);
+      out.z.resize(out.num_vertices);
+      for (size_t v = 0; v < out.num_vertices; v++) {
+         out.x[v] = mesh.vertices[v].x();
+         out.y[v] = mesh.vertices[v].y();
+         out.z[v] = mesh.vertices[v].z();
+      }
+   }
+
+   if (mesh.normals.size() == mesh.vertices.size()) {
+      out.nx.resize(out.num_vertices);
+      out.ny.resize(out.num_vertices);
+      out.nz.resize(out.num_vertices);
+      for (size_t v = 0; v < out.num_vertices; v++) {
+         const Vec3 &n = mesh.normals[v];
+         out.nx[v] = (int16_t)roundf(std::max(-1.f, std::min(1.f, n.x())) * 32767);
+         out.ny[v] = (int16_t)roundf(std::max(-1.f, std::min(1.f, n.y())) * 32767);
+         out.nz[v] = (int16_t)roundf(std::max(-1.f, std::min(1.f, n.z())) * 32767);
+      }
+   }
+
+   // Faces past the first three vertices can't be kept, the mesh should have been triangulated
+   vector<u32> indices(3 * out.num_triangles);
+   bool triangulated = true;
+   for (size_t f = 0; f < out.num_triangles; f++) {
+      triangulated &= mesh.num_vertices[f] == 3;
+      for (int n = 0; n < 3; n++) indices[3 * f + n] = mesh.indices[mesh.index_offsets[f] + n];
+   }
+   if (!triangulated) printf("WARNING: %s isn't triangulated\n", mesh.name.c_str());
+
+   out.num_edges = mesh.edges.size() / 2;
+   out.num_outline_edges = mesh.num_outline_edges;
+   if (out.wide_indices()) {
+      out.indices32.swap(indices);
+      out.edges32 = mesh.edges;
+   } else {
+      out.indices16.assign(indices.begin(), indices.end());
+      out.edges16.assign(mesh.edges.begin(), mesh.edges.end());
+   }
+   return out;
+}
+
+/* Transform the positions [begin, end) of `mesh` into `out` from out_begin on (see
+   transform_points). Quantized positions go through the 16-bit kernel, with the grid folded into
+   `mat` */
+void transform_positions(const MatrixRows &mat, const TriMesh &mesh, PointSpan out, bool project,
+                         size_t begin, size_t end, size_t out_begin) {
+   if (!mesh.quantized()) {
+      transform_points_kernel(mat,
+                              mesh.x.data() + begin,
+                              mesh.y.data() + begin,
+                              mesh.z.data() + begin,
+                              end - begin,
+                              out.x.data() + out_begin,
+                              out.y.data() + out_begin,
+                              out.z.data() + out_begin,
+                              out.w.data() + out_begin,
+                              project);
+      return;
+   }
+
+   // mat * (origin + q * step): columns scaled by the step, origin moved into the translation
+   MatrixRows grid = mat;
+   for (int row = 0; row < 4; row++) {
+      float *m = grid.m + row * 4;
+      m[3] += m[0] * mesh.origin.x() + m[1] * mesh.origin.y() + m[2] * mesh.origin.z();
+      for (int col = 0; col < 3; col++) m[col] *= mesh.step;
+   }
+   transform_points_kernel_u16(grid,
+                               mesh.qx.data() + begin,
+                               mesh.qy.data() + begin,
+                               mesh.qz.data() + begin,
+                               end - begin,
+                               out.x.data() + out_begin,
+                               out.y.data() + out_begin,
+                               out.z.data() + out_begin,
+                               out.w.data() + out_begin,
+                               project);
+}
+
+// Transform the positions [begin, end) of `mesh` into the same range of `out`
+void transform_positions(const MatrixRows &mat, const TriMesh &mesh, PointSpan out, bool project,
+                         size_t begin, size_t end) {
+   transform_positions(mat, mesh, out, project, begin, end, begin);
+}
+
+} // namespace fuake
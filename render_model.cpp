@@ -0,0 +1,131 @@
+// Renders an OBJ or MAP file from a camera pose to a PNG or PPM image, without a window or GPU
+// Usage: render_model <.obj or .map file> [output .png or .ppm] [options]
+//   --mode wireframe|flat|gouraud   shading mode (flat)
+//   --pos x y z                     camera position in world space (in front of the model)
+//   --dir x y z                     camera forward direction (0 0 1)
+//   --size width height             image size (1600 1200)
+//   --no-swap-axes                  don't exchange axes, as the viewer does for Quake files
+//   --no-map-lights                 light maps with the sun instead of their light entities
+//   --no-baked-lighting             light maps per frame even if they have baked lightmaps
+#include <cstdio>
+#include <cstdlib>
+#include <cctype>
+#include <string>
+
+#include "fuake_backend.hpp"
+#include "fuake_camera.hpp"
+#include "fuake_lighting.hpp"
+#include "fuake_render.hpp"
+#include "fuake_scene.hpp"
+
+using namespace fuake;
+
+int main(int argc, char **argv) {
+   if (argc < 2) {
+      printf("Usage: render_model <.obj or .map file> [output .png or .ppm] [--mode "
+             "wireframe|flat|gouraud] [--pos x y z] [--dir x y z] [--size width height] "
+             "[--no-swap-axes] [--no-map-lights] [--no-baked-lighting]\n");
+      return 1;
+   }
+   string path = argv[1];
+   string output = argc > 2 && argv[2][0] != '-' ? argv[2] : "render.png";
+
+   RenderMode mode = kRenderMode_Flat;
+   Vec2 dims = {1600, 1200};
+   Vec4 forward = {0, 0, 1, 0};
+   Vec4 position = {0, 0, 0, 1};
+   bool has_position = false, exchange_axes = true, map_lights = true;
+   bool baked_lighting = true;
+   for (int i = 2; i < argc; i++) {
+      string arg = argv[i];
+      if (arg == "--mode" && i + 1 < argc) {
+         string name = argv[++i];
+         for (int m = 0; m < 3; m++) {
+            string mode_name = RENDER_MODES[m];
+            for (auto &c : mode_name) c = (char)tolower(c);
+            if (name == mode_name) mode = (RenderMode)m;
+         }
+      } else if (arg == "--pos" && i + 3 < argc) {
+         position = {(float)atof(argv[i + 1]), (float)atof(argv[i + 2]),
+                     (float)atof(argv[i + 3]), 1};
+         has_position = true;
+         i += 3;
+      } else if (arg == "--dir" && i + 3 < argc) {
+         forward = Vec4((float)atof(argv[i + 1]), (float)atof(argv[i + 2]),
+                        (float)atof(argv[i + 3]), 0)
+                       .normalized();
+         i += 3;
+      } else if (arg == "--size" && i + 2 < argc) {
+         dims = {(float)atof(argv[i + 1]), (float)atof(argv[i + 2])};
+         i += 2;
+      } else if (arg == "--no-swap-axes") {
+         exchange_axes = false;
+      } else if (arg == "--no-map-lights") {
+         map_lights = false;
+      } else if (arg == "--no-baked-lighting") {
+         baked_lighting = false;
+      } else if (i > 2 || arg[0] == '-') {
+         printf("WARNING: Ignoring unknown argument %s\n", arg.c_str());
+      }
+   }
+
+   Scene scene;
+   if (!load_scene(path, exchange_axes, scene)) return 1;
+   const vector<TriMesh> &meshes = scene.meshes;
+
+   // Same model matrix as the viewer, so poses taken from its GUI can be used here
+   Mat4 model = Mat4::transform({0, 0, 5}, {1, 1, 1}, {0, 0, 0});
+   if (!has_position && !meshes.empty()) {
+      // Back off along -forward until the bounding sphere of everything is in view
+      Vec3 bounds_min = meshes[0].bounds_min, bounds_max = meshes[0].bounds_max;
+      for (auto &mesh : meshes) {
+         for (int axis = 0; axis < 3; axis++) {
+            bounds_min[axis] = std::min(bounds_min[axis], mesh.bounds_min[axis]);
+            bounds_max[axis] = std::max(bounds_max[axis], mesh.bounds_max[axis]);
+         }
+      }
+      Vec3 center = (bounds_min + bounds_max) * 0.5f;
+      float radius = (bounds_max - center).length();
+      Vec4 world_center = model * Vec4{center.x(), center.y(), center.z(), 1};
+      position = world_center - forward * (radius * 1.5f);
+   }
+
+   HeadlessBackend backend(dims);
+   RenderContext context(dims);
+   context.mode = mode;
+   context.map_lights = map_lights;
+   context.baked_lighting = baked_lighting;
+   context.backend = &backend;
+   Camera camera(position, forward);
+   Light light(kLightType_Directional, Vec4(1, -1, -1, 0).normalized());
+   Mat4 view = camera.get_view_matrix();
+
+   SceneFrame frame(dims);
+   backend.clear(0, 0, 0);
+   render_scene(meshes,
+                scene.accels,
+                &scene.pvs,
+                model,
+                view,
+                light.direction,
+                context,
+                frame,
+                &scene.point_lights,
+                &scene.baked);
+
+   if (!backend.save(output)) {
+      printf("WARNING: Couldn't write %s\n", output.c_str());
+      return 1;
+   }
+   printf("%s: %s, camera at [%f, %f, %f] looking along [%f, %f, %f], written to %s\n",
+          path.c_str(),
+          RENDER_MODES[mode],
+          position.x(),
+          position.y(),
+          position.z(),
+          forward.x(),
+          forward.y(),
+          forward.z(),
+          output.c_str());
+   return 0;
+}
@@ -0,0 +1,141 @@
+// Checks the frame arena, and that rendering does no heap allocations once it's warmed up: every
+// frame of a camera path is rendered twice in each mode, and the second pass must not allocate
+// Usage: test_frame_arena [.obj file] (assets/demo_objects/monkey.obj)
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+#include "fuake_arena.hpp"
+#include "fuake_backend.hpp"
+#include "fuake_campath.hpp"
+#include "fuake_camera.hpp"
+#include "fuake_lighting.hpp"
+#include "fuake_profiler.hpp"
+#include "fuake_render.hpp"
+#include "fuake_scene.hpp"
+
+// Every heap allocation of any thread goes through here. GCC sees the library's inlined deletes
+// reach free() and takes them for mismatched, they aren't
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+#endif
+std::atomic<size_t> num_allocations{0};
+
+void *operator new(size_t size) {
+   num_allocations++;
+   void *p = malloc(size ? size : 1);
+   if (!p) throw std::bad_alloc();
+   return p;
+}
+void operator delete(void *p) noexcept { free(p); }
+void operator delete(void *p, size_t) noexcept { free(p); }
+
+using namespace fuake;
+
+int failures = 0;
+
+void check(bool ok, const char *what) {
+   printf("%s: %s\n", ok ? "OK  " : "FAIL", what);
+   if (!ok) failures++;
+}
+
+void test_arena() {
+   FrameArena arena(1024);
+   Span<float> a = arena.alloc<float>(10);
+   Span<u8> b = arena.alloc<u8>(3, 7);
+   Span<double> c = arena.alloc<double>(5);
+   check((size_t)a.data() % FrameArena::kAlignment == 0 &&
+             (size_t)b.data() % FrameArena::kAlignment == 0 &&
+             (size_t)c.data() % FrameArena::kAlignment == 0,
+         "allocations are aligned");
+   check(b[0] == 7 && b[1] == 7 && b[2] == 7, "alloc with a value fills the span");
+
+   // Overflow into a second block keeps earlier spans valid, reset merges the blocks
+   a[0] = 1.5f;
+   Span<u32> big = arena.alloc<u32>(4096);
+   big[4095] = 42;
+   check(arena.blocks.size() == 2 && a[0] == 1.5f, "overflow chains a block");
+   arena.reset();
+   check(arena.blocks.size() == 1 && arena.capacity() >= 1024 + 4096 * sizeof(u32),
+         "reset merges the blocks");
+
+   size_t before = num_allocations;
+   arena.alloc<float>(10);
+   arena.alloc<u32>(4096);
+   arena.reset();
+   check(num_allocations == before, "a frame that fits doesn't allocate");
+}
+
+void test_render(const string &path) {
+   Scene scene;
+   if (!load_scene(path, true, scene)) {
+      check(false, "model loaded");
+      return;
+   }
+   const vector<TriMesh> &meshes = scene.meshes;
+
+   Vec2 dims = {640, 480};
+   HeadlessBackend backend(dims);
+   RenderContext context(dims);
+   context.backend = &backend;
+   SceneFrame frame(dims);
+   Light light(kLightType_Directional, Vec4(1, -1, -1, 0).normalized());
+   Mat4 model = Mat4::transform({0, 0, 5}, {1, 1, 1}, {0, 0, 0});
+
+   Vec3 center = (meshes[0].bounds_min + meshes[0].bounds_max) * 0.5f;
+   Vec4 world_center = model * Vec4{center.x(), center.y(), center.z(), 1};
+   CameraPath camera_path =
+       default_camera_path({world_center.x(), world_center.y(), world_center.z()},
+                           (meshes[0].bounds_max - center).length());
+   const int frames = 32;
+   vector<Mat4> views;
+   for (int f = 0; f < frames; f++) {
+      Vec4 position, forward;
+      camera_path.sample(camera_path.duration() * f / (frames - 1), position, forward);
+      views.push_back(Camera(position, forward).get_view_matrix());
+   }
+
+   // Every mode, then the painter's modes sorting by depth instead of with the BSP
+   for (int run = 0; run < 5; run++) {
+      int mode = run % 3;
+      context.mode = (RenderMode)mode;
+      context.bsp_sorting = run < 3;
+      size_t steady_allocations = 0;
+      for (int pass = 0; pass < 2; pass++) {
+         for (auto &view : views) {
+            size_t before = num_allocations;
+            backend.clear(0, 0, 0);
+            render_scene(meshes,
+                         scene.accels,
+                         nullptr,
+                         model,
+                         view,
+                         light.direction,
+                         context,
+                         frame,
+                         &scene.point_lights,
+                         &scene.baked);
+            FUAKE_PROFILE_FRAME();
+            frame_arena().reset();
+            if (pass == 1) steady_allocations += num_allocations - before;
+         }
+      }
+      char what[128];
+      snprintf(what,
+               sizeof(what),
+               "%s%s: %zu allocations over %d warmed-up frames",
+               RENDER_MODES[mode],
+               context.bsp_sorting ? "" : " (depth sorted)",
+               steady_allocations,
+               frames);
+      check(steady_allocations == 0, what);
+   }
+}
+
+int main(int argc, char **argv) {
+   test_arena();
+   test_render(argc > 1 ? argv[1] : "assets/demo_objects/monkey.obj");
+   if (failures) printf("%d checks failed\n", failures);
+   return failures ? 1 : 0;
+}
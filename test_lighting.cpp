@@ -0,0 +1,153 @@
+// Checks that the SIMD vertex lighting kernels match the scalar ones: the point lights summed into
+// the output, then the sun, ambient and depth shading on top. Runs with 0, 1 and many point lights,
+// with and without depth shading, on every count from 0 to past two AVX2 vectors, so each tail
+// length is covered. Only the kernels this CPU can run are tested
+// Usage: test_lighting
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "fuake_lighting.hpp"
+
+using namespace fuake;
+
+int failures = 0;
+
+void check(bool ok, const char *what) {
+   printf("%s: %s\n", ok ? "OK  " : "FAIL", what);
+   if (!ok) failures++;
+}
+
+// Kernels add the products in a different order, or fused, and sum many lights, so results differ
+// in the last bits
+bool close(float a, float b) { return fabsf(a - b) <= 1e-4f * std::max(1.f, fabsf(b)); }
+
+float random_float(float min, float max) { return min + rand() / (float)RAND_MAX * (max - min); }
+
+// Vertices of a mesh as the kernels take them, positions and unit normals as floats for the point
+// lights, and normals as int16_t with the view depth for the vertex lighting
+struct Vertices {
+   vector<float> px, py, pz, nx, ny, nz, view_z;
+   vector<int16_t> qx, qy, qz;
+};
+
+/* Run the `kernel` and scalar kernels on the vertices from an odd offset, so loads are unaligned,
+   and compare their outputs. Past `count`, outputs must be left alone */
+void test_kernel(int kernel, const Vertices &v, const vector<Light> &lights,
+                 VertexLighting lighting, bool depth_shading) {
+   const size_t kOffset = 1, kMaxCount = 19, kGuard = 8;
+   PointLightKernel simd_point = get_point_light_kernel(kernel);
+   LightingKernel simd = get_lighting_kernel(kernel);
+   lighting.add_to_out = !lights.empty();
+   if (depth_shading) lighting.depth_offset = 1.25f, lighting.depth_scale = -0.01f;
+
+   bool same = true, guard_intact = true;
+   for (size_t count = 0; count <= kMaxCount; count++) {
+      vector<float> expected(count + kGuard, 0.f), got(count + kGuard, 0.f);
+      for (size_t i = count; i < got.size(); i++) got[i] = -12345.f;
+      for (const Light &light : lights) {
+         add_point_light_scalar(light,
+                                &v.px[kOffset],
+                                &v.py[kOffset],
+                                &v.pz[kOffset],
+                                &v.nx[kOffset],
+                                &v.ny[kOffset],
+                                &v.nz[kOffset],
+                                count,
+                                expected.data());
+         simd_point(light,
+                    &v.px[kOffset],
+                    &v.py[kOffset],
+                    &v.pz[kOffset],
+                    &v.nx[kOffset],
+                    &v.ny[kOffset],
+                    &v.nz[kOffset],
+                    count,
+                    got.data());
+      }
+      light_vertices_scalar(lighting,
+                            &v.qx[kOffset],
+                            &v.qy[kOffset],
+                            &v.qz[kOffset],
+                            &v.view_z[kOffset],
+                            count,
+                            expected.data());
+      simd(lighting,
+           &v.qx[kOffset],
+           &v.qy[kOffset],
+           &v.qz[kOffset],
+           &v.view_z[kOffset],
+           count,
+           got.data());
+      for (size_t i = 0; i < count; i++) same &= close(got[i], expected[i]);
+      for (size_t i = count; i < got.size(); i++) guard_intact &= got[i] == -12345.f;
+   }
+
+   char what[128];
+   snprintf(what,
+            sizeof(what),
+            "%s, %zu point lights%s: matches Scalar on 0 to %zu vertices",
+            TRANSFORM_KERNEL_NAMES[kernel],
+            lights.size(),
+            depth_shading ? ", depth shaded" : "",
+            kMaxCount);
+   check(same, what);
+   snprintf(what,
+            sizeof(what),
+            "%s, %zu point lights%s: writes nothing past the count",
+            TRANSFORM_KERNEL_NAMES[kernel],
+            lights.size(),
+            depth_shading ? ", depth shaded" : "");
+   check(guard_intact, what);
+}
+
+int main() {
+   // Vertices in a 256 unit box, every fourth one with a zero normal as degenerate faces have
+   const size_t kVertices = 32;
+   Vertices v;
+   srand(1);
+   for (size_t i = 0; i < kVertices; i++) {
+      float x = random_float(-1, 1), y = random_float(-1, 1), z = random_float(-1, 1);
+      float length = sqrtf(x * x + y * y + z * z);
+      if (i % 4 == 3) x = y = z = 0, length = 1;
+      v.px.push_back(random_float(-128, 128));
+      v.py.push_back(random_float(-128, 128));
+      v.pz.push_back(random_float(-128, 128));
+      v.nx.push_back(x / length);
+      v.ny.push_back(y / length);
+      v.nz.push_back(z / length);
+      v.qx.push_back((int16_t)(x / length * 32767));
+      v.qy.push_back((int16_t)(y / length * 32767));
+      v.qz.push_back((int16_t)(z / length * 32767));
+      v.view_z.push_back(random_float(-100, -1));
+   }
+
+   // Lights in and around the box, with radii that reach some of the vertices but not all
+   vector<Light> lights;
+   for (int i = 0; i < 16; i++) {
+      Vec3 position = {random_float(-160, 160), random_float(-160, 160), random_float(-160, 160)};
+      lights.push_back(Light(position, random_float(50, 300), random_float(64, 256)));
+   }
+
+   // A rotation and scale of the normals into view space, and a unit sun direction
+   VertexLighting lighting;
+   const float m[9] = {0.8f, -0.6f, 0, 0.36f, 0.48f, -0.8f, 0.48f, 0.64f, 0.6f};
+   for (int i = 0; i < 9; i++) lighting.normal_to_view[i] = m[i] * 1.5f;
+   lighting.light[0] = 0.48f, lighting.light[1] = 0.6f, lighting.light[2] = 0.64f;
+   lighting.ambient = 40;
+   lighting.directional = 180;
+
+   int best = detect_transform_kernel();
+   printf("Best kernel for this CPU: %s\n", TRANSFORM_KERNEL_NAMES[best]);
+   for (int kernel = 1; kernel <= best; kernel++) {
+      for (size_t num_lights : {0, 1, 16}) {
+         vector<Light> used(lights.begin(), lights.begin() + num_lights);
+         for (bool depth_shading : {false, true})
+            test_kernel(kernel, v, used, lighting, depth_shading);
+      }
+   }
+   if (best == 0) printf("No SIMD kernel on this CPU, nothing to compare\n");
+
+   if (failures) printf("%d checks failed\n", failures);
+   return failures ? 1 : 0;
+}
@@ -0,0 +1,99 @@
+// Checks that the SIMD transform kernels match the scalar one, for float and uint16_t coordinates,
+// with and without the divide by w, on every count from 0 to past two AVX2 vectors, so each tail
+// length is covered. Only the kernels this CPU can run are tested
+// Usage: test_transform
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+
+#include "fuake_transform.hpp"
+
+using namespace fuake;
+
+int failures = 0;
+
+void check(bool ok, const char *what) {
+   printf("%s: %s\n", ok ? "OK  " : "FAIL", what);
+   if (!ok) failures++;
+}
+
+// Kernels add the products in a different order, or fused, so results differ in the last bits
+bool close(float a, float b) { return fabsf(a - b) <= 1e-5f * std::max(1.f, fabsf(b)); }
+
+/* Run `kernel` and the scalar one on the points of x, y and z from an odd offset, so loads are
+   unaligned, and compare their outputs. Past `count`, outputs must be left alone */
+template <class T>
+void test_kernel(int kernel, const char *type, const MatrixRows &mat, const vector<T> &x,
+                 const vector<T> &y, const vector<T> &z) {
+   const size_t kOffset = 1, kMaxCount = 19, kGuard = 8;
+   TransformKernelOf<T> simd = get_transform_kernel<T>(kernel);
+   TransformKernelOf<T> scalar = transform_points_scalar<T>;
+
+   for (bool project : {false, true}) {
+      bool same = true, guard_intact = true;
+      for (size_t count = 0; count <= kMaxCount; count++) {
+         vector<float> expected(4 * (count + kGuard)), got(4 * (count + kGuard), -12345.f);
+         float *e = expected.data(), *g = got.data();
+         size_t n = count + kGuard;
+         scalar(mat, &x[kOffset], &y[kOffset], &z[kOffset], count, e, e + n, e + 2 * n, e + 3 * n,
+                project);
+         simd(mat, &x[kOffset], &y[kOffset], &z[kOffset], count, g, g + n, g + 2 * n, g + 3 * n,
+              project);
+         for (size_t c = 0; c < 4; c++) {
+            for (size_t i = 0; i < count; i++) same &= close(g[c * n + i], e[c * n + i]);
+            for (size_t i = count; i < n; i++) guard_intact &= g[c * n + i] == -12345.f;
+         }
+      }
+
+      char what[128];
+      snprintf(what,
+               sizeof(what),
+               "%s %s%s: matches Scalar on 0 to %zu points",
+               TRANSFORM_KERNEL_NAMES[kernel],
+               type,
+               project ? ", projected" : "",
+               kMaxCount);
+      check(same, what);
+      snprintf(what,
+               sizeof(what),
+               "%s %s%s: writes nothing past the count",
+               TRANSFORM_KERNEL_NAMES[kernel],
+               type,
+               project ? ", projected" : "");
+      check(guard_intact, what);
+   }
+}
+
+int main() {
+   // Points in front of a perspective camera, so w stays away from 0 when projecting
+   const size_t kPoints = 32;
+   vector<float> x(kPoints), y(kPoints), z(kPoints);
+   vector<uint16_t> qx(kPoints), qy(kPoints), qz(kPoints);
+   srand(1);
+   for (size_t i = 0; i < kPoints; i++) {
+      x[i] = rand() / (float)RAND_MAX * 2 - 1;
+      y[i] = rand() / (float)RAND_MAX * 2 - 1;
+      z[i] = rand() / (float)RAND_MAX * 2 - 1;
+      qx[i] = (uint16_t)(rand() % 65536);
+      qy[i] = (uint16_t)(rand() % 65536);
+      qz[i] = (uint16_t)(rand() % 65536);
+   }
+   Mat4 persp = Mat4::perspective(1.2f, 1.5f, 0.1f, 100);
+   Mat4 model = Mat4::transform({0.25f, -0.5f, 4}, {1.5f, 1, 0.75f}, {10, 20, 30});
+   MatrixRows mat(persp * model);
+   // Quantized meshes fold their grid step into the matrix, here mapping the grid to [-1, 1]
+   const float kStep = 2.f / 65535;
+   Mat4 dequantize = Mat4::transform({-1, -1, -1}, {kStep, kStep, kStep}, {0, 0, 0});
+   MatrixRows quantized_mat(persp * model * dequantize);
+
+   int best = detect_transform_kernel();
+   printf("Best kernel for this CPU: %s\n", TRANSFORM_KERNEL_NAMES[best]);
+   for (int kernel = 1; kernel <= best; kernel++) {
+      test_kernel<float>(kernel, "float", mat, x, y, z);
+      test_kernel<uint16_t>(kernel, "uint16_t", quantized_mat, qx, qy, qz);
+   }
+   if (best == 0) printf("No SIMD kernel on this CPU, nothing to compare\n");
+
+   if (failures) printf("%d checks failed\n", failures);
+   return failures ? 1 : 0;
+}
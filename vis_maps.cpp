@@ -0,0 +1,82 @@
+// Offline visibility: compiles .MAP files like the viewer does and writes the potentially visible
+// set of each one next to it as <name>.MAP.pvs
+// Usage: vis_maps [.map file or directory] [cell size] [max splits]
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+#include <cctype>
+#include <filesystem>
+
+#include "fuake_mapcompiler.hpp"
+#include "fuake_pvs.hpp"
+
+using namespace fuake;
+namespace fs = std::filesystem;
+
+int main(int argc, char **argv) {
+   string target = argc > 1 ? argv[1] : "assets/quake_maps";
+   float cell_size = argc > 2 ? (float)atof(argv[2]) : 256;
+   int max_splits = argc > 3 ? atoi(argv[3]) : 256;
+   const bool exchange_axes = true; // As the viewer loads maps by default
+
+   vector<string> paths;
+   if (fs::is_directory(target)) {
+      for (auto &entry : fs::directory_iterator(target)) {
+         string ext = entry.path().extension().string();
+         for (auto &c : ext) c = (char)tolower(c);
+         if (ext == ".map") paths.push_back(entry.path().string());
+      }
+   } else {
+      paths.push_back(target);
+   }
+   std::sort(paths.begin(), paths.end());
+
+   for (auto &path : paths) {
+      MappedFile source(path);
+      QuakeMap map(path);
+      if (!source.is_open || !map.ok()) continue;
+
+      auto t0 = std::chrono::steady_clock::now();
+      vector<Mesh> meshes = compile_map(map, exchange_axes);
+      vector<MeshAccel> accels(meshes.size());
+      default_thread_pool().parallel_for(meshes.size(), [&](size_t m, size_t) {
+         accels[m] = build_accel(meshes[m]);
+      });
+      auto t1 = std::chrono::steady_clock::now();
+      PVS pvs = build_pvs(map, exchange_axes, meshes, accels, cell_size, max_splits);
+      auto t2 = std::chrono::steady_clock::now();
+
+      // Average share of the geometry cells each cell sees
+      size_t num_cells = pvs.num_cells(), geometry_cells = 0, seen = 0;
+      vector<u8> row;
+      for (size_t c = 0; c < num_cells; c++) {
+         if (pvs.cell_leaf_offsets[c + 1] == pvs.cell_leaf_offsets[c]) continue;
+         geometry_cells++;
+         pvs.decompress((int)c, row);
+         for (size_t other = 0; other < num_cells; other++)
+            if ((row[other >> 3] >> (other & 7)) & 1 &&
+                pvs.cell_leaf_offsets[other + 1] > pvs.cell_leaf_offsets[other])
+               seen++;
+      }
+
+      PVSHeader stamp = pvs_stamp(path, source, exchange_axes);
+      stamp.source_hash = hash_bytes(source.data, source.size);
+      bool written = write_pvs(pvs_path(path), pvs, stamp);
+
+      printf("%-16s cells: %4dx%4dx%4d  with geometry: %5zu  visible: %5.1f%%  "
+             "size: %7zu -> %6zu bytes  compile: %6.0f ms  vis: %7.0f ms%s\n",
+             fs::path(path).filename().string().c_str(),
+             pvs.dims[0],
+             pvs.dims[1],
+             pvs.dims[2],
+             geometry_cells,
+             geometry_cells ? 100.0 * seen / ((double)geometry_cells * geometry_cells) : 0.0,
+             num_cells * pvs.row_bytes(),
+             pvs.rows.size(),
+             std::chrono::duration<double, std::milli>(t1 - t0).count(),
+             std::chrono::duration<double, std::milli>(t2 - t1).count(),
+             written ? "" : "  (couldn't write)");
+   }
+   return 0;
+}